@@ -11,6 +11,7 @@
 
 #include <iostream>
 #include <cmath>
+#include <cstdio>
 
 #define EDITOR_WINDOW "Editor"
 #define LOG_WINDOW "Logs"
@@ -79,13 +80,23 @@ void App::OnEvent()
     auto im = manager.CurrentImage();
     if (im != nullptr)
     {
+        auto mask = manager.CurrentMask();
+        auto history = manager.CurrentHistory();
+
+        const bool ctrl = IsKeyDown(KEY_LEFT_CONTROL) || IsKeyDown(KEY_RIGHT_CONTROL);
+        if (ctrl && IsKeyPressed(KEY_Z)) history->Undo();
+        if (ctrl && IsKeyPressed(KEY_Y)) history->Redo();
+
+        // A stroke lasts from press to release, whatever happens in between
+        if (IsMouseButtonPressed(MOUSE_BUTTON_RIGHT))  history->BeginMaskEdit(*mask);
+        if (IsMouseButtonReleased(MOUSE_BUTTON_RIGHT)) history->EndMaskEdit(*mask);
+
         const Vector2 pos = GetMousePosition();
         const Rectangle area = ComputeMainImageArea();
         if (CheckCollisionPointRec(pos, area))
         {
             if (IsMouseButtonDown(MOUSE_BUTTON_RIGHT))
             {
-                auto mask = manager.CurrentMask();
                 const float w = mask->width;
                 const float h = mask->height;
                 const float ax = (pos.x - area.x) / (float)area.width;
@@ -224,6 +235,11 @@ void App::OnRender(float dt)
         const Rectangle dest = ComputeMainImageArea();
         const Rectangle src  = ComputeMainImageSrcArea(dest);
 
+        // Texture pixels on screen, rendered on the next frame
+        const uint32_t x0 = (uint32_t)std::floor(src.x), y0 = (uint32_t)std::floor(src.y);
+        const uint32_t x1 = (uint32_t)std::ceil(src.x + src.width), y1 = (uint32_t)std::ceil(src.y + src.height);
+        manager.SetViewport(RawEdit::Rect{ x0, y0, x1 - x0, y1 - y0 }, dest.width / src.width);
+
         DrawTexturePro(texture, src, dest, Vector2Zero(), 0.f, WHITE); 
     }
 }
@@ -277,6 +293,25 @@ void App::MainMenu(float dt)
                 for (const auto& p : files)
                     manager.AddImage(p);
             }
+            if (ImGui::MenuItem("Open folder"))
+            {
+                nfdu8char_t* folder;
+                if (NFD_PickFolderU8(&folder, nullptr) == NFD_OKAY)
+                {
+                    manager.OpenFolder(folder);
+                    NFD_FreePathU8(folder);
+                }
+            }
+            if (ImGui::MenuItem("Export", nullptr, false, manager.CurrentImage() != nullptr))
+            {
+                const nfdu8filteritem_t filters[]{ { "TIFF", "tif,tiff" }, { "PNG", "png" }, { "JPEG", "jpg,jpeg" } };
+                nfdu8char_t* path;
+                if (NFD_SaveDialogU8(&path, filters, 3, nullptr, nullptr) == NFD_OKAY)
+                {
+                    manager.Export(path);
+                    NFD_FreePathU8(path);
+                }
+            }
             ImGui::EndMenu();
         }
     }
@@ -310,12 +345,90 @@ void App::ParamMenu(float dt)
             ImGui::SliderFloat("Resize Factor", &factor, 0.f, 1.f);
             if (ImGui::Button("Reload all"))
                 manager.Reload();
+
+            // Cores for the edited image vs the ones loading
+            static const char* policies[]{ "Interactive", "Batch", "Balanced" };
+            static int policy = 0;
+            if (ImGui::Combo("Threads", &policy, policies, IM_ARRAYSIZE(policies)))
+                RawEdit::Concurrency::Instance().SetPolicy(static_cast<RawEdit::ConcurrencyPolicy>(policy));
+            const RawEdit::ConcurrencyBudget budget = RawEdit::Concurrency::Instance().Budget();
+            ImGui::Text("Edit: %u threads, loading: %u x %u", budget.interactiveThreads, budget.batchLanes, budget.batchThreads);
+            ImGui::TreePop();
+        }
+
+        RawEdit::Pipeline* pipeline = manager.CurrentPipeline();
+        if (pipeline != nullptr && ImGui::TreeNodeEx("Edit", flag))
+        {
+            for (size_t i = 0; i < pipeline->StageCount(); ++i)
+            {
+                RawEdit::Algorithm& stage = (*pipeline)[i];
+                ImGui::PushID((int)i);
+                ImGui::SeparatorText(stage.GetName().c_str());
+                for (auto& [name, param] : stage.GetInputs())
+                    DisplayParam(name, param);
+                ImGui::PopID();
+            }
             ImGui::TreePop();
         }
     }
     ImGui::End();
 }
 
+// Edits the first value of multi mask params. An edit (a whole drag, a
+// text until it loses focus) is one history step.
+void App::DisplayParam(const std::string& name, RawEdit::Param& param)
+{
+    RawEdit::History* history = manager.CurrentHistory();
+
+    switch (param.type)
+    {
+        case RawEdit::ParamType::Int:
+            ImGui::DragInt(name.c_str(), &param.AsInt());
+            break;
+        case RawEdit::ParamType::Float:
+            ImGui::DragFloat(name.c_str(), &param.AsFloat(), 0.01f);
+            break;
+        case RawEdit::ParamType::Color:
+            ImGui::ColorEdit3(name.c_str(), param.AsColor().data(), ImGuiColorEditFlags_Float | ImGuiColorEditFlags_HDR);
+            break;
+        case RawEdit::ParamType::Enum:
+        {
+            RawEdit::EnumType& e = param.AsEnum();
+            if (e.possibleValues == nullptr) return;
+            if (ImGui::BeginCombo(name.c_str(), e.value.c_str()))
+            {
+                for (const auto& v : *e.possibleValues)
+                {
+                    if (ImGui::Selectable(v.c_str(), v == e.value) && v != e.value)
+                    {
+                        if (history) history->BeginParamEdit(param);
+                        e.value = v;
+                        if (history) history->EndParamEdit(param);
+                    }
+                }
+                ImGui::EndCombo();
+            }
+            return;
+        }
+        case RawEdit::ParamType::String:
+        {
+            char buffer[256];
+            std::snprintf(buffer, sizeof(buffer), "%s", param.AsString().c_str());
+            if (ImGui::InputText(name.c_str(), buffer, sizeof(buffer)))
+                param.AsString() = buffer;
+            break;
+        }
+        default:
+            return;
+    }
+
+    if (history == nullptr) return;
+    if (ImGui::IsItemActivated())
+        history->BeginParamEdit(param);
+    if (ImGui::IsItemDeactivatedAfterEdit())
+        history->EndParamEdit(param);
+}
+
 std::vector<std::string> App::OpenDialog()
 {
     const nfdpathset_t* outPaths;
@@ -27,7 +27,7 @@ private:
     void MainMenu(float dt);
     void ParamMenu(float dt);
 
-    void DisplayParam(RawEdit::Param& param);
+    void DisplayParam(const std::string& name, RawEdit::Param& param);
 
     std::vector<std::string> OpenDialog();
 private:
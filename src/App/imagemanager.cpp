@@ -1,5 +1,62 @@
 #include "imagemanager.h"
 #include <numeric>
+#include <cctype>
+#include <filesystem>
+
+// Rendered pixels are handed to the UI thread at this pace
+static constexpr std::chrono::milliseconds PUBLISH_INTERVAL{ 16 };
+// Sources from this size on are exported through tile stores, never
+// whole in memory
+static constexpr uint64_t STORE_EXPORT_PIXELS = uint64_t(1) << 28;
+
+// Same stages for the pipeline edited from the UI and the rendered one
+static void AddEditStages(RawEdit::Pipeline& pipeline, uint32_t channels)
+{
+    pipeline.Add<RawEdit::Exposure>();
+    if (channels >= 3)
+        pipeline.Add<RawEdit::WhiteBalance>();
+    pipeline.Add<RawEdit::ToneCurve>();
+}
+
+// Decoded, developed (raw files) and oriented, scaled by 'scale'
+static RawEdit::Failable<RawEdit::ImagePtr> Develop(const std::string& path, float scale)
+{
+    auto loaded = RawEdit::Load(path.c_str());
+    if (!loaded)
+        return loaded;
+
+    RawEdit::ImagePtr developed = *loaded;
+    if (developed->metadata.cfa.size != 0)
+    {
+        // Raw files are developed with their own levels
+        RawEdit::ImagePtr mosaic = developed;
+        RawEdit::ImagePtr balanced(mosaic->EmptyCopy(true));
+        developed.reset(mosaic->EmptyCopy(true));
+
+        RawEdit::RawPreprocess preprocess;
+        preprocess.FromMetaData(mosaic->metadata);
+        preprocess.BindInputImage(mosaic);
+        preprocess.BindOutputImage(balanced);
+        if (RawEdit::Error err = preprocess.Run(); !err.empty())
+            return RawEdit::Failed(err);
+
+        RawEdit::Demosaic demosaic;
+        demosaic.BindInputImage(balanced);
+        demosaic.BindOutputImage(developed);
+        if (RawEdit::Error err = demosaic.Run(); !err.empty())
+            return RawEdit::Failed(err);
+    }
+
+    // Orientation and resizing, in one pass
+    RawEdit::Geometry resize;
+    resize["scale"].AsFloat() = scale;
+    RawEdit::ImagePtr out(developed->EmptyCopy(true));
+    resize.BindInputImage(developed);
+    resize.BindOutputImage(out);
+    if (RawEdit::Error err = resize.Run(); !err.empty())
+        return RawEdit::Failed(err);
+    return out;
+}
 
 void ImageManager::AddImage(std::string path)
 {
@@ -10,6 +67,53 @@ void ImageManager::AddImage(std::string path)
     allPaths.push_back(std::move(path));
 }
 
+void ImageManager::OpenFolder(std::string folder)
+{
+    spdlog::info("Opening folder {}", folder);
+    if (RawEdit::Error err = catalog.Open(folder); !err.empty())
+        spdlog::info("No catalog yet for {}", folder);
+
+    allPaths.clear();
+    failed.clear();
+    selected = 0;
+    ListCatalog();
+
+    // Assigning to a running future would wait for it on this thread
+    ++catalogGeneration;
+    if (catalogUpdate.valid())
+        nextCatalogFolder = std::move(folder);
+    else
+        StartCatalogUpdate(folder);
+}
+
+void ImageManager::StartCatalogUpdate(const std::string& folder)
+{
+    // Only new and modified files are read
+    catalogUpdate = std::async(std::launch::async, [folder, generation = catalogGeneration]() {
+        RawEdit::ConcurrencyLease lease(RawEdit::Lane::Batch);
+        CatalogUpdate update;
+        update.generation = generation;
+        update.error = update.catalog.Update(folder, &update.skipped);
+        return update;
+    });
+}
+
+void ImageManager::ListCatalog()
+{
+    const std::string current = allPaths.empty() ? "" : allPaths[selected];
+
+    allPaths.clear();
+    for (uint32_t id = 0; id < catalog.Size(); ++id)
+    {
+        // Files that could not be read
+        if (catalog.Entry(id).width == 0) continue;
+        allPaths.push_back(catalog.Path(id).string());
+    }
+
+    auto it = std::find(allPaths.begin(), allPaths.end(), current);
+    selected = it == allPaths.end() ? 0 : it - allPaths.begin();
+}
+
 // TODO: allocation at each frame... Same for Check and Fetch
 std::vector<uint32_t> ImageManager::GenerateWindowIndices() const
 {
@@ -50,13 +154,21 @@ void ImageManager::CheckAndFetch()
 {
     const auto indices = GenerateWindowIndices();
     
-    // Unload textures unwanted textures
-    std::erase_if(images, [&](const auto& pair) {
+    // Unload unwanted images, their textures are kept for the next ones
+    for (auto im = images.begin(); im != images.end();)
+    {
         auto it = std::find_if(indices.begin(), indices.end(), [&](uint32_t idx){
-            return pair.first == allPaths[idx];
+            return im->first == allPaths[idx];
         });
-        return it == indices.end();
-    });
+        if (it != indices.end())
+        {
+            ++im;
+            continue;
+        }
+        scheduler.Cancel(im->first);
+        Recycle(std::move(im->second.texture));
+        im = images.erase(im);
+    }
 
     // Something can be loaded
     if (loaders.size() < maxLoader)
@@ -90,6 +202,40 @@ void ImageManager::CheckAndFetch()
 
 void ImageManager::Update()
 {
+    if (catalogUpdate.valid() && catalogUpdate.wait_for(std::chrono::milliseconds(0)) == std::future_status::ready)
+    {
+        CatalogUpdate update = catalogUpdate.get();
+        // Stale when another folder was opened meanwhile
+        if (update.generation == catalogGeneration)
+        {
+            if (update.error.empty())
+            {
+                catalog = std::move(update.catalog);
+                ListCatalog();
+            }
+            else
+            {
+                errors.push_back(update.error);
+            }
+            for (auto& err : update.skipped)
+                errors.push_back(std::move(err));
+        }
+
+        if (nextCatalogFolder)
+        {
+            StartCatalogUpdate(*nextCatalogFolder);
+            nextCatalogFolder.reset();
+        }
+    }
+
+    std::erase_if(exports, [&](std::future<RawEdit::Error>& e) {
+        if (e.wait_for(std::chrono::milliseconds(0)) != std::future_status::ready)
+            return false;
+        if (RawEdit::Error err = e.get(); !err.empty())
+            errors.push_back(err);
+        return true;
+    });
+
     for (auto it = loaders.begin(); it != loaders.end();)
     {
         auto state = it->future.wait_for(std::chrono::milliseconds(0));
@@ -114,10 +260,113 @@ void ImageManager::Update()
         }
     }
 
+    if (!allPaths.empty())
+    {
+        auto it = images.find(allPaths[selected]);
+        if (it != images.end())
+            Submit(it->first, it->second);
+    }
+
+    for (auto& [path, im] : images)
+    {
+        if (RawEdit::Error err = im.texture.Update(im.shown.get(), im.dirty); !err.empty())
+            errors.push_back(err);
+        ShowRendered(im);
+    }
+
     // Unload unwanted textures and fetch new ones
     CheckAndFetch();
 }
 
+void ImageManager::Submit(const std::string& path, LoadedImage& im)
+{
+    // Params are edited on this thread, the job gets its own copy
+    RawEdit::Sidecar edits = RawEdit::Sidecar::Capture(im.pipeline);
+    std::vector<uint8_t> encoded = edits.Encode();
+    if (encoded == im.submitted && viewport == im.submittedView)
+        return;
+    im.submitted = std::move(encoded);
+    im.submittedView = viewport;
+
+    scheduler.Submit(path, [render = im.render, image = im.image, view = viewport, edits = std::move(edits)](std::stop_token stop) {
+        if (RawEdit::Error err = edits.Apply(render->pipeline); !err.empty())
+        {
+            render->Publish({}, err);
+            return;
+        }
+        render->renderer.SetInput(image);
+        render->renderer.SetViewport(view);
+
+        // A newer job stops this one at the next tile
+        while (!stop.stop_requested())
+        {
+            auto more = render->renderer.Step(PUBLISH_INTERVAL, stop);
+
+            std::vector<Patch> patches;
+            for (const auto& r : render->renderer.PullUpdated())
+                patches.push_back(Patch{ r, render->renderer.Copy(r) });
+            render->Publish(std::move(patches), more ? RawEdit::Ok() : more.error());
+
+            if (!more || !*more)
+                break;
+        }
+    });
+}
+
+void ImageManager::Render::Publish(std::vector<Patch>&& fresh, const RawEdit::Error& err)
+{
+    std::lock_guard lock(mutex);
+    for (auto& p : fresh)
+    {
+        std::erase_if(patches, [&](const Patch& old) {
+            return old.region.Intersect(p.region) == old.region;
+        });
+        patches.push_back(std::move(p));
+    }
+    if (!err.empty())
+        errors.push_back(err);
+}
+
+void ImageManager::ShowRendered(LoadedImage& im)
+{
+    std::vector<Patch> patches;
+    {
+        std::lock_guard lock(im.render->mutex);
+        std::swap(patches, im.render->patches);
+        for (auto& err : im.render->errors)
+            errors.push_back(std::move(err));
+        im.render->errors.clear();
+    }
+
+    for (const auto& p : patches)
+    {
+        if (RawEdit::Error err = im.texture.Update(p.pixels.get(), p.region.x, p.region.y); !err.empty())
+        {
+            errors.push_back(err);
+            continue;
+        }
+
+        // Kept for the dirty tiles, the image itself is the render input
+        if (p.pixels->channels != im.shown->channels)
+            continue;
+        if (im.shown == im.image || im.shown->type != p.pixels->type)
+            im.shown = RawEdit::ConvertImage(im.shown, p.pixels->type);
+        const RawEdit::Rect placed = p.region.Intersect({ 0, 0, im.shown->width, im.shown->height });
+        if (!placed.Empty())
+            RawEdit::Pipeline::CopyRect(p.pixels, { 0, 0, placed.width, placed.height }, im.shown, placed.x, placed.y, false);
+    }
+}
+
+void ImageManager::Recycle(DisplayTexture&& texture)
+{
+    if (!texture.Valid()) return;
+
+    // Enough for a whole window of images of the same size
+    spareTextures.push_back(std::move(texture));
+    if (spareTextures.size() > windowSize)
+        spareTextures.erase(spareTextures.begin());
+}
+
 void ImageManager::SelectNext()
 {
     Select((int32_t)selected + 1);
@@ -159,7 +408,7 @@ const Texture2D* ImageManager::CurrentRLTexture() const
     auto it = images.find(allPaths[selected]);
     if (it == images.end())
         return nullptr;
-    return &it->second.texture;
+    return &it->second.texture.Get();
 }
 
 RawEdit::Mask* ImageManager::CurrentMask()
@@ -172,6 +421,26 @@ RawEdit::Mask* ImageManager::CurrentMask()
     return &it->second.mask;
 }
 
+RawEdit::History* ImageManager::CurrentHistory()
+{
+    if (allPaths.size() == 0) return nullptr;
+
+    auto it = images.find(allPaths[selected]);
+    if (it == images.end())
+        return nullptr;
+    return &it->second.history;
+}
+
+RawEdit::Pipeline* ImageManager::CurrentPipeline()
+{
+    if (allPaths.size() == 0) return nullptr;
+
+    auto it = images.find(allPaths[selected]);
+    if (it == images.end())
+        return nullptr;
+    return &it->second.pipeline;
+}
+
 void ImageManager::AsyncLoad(const std::string& path)
 {
     if (loaders.size() < maxLoader)
@@ -180,40 +449,128 @@ void ImageManager::AsyncLoad(const std::string& path)
         loaders.push_back(Loader{
             .path = path,
             .future = std::async(std::launch::async,
-            [=]()
+            [=, scale = geometry["scale"].AsFloat()]() -> RawEdit::Failable<RawEdit::ImagePtr>
             {
-                return RawEdit::Load(path.c_str());
+                // Waits for a lane: loaders never take the cores of the
+                // edited image
+                RawEdit::ConcurrencyLease lease(RawEdit::Lane::Batch);
+                return Develop(path, scale);
             })
         });
     }
 }
 
-void ImageManager::ImageLoaded(RawEdit::ImagePtr im)
+void ImageManager::ImageLoaded(RawEdit::ImagePtr newIm)
 {
-    spdlog::info("{} loaded", im->metadata.path);
+    spdlog::info("{} loaded", newIm->metadata.path);
 
-    // Resizing
-    RawEdit::ImagePtr newIm(im->EmptyCopy(true));
-    rescale.BindInputImage(im);
-    rescale.BindOutputImage(newIm);
+    auto& loc = images[newIm->metadata.path];
+    loc.image = newIm;
+    loc.mask.FillData(newIm->width, newIm->height, 1, true);
 
-    RawEdit::Error err = rescale.Run();
-    if (!err.empty())
+    loc.render = std::make_shared<Render>();
+    AddEditStages(loc.pipeline, newIm->channels);
+    AddEditStages(loc.render->pipeline, newIm->channels);
+
+    // Same size as a previous image: its texture is updated, not recreated
+    if (!loc.texture.Matches(newIm.get()))
+    {
+        auto spare = std::find_if(spareTextures.begin(), spareTextures.end(), [&](const DisplayTexture& t) {
+            return t.Matches(newIm.get());
+        });
+        if (spare != spareTextures.end())
+        {
+            loc.texture = std::move(*spare);
+            spareTextures.erase(spare);
+        }
+    }
+    if (RawEdit::Error err = loc.texture.Upload(newIm.get()); !err.empty())
     {
         spdlog::error("{}", err);
         errors.push_back(err);
-        failed.push_back(im->metadata.path);
-        return;
     }
+    loc.shown = newIm;
+    loc.dirty.Reset(newIm->width, newIm->height);
+    loc.dirty.PullDirty();
+}
 
-    auto& loc = images[newIm->metadata.path];
-    loc.image = newIm;
-    loc.mask.FillData(newIm->width, newIm->height, 1, true);
-    loc.texture = ConvertToRaylibTexture(newIm.get());
+void ImageManager::Invalidate(const RawEdit::Rect& region)
+{
+    if (allPaths.size() == 0) return;
+
+    auto it = images.find(allPaths[selected]);
+    if (it != images.end())
+        it->second.dirty.MarkDirty(region);
+}
+
+void ImageManager::SetViewport(const RawEdit::Rect& region, float scale)
+{
+    viewport = RawEdit::Viewport{ region, scale };
+}
+
+void ImageManager::Export(std::string destination)
+{
+    if (allPaths.empty()) return;
+    auto it = images.find(allPaths[selected]);
+    if (it == images.end()) return;
+
+    std::string ext = std::filesystem::path(destination).extension().string();
+    std::transform(ext.begin(), ext.end(), ext.begin(), [](unsigned char c) { return (char)std::tolower(c); });
+    RawEdit::ExportSettings settings;
+    if (ext == ".png")
+        settings.format = RawEdit::ExportFormat::PNG;
+    else if (ext == ".jpg" || ext == ".jpeg")
+        settings.format = RawEdit::ExportFormat::JPEG;
+    else if (ext != ".tif" && ext != ".tiff")
+        destination += ".tif";
+
+    spdlog::info("Exporting {} to {}", it->first, destination);
+    exports.push_back(std::async(std::launch::async,
+        [source = it->first, destination, settings, edits = RawEdit::Sidecar::Capture(it->second.pipeline)]() -> RawEdit::Error
+        {
+            RawEdit::ConcurrencyLease lease(RawEdit::Lane::Batch);
+
+            // Large PNG files are read into a store band by band, edited
+            // tile by tile (the edit stages are all bounded) and written
+            // from the store
+            if (RawEdit::LoadsIntoStore(source.c_str(), STORE_EXPORT_PIXELS))
+            {
+                RawEdit::TileStore in, out;
+                if (RawEdit::Error err = RawEdit::LoadIntoStore(source.c_str(), in); !err.empty())
+                    return err;
+
+                RawEdit::Pipeline pipeline;
+                AddEditStages(pipeline, in.Channels());
+                if (RawEdit::Error err = edits.Apply(pipeline); !err.empty())
+                    return err;
+                if (RawEdit::Error err = pipeline.RunTiled(in, out); !err.empty())
+                    return err;
+                return RawEdit::Export(destination.c_str(), out, settings);
+            }
+
+            // The loaded image is scaled for display, the source is
+            // developed again at full resolution
+            auto developed = Develop(source, 1.f);
+            if (!developed)
+                return developed.error();
+
+            RawEdit::Pipeline pipeline;
+            AddEditStages(pipeline, (*developed)->channels);
+            if (RawEdit::Error err = edits.Apply(pipeline); !err.empty())
+                return err;
+
+            // Edited strips are computed as they are written
+            return RawEdit::Export(destination.c_str(), pipeline, *developed, settings);
+        }));
 }
 
 void ImageManager::Reload()
 {
+    for (auto& [path, im] : images)
+    {
+        scheduler.Cancel(path);
+        Recycle(std::move(im.texture));
+    }
     images.clear();
 }
 
@@ -221,17 +578,20 @@ void ImageManager::Clear()
 {
     loaders.clear();
     allPaths.clear();
+    for (const auto& [path, im] : images)
+        scheduler.Cancel(path);
     images.clear();
+    spareTextures.clear();
 }
 
 float ImageManager::GetResizeFactor() const 
 {
-    return rescale["factor"].AsFloat();
+    return geometry["scale"].AsFloat();
 }
 
 float& ImageManager::GetResizeFactor()
 {
-    return rescale["factor"].AsFloat();
+    return geometry["scale"].AsFloat();
 }
 
 uint32_t ImageManager::NbImageLoading() const
@@ -3,9 +3,13 @@
 #include <string_view>
 #include <algorithm>
 #include <future>
+#include <chrono>
 #include <vector>
 #include <map>
+#include <mutex>
+#include <memory>
 #include <set>
+#include <optional>
 
 #include "raweditraylib.h"
 #include "spdlog/spdlog.h"
@@ -24,14 +28,31 @@ public:
     const RawEdit::ImagePtr CurrentImage() const;
     const Texture2D* CurrentRLTexture() const;
     RawEdit::Mask* CurrentMask();
+    RawEdit::History* CurrentHistory();
+    // Edits of the current image, shown progressively on its texture
+    RawEdit::Pipeline* CurrentPipeline();
     
     void AddImage(std::string path);
+    // Lists the images of a folder from its catalog (a mapping, no walk),
+    // the catalog is brought up to date in the background
+    void OpenFolder(std::string folder);
     void SelectNext();
     void SelectPrevious();
     void Select(int32_t idx);
 
     std::vector<RawEdit::Error> pullErrors();
 
+    // Pixels of the current image changed in 'region': only this part of
+    // its texture is uploaded again (on the next Update)
+    void Invalidate(const RawEdit::Rect& region);
+    // Part of the current image on screen (texture pixels) and its zoom:
+    // edits are rendered there first
+    void SetViewport(const RawEdit::Rect& region, float scale);
+
+    // Writes the current image with its edits, at full resolution, in the
+    // background. The format follows the extension (.tif, .png, .jpg).
+    void Export(std::string destination);
+
     void Reload();
     void Clear();
 
@@ -48,20 +69,72 @@ private:
         std::future<RawEdit::Failable<RawEdit::ImagePtr>> future;
     };
 
+    // Rendered pixels of the edits, at their place in the texture
+    struct Patch
+    {
+        RawEdit::Rect region;
+        RawEdit::ImagePtr pixels;
+    };
+
+    // Evaluation side of an image. Only its jobs (one at a time) use the
+    // pipeline and the renderer; their results go through the mailbox.
+    struct Render
+    {
+        RawEdit::Pipeline pipeline;
+        RawEdit::ProgressiveRenderer renderer{ pipeline };
+
+        std::mutex mutex;
+        std::vector<Patch> patches;
+        std::vector<RawEdit::Error> errors;
+
+        // Patches still in the mailbox and covered by newer ones are
+        // dropped: only the latest pixels reach the texture
+        void Publish(std::vector<Patch>&& fresh, const RawEdit::Error& err);
+    };
+
     struct LoadedImage
     {
         RawEdit::ImagePtr image;
         RawEdit::Mask mask;
-        Texture2D texture;
+        RawEdit::History history;
+        DisplayTexture texture;
+        // Pixels of the texture: the image, then the rendered patches over
+        // it (a copy from the first patch on)
+        RawEdit::ImagePtr shown;
+        // Parts of the texture to upload again, from 'shown'
+        RawEdit::TileGrid dirty;
+        // Edited from the UI, jobs render a copy of its inputs
+        RawEdit::Pipeline pipeline;
+        std::shared_ptr<Render> render;
+        // Edits and viewport of the last job
+        std::vector<uint8_t> submitted;
+        RawEdit::Viewport submittedView;
+    };
+
+    struct CatalogUpdate
+    {
+        // Of the OpenFolder call, older ones are stale
+        uint32_t generation = 0;
+        RawEdit::Catalog catalog;
+        RawEdit::Error error;
+        std::vector<RawEdit::Error> skipped;
     };
 
+    void ListCatalog();
+    void StartCatalogUpdate(const std::string& folder);
     void AsyncLoad(const std::string& path);
     void ImageLoaded(RawEdit::ImagePtr ptr);
     void CheckAndFetch();
+    void Recycle(DisplayTexture&& texture);
+    // A job rendering the current edits and viewport of 'im', when they
+    // changed since the last one. It supersedes the previous job.
+    void Submit(const std::string& path, LoadedImage& im);
+    void ShowRendered(LoadedImage& im);
     
-    RawEdit::Rescale rescale;
+    RawEdit::Geometry geometry;
     uint32_t maxLoader  = 3;
     uint32_t windowSize = 3;
+    RawEdit::Viewport viewport;
 
     uint32_t selected = 0;
 
@@ -69,6 +142,23 @@ private:
     std::vector<std::string> failed;
     std::vector<Loader> loaders;
 
+    RawEdit::Catalog catalog;
+    // A single scan runs at a time (scans of a folder write the same
+    // file): a folder opened meanwhile waits in 'nextCatalogFolder', and
+    // the running scan is dropped when it ends
+    std::future<CatalogUpdate> catalogUpdate;
+    std::optional<std::string> nextCatalogFolder;
+    uint32_t catalogGeneration = 0;
+
+    // Running exports, their errors end up in 'errors'
+    std::vector<std::future<RawEdit::Error>> exports;
+
     std::vector<RawEdit::Error> errors;
     std::map<std::string, LoadedImage> images;
+    // Textures of unloaded images, reused by images of the same size
+    std::vector<DisplayTexture> spareTextures;
+
+    // Edit rendering, apart from the loaders. Destroyed first: running
+    // jobs are stopped before anything else goes.
+    RawEdit::JobScheduler scheduler;
 };
@@ -1,29 +1,171 @@
 #include "raweditraylib.h"
 #include "spdlog/spdlog.h"
 
-Texture2D ConvertToRaylibTexture(const RawEdit::Image* img)
+static int PixelFormat(uint32_t channels)
 {
-    if (img->backend != RawEdit::ImageBackend::CPU && 
-        img->type != RawEdit::ImageDataType::UINT8)
+    switch (channels)
     {
-        spdlog::error("Unsupported img type");
-        return {};
+        case 1:  return PIXELFORMAT_UNCOMPRESSED_GRAYSCALE;
+        case 2:  return PIXELFORMAT_UNCOMPRESSED_GRAY_ALPHA;
+        case 3:  return PIXELFORMAT_UNCOMPRESSED_R8G8B8;
+        case 4:  return PIXELFORMAT_UNCOMPRESSED_R8G8B8A8;
+        default: return 0;
     }
+}
+
+// Textures are sRGB: color images in other spaces go through a transform
+static bool NeedsTransform(const RawEdit::Image* img)
+{
+    return img->channels >= 3 && img->metadata.colorSpace != "sRGB";
+}
+
+bool DisplayTexture::Matches(const RawEdit::Image* img) const
+{
+    return Valid() && texture.width == (int)img->width && texture.height == (int)img->height && texture.format == PixelFormat(img->channels);
+}
+
+void DisplayTexture::Unload()
+{
+    if (Valid())
+        UnloadTexture(texture);
+    texture = {};
+}
+
+RawEdit::Failable<const uint8_t*> DisplayTexture::Convert(const RawEdit::Image* img, const RawEdit::Rect& region, uint32_t x, uint32_t y, uint32_t width)
+{
+    static thread_local RawEdit::ColorTransform toSRGB;
+
+    const uint32_t c = img->channels;
+    const size_t rowSize = (size_t)region.width * c;
+    const uint8_t* rows = static_cast<const uint8_t*>(img->RawData());
+    const RawEdit::ImageDataType srcType = img->type;
+
+    // Direct upload of whole rows
+    if (srcType == RawEdit::ImageDataType::UINT8 && !NeedsTransform(img) && region.x == 0 && region.width == img->width)
+        return rows + (size_t)region.y * img->width * c;
+
+    // Source rows and their index in the texture (keeps dithering the
+    // same whatever the region)
+    size_t srcStride = (size_t)img->width * c * RawEdit::SizeofType(srcType);
+    const size_t dstOffset = ((size_t)y * width + x) * c;
+    if (NeedsTransform(img))
+    {
+        DISPATCH_DATATYPE(srcType,
+            if (crop == nullptr || crop->type != srcType)
+            {
+                crop = std::make_shared<RawEdit::CPUImage<DataType>>();
+                cropDisplay = std::make_shared<RawEdit::CPUImage<DataType>>();
+            }
+            static_cast<RawEdit::CPUImage<DataType>*>(crop.get())->Resize(region.width, region.height, c);
+        );
+        crop->metadata = img->metadata;
+
+        const size_t pixelSize = c * RawEdit::SizeofType(srcType);
+        for (uint32_t j = 0; j < region.height; ++j)
+            memcpy(static_cast<uint8_t*>(crop->RawData()) + j * region.width * pixelSize, rows + (region.y + j) * srcStride + region.x * pixelSize, region.width * pixelSize);
+
+        toSRGB.BindInputImage(crop);
+        toSRGB.BindOutputImage(cropDisplay);
+        if (RawEdit::Error err = toSRGB.Run(); !err.empty())
+            return RawEdit::Failed(err);
+
+        rows = static_cast<const uint8_t*>(cropDisplay->RawData());
+        srcStride = region.width * pixelSize;
+    }
+    else
+    {
+        rows += (size_t)region.y * srcStride + (size_t)region.x * c * RawEdit::SizeofType(srcType);
+    }
+
+    staging.resize(rowSize * region.height);
+    const RawEdit::ConvertOptions opts{ .dither = true };
+    DISPATCH_DATATYPE(srcType,
+        for (uint32_t j = 0; j < region.height; ++j)
+        {
+            const DataType* src = reinterpret_cast<const DataType*>(rows + j * srcStride);
+            RawEdit::ConvertSpan(src, staging.data() + j * rowSize, rowSize, dstOffset + (size_t)j * width * c, opts);
+        }
+    );
+    return staging.data();
+}
+
+RawEdit::Error DisplayTexture::Upload(const RawEdit::Image* img)
+{
+    const RawEdit::Rect whole{ 0, 0, img->width, img->height };
+    if (Matches(img))
+        return Update(img, whole);
+
+    if (img->backend != RawEdit::ImageBackend::CPU)
+        return RawEdit::Error("Display: unsupported image backend");
+    if (PixelFormat(img->channels) == 0)
+        return RawEdit::Failed("Display: can not display {} channels", img->channels).error();
 
-    spdlog::warn("Conversion using upload copy");
+    auto pixels = Convert(img, whole, 0, 0, img->width);
+    if (!pixels)
+        return pixels.error();
 
-    using ImType = const RawEdit::CPUImage<uint8_t>*;
-    ImType rawim = reinterpret_cast<ImType>(img);
+    Unload();
     Image im = {
-        .data    = const_cast<uint8_t*>(rawim->GetDataPtr()),
-        .width   = (int)img->width, 
-        .height  = (int)img->height, 
+        .data    = const_cast<uint8_t*>(*pixels),
+        .width   = (int)img->width,
+        .height  = (int)img->height,
         .mipmaps = 1,
-        .format  = PIXELFORMAT_UNCOMPRESSED_R8G8B8
+        .format  = PixelFormat(img->channels)
     };
+    texture = LoadTextureFromImage(im);
+    return RawEdit::Ok();
+}
+
+RawEdit::Error DisplayTexture::Update(const RawEdit::Image* img, const RawEdit::Rect& region)
+{
+    if (!Matches(img))
+        return RawEdit::Error("Display: image and texture differ, upload the image first");
+
+    const RawEdit::Rect r = region.Intersect({ 0, 0, img->width, img->height });
+    if (r.Empty())
+        return RawEdit::Ok();
+
+    auto pixels = Convert(img, r, r.x, r.y, img->width);
+    if (!pixels)
+        return pixels.error();
+
+    const Rectangle rec = { (float)r.x, (float)r.y, (float)r.width, (float)r.height };
+    UpdateTextureRec(texture, rec, *pixels);
+    return RawEdit::Ok();
+}
+
+RawEdit::Error DisplayTexture::Update(const RawEdit::Image* img, RawEdit::TileGrid& grid)
+{
+    if (!grid.AnyDirty())
+        return RawEdit::Ok();
+
+    // A brush dab touches a few neighbouring tiles: one rectangle per row
+    // of tiles instead of one upload per tile
+    std::vector<RawEdit::Rect> rows(grid.TilesY());
+    for (uint32_t tile : grid.PullDirty())
+        rows[tile / grid.TilesX()] = rows[tile / grid.TilesX()].Union(grid.TileRect(tile));
+
+    for (const auto& r : rows)
+        if (RawEdit::Error err = Update(img, r); !err.empty())
+            return err;
+    return RawEdit::Ok();
+}
+
+RawEdit::Error DisplayTexture::Update(const RawEdit::Image* patch, uint32_t x, uint32_t y)
+{
+    if (!Valid() || texture.format != PixelFormat(patch->channels))
+        return RawEdit::Error("Display: patch and texture differ");
+
+    // Clipped to the texture
+    const RawEdit::Rect placed = RawEdit::Rect{ x, y, patch->width, patch->height }.Intersect({ 0, 0, (uint32_t)texture.width, (uint32_t)texture.height });
+    if (placed.Empty())
+        return RawEdit::Ok();
 
-    if (img->channels == 1)
-        im.format = PIXELFORMAT_UNCOMPRESSED_GRAYSCALE;
+    auto pixels = Convert(patch, { 0, 0, placed.width, placed.height }, x, y, texture.width);
+    if (!pixels)
+        return pixels.error();
 
-    return LoadTextureFromImage(im);
+    const Rectangle rec = { (float)x, (float)y, (float)placed.width, (float)placed.height };
+    UpdateTextureRec(texture, rec, *pixels);
+    return RawEdit::Ok();
 }
@@ -1,6 +1,54 @@
 #pragma once
 
+#include <vector>
 #include "raylib.h"
 #include "RawEdit/RawEdit.h"
 
-Texture2D ConvertToRaylibTexture(const RawEdit::Image* img);
+// Texture displaying a RawEdit image. It stays alive as long as this
+// object and is updated in place: only the regions given to Update are
+// converted (to sRGB uint8, in a reused staging buffer) and uploaded.
+class DisplayTexture
+{
+public:
+    DisplayTexture() = default;
+    DisplayTexture(const DisplayTexture&) = delete;
+    DisplayTexture& operator=(const DisplayTexture&) = delete;
+    DisplayTexture(DisplayTexture&& o) noexcept { *this = std::move(o); }
+    DisplayTexture& operator=(DisplayTexture&& o) noexcept
+    {
+        std::swap(texture, o.texture);
+        std::swap(staging, o.staging);
+        std::swap(crop, o.crop);
+        std::swap(cropDisplay, o.cropDisplay);
+        return *this;
+    }
+    ~DisplayTexture() { Unload(); }
+
+    // Whole image. The texture is only recreated when the size or the
+    // pixel format changes.
+    RawEdit::Error Upload(const RawEdit::Image* img);
+    // 'region' of 'img', which has the size of the texture
+    RawEdit::Error Update(const RawEdit::Image* img, const RawEdit::Rect& region);
+    // Dirty tiles of 'grid', one upload per row of tiles. Flags them clean.
+    RawEdit::Error Update(const RawEdit::Image* img, RawEdit::TileGrid& grid);
+    // The whole of 'patch' at ('x', 'y') of the texture
+    RawEdit::Error Update(const RawEdit::Image* patch, uint32_t x, uint32_t y);
+
+    bool Matches(const RawEdit::Image* img) const;
+    bool Valid() const { return texture.id != 0; }
+    const Texture2D& Get() const { return texture; }
+
+    void Unload();
+
+private:
+    // Pixels of 'region' as texture data: the image rows themselves when
+    // they can be used as is, the staging buffer otherwise. They land at
+    // ('x', 'y') of a texture 'width' wide (dithering depends on it).
+    RawEdit::Failable<const uint8_t*> Convert(const RawEdit::Image* img, const RawEdit::Rect& region, uint32_t x, uint32_t y, uint32_t width);
+
+    Texture2D texture{};
+    std::vector<uint8_t> staging;
+    // Regions in other color spaces are transformed on their own
+    RawEdit::ImagePtr crop;
+    RawEdit::ImagePtr cropDisplay;
+};
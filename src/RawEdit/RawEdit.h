@@ -1,8 +1,40 @@
 #pragma once
 
 #include "image/image.h"
+#include "image/pyramid.h"
+#include "image/foreach.h"
+#include "image/tilestore.h"
 #include "utils/error.h"
+#include "utils/scheduler.h"
+#include "utils/concurrency.h"
 #include "io/imageloader.h"
+#include "io/imagewriter.h"
+#include "io/catalog.h"
+#include "io/sidecar.h"
+#include "history/history.h"
+#include "stats/statistics.h"
 
+#include "algorithm/base/pipeline.h"
+#include "algorithm/base/renderer.h"
 #include "algorithm/standard/rescale.h"
+#include "algorithm/standard/exposure.h"
+#include "algorithm/standard/blacklevel.h"
+#include "algorithm/standard/whitebalance.h"
+#include "algorithm/standard/tonecurve.h"
+
+#include "algorithm/raw/rawpreprocess.h"
+#include "algorithm/raw/demosaic.h"
+
+#include "algorithm/color/colortransform.h"
+
+#include "algorithm/filter/blur.h"
+#include "algorithm/filter/unsharp.h"
+#include "algorithm/filter/guided.h"
+#include "algorithm/filter/bilateralgrid.h"
+#include "algorithm/filter/locallaplacian.h"
+
+#include "algorithm/geometry/geometry.h"
+#include "algorithm/geometry/lens.h"
+
+#include "algorithm/hdr/hdrmerge.h"
 
@@ -1,7 +1,9 @@
 #pragma once
 
+#include <cmath>
 #include <iostream>
 #include <map>
+#include <algorithm>
 #include "utils/error.h"
 #include "utils/cache.h"
 #include "params.h"
@@ -38,6 +40,8 @@ namespace RawEdit
         };
         std::map<std::string, Param>& GetInputs()  { return inputs; }
         std::map<std::string, Param>& GetOutputs() { return outputs; }
+        const std::map<std::string, Param>& GetInputs()  const { return inputs; }
+        const std::map<std::string, Param>& GetOutputs() const { return outputs; }
         
         // This has sense, only non masked parameter can be bound
         virtual Error Bind(const std::string& pname, const Param* ptr)
@@ -60,6 +64,10 @@ namespace RawEdit
         virtual void BindOutputImage(ImagePtr img) { outputImage = img; }
         virtual void BindMask(ImagePtr img) { mask = img; }
 
+        // Called by pipelines when the pixels of the bound input changed
+        // since the last run, for algorithms keeping data derived from it
+        virtual void InputChanged() {}
+
         void Propagate()
         {
             for (const auto& [name, ptr] : connections)
@@ -69,6 +77,17 @@ namespace RawEdit
             }
         }
 
+        // True if any input changed since last call (consumes the changes)
+        bool Dirty()
+        {
+            bool dirty = false;
+            for (const auto& [name, param] : inputs)
+                dirty = param.dirty() || dirty;
+            return dirty;
+        }
+
+        const std::string& GetName() const { return name; }
+
         void Print()
         {
             std::cout << "Algorithm: " << name << "\n";
@@ -79,9 +98,37 @@ namespace RawEdit
             }
         }
 
+        // True if the algorithm has integer kernels for UINT16 images,
+        // letting pipelines keep UINT16 inputs as they are
+        virtual bool HasFixedPoint() const { return false; }
+
+        // Pixels of the input read around each output pixel. Pipelines
+        // rendering a viewport run the stages after the last WHOLE_IMAGE
+        // one on crops of their input; algorithms which need all of it
+        // (geometry, image statistics) keep the default.
+        static constexpr uint32_t WHOLE_IMAGE = UINT32_MAX;
+        virtual uint32_t Halo() const { return WHOLE_IMAGE; }
+
+        // Pyramid level of the bound input: viewport runs give the stages
+        // an image 2^level times smaller than the one the params are set
+        // for. Sizes in pixels (radii, sigmas, halos) are scaled with it.
+        void SetLevel(uint32_t l) { inputLevel = l; }
+        uint32_t GetLevel() const { return inputLevel; }
+
         virtual Error Run() = 0;
         virtual ~Algorithm() {}
     protected:
+        // Length in pixels of the bound input of 'pixels' pixels of the
+        // full resolution image
+        float ToLevel(float pixels) const { return std::ldexp(pixels, -(int)inputLevel); }
+        uint32_t RadiusAtLevel(int radius, int least = 0) const
+        {
+            return (uint32_t)std::max((int)std::lround(ToLevel((float)radius)), least);
+        }
+        // Preview modes compute 2^preview times smaller than full
+        // resolution, which the input already is 2^level times
+        uint32_t PreviewAtLevel(int preview) const { return (uint32_t)std::max(preview - (int)inputLevel, 0); }
+
         const std::string name;
 
         ImagePtr inputImage  = nullptr;
@@ -91,5 +138,7 @@ namespace RawEdit
         std::map<std::string, Param> inputs;
         std::map<std::string, Param> outputs;
         std::map<std::string, const Param*> connections;
+
+        uint32_t inputLevel = 0;
     };
 };
@@ -23,7 +23,7 @@ namespace RawEdit
         }
 
         bool operator!=(const EnumType& other) const
-        { return possibleValues != other.possibleValues && value != other.value; }
+        { return possibleValues != other.possibleValues || value != other.value; }
 
         Value value;
         std::shared_ptr<ValueList> possibleValues;
@@ -38,7 +38,8 @@ namespace RawEdit
         __RAWEDIT_PARAM_X(Int, int, __VA_ARGS__) \
         __RAWEDIT_PARAM_X(Enum, EnumType, __VA_ARGS__) \
         __RAWEDIT_PARAM_X(Float, float, __VA_ARGS__) \
-        __RAWEDIT_PARAM_X(Color, __Color, __VA_ARGS__) 
+        __RAWEDIT_PARAM_X(Color, __Color, __VA_ARGS__) \
+        __RAWEDIT_PARAM_X(String, std::string, __VA_ARGS__) 
     
     #define __RAWEDIT_PARAM_X(name, type, ...) type,
     using AnyParamType = std::variant<PARAM_TYPES_LIST() std::nullptr_t>;
@@ -73,6 +74,7 @@ namespace RawEdit
         template<typename T>
         Param(const T& initValue, bool mmask = true)  : multiMask(mmask)
         {
+            values.push_back(Cached<AnyParamType>(nullptr));
             *this = initValue;
         }
 
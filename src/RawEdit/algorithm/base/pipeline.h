@@ -0,0 +1,718 @@
+#pragma once
+
+#include <cmath>
+#include <memory>
+#include <vector>
+#include <algorithm>
+#include "algorithm.h"
+#include "regionalgorithm.h"
+#include "image/tilestore.h"
+
+namespace RawEdit
+{
+    struct PrecisionReport
+    {
+        double maxError = 0.0;
+        double rmse     = 0.0;
+        double psnr     = 0.0;
+
+        // Memory held by the intermediates in each mode
+        size_t referenceBytes = 0;
+        size_t workingBytes   = 0;
+    };
+
+    // Fixed16 lets UINT16 inputs be processed as UINT16 (values are then
+    // clipped to [0, 1] and quantized between stages) when every stage 
+    // has fixed point kernels. Float always uses the working type.
+    enum class Precision
+    {
+        Float,
+        Fixed16
+    };
+
+    // Part of the input shown on screen: 'region' in input pixels, drawn
+    // at 'scale' screen pixels per input pixel
+    struct Viewport
+    {
+        Rect region;
+        float scale = 1.f;
+
+        bool operator==(const Viewport& other) const = default;
+    };
+
+    // 'image' has the size of the pyramid level (the input 2^level times
+    // smaller), only its computed tiles are valid
+    struct ViewportResult
+    {
+        ImagePtr image;
+        uint32_t level = 0;
+        // Visible part, in level pixels
+        Rect region;
+        // Tiles computed by this run
+        std::vector<Rect> updated;
+        // Every visible tile is computed
+        bool complete = false;
+        // Tiles computed before were dropped (an input or a param changed)
+        bool changed = false;
+    };
+
+    // Ordered list of algorithms, each one reading the output of the
+    // previous one. Intermediates are kept between runs (only stages after
+    // the first dirty one are recomputed) and are stored in the working
+    // type: FLOAT32 by default, FLOAT16 halves their memory. Kernels
+    // compute in float whatever the storage type.
+    class Pipeline
+    {
+    public:
+        template<typename A, typename... Args>
+        A& Add(Args&&... args)
+        {
+            auto algo = std::make_unique<A>(std::forward<Args>(args)...);
+            A& ref = *algo;
+            stages.push_back(Stage{ std::move(algo), nullptr });
+            return ref;
+        }
+
+        size_t StageCount() const { return stages.size(); }
+        Algorithm& operator[](size_t i) { return *stages[i].algorithm; }
+        const Algorithm& operator[](size_t i) const { return *stages[i].algorithm; }
+
+        void SetWorkingType(ImageDataType type)
+        {
+            if (type == workingType) return;
+
+            workingType = type;
+            Invalidate();
+        }
+        ImageDataType GetWorkingType() const { return workingType; }
+
+        void SetPrecision(Precision p)
+        {
+            if (p == precision) return;
+
+            precision = p;
+            Invalidate();
+        }
+        Precision GetPrecision() const { return precision; }
+
+        // Type actually used for the intermediates of 'input'
+        ImageDataType ResolveType(const ImagePtr& input) const
+        {
+            if (precision != Precision::Fixed16 || input->type != ImageDataType::UINT16)
+                return workingType;
+
+            for (const auto& s : stages)
+                if (!s.algorithm->HasFixedPoint())
+                    return workingType;
+            return ImageDataType::UINT16;
+        }
+
+        // Next run recomputes everything
+        void Invalidate()
+        {
+            working = nullptr;
+            for (auto& s : stages)
+                s.output = nullptr;
+            viewLevels.clear();
+            viewChanged = true;
+        }
+
+        Error Run(ImagePtr input)
+        {
+            if (input == nullptr)
+                return Error("Pipeline: no input image");
+
+            // Changes seen by viewport runs count as well
+            size_t first = std::min(ConsumeChanges(), pendingFirst);
+            pendingFirst = stages.size();
+
+            bool inputChanged = false;
+            if (Error err = UpdateWorking(input, inputChanged); !err.empty())
+                return err;
+            if (inputChanged)
+                first = 0;
+            InvalidateViewport(first);
+            SetLevel(0);
+
+            const ImageDataType type = working->type;
+
+            for (size_t i = 0; i < stages.size(); ++i)
+            {
+                if (stages[i].output == nullptr || stages[i].output->type != type)
+                {
+                    stages[i].output = Allocate(type);
+                    first = std::min(first, i);
+                }
+            }
+
+            ImagePtr current = first == 0 ? working : stages[first - 1].output;
+            for (size_t i = first; i < stages.size(); ++i)
+            {
+                Algorithm& algo = *stages[i].algorithm;
+                algo.Propagate();
+                algo.BindInputImage(current);
+                algo.BindOutputImage(stages[i].output);
+                // Stages after the first one read a recomputed image
+                if (i > first || inputChanged || viewportBound)
+                    algo.InputChanged();
+                // Set before running, algorithms may update it
+                stages[i].output->metadata = current->metadata;
+
+                Error err = algo.Run();
+                if (!err.empty())
+                {
+                    // Leave the stage to be recomputed on next run
+                    stages[i].output = nullptr;
+                    return err;
+                }
+                current = stages[i].output;
+            }
+            viewportBound = false;
+            return Ok();
+        }
+
+        // Tiles of viewport runs, in level pixels
+        static constexpr uint32_t VIEWPORT_TILE_SIZE = 256;
+        // Crops of the tiled stages start on multiples of this: preview
+        // modes working on a pyramid of their input see the same pixels
+        // as on the whole image
+        static constexpr uint32_t VIEWPORT_ALIGN = 64;
+
+        // Computes the visible part of the output at the pyramid level
+        // matching the display scale (the largest one still at least as
+        // sharp as the screen). The stages up to the last WHOLE_IMAGE one
+        // run once on the whole level; the next ones run on the visible
+        // tiles only, cropped with their halo. Params in pixels (radii,
+        // sigmas) are scaled to the level. Tiles are kept per level until
+        // an input or a param changes, so panning and zooming back only
+        // compute what was never shown. At most 'maxTiles' tiles
+        // (0: no limit) are computed per call, from the centre of the
+        // viewport outwards: call again until 'complete'.
+        Failable<ViewportResult> RunViewport(ImagePtr input, const Viewport& view, size_t maxTiles = 0)
+        {
+            if (input == nullptr)
+                return Failed("Pipeline: no input image");
+
+            // Full runs see these changes too
+            size_t first = ConsumeChanges();
+            bool inputChanged = false;
+            if (Error err = UpdateWorking(input, inputChanged); !err.empty())
+                return Failed(err);
+            if (inputChanged)
+                first = 0;
+            pendingFirst = std::min(pendingFirst, first);
+
+            // Stages after the last whole image one run on crops
+            size_t split = 0;
+            for (size_t i = 0; i < stages.size(); ++i)
+                if (stages[i].algorithm->Halo() == Algorithm::WHOLE_IMAGE)
+                    split = i + 1;
+            if (split != viewSplit)
+            {
+                viewLevels.clear();
+                viewChanged = true;
+            }
+            viewSplit = split;
+            InvalidateViewport(first);
+
+            ViewportResult result;
+            result.changed = viewChanged;
+            viewChanged = false;
+
+            if (view.scale <= 0.5f && !viewPyramid.Matches(working))
+                viewPyramid.Build(working);
+            while (view.scale * (2u << result.level) <= 1.f && result.level + 1 < viewPyramid.LevelCount() && viewPyramid.Matches(working))
+                ++result.level;
+
+            if (viewLevels.size() <= result.level)
+                viewLevels.resize(result.level + 1);
+            ViewLevel& level = viewLevels[result.level];
+            viewportBound = true;
+
+            // Radii and halos shrink with the level
+            SetLevel(result.level);
+            uint32_t halo = 0;
+            for (size_t i = split; i < stages.size(); ++i)
+                halo += stages[i].algorithm->Halo();
+            halo = (halo + VIEWPORT_ALIGN - 1) / VIEWPORT_ALIGN * VIEWPORT_ALIGN;
+
+            if (level.prefix == nullptr)
+            {
+                ImagePtr current = result.level == 0 ? working : viewPyramid.Level(result.level);
+                for (size_t i = 0; i < split; ++i)
+                {
+                    ImagePtr out = Allocate(working->type);
+                    if (Error err = RunStage(i, current, out); !err.empty())
+                        return Failed(err);
+                    current = out;
+                }
+                level.prefix = current;
+                level.output = nullptr;
+                level.todo.Reset(current->width, current->height, VIEWPORT_TILE_SIZE);
+            }
+
+            const ImagePtr& prefix = level.prefix;
+            const Rect bounds{ 0, 0, prefix->width, prefix->height };
+            result.region = (result.level == 0 ? view.region : viewPyramid.ToLevel(view.region, result.level)).Intersect(bounds);
+
+            // Centre first: the part looked at is refined before the borders
+            std::vector<uint32_t> tiles;
+            for (uint32_t t : level.todo.TilesIn(result.region))
+                if (level.todo.IsDirty(t))
+                    tiles.push_back(t);
+            const float cx = result.region.x + 0.5f * result.region.width;
+            const float cy = result.region.y + 0.5f * result.region.height;
+            auto distance = [&](uint32_t t) {
+                const Rect r = level.todo.TileRect(t);
+                const float dx = r.x + 0.5f * r.width - cx, dy = r.y + 0.5f * r.height - cy;
+                return dx * dx + dy * dy;
+            };
+            std::sort(tiles.begin(), tiles.end(), [&](uint32_t a, uint32_t b) { return distance(a) < distance(b); });
+
+            const size_t count = maxTiles == 0 ? tiles.size() : std::min(tiles.size(), maxTiles);
+            for (size_t k = 0; k < count; ++k)
+            {
+                const Rect tile = level.todo.TileRect(tiles[k]);
+                if (Error err = RunTile(level, split, halo, tile); !err.empty())
+                    return Failed(err);
+                level.todo.MarkClean(tiles[k]);
+                result.updated.push_back(tile);
+            }
+
+            result.image = level.output;
+            result.complete = count == tiles.size();
+            return result;
+        }
+
+        // Runs the stages over a store too large for memory into 'out'
+        // (created like 'in', in the working type), a tile at a time
+        // cropped with the summed halo of the stages. The input of the next
+        // tile is prefetched while one is computed. Every stage must have
+        // a bounded halo; full runs keep their own intermediates.
+        Error RunTiled(TileStore& in, TileStore& out)
+        {
+            SetLevel(0);
+            uint32_t halo = 0;
+            for (const auto& s : stages)
+            {
+                const uint32_t h = s.algorithm->Halo();
+                if (h == Algorithm::WHOLE_IMAGE)
+                    return Failed("Pipeline: {} needs the whole image, it can not run on tiles", s.algorithm->GetName()).error();
+                halo += h;
+            }
+
+            const uint32_t ts = in.TileSize();
+            auto cropOf = [&](uint64_t tx, uint64_t ty) {
+                const uint64_t x0 = tx * ts > halo ? tx * ts - halo : 0;
+                const uint64_t y0 = ty * ts > halo ? ty * ts - halo : 0;
+                const uint64_t x1 = std::min(in.Width(),  (tx + 1) * ts + halo);
+                const uint64_t y1 = std::min(in.Height(), (ty + 1) * ts + halo);
+                return StoreRegion{ x0, y0, (uint32_t)(x1 - x0), (uint32_t)(y1 - y0) };
+            };
+
+            ImagePtr input;
+            ImagePtr tile;
+            if (tiledOutputs.size() < stages.size())
+                tiledOutputs.resize(stages.size());
+
+            for (uint64_t ty = 0; ty < in.TilesY(); ++ty)
+            {
+                for (uint64_t tx = 0; tx < in.TilesX(); ++tx)
+                {
+                    if (tx + 1 < in.TilesX())
+                        in.Prefetch(cropOf(tx + 1, ty));
+                    else if (ty + 1 < in.TilesY())
+                        in.Prefetch(cropOf(0, ty + 1));
+
+                    const StoreRegion crop = cropOf(tx, ty);
+                    if (Error err = in.Read(crop, input); !err.empty())
+                        return err;
+
+                    const ImageDataType type = ResolveType(input);
+                    ImagePtr current = input->type == type ? input : ConvertImage(input, type);
+                    if (current == nullptr)
+                        return Error("Pipeline: unsupported input image");
+                    for (size_t i = 0; i < stages.size(); ++i)
+                    {
+                        if (tiledOutputs[i] == nullptr || tiledOutputs[i]->type != type)
+                            tiledOutputs[i] = Allocate(type);
+                        if (Error err = RunStage(i, current, tiledOutputs[i]); !err.empty())
+                            return err;
+                        current = tiledOutputs[i];
+                    }
+
+                    if (!out.Valid())
+                    {
+                        if (Error err = out.Create(in.Width(), in.Height(), current->channels, current->type, in.Options()); !err.empty())
+                            return err;
+                        out.metadata = current->metadata;
+                    }
+
+                    // The tile without its halo
+                    const Rect inner{ (uint32_t)(tx * ts - crop.x), (uint32_t)(ty * ts - crop.y),
+                                      (uint32_t)std::min<uint64_t>(ts, in.Width() - tx * ts), (uint32_t)std::min<uint64_t>(ts, in.Height() - ty * ts) };
+                    if (tile == nullptr || tile->type != current->type)
+                        tile = Allocate(current->type);
+                    CopyRect(current, inner, tile, 0, 0, true);
+                    if (Error err = out.Write(tile, tx * ts, ty * ts); !err.empty())
+                        return err;
+                }
+            }
+            // Stages were bound to the crops
+            viewportBound = true;
+            return Ok();
+        }
+
+        // Streaming runs, for exports: BeginRows runs the stages up to the
+        // last WHOLE_IMAGE one on the whole input, then RunRows computes
+        // rows [y, y + rows) of the output into 'strip' from the rows of
+        // that prefix and the summed halo of the next stages, cropped like
+        // viewport tiles. Only the prefix (the input itself when no stage
+        // needs the whole image) is whole in memory.
+        Error BeginRows(ImagePtr input)
+        {
+            if (input == nullptr)
+                return Error("Pipeline: no input image");
+
+            SetLevel(0);
+            rowsSplit = 0;
+            rowsHalo = 0;
+            for (size_t i = 0; i < stages.size(); ++i)
+            {
+                const uint32_t h = stages[i].algorithm->Halo();
+                if (h == Algorithm::WHOLE_IMAGE)
+                {
+                    rowsSplit = i + 1;
+                    rowsHalo = 0;
+                }
+                else
+                {
+                    rowsHalo += h;
+                }
+            }
+
+            rowsType = ResolveType(input);
+            rowsPrefix = input;
+            if (rowsSplit > 0)
+            {
+                rowsPrefix = input->type == rowsType ? input : ConvertImage(input, rowsType);
+                if (rowsPrefix == nullptr)
+                    return Error("Pipeline: unsupported input image");
+                for (size_t i = 0; i < rowsSplit; ++i)
+                {
+                    ImagePtr out = Allocate(rowsType);
+                    if (Error err = RunStage(i, rowsPrefix, out); !err.empty())
+                    {
+                        rowsPrefix = nullptr;
+                        return err;
+                    }
+                    rowsPrefix = out;
+                }
+            }
+            viewportBound = true;
+            return Ok();
+        }
+
+        Error RunRows(uint32_t y, uint32_t rows, ImagePtr& strip)
+        {
+            if (rowsPrefix == nullptr)
+                return Error("Pipeline: BeginRows was not called");
+
+            const ImagePtr& prefix = rowsPrefix;
+            const uint32_t y0 = y > rowsHalo ? y - rowsHalo : 0;
+            const Rect crop = Rect{ 0, y0, prefix->width, y + rows + rowsHalo - y0 }.Intersect(Rect{ 0, 0, prefix->width, prefix->height });
+            if (crop.Empty() || y + rows > prefix->height)
+                return Error("Pipeline: rows out of the image");
+
+            SetLevel(0);
+            // The input is converted a crop at a time
+            if (rowsInput == nullptr || rowsInput->type != prefix->type)
+                rowsInput = Allocate(prefix->type);
+            CopyRect(prefix, crop, rowsInput, 0, 0, true);
+            rowsInput->metadata = prefix->metadata;
+            ImagePtr current = prefix->type == rowsType ? rowsInput : ConvertImage(rowsInput, rowsType);
+            if (current == nullptr)
+                return Error("Pipeline: unsupported input image");
+
+            if (tiledOutputs.size() < stages.size())
+                tiledOutputs.resize(stages.size());
+            for (size_t i = rowsSplit; i < stages.size(); ++i)
+            {
+                if (tiledOutputs[i] == nullptr || tiledOutputs[i]->type != rowsType)
+                    tiledOutputs[i] = Allocate(rowsType);
+                if (Error err = RunStage(i, current, tiledOutputs[i]); !err.empty())
+                    return err;
+                current = tiledOutputs[i];
+            }
+
+            if (strip == nullptr || strip->type != current->type)
+                strip = Allocate(current->type);
+            CopyRect(current, Rect{ 0, y - crop.y, current->width, rows }, strip, 0, 0, true);
+            strip->metadata = current->metadata;
+            viewportBound = true;
+            return Ok();
+        }
+
+        // Output rows of the streaming run
+        uint32_t RowCount() const { return rowsPrefix ? rowsPrefix->height : 0; }
+
+        // Drops the prefix of BeginRows
+        void EndRows()
+        {
+            rowsPrefix = nullptr;
+            rowsInput = nullptr;
+        }
+
+        // Tiles of a viewport level still to compute, nullptr when the
+        // level has nothing computed
+        const TileGrid* ViewportTodo(uint32_t level) const
+        {
+            if (level >= viewLevels.size() || viewLevels[level].output == nullptr)
+                return nullptr;
+            return &viewLevels[level].todo;
+        }
+
+        ImagePtr Output() const
+        {
+            if (stages.empty()) return working;
+            return stages.back().output;
+        }
+
+        size_t MemoryUsage() const
+        {
+            size_t bytes = 0;
+            if (working != nullptr && working != source) bytes += ByteSize(working);
+            for (const auto& s : stages)
+                if (s.output != nullptr) bytes += ByteSize(s.output);
+            for (const auto& l : viewLevels)
+            {
+                if (l.prefix != nullptr && l.prefix != working && l.prefix != viewPyramid.Level(0)) bytes += ByteSize(l.prefix);
+                if (l.output != nullptr) bytes += ByteSize(l.output);
+            }
+            return bytes;
+        }
+
+        // Runs the pipeline with FLOAT32 intermediates and with 'type'
+        // intermediates (UINT16: fixed point path) and compares both 
+        // outputs. The working type and precision are restored afterwards.
+        Failable<PrecisionReport> MeasurePrecision(ImagePtr input, ImageDataType type)
+        {
+            const ImageDataType previous = workingType;
+            const Precision previousPrecision = precision;
+            PrecisionReport report;
+
+            SetPrecision(Precision::Float);
+            SetWorkingType(ImageDataType::FLOAT32);
+            if (Error err = Run(input); !err.empty()) return Failed(err);
+            ImagePtr reference = ConvertImage(Output(), ImageDataType::FLOAT32);
+            report.referenceBytes = MemoryUsage();
+
+            // UINT16 measures the fixed point path
+            if (type == ImageDataType::UINT16)
+                SetPrecision(Precision::Fixed16);
+            else
+                SetWorkingType(type);
+            if (Error err = Run(input); !err.empty()) return Failed(err);
+            ImagePtr result = ConvertImage(Output(), ImageDataType::FLOAT32);
+            report.workingBytes = MemoryUsage();
+
+            SetWorkingType(previous);
+            SetPrecision(previousPrecision);
+
+            const float* a = static_cast<const float*>(reference->RawData());
+            const float* b = static_cast<const float*>(result->RawData());
+            const int64_t n = (int64_t)reference->width * reference->height * reference->channels;
+
+            double sum = 0.0;
+            double maxError = 0.0;
+            #pragma omp parallel for reduction(+:sum) reduction(max:maxError)
+            for (int64_t i = 0; i < n; ++i)
+            {
+                const double e = std::abs((double)a[i] - (double)b[i]);
+                sum += e * e;
+                maxError = std::max(maxError, e);
+            }
+
+            report.maxError = maxError;
+            report.rmse = n > 0 ? std::sqrt(sum / n) : 0.0;
+            report.psnr = report.rmse > 0.0 ? 20.0 * std::log10(1.0 / report.rmse) : INFINITY;
+            return report;
+        }
+
+        // 'r' of 'src' to ('x', 'y') in 'dst', which is resized to 'r' first
+        // when 'resize' is set
+        static void CopyRect(const ImagePtr& src, const Rect& r, const ImagePtr& dst, uint32_t x, uint32_t y, bool resize)
+        {
+            if (resize)
+            {
+                DISPATCH_DATATYPE(dst->type,
+                    static_cast<CPUImage<DataType>*>(dst.get())->Resize(r.width, r.height, src->channels);
+                );
+            }
+            const size_t pixel = (size_t)src->channels * SizeofType(src->type);
+            const uint8_t* s = static_cast<const uint8_t*>(src->RawData());
+            uint8_t* d = static_cast<uint8_t*>(dst->RawData());
+            for (uint32_t j = 0; j < r.height; ++j)
+                memcpy(d + ((size_t)(y + j) * dst->width + x) * pixel, s + ((size_t)(r.y + j) * src->width + r.x) * pixel, r.width * pixel);
+        }
+
+    private:
+        // Output of the whole image stages and computed tiles, per level
+        struct ViewLevel
+        {
+            ImagePtr prefix;
+            ImagePtr output;
+            // Tiles still to compute
+            TileGrid todo;
+        };
+
+        // First stage whose inputs changed. Every stage must be asked (it
+        // consumes the changes).
+        size_t ConsumeChanges()
+        {
+            size_t first = stages.size();
+            for (size_t i = 0; i < stages.size(); ++i)
+                if (stages[i].algorithm->Dirty() && first == stages.size())
+                    first = i;
+            return first;
+        }
+
+        Error UpdateWorking(const ImagePtr& input, bool& changed)
+        {
+            const ImageDataType type = ResolveType(input);
+            changed = input != source || working == nullptr || working->type != type;
+            if (!changed)
+                return Ok();
+
+            source  = input;
+            working = input->type == type ? input : ConvertImage(input, type);
+            if (working == nullptr)
+                return Error("Pipeline: unsupported input image");
+            return Ok();
+        }
+
+        // Viewport results computed by stages from 'first' are dropped
+        void InvalidateViewport(size_t first)
+        {
+            if (first >= stages.size()) return;
+            viewChanged = true;
+            if (first < viewSplit)
+            {
+                viewLevels.clear();
+                return;
+            }
+            for (auto& l : viewLevels)
+                l.todo.MarkAllDirty();
+        }
+
+        // Pyramid level the stages run on
+        void SetLevel(uint32_t level)
+        {
+            for (auto& s : stages)
+                s.algorithm->SetLevel(level);
+        }
+
+        Error RunStage(size_t i, const ImagePtr& input, const ImagePtr& output)
+        {
+            Algorithm& algo = *stages[i].algorithm;
+            algo.Propagate();
+            algo.BindInputImage(input);
+            algo.BindOutputImage(output);
+            algo.InputChanged();
+            output->metadata = input->metadata;
+
+            // Regions are for full runs, crops are computed whole
+            auto* regional = dynamic_cast<RegionAlgorithm*>(&algo);
+            const Rect region = regional ? regional->GetRegion() : Rect{};
+            if (regional) regional->SetRegion(Rect{});
+            Error err = algo.Run();
+            if (regional) regional->SetRegion(region);
+            return err;
+        }
+
+        // Runs the stages from 'split' on 'tile' of the level with 'halo'
+        // pixels around it and stores the tile in the level output
+        Error RunTile(ViewLevel& level, size_t split, uint32_t halo, const Rect& tile)
+        {
+            const ImagePtr& prefix = level.prefix;
+            const uint32_t x0 = tile.x > halo ? tile.x - halo : 0;
+            const uint32_t y0 = tile.y > halo ? tile.y - halo : 0;
+            const Rect crop = Rect{ x0, y0, tile.Right() + halo - x0, tile.Bottom() + halo - y0 }.Intersect(Rect{ 0, 0, prefix->width, prefix->height });
+
+            if (cropInput == nullptr || cropInput->type != prefix->type)
+                cropInput = Allocate(prefix->type);
+            CopyRect(prefix, crop, cropInput, 0, 0, true);
+            cropInput->metadata = prefix->metadata;
+
+            if (cropOutputs.size() < stages.size())
+                cropOutputs.resize(stages.size());
+            ImagePtr current = cropInput;
+            for (size_t i = split; i < stages.size(); ++i)
+            {
+                if (cropOutputs[i] == nullptr || cropOutputs[i]->type != prefix->type)
+                    cropOutputs[i] = Allocate(prefix->type);
+                if (Error err = RunStage(i, current, cropOutputs[i]); !err.empty())
+                    return err;
+                current = cropOutputs[i];
+            }
+
+            if (level.output == nullptr || level.output->channels != current->channels)
+            {
+                level.output = Allocate(current->type);
+                DISPATCH_DATATYPE(current->type,
+                    static_cast<CPUImage<DataType>*>(level.output.get())->Resize(prefix->width, prefix->height, current->channels);
+                );
+            }
+            level.output->metadata = current->metadata;
+            CopyRect(current, Rect{ tile.x - crop.x, tile.y - crop.y, tile.width, tile.height }, level.output, tile.x, tile.y, false);
+            return Ok();
+        }
+
+        static size_t ByteSize(const ImagePtr& img)
+        {
+            return (size_t)img->width * img->height * img->channels * SizeofType(img->type);
+        }
+
+        static ImagePtr Allocate(ImageDataType type)
+        {
+            ImagePtr result;
+            DISPATCH_DATATYPE(type,
+                result = std::make_shared<CPUImage<DataType>>();
+            );
+            return result;
+        }
+
+        struct Stage
+        {
+            std::unique_ptr<Algorithm> algorithm;
+            ImagePtr output;
+        };
+
+        ImageDataType workingType = ImageDataType::FLOAT32;
+        Precision precision = Precision::Float;
+
+        ImagePtr source  = nullptr;
+        ImagePtr working = nullptr;
+        std::vector<Stage> stages;
+        // First stage a viewport run saw changed, recomputed by the next Run
+        size_t pendingFirst = SIZE_MAX;
+        // Algorithms were bound to viewport images since the last Run
+        bool viewportBound = false;
+
+        // Viewport runs: levels of the working image and their results
+        Pyramid viewPyramid;
+        std::vector<ViewLevel> viewLevels;
+        size_t viewSplit = 0;
+        bool viewChanged = false;
+        ImagePtr cropInput;
+        std::vector<ImagePtr> cropOutputs;
+        // Intermediates of RunTiled and RunRows, tile or strip sized
+        std::vector<ImagePtr> tiledOutputs;
+        // Streaming runs
+        ImagePtr rowsPrefix;
+        ImagePtr rowsInput;
+        ImageDataType rowsType = ImageDataType::FLOAT32;
+        size_t rowsSplit = 0;
+        uint32_t rowsHalo = 0;
+    };
+}
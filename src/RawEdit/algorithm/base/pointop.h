@@ -0,0 +1,154 @@
+#pragma once
+
+#include <array>
+#include <cmath>
+#include "image/image.h"
+#include "image/foreach.h"
+#include "utils/error.h"
+
+namespace RawEdit
+{
+    // Per channel values are expanded on a pattern long enough to repeat
+    // exactly for 1, 2, 3, 4, 6, 8, 12 and 16 channels: kernels then run 
+    // straight loops over interleaved rows.
+    constexpr size_t PATTERN_SIZE = 48;
+
+    template<typename V>
+    std::array<V, PATTERN_SIZE> MakePattern(const V* perChannel, uint32_t channels)
+    {
+        std::array<V, PATTERN_SIZE> pattern;
+        for (size_t k = 0; k < PATTERN_SIZE; ++k)
+            pattern[k] = perChannel[k % channels];
+        return pattern;
+    }
+
+    // out = (in - offset) * gain, in float
+    template<typename T>
+    RAWEDIT_INLINE void AffineRowImpl(const T* src, T* dst, size_t n, const T* offsets, const T* gains)
+    {
+        for (size_t i = 0; i < n; i += PATTERN_SIZE)
+        {
+            const size_t count = std::min(PATTERN_SIZE, n - i);
+            for (size_t k = 0; k < count; ++k)
+                dst[i + k] = (src[i + k] - offsets[k]) * gains[k];
+        }
+    }
+    RAWEDIT_KERNEL(AffineRow)
+
+    // Fixed point version for uint16: gains are Q12, subtraction and 
+    // the final narrowing saturate (psubusw / pminud + packusdw). 
+    // Gains must stay below 16 for the product to fit on 32 bits.
+    constexpr uint32_t FIXED_SHIFT = 12;
+    constexpr float FIXED_MAX_GAIN = (float)(1u << (16 - FIXED_SHIFT));
+
+    template<typename T>
+    RAWEDIT_INLINE void AffineRowFixedImpl(const T* src, T* dst, size_t n, const T* offsets, const uint32_t* gains)
+    {
+        for (size_t i = 0; i < n; i += PATTERN_SIZE)
+        {
+            const size_t count = std::min(PATTERN_SIZE, n - i);
+            for (size_t k = 0; k < count; ++k)
+            {
+                const uint32_t v = src[i + k] > offsets[k] ? src[i + k] - offsets[k] : 0;
+                const uint32_t r = (v * gains[k] + (1u << (FIXED_SHIFT - 1))) >> FIXED_SHIFT;
+                dst[i + k] = static_cast<T>(std::min(r, (uint32_t)UINT16_MAX));
+            }
+        }
+    }
+    RAWEDIT_KERNEL(AffineRowFixed)
+
+    template<typename T>
+    RAWEDIT_INLINE void LutRowImpl(const T* src, T* dst, size_t n, const T* lut)
+    {
+        for (size_t i = 0; i < n; ++i)
+            dst[i] = lut[src[i]];
+    }
+    RAWEDIT_KERNEL(LutRow)
+
+    // Applies out = (in - offset[c]) * gain[c] on normalized values.
+    // uint16 images use the fixed point kernel as long as gains fit. 
+    template<typename T>
+    Error AffineCPU(const CPUImage<T>* input, CPUImage<T>* output, const float* offsets, const float* gains)
+    {
+        const uint32_t c = input->channels;
+        if (c == 0 || PATTERN_SIZE % c != 0)
+            return Error(std::format("Unsupported channel count for point operation: {}", c));
+
+        output->Resize(input->width, input->height, c);
+
+        bool fixed = std::is_same_v<T, uint16_t>;
+        for (uint32_t k = 0; k < c; ++k)
+            fixed = fixed && gains[k] >= 0.f && gains[k] < FIXED_MAX_GAIN && offsets[k] >= 0.f;
+
+        if constexpr (std::is_same_v<T, uint16_t>)
+        {
+            if (fixed)
+            {
+                static const auto kernel = RAWEDIT_SELECT_KERNEL(AffineRowFixed, uint16_t);
+
+                std::array<uint16_t, 16> off;
+                std::array<uint32_t, 16> gain;
+                for (uint32_t k = 0; k < c; ++k)
+                {
+                    off[k]  = static_cast<uint16_t>(std::min(std::round(offsets[k] * UINT16_MAX), (float)UINT16_MAX));
+                    gain[k] = static_cast<uint32_t>(std::round(gains[k] * (1u << FIXED_SHIFT)));
+                }
+                const auto offPattern  = MakePattern(off.data(), c);
+                const auto gainPattern = MakePattern(gain.data(), c);
+
+                ForEachRow([&](uint32_t, std::span<const uint16_t> src, std::span<uint16_t> dst) {
+                    kernel(src.data(), dst.data(), src.size(), offPattern.data(), gainPattern.data());
+                }, input, output);
+                return Ok();
+            }
+        }
+
+        static const auto kernel = RAWEDIT_SELECT_KERNEL(AffineRow, float);
+        const auto offPattern  = MakePattern(offsets, c);
+        const auto gainPattern = MakePattern(gains, c);
+
+        ForEachRow([&](uint32_t, std::span<const T> src, std::span<T> dst) {
+            ProcessAsFloat(src.data(), dst.data(), src.size(), 
+                [&](const float* in, float* out, size_t n) { kernel(in, out, n, offPattern.data(), gainPattern.data()); }
+            );
+        }, input, output);
+        return Ok();
+    }
+
+    // Applies a curve given on [0, 1]. uint16 (and uint8) images go through a 
+    // full table of the curve, other types evaluate it.
+    template<typename T, typename Curve>
+    Error CurveCPU(const CPUImage<T>* input, CPUImage<T>* output, std::vector<T>& lut, Curve&& curve)
+    {
+        output->Resize(input->width, input->height, input->channels);
+
+        if constexpr (std::is_same_v<T, uint16_t> || std::is_same_v<T, uint8_t>)
+        {
+            constexpr size_t size = (size_t)std::numeric_limits<T>::max() + 1;
+            if (lut.size() != size)
+            {
+                lut.resize(size);
+                for (size_t v = 0; v < size; ++v)
+                {
+                    const float r = curve(v / (float)(size - 1));
+                    lut[v] = static_cast<T>(std::clamp(std::round(r * (size - 1)), 0.f, (float)(size - 1)));
+                }
+            }
+
+            static const auto kernel = RAWEDIT_SELECT_KERNEL(LutRow, T);
+
+            ForEachRow([&](uint32_t, std::span<const T> src, std::span<T> dst) {
+                kernel(src.data(), dst.data(), src.size(), lut.data());
+            }, input, output);
+        }
+        else
+        {
+            ForEachRow([&](uint32_t, std::span<const T> src, std::span<T> dst) {
+                ProcessAsFloat(src.data(), dst.data(), src.size(), 
+                    [&](const float* in, float* out, size_t n) { for (size_t k = 0; k < n; ++k) out[k] = curve(in[k]); }
+                );
+            }, input, output);
+        }
+        return Ok();
+    }
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include "image/pyramid.h"
+#include "image/tile.h"
+#include "algorithm.h"
+
+namespace RawEdit
+{
+    // Base of the algorithms which can update a part of their output. A
+    // region restricts the next runs to the tiles overlapping it, the
+    // output must then hold a previous result of the same size (the rest
+    // of it is kept).
+    class RegionAlgorithm : public Algorithm
+    {
+    public:
+        using Algorithm::Algorithm;
+
+        void SetRegion(const Rect& r) { region = r; }
+        const Rect& GetRegion() const { return region; }
+
+        void InputChanged() override { pyramidStale = true; }
+
+    protected:
+        // Input downscaled 2^level times (or less for small images), for the
+        // preview modes. The pyramid is kept while the same input is bound
+        // and unchanged: dragging a slider only costs the filter itself.
+        template<typename T>
+        const CPUImage<T>* Downscaled(uint32_t& level)
+        {
+            if (pyramidStale || !pyramid.Matches(inputImage))
+            {
+                pyramid.Build(inputImage);
+                pyramidStale = false;
+            }
+            level = std::min(level, pyramid.LevelCount() - 1);
+            return static_cast<const CPUImage<T>*>(pyramid.Level(level).get());
+        }
+
+        Rect region;
+        Pyramid pyramid;
+        bool pyramidStale = true;
+    };
+};
@@ -0,0 +1,213 @@
+#pragma once
+
+#include <chrono>
+#include <stop_token>
+#include <utility>
+#include "pipeline.h"
+#include "image/foreach.h"
+
+namespace RawEdit
+{
+    // Renders the viewport of a pipeline in steps short enough for a UI
+    // frame. After a change, the visible part is first computed on a proxy
+    // (a pyramid level of about PROXY_PIXELS visible pixels) and shown
+    // enlarged, then refined at the display level tile by tile from the
+    // centre of the viewport outwards, each tile replacing the proxy
+    // pixels. Both are gathered in Display(), which has the input size.
+    class ProgressiveRenderer
+    {
+    public:
+        static constexpr size_t PROXY_PIXELS = 1 << 16;
+
+        explicit ProgressiveRenderer(Pipeline& p) : pipeline(p) {}
+
+        void SetInput(ImagePtr img)
+        {
+            if (img == input) return;
+            input   = img;
+            display = nullptr;
+            shown   = {};
+            pendingLevel = UINT32_MAX;
+        }
+        void SetViewport(const Viewport& v) { view = v; }
+
+        ImagePtr Display() const { return display; }
+        // Parts of Display() written since the last call
+        std::vector<Rect> PullUpdated() { return std::exchange(updated, {}); }
+
+        // 'r' of Display() in an image of its own
+        ImagePtr Copy(const Rect& r) const
+        {
+            ImagePtr out(display->EmptyCopy(true));
+            Pipeline::CopyRect(display, r, out, 0, 0, true);
+            return out;
+        }
+
+        // Renders for about 'budget': the proxy when needed (whatever the
+        // budget), then refined tiles until 'stop' is requested. Returns
+        // true while the viewport is not fully refined.
+        Failable<bool> Step(std::chrono::microseconds budget, std::stop_token stop = {})
+        {
+            const auto deadline = std::chrono::steady_clock::now() + budget;
+            const Rect region = input ? view.region.Intersect(Rect{ 0, 0, input->width, input->height }) : Rect{};
+            if (region.Empty())
+                return false;
+
+            // Each level divides the pixels by 4
+            uint32_t proxyLevel = 0;
+            while (((size_t)region.width * region.height >> (2 * proxyLevel)) > PROXY_PIXELS && proxyLevel < 16)
+                ++proxyLevel;
+            const float proxyScale = std::min(view.scale, 1.f / (1u << proxyLevel));
+
+            auto proxy = pipeline.RunViewport(input, Viewport{ region, proxyScale });
+            if (!proxy)
+                return Failed(proxy.error());
+
+            // Only the visible part is written: after a change all of it,
+            // otherwise what panning uncovered
+            std::vector<Rect> exposed = { region };
+            if (proxy->changed || display == nullptr)
+                pendingLevel = UINT32_MAX;
+            else
+                exposed = Subtract(region, shown);
+            shown = region;
+
+            for (const Rect& area : exposed)
+            {
+                Blit(proxy->image, proxy->level, area);
+                // Refined tiles stay on top of the proxy
+                if (pendingLevel == UINT32_MAX || pendingLevel == proxy->level) continue;
+                for (uint32_t idx : pending.TilesIn(ToLevel(area, pendingLevel)))
+                    if (!pending.IsDirty(idx))
+                        Blit(refined, pendingLevel, FromLevel(pending.TileRect(idx), pendingLevel).Intersect(area));
+            }
+
+            // The proxy may have used the whole budget
+            while (std::chrono::steady_clock::now() < deadline && !stop.stop_requested())
+            {
+                auto result = pipeline.RunViewport(input, view, 1);
+                if (!result)
+                    return Failed(result.error());
+
+                if (result->level != pendingLevel && result->image != nullptr)
+                {
+                    pendingLevel = result->level;
+                    pending.Reset(result->image->width, result->image->height, Pipeline::VIEWPORT_TILE_SIZE);
+
+                    // Tiles of this level computed by earlier steps are not
+                    // computed again, the display may show another level there
+                    const TileGrid* todo = pipeline.ViewportTodo(pendingLevel);
+                    for (uint32_t idx : pending.TilesIn(result->region))
+                    {
+                        if (todo == nullptr || todo->IsDirty(idx)) continue;
+                        // The proxy is this level: already shown
+                        if (result->level != proxy->level)
+                            Blit(result->image, pendingLevel, FromLevel(pending.TileRect(idx), pendingLevel).Intersect(region));
+                        pending.MarkClean(idx);
+                    }
+                }
+                refined = result->image;
+
+                for (const Rect& tile : result->updated)
+                {
+                    const uint32_t idx = pending.TileIndex(tile.x, tile.y);
+                    if (!pending.IsDirty(idx)) continue;
+                    Blit(result->image, result->level, FromLevel(tile, result->level).Intersect(region));
+                    pending.MarkClean(idx);
+                }
+
+                if (result->complete)
+                    return false;
+            }
+            return true;
+        }
+
+    private:
+        // Level 'l' region to the level 0 region it covers
+        Rect FromLevel(const Rect& r, uint32_t l) const
+        {
+            return Rect{ r.x << l, r.y << l, r.width << l, r.height << l }.Intersect(Rect{ 0, 0, input->width, input->height });
+        }
+
+        static Rect ToLevel(const Rect& r, uint32_t l)
+        {
+            const uint32_t s = 1u << l;
+            const uint32_t x0 = r.x / s, y0 = r.y / s;
+            return Rect{ x0, y0, (r.Right() + s - 1) / s - x0, (r.Bottom() + s - 1) / s - y0 };
+        }
+
+        // Parts of 'a' outside of 'b'
+        static std::vector<Rect> Subtract(const Rect& a, const Rect& b)
+        {
+            const Rect i = a.Intersect(b);
+            if (i.Empty()) return { a };
+
+            std::vector<Rect> parts = {
+                Rect{ a.x, a.y, a.width, i.y - a.y },
+                Rect{ a.x, i.Bottom(), a.width, a.Bottom() - i.Bottom() },
+                Rect{ a.x, i.y, i.x - a.x, i.height },
+                Rect{ i.Right(), i.y, a.Right() - i.Right(), i.height }
+            };
+            std::erase_if(parts, [](const Rect& r) { return r.Empty(); });
+            return parts;
+        }
+
+        // Writes 'dst' (level 0 pixels) of Display() from 'src', a level
+        // 'l' image, enlarged 2^l times
+        void Blit(const ImagePtr& src, uint32_t l, const Rect& dst)
+        {
+            if (dst.Empty()) return;
+
+            if (display == nullptr || display->type != src->type || display->channels != src->channels)
+            {
+                display.reset(src->EmptyCopy(true));
+                DISPATCH_DATATYPE(src->type,
+                    static_cast<CPUImage<DataType>*>(display.get())->Resize(input->width, input->height, src->channels);
+                );
+            }
+            display->metadata = src->metadata;
+
+            DISPATCH_DATATYPE(src->type,
+                Enlarge(static_cast<const CPUImage<DataType>*>(src.get()), static_cast<CPUImage<DataType>*>(display.get()), l, dst);
+            );
+            updated.push_back(dst);
+        }
+
+        // Nearest neighbour: 'dst' of 'out' from 'in', 2^l times smaller
+        template<typename T>
+        static void Enlarge(const CPUImage<T>* in, CPUImage<T>* out, uint32_t l, const Rect& dst)
+        {
+            const uint32_t c = in->channels;
+            const size_t inRow = (size_t)in->width * c;
+
+            ForEachRow(dst, [&](uint32_t y, std::span<T> o) {
+                const T* row = in->GetDataPtr() + std::min(y >> l, in->height - 1) * inRow;
+                if (l == 0)
+                {
+                    std::copy_n(row + (size_t)dst.x * c, o.size(), o.data());
+                    return;
+                }
+                for (uint32_t x = dst.x, i = 0; x < dst.Right(); ++x, i += c)
+                {
+                    const T* p = row + (size_t)std::min(x >> l, in->width - 1) * c;
+                    for (uint32_t k = 0; k < c; ++k)
+                        o[i + k] = p[k];
+                }
+            }, out);
+        }
+
+        Pipeline& pipeline;
+        ImagePtr input;
+        Viewport view;
+
+        ImagePtr display;
+        std::vector<Rect> updated;
+        // Visible part at the last step
+        Rect shown;
+
+        // Display level tiles not refined yet (a proxy is shown there)
+        TileGrid pending;
+        uint32_t pendingLevel = UINT32_MAX;
+        ImagePtr refined;
+    };
+}
@@ -0,0 +1,299 @@
+#pragma once
+
+#include <array>
+#include <cmath>
+#include <vector>
+#include "image/image.h"
+#include "image/tile.h"
+#include "image/foreach.h"
+#include "image/colorspace.h"
+#include "utils/error.h"
+#include "utils/kernel.h"
+
+namespace RawEdit
+{
+    enum class Interpolation
+    {
+        Nearest,
+        Bilinear,
+        Bicubic
+    };
+
+    // Output tiles of the resampling, the source region of each one is
+    // loaded once (as float) and sampled from there
+    constexpr uint32_t RESAMPLE_TILE = 128;
+
+    // Homogeneous mapping of a point
+    inline std::array<float, 3> MapPoint(const Mat3& m, float x, float y)
+    {
+        return {
+            m[0] * x + m[1] * y + m[2],
+            m[3] * x + m[4] * y + m[5],
+            m[6] * x + m[7] * y + m[8]
+        };
+    }
+
+    // Source coordinates of the centers of n output pixels of a row,
+    // starting at (u0, v). Coordinates are pixel centers on both sides.
+    template<typename T>
+    RAWEDIT_INLINE void MapRowImpl(const float* m, float u0, float v, float* sx, float* sy, uint32_t n)
+    {
+        const float vv = v + 0.5f;
+        const float bx = m[1] * vv + m[2], by = m[4] * vv + m[5], bw = m[7] * vv + m[8];
+        for (uint32_t i = 0; i < n; ++i)
+        {
+            const float u = u0 + i + 0.5f;
+            const float iw = 1.f / (m[6] * u + bw);
+            sx[i] = (m[0] * u + bx) * iw - 0.5f;
+            sy[i] = (m[3] * u + by) * iw - 0.5f;
+        }
+    }
+    RAWEDIT_KERNEL(MapRow)
+
+    // Catmull-Rom weights of the 4 taps around a fraction f
+    inline void CubicWeights(float f, float* w)
+    {
+        const float f2 = f * f, f3 = f2 * f;
+        w[0] = -0.5f * f3 + f2 - 0.5f * f;
+        w[1] =  1.5f * f3 - 2.5f * f2 + 1.f;
+        w[2] = -1.5f * f3 + 2.f * f2 + 0.5f * f;
+        w[3] =  0.5f * f3 - 0.5f * f2;
+    }
+
+    // Float source region to sample from: w x h pixels of c channels.
+    // Samples outside [lo, hi] (the source image) are transparent (0),
+    // taps are clamped to the region otherwise.
+    struct SampleSource
+    {
+        const float* data;
+        uint32_t width, height, channels;
+        float loX, loY, hiX, hiY;
+
+        const float* At(int32_t x, int32_t y) const
+        {
+            x = std::clamp(x, 0, (int32_t)width - 1);
+            y = std::clamp(y, 0, (int32_t)height - 1);
+            return data + ((size_t)y * width + x) * channels;
+        }
+
+        bool Outside(float x, float y) const { return !(x >= loX && x <= hiX && y >= loY && y <= hiY); }
+    };
+
+    // Samplers are written for a channel count known at compile time
+    // (0: any, read from the source), the row kernels pick the instance
+    #define __RAWEDIT_SAMPLE_CHANNELS(fn, s, ...) \
+        switch (s.channels) \
+        { \
+            case 1:  fn<1>(s, __VA_ARGS__); break; \
+            case 3:  fn<3>(s, __VA_ARGS__); break; \
+            case 4:  fn<4>(s, __VA_ARGS__); break; \
+            default: fn<0>(s, __VA_ARGS__); break; \
+        }
+
+    template<uint32_t C>
+    RAWEDIT_INLINE void SampleNearestRows(const SampleSource& s, const float* sx, const float* sy, float* dst, uint32_t n)
+    {
+        const uint32_t c = C ? C : s.channels;
+        for (uint32_t i = 0; i < n; ++i)
+        {
+            float* out = dst + i * c;
+            if (s.Outside(sx[i], sy[i]))
+            {
+                std::fill(out, out + c, 0.f);
+                continue;
+            }
+            const float* p = s.At((int32_t)std::floor(sx[i] + 0.5f), (int32_t)std::floor(sy[i] + 0.5f));
+            for (uint32_t k = 0; k < c; ++k)
+                out[k] = p[k];
+        }
+    }
+
+    template<typename T>
+    RAWEDIT_INLINE void SampleNearestRowImpl(const SampleSource& s, const float* sx, const float* sy, float* dst, uint32_t n)
+    {
+        __RAWEDIT_SAMPLE_CHANNELS(SampleNearestRows, s, sx, sy, dst, n)
+    }
+    RAWEDIT_KERNEL(SampleNearestRow)
+
+    template<uint32_t C>
+    RAWEDIT_INLINE void SampleBilinearRows(const SampleSource& s, const float* sx, const float* sy, float* dst, uint32_t n)
+    {
+        const uint32_t c = C ? C : s.channels;
+        for (uint32_t i = 0; i < n; ++i)
+        {
+            float* out = dst + i * c;
+            if (s.Outside(sx[i], sy[i]))
+            {
+                std::fill(out, out + c, 0.f);
+                continue;
+            }
+            const float fx0 = std::floor(sx[i]), fy0 = std::floor(sy[i]);
+            const int32_t x0 = (int32_t)fx0, y0 = (int32_t)fy0;
+            const float fx = sx[i] - fx0, fy = sy[i] - fy0;
+
+            const bool inside = x0 >= 0 && y0 >= 0 && x0 + 1 < (int32_t)s.width && y0 + 1 < (int32_t)s.height;
+            const float* p00 = inside ? s.data + ((size_t)y0 * s.width + x0) * c : s.At(x0, y0);
+            const float* p01 = inside ? p00 + c : s.At(x0 + 1, y0);
+            const float* p10 = inside ? p00 + (size_t)s.width * c : s.At(x0, y0 + 1);
+            const float* p11 = inside ? p10 + c : s.At(x0 + 1, y0 + 1);
+            for (uint32_t k = 0; k < c; ++k)
+            {
+                const float top    = p00[k] + fx * (p01[k] - p00[k]);
+                const float bottom = p10[k] + fx * (p11[k] - p10[k]);
+                out[k] = top + fy * (bottom - top);
+            }
+        }
+    }
+
+    template<typename T>
+    RAWEDIT_INLINE void SampleBilinearRowImpl(const SampleSource& s, const float* sx, const float* sy, float* dst, uint32_t n)
+    {
+        __RAWEDIT_SAMPLE_CHANNELS(SampleBilinearRows, s, sx, sy, dst, n)
+    }
+    RAWEDIT_KERNEL(SampleBilinearRow)
+
+    template<uint32_t C>
+    RAWEDIT_INLINE void SampleBicubicRows(const SampleSource& s, const float* sx, const float* sy, float* dst, uint32_t n)
+    {
+        const uint32_t c = C ? C : s.channels;
+        const size_t stride = (size_t)s.width * c;
+        for (uint32_t i = 0; i < n; ++i)
+        {
+            float* out = dst + i * c;
+            if (s.Outside(sx[i], sy[i]))
+            {
+                std::fill(out, out + c, 0.f);
+                continue;
+            }
+            const float fx0 = std::floor(sx[i]), fy0 = std::floor(sy[i]);
+            const int32_t x0 = (int32_t)fx0, y0 = (int32_t)fy0;
+            float wx[4], wy[4];
+            CubicWeights(sx[i] - fx0, wx);
+            CubicWeights(sy[i] - fy0, wy);
+
+            // Taps are clamped near the borders of the region only
+            const bool inside = x0 >= 1 && y0 >= 1 && x0 + 2 < (int32_t)s.width && y0 + 2 < (int32_t)s.height;
+            float acc[C ? C : 16] = {};
+            for (int32_t j = 0; j < 4; ++j)
+            {
+                float row[C ? C : 16] = {};
+                const float* line = inside ? s.data + (y0 - 1 + j) * stride + (x0 - 1) * c : nullptr;
+                for (int32_t t = 0; t < 4; ++t)
+                {
+                    const float* p = inside ? line + t * c : s.At(x0 - 1 + t, y0 - 1 + j);
+                    for (uint32_t k = 0; k < c; ++k)
+                        row[k] += wx[t] * p[k];
+                }
+                for (uint32_t k = 0; k < c; ++k)
+                    acc[k] += wy[j] * row[k];
+            }
+            for (uint32_t k = 0; k < c; ++k)
+                out[k] = acc[k];
+        }
+    }
+
+    template<typename T>
+    RAWEDIT_INLINE void SampleBicubicRowImpl(const SampleSource& s, const float* sx, const float* sy, float* dst, uint32_t n)
+    {
+        __RAWEDIT_SAMPLE_CHANNELS(SampleBicubicRows, s, sx, sy, dst, n)
+    }
+    RAWEDIT_KERNEL(SampleBicubicRow)
+
+    // Per thread buffers of ResampleCPU: the source region of a tile, the
+    // source coordinates of an output row and its sampled pixels
+    struct ResampleScratch
+    {
+        std::vector<float> source, sx, sy, row;
+    };
+
+    // Fills output pixel (u, v) with the source sampled at 'toSource' *
+    // (u, v, 1) (projective: perspective is allowed). The output is
+    // processed by tiles: each tile maps its corners to find the source
+    // region it reads, converts that region only and samples it. With a
+    // region, only the tiles overlapping it are written.
+    template<typename T>
+    Error ResampleCPU(const CPUImage<T>* input, CPUImage<T>* output, const Mat3& toSource, uint32_t width, uint32_t height, Interpolation method, Rect region = {})
+    {
+        const uint32_t c = input->channels;
+        if (c == 0 || c > 16)
+            return Error("Resample: unsupported channel count");
+        if (width == 0 || height == 0)
+            return Error("Resample: empty output");
+
+        if (region.Empty())
+        {
+            region = Rect{ 0, 0, width, height };
+            output->Resize(width, height, c);
+        }
+        else if (output->width != width || output->height != height || output->channels != c)
+        {
+            return Error("Resample: partial update of an output of another size");
+        }
+
+        static const auto mapRow   = RAWEDIT_SELECT_KERNEL(MapRow, float);
+        static const auto nearest  = RAWEDIT_SELECT_KERNEL(SampleNearestRow, float);
+        static const auto bilinear = RAWEDIT_SELECT_KERNEL(SampleBilinearRow, float);
+        static const auto bicubic  = RAWEDIT_SELECT_KERNEL(SampleBicubicRow, float);
+        const auto sample = method == Interpolation::Nearest ? nearest : method == Interpolation::Bilinear ? bilinear : bicubic;
+        const int32_t margin = method == Interpolation::Bicubic ? 3 : 2;
+
+        ForEachTile<ResampleScratch>(AlignToTiles(region, RESAMPLE_TILE, Rect{ 0, 0, width, height }), RESAMPLE_TILE, [&](ResampleScratch& scratch, const Rect& r, ImageView<T> dst) {
+            auto& [source, sx, sy, row] = scratch;
+            sx.resize(RESAMPLE_TILE);
+            sy.resize(RESAMPLE_TILE);
+            row.resize((size_t)RESAMPLE_TILE * c);
+
+
+            // Source bounds of the tile, from its corners (lines stay
+            // lines). Corners behind the projection read everything.
+            float x0 = INFINITY, y0 = INFINITY, x1 = -INFINITY, y1 = -INFINITY;
+            bool behind = false;
+            for (const auto& [u, v] : { std::pair{ r.x, r.y }, std::pair{ r.Right(), r.y }, std::pair{ r.x, r.Bottom() }, std::pair{ r.Right(), r.Bottom() } })
+            {
+                const auto p = MapPoint(toSource, (float)u, (float)v);
+                behind = behind || p[2] <= 0.f;
+                x0 = std::min(x0, p[0] / p[2]); x1 = std::max(x1, p[0] / p[2]);
+                y0 = std::min(y0, p[1] / p[2]); y1 = std::max(y1, p[1] / p[2]);
+            }
+            int64_t bx0 = 0, by0 = 0, bx1 = input->width, by1 = input->height;
+            if (!behind)
+            {
+                bx0 = std::max<int64_t>(0, (int64_t)std::floor(x0) - margin);
+                by0 = std::max<int64_t>(0, (int64_t)std::floor(y0) - margin);
+                bx1 = std::min<int64_t>(input->width,  (int64_t)std::ceil(x1) + margin);
+                by1 = std::min<int64_t>(input->height, (int64_t)std::ceil(y1) + margin);
+            }
+
+            if (bx1 <= bx0 || by1 <= by0)
+            {
+                // Entirely outside of the source
+                for (uint32_t v = r.y; v < r.Bottom(); ++v)
+                    std::fill_n(dst.At(r.x, v), (size_t)r.width * c, T{});
+                return;
+            }
+
+            const uint32_t bw = bx1 - bx0, bh = by1 - by0;
+            source.resize((size_t)bw * bh * c);
+            for (uint32_t y = 0; y < bh; ++y)
+                ConvertSpan(input->GetDataPtr() + input->GetIndex(by0 + y, bx0), source.data() + (size_t)y * bw * c, (size_t)bw * c, 0, {});
+
+            // Mapping to the coordinates of the loaded region
+            Mat3 m = toSource;
+            for (uint32_t k = 0; k < 3; ++k)
+            {
+                m[k]     -= bx0 * m[6 + k];
+                m[3 + k] -= by0 * m[6 + k];
+            }
+            const SampleSource s{ source.data(), bw, bh, c,
+                -0.5f - bx0, -0.5f - by0, input->width - 0.5f - bx0, input->height - 0.5f - by0 };
+
+            for (uint32_t v = r.y; v < r.Bottom(); ++v)
+            {
+                mapRow(m.data(), (float)r.x, (float)v, sx.data(), sy.data(), r.width);
+                sample(s, sx.data(), sy.data(), row.data(), r.width);
+                ConvertSpan(row.data(), dst.At(r.x, v), (size_t)r.width * c, 0, {});
+            }
+        }, output);
+        return Ok();
+    }
+};
@@ -0,0 +1,272 @@
+#pragma once
+
+#include <vector>
+#include "image/colorspace.h"
+#include "../base/algorithm.h"
+#include "../base/pointop.h"
+#include "lut3d.h"
+
+namespace RawEdit
+{
+    // Transfer functions are tabulated on [0, 1] and linearly interpolated
+    constexpr uint32_t TRANSFER_LUT_SIZE = 1 << 14;
+    // Pixels processed per step, planes of that size stay in L1
+    constexpr uint32_t COLOR_BLOCK = 320;
+
+    inline std::vector<float> MakeTransferLUT(TransferFunction t, bool encode)
+    {
+        std::vector<float> lut(TRANSFER_LUT_SIZE + 1);
+        for (uint32_t i = 0; i <= TRANSFER_LUT_SIZE; ++i)
+        {
+            const float v = i / (float)TRANSFER_LUT_SIZE;
+            lut[i] = encode ? EncodeTransfer(t, v) : DecodeTransfer(t, v);
+        }
+        return lut;
+    }
+
+    template<typename T>
+    RAWEDIT_INLINE void TransferRowImpl(float* v, size_t n, const float* lut)
+    {
+        for (size_t k = 0; k < n; ++k)
+        {
+            const float x = std::clamp(v[k], 0.f, 1.f) * TRANSFER_LUT_SIZE;
+            const int32_t i = std::min((int32_t)x, (int32_t)TRANSFER_LUT_SIZE - 1);
+            const float f = x - i;
+            v[k] = lut[i] + f * (lut[i + 1] - lut[i]);
+        }
+    }
+    RAWEDIT_KERNEL(TransferRow)
+
+    #if RAWEDIT_X86
+        RAWEDIT_TARGET("avx2,fma") inline void TransferRowAVX2(float* v, size_t n, const float* lut)
+        {
+            const __m256 zero = _mm256_setzero_ps();
+            const __m256 one  = _mm256_set1_ps(1.f);
+            const __m256 size = _mm256_set1_ps((float)TRANSFER_LUT_SIZE);
+            const __m256i last = _mm256_set1_epi32(TRANSFER_LUT_SIZE - 1);
+
+            size_t k = 0;
+            for (; k + 8 <= n; k += 8)
+            {
+                const __m256 x = _mm256_mul_ps(_mm256_min_ps(_mm256_max_ps(_mm256_loadu_ps(v + k), zero), one), size);
+                const __m256i i = _mm256_min_epi32(_mm256_cvttps_epi32(x), last);
+                const __m256 f = _mm256_sub_ps(x, _mm256_cvtepi32_ps(i));
+                const __m256 a = _mm256_i32gather_ps(lut, i, 4);
+                const __m256 b = _mm256_i32gather_ps(lut + 1, i, 4);
+                _mm256_storeu_ps(v + k, _mm256_fmadd_ps(f, _mm256_sub_ps(b, a), a));
+            }
+            TransferRowImpl<float>(v + k, n - k, lut);
+        }
+    #endif
+
+    template<typename T>
+    RAWEDIT_INLINE void MatrixRowImpl(float* r, float* g, float* b, size_t n, const float* m)
+    {
+        for (size_t k = 0; k < n; ++k)
+        {
+            const float x = r[k], y = g[k], z = b[k];
+            r[k] = m[0] * x + m[1] * y + m[2] * z;
+            g[k] = m[3] * x + m[4] * y + m[5] * z;
+            b[k] = m[6] * x + m[7] * y + m[8] * z;
+        }
+    }
+    RAWEDIT_KERNEL(MatrixRow)
+
+    // Everything needed to convert pixels, built once per parameter change:
+    // decode the input transfer, change primaries, encode the output
+    // transfer, then apply the creative LUT (on encoded values)
+    struct ColorPlan
+    {
+        std::vector<float> decode;
+        Mat3 matrix = IDENTITY3;
+        bool identity = true;
+        std::vector<float> encode;
+        const Lut3D* lut = nullptr;
+
+        bool Empty() const { return decode.empty() && identity && encode.empty() && lut == nullptr; }
+    };
+
+    // Pixels go through the plan by blocks: deinterleaved to planes (the
+    // kernels are then straight loops), processed and interleaved back.
+    // Channels past the third (alpha) are left untouched.
+    template<typename T>
+    Error ColorCPU(const CPUImage<T>* input, CPUImage<T>* output, const ColorPlan& plan)
+    {
+        const uint32_t c = input->channels;
+        if (c != 3 && c != 4)
+            return Error("ColorTransform: expected a RGB(A) image");
+
+        output->Resize(input->width, input->height, c);
+        const size_t rowSize = (size_t)input->width * c;
+        if (plan.Empty())
+        {
+            ConvertBuffer(input->GetDataPtr(), output->GetDataPtr(), rowSize * input->height);
+            return Ok();
+        }
+
+        static const auto transfer    = RAWEDIT_SELECT_KERNEL(TransferRow, float);
+        static const auto matrix      = RAWEDIT_SELECT_KERNEL(MatrixRow, float);
+        static const auto tetrahedral = RAWEDIT_SELECT_KERNEL(TetrahedralRow, float);
+        #if RAWEDIT_X86
+            const bool gather = ActiveISA() >= ISA::AVX2;
+            const auto transferRow    = gather ? TransferRowAVX2    : transfer;
+            const auto tetrahedralRow = gather ? TetrahedralRowAVX2 : tetrahedral;
+        #else
+            const auto transferRow    = transfer;
+            const auto tetrahedralRow = tetrahedral;
+        #endif
+
+        float lutScale[3], lutOffset[3];
+        if (plan.lut != nullptr)
+        {
+            for (uint32_t k = 0; k < 3; ++k)
+            {
+                const float range = std::max(plan.lut->domainMax[k] - plan.lut->domainMin[k], 1e-6f);
+                lutScale[k]  = (plan.lut->size - 1) / range;
+                lutOffset[k] = -plan.lut->domainMin[k] * lutScale[k];
+            }
+        }
+
+        auto process = [&](const float* src, float* dst, size_t n) {
+            alignas(64) float planes[3][COLOR_BLOCK];
+            const size_t pixels = n / c;
+
+            for (size_t start = 0; start < pixels; start += COLOR_BLOCK)
+            {
+                const size_t count = std::min<size_t>(COLOR_BLOCK, pixels - start);
+                const float* in = src + start * c;
+                float* out = dst + start * c;
+
+                for (size_t k = 0; k < count; ++k)
+                {
+                    planes[0][k] = in[k * c];
+                    planes[1][k] = in[k * c + 1];
+                    planes[2][k] = in[k * c + 2];
+                }
+
+                if (!plan.decode.empty())
+                    for (uint32_t p = 0; p < 3; ++p)
+                        transferRow(planes[p], count, plan.decode.data());
+                if (!plan.identity)
+                    matrix(planes[0], planes[1], planes[2], count, plan.matrix.data());
+                if (!plan.encode.empty())
+                    for (uint32_t p = 0; p < 3; ++p)
+                        transferRow(planes[p], count, plan.encode.data());
+                if (plan.lut != nullptr)
+                    tetrahedralRow(planes[0], planes[1], planes[2], count, plan.lut->data.data(), plan.lut->size, lutScale, lutOffset);
+
+                for (size_t k = 0; k < count; ++k)
+                {
+                    out[k * c]     = planes[0][k];
+                    out[k * c + 1] = planes[1][k];
+                    out[k * c + 2] = planes[2][k];
+                    if (c == 4) out[k * c + 3] = in[k * c + 3];
+                }
+            }
+        };
+
+        ForEachRow([&](uint32_t, std::span<const T> src, std::span<T> dst) {
+            ProcessAsFloat(src.data(), dst.data(), src.size(), process);
+        }, input, output);
+        return Ok();
+    }
+
+    // Converts the image from its color space (MetaData::colorSpace, camera
+    // RGB for raw files) to 'space' and optionally applies a .cube 3D LUT.
+    // Tables are only rebuilt when the params or the input space change.
+    class ColorTransform : public Algorithm
+    {
+    public:
+        ColorTransform() : Algorithm("ColorTransform")
+        {
+            inputs["space"] = EnumType({"sRGB", "Linear sRGB", "Adobe RGB", "ProPhoto RGB", "Rec. 2020", "Linear Rec. 2020"}, 0);
+            inputs["lut"]   = std::string("");
+
+            for (auto& it : inputs)
+                it.second.multiMask = false;
+        }
+
+        uint32_t Halo() const override { return 0; }
+
+        Error Run() override
+        {
+            Error err;
+            DISPATCH_IMAGE_CALL(inputImage, {
+                auto in = inputImage.get();
+                auto out = outputImage.get();
+
+                err = Run(reinterpret_cast<ImagePtr>(in), reinterpret_cast<ImagePtr>(out));
+            });
+            return err;
+        }
+
+    private:
+        Error Prepare(const MetaData& metadata)
+        {
+            const std::string& target = inputs["space"].AsEnum().value;
+            const std::string& lutPath = inputs["lut"].AsString();
+
+            if (lutPath != cachedLutPath)
+            {
+                // A failed load is retried (and reported) on every run
+                lut = Lut3D{};
+                cachedLutPath.clear();
+                if (!lutPath.empty())
+                {
+                    auto loaded = LoadCubeLUT(lutPath);
+                    if (!loaded) return loaded.error();
+                    lut = std::move(*loaded);
+                }
+                cachedLutPath = lutPath;
+            }
+            plan.lut = lut.Empty() ? nullptr : &lut;
+
+            if (target == cachedTarget && metadata.colorSpace == cachedSource && metadata.cameraMatrix == cachedCamera)
+                return Ok();
+
+            const ColorSpace* to = FindColorSpace(target);
+            const bool camera = metadata.colorSpace == CAMERA_SPACE;
+            const ColorSpace* from = camera ? nullptr : FindColorSpace(metadata.colorSpace);
+            if (to == nullptr || (!camera && from == nullptr))
+                return Failed("ColorTransform: unknown color space '{}'", to == nullptr ? target : metadata.colorSpace).error();
+
+            const bool sameSpace = !camera && from->transfer == to->transfer && from->toXYZ == to->toXYZ;
+            plan.decode = sameSpace || camera || from->transfer == TransferFunction::Linear ? std::vector<float>() : MakeTransferLUT(from->transfer, false);
+            plan.encode = sameSpace || to->transfer == TransferFunction::Linear ? std::vector<float>() : MakeTransferLUT(to->transfer, true);
+
+            plan.matrix = Multiply(Inverse(to->toXYZ), camera ? metadata.cameraMatrix : from->toXYZ);
+            plan.identity = true;
+            for (uint32_t k = 0; k < 9; ++k)
+                plan.identity = plan.identity && std::abs(plan.matrix[k] - IDENTITY3[k]) < 1e-5f;
+
+            cachedTarget = target;
+            cachedSource = metadata.colorSpace;
+            cachedCamera = metadata.cameraMatrix;
+            return Ok();
+        }
+
+        template<typename T>
+        Error Run(CPUImage<T>* input, CPUImage<T>* output)
+        {
+            if (Error err = Prepare(input->metadata); !err.empty())
+                return err;
+
+            output->metadata.colorSpace   = cachedTarget;
+            output->metadata.cameraMatrix = IDENTITY3;
+            return ColorCPU(input, output, plan);
+        }
+
+        template<typename T>
+        Error Run(T i, T o)
+        {
+            return Error("Run method not implemented for ColorTransform");
+        }
+
+        ColorPlan plan;
+        Lut3D lut;
+        std::string cachedLutPath;
+        std::string cachedTarget;
+        std::string cachedSource;
+        Mat3 cachedCamera = IDENTITY3;
+    };
+};
@@ -0,0 +1,192 @@
+#pragma once
+
+#include <array>
+#include <algorithm>
+#include <vector>
+#include <string>
+#include <fstream>
+#include <sstream>
+#include "utils/error.h"
+#include "image/convert.h"
+
+namespace RawEdit
+{
+    // Cube of size^3 RGB entries, red varying fastest (.cube order)
+    struct Lut3D
+    {
+        std::string title;
+        uint32_t size = 0;
+        std::array<float, 3> domainMin = { 0.f, 0.f, 0.f };
+        std::array<float, 3> domainMax = { 1.f, 1.f, 1.f };
+        std::vector<float> data;
+
+        bool Empty() const { return size == 0; }
+    };
+
+    // Adobe / Resolve .cube format. Only 3D tables are supported.
+    inline Failable<Lut3D> LoadCubeLUT(const std::string& path)
+    {
+        std::ifstream file(path);
+        if (!file)
+            return Failed("[Cube LUT] - Can not open '{}'", path);
+
+        Lut3D lut;
+        std::string line;
+        size_t expected = 0;
+        while (std::getline(file, line))
+        {
+            if (line.empty() || line[0] == '#') continue;
+
+            std::istringstream ss(line);
+            std::string key;
+            ss >> key;
+            if (key.empty()) continue;
+
+            if (key == "TITLE")
+            {
+                const size_t start = line.find('"');
+                const size_t end   = line.rfind('"');
+                if (start != std::string::npos && end > start)
+                    lut.title = line.substr(start + 1, end - start - 1);
+            }
+            else if (key == "LUT_3D_SIZE")
+            {
+                ss >> lut.size;
+                if (lut.size < 2 || lut.size > 256)
+                    return Failed("[Cube LUT] - Invalid size {} in '{}'", lut.size, path);
+                expected = (size_t)lut.size * lut.size * lut.size * 3;
+                lut.data.reserve(expected);
+            }
+            else if (key == "LUT_1D_SIZE")
+            {
+                return Failed("[Cube LUT] - '{}' is a 1D LUT, only 3D LUTs are supported", path);
+            }
+            else if (key == "DOMAIN_MIN")
+            {
+                ss >> lut.domainMin[0] >> lut.domainMin[1] >> lut.domainMin[2];
+            }
+            else if (key == "DOMAIN_MAX")
+            {
+                ss >> lut.domainMax[0] >> lut.domainMax[1] >> lut.domainMax[2];
+            }
+            else
+            {
+                // Data line, the key is the red value
+                std::istringstream values(line);
+                float r, g, b;
+                if (!(values >> r >> g >> b))
+                    continue;
+                lut.data.push_back(r);
+                lut.data.push_back(g);
+                lut.data.push_back(b);
+            }
+        }
+
+        if (lut.size == 0 || lut.data.size() != expected)
+            return Failed("[Cube LUT] - '{}' has {} entries, {} expected", path, lut.data.size() / 3, expected / 3);
+        return lut;
+    }
+
+    // Tetrahedral interpolation of planar r, g, b values in place. The cube
+    // cell is split in 6 tetrahedra along its diagonal, the one holding
+    // the point is found from the order of the fractional coordinates:
+    // out = (1 - a) c000 + (a - b) cA + (b - c) cAB + c c111
+    // with a >= b >= c the sorted fractions and A, B their axes.
+    template<typename T>
+    RAWEDIT_INLINE void TetrahedralRowImpl(float* r, float* g, float* b, size_t n, const float* lut, uint32_t size, const float* scale, const float* offset)
+    {
+        const int32_t sr = 3, sg = 3 * size, sb = 3 * size * size;
+        const float last = (float)(size - 1);
+
+        for (size_t k = 0; k < n; ++k)
+        {
+            const float x = std::clamp(r[k] * scale[0] + offset[0], 0.f, last);
+            const float y = std::clamp(g[k] * scale[1] + offset[1], 0.f, last);
+            const float z = std::clamp(b[k] * scale[2] + offset[2], 0.f, last);
+            const int32_t ix = std::min((int32_t)x, (int32_t)size - 2);
+            const int32_t iy = std::min((int32_t)y, (int32_t)size - 2);
+            const int32_t iz = std::min((int32_t)z, (int32_t)size - 2);
+            const float fx = x - ix, fy = y - iy, fz = z - iz;
+
+            const bool xy = fx >= fy, yz = fy >= fz, xz = fx >= fz;
+            const float a  = xy ? (xz ? fx : fz) : (yz ? fy : fz);
+            const float c  = xy ? (yz ? fz : fy) : (xz ? fz : fx);
+            const float bb = fx + fy + fz - a - c;
+            const int32_t oa  = xy ? (xz ? sr : sb) : (yz ? sg : sb);
+            const int32_t oab = sr + sg + sb - (xy ? (yz ? sb : sg) : (xz ? sb : sr));
+
+            const int32_t base = ix * sr + iy * sg + iz * sb;
+            const float w0 = 1.f - a, w1 = a - bb, w2 = bb - c, w3 = c;
+            const float* c000 = lut + base;
+            const float* cA   = lut + base + oa;
+            const float* cAB  = lut + base + oab;
+            const float* c111 = lut + base + sr + sg + sb;
+
+            r[k] = w0 * c000[0] + w1 * cA[0] + w2 * cAB[0] + w3 * c111[0];
+            g[k] = w0 * c000[1] + w1 * cA[1] + w2 * cAB[1] + w3 * c111[1];
+            b[k] = w0 * c000[2] + w1 * cA[2] + w2 * cAB[2] + w3 * c111[2];
+        }
+    }
+    RAWEDIT_KERNEL(TetrahedralRow)
+
+    #if RAWEDIT_X86
+        // Compilers do not emit gathers for the table lookups (disabled by
+        // their tuning), explicit AVX2 version of the kernel above
+        RAWEDIT_TARGET("avx2,fma") inline void TetrahedralRowAVX2(float* r, float* g, float* b, size_t n, const float* lut, uint32_t size, const float* scale, const float* offset)
+        {
+            const __m256 zero = _mm256_setzero_ps();
+            const __m256 one  = _mm256_set1_ps(1.f);
+            const __m256 last = _mm256_set1_ps((float)(size - 1));
+            const __m256i maxIdx = _mm256_set1_epi32(size - 2);
+            const __m256i sr = _mm256_set1_epi32(3), sg = _mm256_set1_epi32(3 * size), sb = _mm256_set1_epi32(3 * size * size);
+            const __m256i diag = _mm256_add_epi32(sr, _mm256_add_epi32(sg, sb));
+
+            size_t k = 0;
+            for (; k + 8 <= n; k += 8)
+            {
+                __m256 f[3];
+                __m256i idx[3];
+                const float* planes[3] = { r + k, g + k, b + k };
+                for (uint32_t p = 0; p < 3; ++p)
+                {
+                    __m256 x = _mm256_fmadd_ps(_mm256_loadu_ps(planes[p]), _mm256_set1_ps(scale[p]), _mm256_set1_ps(offset[p]));
+                    x = _mm256_min_ps(_mm256_max_ps(x, zero), last);
+                    idx[p] = _mm256_min_epi32(_mm256_cvttps_epi32(x), maxIdx);
+                    f[p] = _mm256_sub_ps(x, _mm256_cvtepi32_ps(idx[p]));
+                }
+                const __m256 fx = f[0], fy = f[1], fz = f[2];
+
+                const __m256 xy = _mm256_cmp_ps(fx, fy, _CMP_GE_OQ);
+                const __m256 yz = _mm256_cmp_ps(fy, fz, _CMP_GE_OQ);
+                const __m256 xz = _mm256_cmp_ps(fx, fz, _CMP_GE_OQ);
+
+                const __m256 a = _mm256_blendv_ps(_mm256_blendv_ps(fz, fy, yz), _mm256_blendv_ps(fz, fx, xz), xy);
+                const __m256 c = _mm256_blendv_ps(_mm256_blendv_ps(fx, fz, xz), _mm256_blendv_ps(fy, fz, yz), xy);
+                const __m256 m = _mm256_sub_ps(_mm256_add_ps(fx, _mm256_add_ps(fy, fz)), _mm256_add_ps(a, c));
+                // Integer selects through float blends of the same masks
+                #define __RAWEDIT_SELECT_EPI32(a, b, mask) _mm256_castps_si256(_mm256_blendv_ps(_mm256_castsi256_ps(a), _mm256_castsi256_ps(b), mask))
+                const __m256i oa  = __RAWEDIT_SELECT_EPI32(__RAWEDIT_SELECT_EPI32(sb, sg, yz), __RAWEDIT_SELECT_EPI32(sb, sr, xz), xy);
+                const __m256i oab = _mm256_sub_epi32(diag, __RAWEDIT_SELECT_EPI32(__RAWEDIT_SELECT_EPI32(sr, sb, xz), __RAWEDIT_SELECT_EPI32(sg, sb, yz), xy));
+                #undef __RAWEDIT_SELECT_EPI32
+
+                const __m256i base = _mm256_add_epi32(_mm256_mullo_epi32(idx[0], sr), _mm256_add_epi32(_mm256_mullo_epi32(idx[1], sg), _mm256_mullo_epi32(idx[2], sb)));
+                const __m256i iA   = _mm256_add_epi32(base, oa);
+                const __m256i iAB  = _mm256_add_epi32(base, oab);
+                const __m256i i111 = _mm256_add_epi32(base, diag);
+                const __m256 w0 = _mm256_sub_ps(one, a), w1 = _mm256_sub_ps(a, m), w2 = _mm256_sub_ps(m, c);
+
+                float* outputs[3] = { r + k, g + k, b + k };
+                for (uint32_t p = 0; p < 3; ++p)
+                {
+                    const float* t = lut + p;
+                    __m256 v = _mm256_mul_ps(w0, _mm256_i32gather_ps(t, base, 4));
+                    v = _mm256_fmadd_ps(w1, _mm256_i32gather_ps(t, iA, 4), v);
+                    v = _mm256_fmadd_ps(w2, _mm256_i32gather_ps(t, iAB, 4), v);
+                    v = _mm256_fmadd_ps(c,  _mm256_i32gather_ps(t, i111, 4), v);
+                    _mm256_storeu_ps(outputs[p], v);
+                }
+            }
+            TetrahedralRowImpl<float>(r + k, g + k, b + k, n - k, lut, size, scale, offset);
+        }
+    #endif
+}
@@ -0,0 +1,252 @@
+#pragma once
+
+#include <cmath>
+#include <vector>
+#include "guided.h"
+
+namespace RawEdit
+{
+    // Empty cells around the grid, the blur and the slicing need no
+    // bound checks
+    constexpr uint32_t GRID_PADDING = 2;
+
+    // Bilateral grid (Chen, Paris, Durand): pixels are accumulated in a
+    // coarse 3D grid (x, y, guide value) as homogeneous (sum of colors,
+    // count) cells, the grid is blurred and each pixel reads back the
+    // trilinear interpolation at its own (x, y, guide). Pixels only mix
+    // with pixels of close guide values, hence the edges are kept.
+    class BilateralGridCPU
+    {
+    public:
+        // 'spatial' is the cell size in pixels, 'range' in guide values
+        void Reset(uint32_t width, uint32_t height, uint32_t channels, float spatial, float range)
+        {
+            f = std::min(channels, 3u);
+            stride = f + 1;
+            cellSize = std::max(spatial, 1.f);
+            rangeSize = std::clamp(range, 1e-3f, 1.f);
+            gw = (uint32_t)std::ceil(width / cellSize) + 1 + 2 * GRID_PADDING;
+            gh = (uint32_t)std::ceil(height / cellSize) + 1 + 2 * GRID_PADDING;
+            gd = (uint32_t)std::ceil(1.f / rangeSize) + 1 + 2 * GRID_PADDING;
+            cells.assign((size_t)gw * gh * gd * stride, 0.f);
+            tmp.resize(cells.size());
+        }
+
+        // Accumulates 'src', which can be smaller than the image the grid
+        // was made for (preview); its pixels are scaled to the grid
+        template<typename T>
+        void Splat(const CPUImage<T>* src, float scale)
+        {
+            const uint32_t c = src->channels;
+            const float toGrid = 1.f / (cellSize * scale);
+
+            // Each grid row is filled by one thread from the rows falling in it
+            #pragma omp parallel
+            {
+                std::vector<float> row((size_t)src->width * c);
+
+                #pragma omp for schedule(dynamic)
+                for (int64_t gy = 0; gy < gh - 2 * GRID_PADDING; ++gy)
+                {
+                    const int64_t y0 = std::max<int64_t>(0, (int64_t)std::ceil((gy - 0.5f) / toGrid));
+                    const int64_t y1 = std::min<int64_t>(src->height, (int64_t)std::ceil((gy + 0.5f) / toGrid));
+                    for (int64_t y = y0; y < y1; ++y)
+                    {
+                        ConvertSpan(src->GetDataPtr() + src->GetIndex(y, 0), row.data(), row.size(), 0, {});
+                        for (uint32_t x = 0; x < src->width; ++x)
+                        {
+                            const float* px = row.data() + x * c;
+                            const uint32_t cx = (uint32_t)(x * toGrid + 0.5f) + GRID_PADDING;
+                            const uint32_t cz = (uint32_t)(std::clamp(GuideValue(px, c), 0.f, 1.f) / rangeSize + 0.5f) + GRID_PADDING;
+                            float* cell = Cell(cx, gy + GRID_PADDING, cz);
+                            for (uint32_t k = 0; k < f; ++k)
+                                cell[k] += px[k];
+                            cell[f] += 1.f;
+                        }
+                    }
+                }
+            }
+        }
+
+        // [1 4 6 4 1] / 16 along each axis, about a Gaussian of one cell
+        void Blur()
+        {
+            const size_t sx = stride, sy = (size_t)gw * stride, sz = (size_t)gw * gh * stride;
+            BlurAxis(cells, tmp, sz, gd);
+            BlurAxis(tmp, cells, sy, gh);
+            BlurAxis(cells, tmp, sx, gw);
+            std::swap(cells, tmp);
+        }
+
+        // Reads the filtered colors back at full resolution, guided by the
+        // input pixels. Other channels are copied.
+        template<typename T>
+        void Slice(const CPUImage<T>* input, CPUImage<T>* output, const Rect& region) const
+        {
+            const uint32_t c = input->channels;
+            const float toGrid = 1.f / cellSize;
+            const size_t planeSize = (size_t)gw * gd * stride;
+
+            ForEachRow<SliceScratch>(region, [&](SliceScratch& scratch, uint32_t y, std::span<const T> src, std::span<T> dst) {
+                std::vector<float>& row = scratch.row;
+                std::vector<float>& plane = scratch.plane;
+                row.resize(src.size());
+                plane.resize(planeSize);
+
+                const float py = y * toGrid + GRID_PADDING;
+                const uint32_t iy = (uint32_t)py;
+                const float fy = py - iy;
+                for (uint32_t z = 0; z < gd; ++z)
+                {
+                    for (uint32_t x = 0; x < gw; ++x)
+                    {
+                        const float* a = Cell(x, iy, z);
+                        const float* b = Cell(x, iy + 1, z);
+                        float* p = plane.data() + ((size_t)z * gw + x) * stride;
+                        for (uint32_t k = 0; k < stride; ++k)
+                            p[k] = a[k] + fy * (b[k] - a[k]);
+                    }
+                }
+
+                ConvertSpan(src.data(), row.data(), row.size(), 0, {});
+                for (uint32_t x = 0; x < region.width; ++x)
+                {
+                    float* px = row.data() + x * c;
+                    const float gx = (region.x + x) * toGrid + GRID_PADDING;
+                    const float gz = std::clamp(GuideValue(px, c), 0.f, 1.f) / rangeSize + GRID_PADDING;
+                    const uint32_t ix = (uint32_t)gx, iz = (uint32_t)gz;
+                    const float fx = gx - ix, fz = gz - iz;
+
+                    const float* c00 = plane.data() + ((size_t)iz * gw + ix) * stride;
+                    const float* c01 = c00 + stride;
+                    const float* c10 = c00 + (size_t)gw * stride;
+                    const float* c11 = c10 + stride;
+
+                    float v[4];
+                    for (uint32_t k = 0; k < stride; ++k)
+                    {
+                        const float top    = c00[k] + fx * (c01[k] - c00[k]);
+                        const float bottom = c10[k] + fx * (c11[k] - c10[k]);
+                        v[k] = top + fz * (bottom - top);
+                    }
+                    if (v[f] > 1e-6f)
+                        for (uint32_t k = 0; k < f; ++k)
+                            px[k] = v[k] / v[f];
+                }
+                ConvertSpan(row.data(), dst.data(), row.size(), 0, {});
+            }, input, output);
+        }
+
+    private:
+        // Per thread rows of Slice: the pixels and the (x, z) plane
+        // interpolated between the two grid rows
+        struct SliceScratch
+        {
+            std::vector<float> row, plane;
+        };
+
+        float* Cell(uint32_t x, uint32_t y, uint32_t z) { return cells.data() + (((size_t)z * gh + y) * gw + x) * stride; }
+        const float* Cell(uint32_t x, uint32_t y, uint32_t z) const { return cells.data() + (((size_t)z * gh + y) * gw + x) * stride; }
+
+        // 'step' apart values along an axis of 'count' cells; the padding
+        // cells of that axis stay as they are (empty). Threads get runs of
+        // the 'step' contiguous values as well as the outer blocks: along z
+        // there is a single block.
+        static void BlurAxis(const std::vector<float>& src, std::vector<float>& dst, size_t step, uint32_t count)
+        {
+            constexpr size_t RUN = 4096;
+            const size_t span = step * count;
+            const size_t blocks = src.size() / span;
+            const size_t run = std::min(step, RUN);
+            const size_t runs = (step + run - 1) / run;
+
+            #pragma omp parallel for
+            for (int64_t idx = 0; idx < (int64_t)(blocks * runs); ++idx)
+            {
+                const size_t k0 = (idx % runs) * run;
+                const size_t k1 = std::min(k0 + run, step);
+                const float* s = src.data() + (idx / runs) * span;
+                float* d = dst.data() + (idx / runs) * span;
+                for (uint32_t i : { 0u, 1u, count - 2, count - 1 })
+                    std::fill(d + i * step + k0, d + i * step + k1, 0.f);
+                for (uint32_t i = 2; i < count - 2; ++i)
+                {
+                    const float* c = s + i * step;
+                    float* o = d + i * step;
+                    for (size_t k = k0; k < k1; ++k)
+                        o[k] = (c[k - 2 * step] + c[k + 2 * step] + 4.f * (c[k - step] + c[k + step]) + 6.f * c[k]) * (1.f / 16.f);
+                }
+            }
+        }
+
+        uint32_t f = 3, stride = 4;
+        float cellSize = 16.f, rangeSize = 0.1f;
+        uint32_t gw = 0, gh = 0, gd = 0;
+        std::vector<float> cells, tmp;
+    };
+
+    // Edge-preserving smoothing with a bilateral grid. 'spatial' is the
+    // spatial sigma in pixels, 'range' the sigma of the luminance.
+    // 'preview' > 0 splats a 2^preview times smaller copy, slicing stays at
+    // full resolution with the full resolution guide.
+    class BilateralGrid : public RegionAlgorithm
+    {
+    public:
+        BilateralGrid() : RegionAlgorithm("BilateralGrid")
+        {
+            inputs["spatial"] = 16.f;
+            inputs["range"]   = 0.1f;
+            inputs["preview"] = 0;
+
+            for (auto& it : inputs)
+                it.second.multiMask = false;
+        }
+
+        Error Run() override
+        {
+            Error err;
+            DISPATCH_IMAGE_CALL(inputImage, {
+                auto in = inputImage.get();
+                auto out = outputImage.get();
+
+                err = Run(reinterpret_cast<ImagePtr>(in), reinterpret_cast<ImagePtr>(out));
+            });
+            return err;
+        }
+
+    private:
+        template<typename T>
+        Error Run(CPUImage<T>* input, CPUImage<T>* output)
+        {
+            const uint32_t w = input->width, h = input->height, c = input->channels;
+            Rect r = region;
+            if (r.Empty())
+            {
+                r = Rect{ 0, 0, w, h };
+                output->Resize(w, h, c);
+            }
+            else if (output->width != w || output->height != h || output->channels != c)
+            {
+                return Error("BilateralGrid: partial update of an output of another size");
+            }
+            r = r.Intersect(Rect{ 0, 0, w, h });
+
+            grid.Reset(w, h, c, ToLevel(inputs["spatial"].AsFloat()), inputs["range"].AsFloat());
+
+            uint32_t level = PreviewAtLevel(inputs["preview"].AsInt());
+            const CPUImage<T>* src = level == 0 ? input : Downscaled<T>(level);
+            grid.Splat(src, (float)src->width / w);
+            grid.Blur();
+            grid.Slice(input, output, r);
+            return Ok();
+        }
+
+        template<typename T>
+        Error Run(T i, T o)
+        {
+            return Error("Run method not implemented for BilateralGrid");
+        }
+
+        BilateralGridCPU grid;
+    };
+};
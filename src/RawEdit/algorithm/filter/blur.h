@@ -0,0 +1,95 @@
+#pragma once
+
+#include "../base/regionalgorithm.h"
+#include "convolution.h"
+
+namespace RawEdit
+{
+    class GaussianBlur : public RegionAlgorithm
+    {
+    public:
+        GaussianBlur() : RegionAlgorithm("GaussianBlur")
+        {
+            inputs["sigma"] = 2.f;
+
+            for (auto& it : inputs)
+                it.second.multiMask = false;
+        }
+
+        uint32_t Halo() const override
+        {
+            const float sigma = ToLevel(GetInputs().at("sigma").AsFloat());
+            return sigma <= 0.f ? 0 : GaussianPlan(sigma).Halo();
+        }
+
+        Error Run() override
+        {
+            Error err;
+            DISPATCH_IMAGE_CALL(inputImage, {
+                auto in = inputImage.get();
+                auto out = outputImage.get();
+
+                err = Run(reinterpret_cast<ImagePtr>(in), reinterpret_cast<ImagePtr>(out));
+            });
+            return err;
+        }
+
+    private:
+        template<typename T>
+        Error Run(CPUImage<T>* input, CPUImage<T>* output)
+        {
+            const float sigma = ToLevel(inputs["sigma"].AsFloat());
+            if (sigma <= 0.f)
+                return TiledFilterCPU(input, output, 0, [](FilterScratch& s, const Rect&) { std::swap(s.input, s.work[0]); }, region);
+
+            const GaussianPlan plan(sigma);
+            return TiledFilterCPU(input, output, plan.Halo(), [&](FilterScratch& s, const Rect&) { plan.Apply(s); }, region);
+        }
+
+        template<typename T>
+        Error Run(T i, T o)
+        {
+            return Error("Run method not implemented for GaussianBlur");
+        }
+    };
+
+    class BoxBlur : public RegionAlgorithm
+    {
+    public:
+        BoxBlur() : RegionAlgorithm("BoxBlur")
+        {
+            inputs["radius"] = 2;
+
+            for (auto& it : inputs)
+                it.second.multiMask = false;
+        }
+
+        uint32_t Halo() const override { return RadiusAtLevel(GetInputs().at("radius").AsInt()); }
+
+        Error Run() override
+        {
+            Error err;
+            DISPATCH_IMAGE_CALL(inputImage, {
+                auto in = inputImage.get();
+                auto out = outputImage.get();
+
+                err = Run(reinterpret_cast<ImagePtr>(in), reinterpret_cast<ImagePtr>(out));
+            });
+            return err;
+        }
+
+    private:
+        template<typename T>
+        Error Run(CPUImage<T>* input, CPUImage<T>* output)
+        {
+            const uint32_t radius = RadiusAtLevel(inputs["radius"].AsInt());
+            return TiledFilterCPU(input, output, radius, [&](FilterScratch& s, const Rect&) { Box(s.input, s.work[1], s.work[0], radius); }, region);
+        }
+
+        template<typename T>
+        Error Run(T i, T o)
+        {
+            return Error("Run method not implemented for BoxBlur");
+        }
+    };
+};
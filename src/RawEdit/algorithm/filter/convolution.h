@@ -0,0 +1,280 @@
+#pragma once
+
+#include <array>
+#include <cmath>
+#include <vector>
+#include <algorithm>
+#include "image/image.h"
+#include "image/tile.h"
+#include "image/foreach.h"
+#include "utils/error.h"
+#include "utils/kernel.h"
+
+namespace RawEdit
+{
+    // Output tiles, halos are added around them
+    constexpr uint32_t FILTER_TILE = 256;
+    // Above this sigma Gaussians are approximated by 3 box filters,
+    // whose cost does not depend on the radius
+    constexpr float GAUSSIAN_DIRECT_MAX_SIGMA = 3.f;
+
+    // Interleaved float pixels of a tile and its halo
+    struct FilterBuffer
+    {
+        std::vector<float> data;
+        uint32_t width  = 0;
+        uint32_t height = 0;
+        uint32_t channels = 0;
+
+        void Resize(uint32_t w, uint32_t h, uint32_t c)
+        {
+            width = w;
+            height = h;
+            channels = c;
+            if (data.size() < (size_t)w * h * c)
+                data.resize((size_t)w * h * c);
+        }
+
+        size_t Stride() const { return (size_t)width * channels; }
+        float* Row(uint32_t y) { return data.data() + y * Stride(); }
+        const float* Row(uint32_t y) const { return data.data() + y * Stride(); }
+    };
+
+    // dst[i] = sum of w[t] * src[i + t * step], 'step' being the channel
+    // count for rows and the row length for columns
+    template<typename T>
+    RAWEDIT_INLINE void ConvolveSpanImpl(const float* src, float* dst, size_t n, const float* w, uint32_t taps, size_t step)
+    {
+        for (size_t i = 0; i < n; ++i)
+            dst[i] = w[0] * src[i];
+        for (uint32_t t = 1; t < taps; ++t)
+        {
+            const float* s = src + t * step;
+            const float wt = w[t];
+            for (size_t i = 0; i < n; ++i)
+                dst[i] += wt * s[i];
+        }
+    }
+    RAWEDIT_KERNEL(ConvolveSpan)
+
+    // Horizontal running sum over 2r + 1 pixels, per channel
+    template<typename T>
+    RAWEDIT_INLINE void BoxRowImpl(const float* src, float* dst, uint32_t width, uint32_t c, uint32_t r)
+    {
+        const float norm = 1.f / (2 * r + 1);
+        const uint32_t window = (2 * r + 1) * c;
+
+        float sum[16] = {};
+        for (uint32_t i = 0; i < window; ++i)
+            sum[i % c] += src[i];
+
+        const float* in  = src + window;
+        const float* out = src;
+        for (uint32_t x = 0; x + 1 < width; ++x)
+        {
+            for (uint32_t k = 0; k < c; ++k)
+            {
+                dst[x * c + k] = sum[k] * norm;
+                sum[k] += in[x * c + k] - out[x * c + k];
+            }
+        }
+        for (uint32_t k = 0; k < c; ++k)
+            dst[(width - 1) * c + k] = sum[k] * norm;
+    }
+    RAWEDIT_KERNEL(BoxRow)
+
+    // One step of the vertical running sum: the sum of the rows is
+    // written and updated with the next (incoming) and first (outgoing) row
+    template<typename T>
+    RAWEDIT_INLINE void BoxColumnStepImpl(float* sum, const float* incoming, const float* outgoing, float* dst, size_t n, float norm)
+    {
+        for (size_t i = 0; i < n; ++i)
+        {
+            dst[i] = sum[i] * norm;
+            sum[i] += incoming[i] - outgoing[i];
+        }
+    }
+    RAWEDIT_KERNEL(BoxColumnStep)
+
+    inline std::vector<float> GaussianKernel(float sigma)
+    {
+        const int32_t r = std::max(1, (int32_t)std::ceil(3.f * sigma));
+        std::vector<float> w(2 * r + 1);
+        float sum = 0.f;
+        for (int32_t i = -r; i <= r; ++i)
+            sum += w[i + r] = std::exp(-0.5f * i * i / (sigma * sigma));
+        for (auto& v : w)
+            v /= sum;
+        return w;
+    }
+
+    // Radii of 3 successive box filters with the variance of a Gaussian
+    inline std::array<uint32_t, 3> GaussianBoxRadii(float sigma)
+    {
+        constexpr int n = 3;
+        const float ideal = std::sqrt(12.f * sigma * sigma / n + 1.f);
+        int32_t wl = (int32_t)std::floor(ideal);
+        if (wl % 2 == 0) wl--;
+        const int32_t wu = wl + 2;
+        const int32_t m = (int32_t)std::round((12.f * sigma * sigma - n * wl * wl - 4.f * n * wl - 3.f * n) / (-4.f * wl - 4.f));
+
+        std::array<uint32_t, 3> radii;
+        for (int i = 0; i < n; ++i)
+            radii[i] = ((i < m ? wl : wu) - 1) / 2;
+        return radii;
+    }
+
+    // Separable convolution of 'src', the result is smaller by the kernel
+    // radius on each side
+    inline void Convolve(const FilterBuffer& src, FilterBuffer& tmp, FilterBuffer& dst, const std::vector<float>& w)
+    {
+        static const auto kernel = RAWEDIT_SELECT_KERNEL(ConvolveSpan, float);
+        const uint32_t taps = w.size();
+        const uint32_t r = taps / 2;
+        const uint32_t c = src.channels;
+
+        tmp.Resize(src.width - 2 * r, src.height, c);
+        for (uint32_t y = 0; y < src.height; ++y)
+            kernel(src.Row(y), tmp.Row(y), tmp.Stride(), w.data(), taps, c);
+
+        dst.Resize(tmp.width, src.height - 2 * r, c);
+        for (uint32_t y = 0; y < dst.height; ++y)
+            kernel(tmp.Row(y), dst.Row(y), dst.Stride(), w.data(), taps, tmp.Stride());
+    }
+
+    // Box filter of radius r, O(1) per pixel, same size reduction
+    inline void Box(const FilterBuffer& src, FilterBuffer& tmp, FilterBuffer& dst, uint32_t r)
+    {
+        static const auto row    = RAWEDIT_SELECT_KERNEL(BoxRow, float);
+        static const auto column = RAWEDIT_SELECT_KERNEL(BoxColumnStep, float);
+        const uint32_t c = src.channels;
+
+        tmp.Resize(src.width - 2 * r, src.height, c);
+        for (uint32_t y = 0; y < src.height; ++y)
+            row(src.Row(y), tmp.Row(y), tmp.width, c, r);
+
+        // The running sum is kept in the last (extra) row of dst
+        dst.Resize(tmp.width, src.height - 2 * r + 1, c);
+        dst.height--;
+        float* sum = dst.Row(dst.height);
+        std::fill(sum, sum + dst.Stride(), 0.f);
+        for (uint32_t y = 0; y < 2 * r + 1; ++y)
+            for (size_t i = 0; i < dst.Stride(); ++i)
+                sum[i] += tmp.Row(y)[i];
+
+        const float norm = 1.f / (2 * r + 1);
+        for (uint32_t y = 0; y < dst.height; ++y)
+        {
+            // The last step has no incoming row, the sum is not used anymore
+            const uint32_t in = std::min(y + 2 * r + 1, tmp.height - 1);
+            column(sum, tmp.Row(in), tmp.Row(y), dst.Row(y), dst.Stride(), norm);
+        }
+    }
+
+    // Per thread buffers of the tiled filters
+    struct FilterScratch
+    {
+        FilterBuffer input;
+        std::array<FilterBuffer, 3> work;
+    };
+
+    // Gaussian blur, direct for small sigmas and 3 boxes otherwise.
+    // Built once per sigma, shared by all tiles.
+    struct GaussianPlan
+    {
+        bool direct = true;
+        std::vector<float> weights;
+        std::array<uint32_t, 3> radii{};
+
+        explicit GaussianPlan(float sigma)
+        {
+            direct = sigma <= GAUSSIAN_DIRECT_MAX_SIGMA;
+            if (direct)
+                weights = GaussianKernel(sigma);
+            else
+                radii = GaussianBoxRadii(sigma);
+        }
+
+        // Pixels lost on each side
+        uint32_t Halo() const
+        {
+            return direct ? weights.size() / 2 : radii[0] + radii[1] + radii[2];
+        }
+
+        // Blurs scratch.input into scratch.work[0], the input is kept
+        void Apply(FilterScratch& s) const
+        {
+            if (direct)
+            {
+                Convolve(s.input, s.work[1], s.work[0], weights);
+                return;
+            }
+            Box(s.input,   s.work[1], s.work[0], radii[0]);
+            Box(s.work[0], s.work[1], s.work[2], radii[1]);
+            Box(s.work[2], s.work[1], s.work[0], radii[2]);
+        }
+    };
+
+    // Runs 'op(FilterScratch&, Rect)' on each tile of the image (or of the
+    // tiles overlapping 'region' only). Before the call, scratch.input holds
+    // the tile with 'halo' pixels around it (edges are replicated); op
+    // leaves the result, the size of the tile with 'outChannels' channels,
+    // in scratch.work[0].
+    template<typename T, typename U, typename Op>
+    Error TiledFilterCPU(const CPUImage<T>* input, CPUImage<U>* output, uint32_t outChannels, uint32_t halo, Op&& op, Rect region = {})
+    {
+        const uint32_t w = input->width;
+        const uint32_t h = input->height;
+        const uint32_t c = input->channels;
+        if (c == 0 || c > 16)
+            return Error("Filter: unsupported channel count");
+
+        if (region.Empty())
+        {
+            region = Rect{ 0, 0, w, h };
+            output->Resize(w, h, outChannels);
+        }
+        else if (output->width != w || output->height != h || output->channels != outChannels)
+        {
+            return Error("Filter: partial update of an output of another size");
+        }
+
+        // Tiles grow with large halos, which would otherwise cost more than the tiles
+        const uint32_t tileSize = std::max(FILTER_TILE, (2 * halo + 63) / 64 * 64);
+        const Rect tiles = AlignToTiles(region, tileSize, Rect{ 0, 0, w, h });
+
+        ForEachTileWithHalo<FilterScratch>(tiles, tileSize, halo, [&](FilterScratch& scratch, const Rect& r, ImageView<const T> source, ImageView<U> dst) {
+            FilterBuffer& in = scratch.input;
+            in.Resize(r.width + 2 * halo, r.height + 2 * halo, c);
+
+            // The view covers what is inside the image, the rest is replicated
+            const Rect& v = source.region;
+            const int64_t x0 = (int64_t)r.x - halo;
+            const int64_t first = v.x - x0, last = v.Right() - x0;
+            for (uint32_t y = 0; y < in.height; ++y)
+            {
+                const int64_t sy = std::clamp<int64_t>((int64_t)r.y - halo + y, v.y, v.Bottom() - 1);
+                float* row = in.Row(y);
+                ConvertSpan(source.Row(sy).data(), row + first * c, source.Row(sy).size(), 0, {});
+
+                for (int64_t x = 0; x < first; ++x)
+                    std::copy_n(row + first * c, c, row + x * c);
+                for (int64_t x = last; x < in.width; ++x)
+                    std::copy_n(row + (last - 1) * c, c, row + x * c);
+            }
+
+            op(scratch, r);
+
+            const FilterBuffer& result = scratch.work[0];
+            for (uint32_t y = 0; y < r.height; ++y)
+                ConvertSpan(result.Row(y), dst.At(r.x, r.y + y), (size_t)r.width * outChannels, 0, {});
+        }, input, output);
+        return Ok();
+    }
+
+    template<typename T, typename Op>
+    Error TiledFilterCPU(const CPUImage<T>* input, CPUImage<T>* output, uint32_t halo, Op&& op, Rect region = {})
+    {
+        return TiledFilterCPU(input, output, input->channels, halo, std::forward<Op>(op), region);
+    }
+}
@@ -0,0 +1,360 @@
+#pragma once
+
+#include "blur.h"
+
+namespace RawEdit
+{
+    // Guide of the edge-aware filters: luminance of RGB images, first
+    // channel otherwise
+    inline float GuideValue(const float* px, uint32_t c)
+    {
+        return c >= 3 ? 0.2126f * px[0] + 0.7152f * px[1] + 0.0722f * px[2] : px[0];
+    }
+
+    // Guided filter (He et al.) with the luminance as guide I. Each filtered
+    // channel p is approximated locally by q = a * I + b, with
+    //   a = cov(I, p) / (var(I) + epsilon),  b = mean(p) - a * mean(I)
+    // over windows of the given radius; a and b are then averaged. All the
+    // means are box filters, the cost does not depend on the radius.
+    // When 'self' is set the guide filters itself (p = I, cov = var).
+    struct GuidedSettings
+    {
+        uint32_t radius = 8;
+        float epsilon = 0.01f;
+        bool self = false;
+    };
+
+    // Number of (a, b) pairs computed per pixel
+    inline uint32_t GuidedFiltered(uint32_t channels, const GuidedSettings& s)
+    {
+        return s.self ? 1 : std::min(channels, 3u);
+    }
+
+    // Per pixel products to average: I, I^2 then p and I * p for each
+    // filtered channel
+    template<typename T>
+    RAWEDIT_INLINE void GuidedProductsRowImpl(const float* src, float* dst, uint32_t n, uint32_t c, uint32_t f, bool self)
+    {
+        const uint32_t m = self ? 2 : 2 + 2 * f;
+        for (uint32_t x = 0; x < n; ++x)
+        {
+            const float* px = src + x * c;
+            float* out = dst + x * m;
+            const float i = GuideValue(px, c);
+            out[0] = i;
+            out[1] = i * i;
+            if (self) continue;
+            for (uint32_t k = 0; k < f; ++k)
+            {
+                out[2 + k]     = px[k];
+                out[2 + f + k] = i * px[k];
+            }
+        }
+    }
+    RAWEDIT_KERNEL(GuidedProductsRow)
+
+    // Linear coefficients from the means of the products: a then b for each
+    // filtered channel
+    template<typename T>
+    RAWEDIT_INLINE void GuidedCoefficientsRowImpl(const float* means, float* dst, uint32_t n, uint32_t f, bool self, float epsilon)
+    {
+        const uint32_t m = self ? 2 : 2 + 2 * f;
+        for (uint32_t x = 0; x < n; ++x)
+        {
+            const float* mean = means + x * m;
+            float* out = dst + x * 2 * f;
+            const float var = mean[1] - mean[0] * mean[0];
+            for (uint32_t k = 0; k < f; ++k)
+            {
+                const float mp  = self ? mean[0] : mean[2 + k];
+                const float cov = self ? var : mean[2 + f + k] - mean[0] * mp;
+                const float a = cov / (var + epsilon);
+                out[k]     = a;
+                out[f + k] = mp - a * mean[0];
+            }
+        }
+    }
+    RAWEDIT_KERNEL(GuidedCoefficientsRow)
+
+    // q = a * I + b from the (averaged) coefficients. Filtered channels are
+    // replaced by q, or in detail mode the guide detail I - q is scaled by
+    // 'amount' and added to the colors. Other channels are copied.
+    template<typename T>
+    RAWEDIT_INLINE void GuidedApplyRowImpl(const float* src, const float* coef, float* dst, uint32_t n, uint32_t c, uint32_t f, bool detail, float amount)
+    {
+        for (uint32_t x = 0; x < n; ++x)
+        {
+            const float* px = src + x * c;
+            const float* ab = coef + x * 2 * f;
+            float* out = dst + x * c;
+            const float i = GuideValue(px, c);
+
+            for (uint32_t k = 0; k < c; ++k)
+                out[k] = px[k];
+            if (detail)
+            {
+                const float d = amount * (i - (ab[0] * i + ab[f]));
+                for (uint32_t k = 0; k < std::min(c, 3u); ++k)
+                    out[k] = px[k] + d;
+            }
+            else
+            {
+                for (uint32_t k = 0; k < f; ++k)
+                    out[k] = ab[k] * i + ab[f + k];
+            }
+        }
+    }
+    RAWEDIT_KERNEL(GuidedApplyRow)
+
+    // Averaged coefficients of a tile (scratch.input has a halo of twice the
+    // radius), left in scratch.work[2] with 2 * f channels
+    inline void GuidedTileCoefficients(FilterScratch& s, const GuidedSettings& settings, uint32_t f)
+    {
+        static const auto products     = RAWEDIT_SELECT_KERNEL(GuidedProductsRow, float);
+        static const auto coefficients = RAWEDIT_SELECT_KERNEL(GuidedCoefficientsRow, float);
+        const uint32_t r = settings.radius;
+        const uint32_t m = settings.self ? 2 : 2 + 2 * f;
+
+        FilterBuffer& x = s.work[0];
+        x.Resize(s.input.width, s.input.height, m);
+        for (uint32_t y = 0; y < x.height; ++y)
+            products(s.input.Row(y), x.Row(y), x.width, s.input.channels, f, settings.self);
+
+        Box(s.work[0], s.work[1], s.work[2], r);
+
+        FilterBuffer& ab = s.work[0];
+        ab.Resize(s.work[2].width, s.work[2].height, 2 * f);
+        for (uint32_t y = 0; y < ab.height; ++y)
+            coefficients(s.work[2].Row(y), ab.Row(y), ab.width, f, settings.self, settings.epsilon);
+
+        Box(s.work[0], s.work[1], s.work[2], r);
+    }
+
+    // Full resolution guided filter, tile by tile (halo of twice the radius)
+    template<typename T>
+    Error GuidedCPU(const CPUImage<T>* input, CPUImage<T>* output, const GuidedSettings& settings, bool detail, float amount, const Rect& region)
+    {
+        static const auto apply = RAWEDIT_SELECT_KERNEL(GuidedApplyRow, float);
+        const uint32_t c = input->channels;
+        const uint32_t f = GuidedFiltered(c, settings);
+        const uint32_t halo = 2 * settings.radius;
+
+        return TiledFilterCPU(input, output, halo, [&](FilterScratch& s, const Rect& r) {
+            GuidedTileCoefficients(s, settings, f);
+
+            FilterBuffer& out = s.work[0];
+            out.Resize(r.width, r.height, c);
+            for (uint32_t y = 0; y < r.height; ++y)
+                apply(s.input.Row(y + halo) + halo * c, s.work[2].Row(y), out.Row(y), r.width, c, f, detail, amount);
+        }, region);
+    }
+
+    // Per thread rows of GuidedPreviewCPU: the input, the upsampled
+    // coefficients and the result
+    struct GuidedRowScratch
+    {
+        std::vector<float> row, ab, out;
+    };
+
+    // Preview: coefficients are computed on a downscaled copy 'small' (the
+    // radius scaled with it), then bilinearly upsampled and applied with the
+    // full resolution guide, which keeps the edges sharp ("fast guided
+    // filter"). Only the rows and columns of 'region' are written.
+    template<typename T>
+    Error GuidedPreviewCPU(const CPUImage<T>* input, const CPUImage<T>* small, CPUImage<T>* output, CPUImage<float>& coefs,
+                           GuidedSettings settings, bool detail, float amount, Rect region)
+    {
+        static const auto apply = RAWEDIT_SELECT_KERNEL(GuidedApplyRow, float);
+        const uint32_t w = input->width, h = input->height, c = input->channels;
+        const uint32_t f = GuidedFiltered(c, settings);
+        const float sx = (float)small->width / w, sy = (float)small->height / h;
+
+        settings.radius = std::max(1u, (uint32_t)std::lround(settings.radius * sx));
+        if (Error err = TiledFilterCPU(small, &coefs, 2 * f, 2 * settings.radius, [&](FilterScratch& s, const Rect&) {
+                GuidedTileCoefficients(s, settings, f);
+                std::swap(s.work[0], s.work[2]);
+            }); !err.empty())
+            return err;
+
+        if (region.Empty())
+        {
+            region = Rect{ 0, 0, w, h };
+            output->Resize(w, h, c);
+        }
+        else if (output->width != w || output->height != h || output->channels != c)
+        {
+            return Error("Filter: partial update of an output of another size");
+        }
+        region = region.Intersect(Rect{ 0, 0, w, h });
+
+        // Horizontal sample positions, shared by all rows
+        const uint32_t cw = coefs.width, m = 2 * f;
+        std::vector<uint32_t> x0(region.width);
+        std::vector<float> fx(region.width);
+        for (uint32_t x = 0; x < region.width; ++x)
+        {
+            const float p = std::clamp((region.x + x + 0.5f) * sx - 0.5f, 0.f, (float)(cw - 1));
+            x0[x] = std::min((uint32_t)p, cw - 1);
+            fx[x] = p - x0[x];
+        }
+
+        ForEachRow<GuidedRowScratch>(region, [&](GuidedRowScratch& scratch, uint32_t y, std::span<const T> src, std::span<T> dst) {
+            scratch.row.resize(src.size());
+            scratch.out.resize(src.size());
+            scratch.ab.resize((size_t)region.width * m);
+
+            const float p = std::clamp((y + 0.5f) * sy - 0.5f, 0.f, (float)(coefs.height - 1));
+            const uint32_t y0 = std::min((uint32_t)p, coefs.height - 1);
+            const uint32_t y1 = std::min(y0 + 1, coefs.height - 1);
+            const float fy = p - y0;
+            const float* r0 = coefs.GetDataPtr() + coefs.GetIndex(y0, 0);
+            const float* r1 = coefs.GetDataPtr() + coefs.GetIndex(y1, 0);
+
+            float* ab = scratch.ab.data();
+            for (uint32_t x = 0; x < region.width; ++x)
+            {
+                const uint32_t a = x0[x] * m, b = std::min(x0[x] + 1, cw - 1) * m;
+                for (uint32_t k = 0; k < m; ++k)
+                {
+                    const float top    = r0[a + k] + fx[x] * (r0[b + k] - r0[a + k]);
+                    const float bottom = r1[a + k] + fx[x] * (r1[b + k] - r1[a + k]);
+                    ab[x * m + k] = top + fy * (bottom - top);
+                }
+            }
+
+            ConvertSpan(src.data(), scratch.row.data(), src.size(), 0, {});
+            apply(scratch.row.data(), ab, scratch.out.data(), region.width, c, f, detail, amount);
+            ConvertSpan(scratch.out.data(), dst.data(), dst.size(), 0, {});
+        }, input, output);
+        return Ok();
+    }
+
+    // Two box filters of 'radius', computed 2^preview times smaller in
+    // preview mode
+    inline uint32_t GuidedHalo(uint32_t radius, uint32_t preview)
+    {
+        return (2 * radius + 2) << std::min(preview, 16u);
+    }
+
+    // Edge-preserving smoothing of the colors, guided by the luminance.
+    // 'epsilon' is the (squared) edge contrast below which details are
+    // smoothed. 'preview' > 0 computes the filter 2^preview times smaller.
+    class GuidedFilter : public RegionAlgorithm
+    {
+    public:
+        GuidedFilter() : RegionAlgorithm("GuidedFilter")
+        {
+            inputs["radius"]  = 8;
+            inputs["epsilon"] = 0.01f;
+            inputs["preview"] = 0;
+
+            for (auto& it : inputs)
+                it.second.multiMask = false;
+        }
+
+        uint32_t Halo() const override
+        {
+            return GuidedHalo(RadiusAtLevel(GetInputs().at("radius").AsInt(), 1), PreviewAtLevel(GetInputs().at("preview").AsInt()));
+        }
+
+        Error Run() override
+        {
+            Error err;
+            DISPATCH_IMAGE_CALL(inputImage, {
+                auto in = inputImage.get();
+                auto out = outputImage.get();
+
+                err = Run(reinterpret_cast<ImagePtr>(in), reinterpret_cast<ImagePtr>(out));
+            });
+            return err;
+        }
+
+    private:
+        template<typename T>
+        Error Run(CPUImage<T>* input, CPUImage<T>* output)
+        {
+            GuidedSettings settings;
+            settings.radius  = RadiusAtLevel(inputs["radius"].AsInt(), 1);
+            settings.epsilon = std::max(inputs["epsilon"].AsFloat(), 1e-6f);
+
+            uint32_t level = PreviewAtLevel(inputs["preview"].AsInt());
+            if (level == 0)
+                return GuidedCPU(input, output, settings, false, 0.f, region);
+            return GuidedPreviewCPU(input, Downscaled<T>(level), output, coefs, settings, false, 0.f, region);
+        }
+
+        template<typename T>
+        Error Run(T i, T o)
+        {
+            return Error("Run method not implemented for GuidedFilter");
+        }
+
+        CPUImage<float> coefs;
+    };
+
+    // Local contrast: the luminance detail above a guided (edge-aware) base
+    // is amplified (amount > 0) or smoothed (amount < 0). Large radii
+    // without halos around edges; meant for interactive use with 'preview'
+    // while the amount is changed.
+    class Clarity : public RegionAlgorithm
+    {
+    public:
+        Clarity() : RegionAlgorithm("Clarity")
+        {
+            inputs["amount"]  = 0.f;
+            inputs["radius"]  = 32;
+            inputs["epsilon"] = 0.02f;
+            inputs["preview"] = 0;
+
+            for (auto& it : inputs)
+                it.second.multiMask = false;
+        }
+
+        uint32_t Halo() const override
+        {
+            return GuidedHalo(RadiusAtLevel(GetInputs().at("radius").AsInt(), 1), PreviewAtLevel(GetInputs().at("preview").AsInt()));
+        }
+
+        Error Run() override
+        {
+            Error err;
+            DISPATCH_IMAGE_CALL(inputImage, {
+                auto in = inputImage.get();
+                auto out = outputImage.get();
+
+                err = Run(reinterpret_cast<ImagePtr>(in), reinterpret_cast<ImagePtr>(out));
+            });
+            return err;
+        }
+
+    private:
+        template<typename T>
+        Error Run(CPUImage<T>* input, CPUImage<T>* output)
+        {
+            GuidedSettings settings;
+            settings.radius  = RadiusAtLevel(inputs["radius"].AsInt(), 1);
+            settings.epsilon = std::max(inputs["epsilon"].AsFloat(), 1e-6f);
+            settings.self    = true;
+            const float amount = inputs["amount"].AsFloat();
+            if (amount == 0.f && region.Empty())
+            {
+                output->Resize(input->width, input->height, input->channels);
+                ConvertBuffer(input->GetDataPtr(), output->GetDataPtr(), (size_t)input->width * input->height * input->channels);
+                return Ok();
+            }
+
+            uint32_t level = PreviewAtLevel(inputs["preview"].AsInt());
+            if (level == 0)
+                return GuidedCPU(input, output, settings, true, amount, region);
+            return GuidedPreviewCPU(input, Downscaled<T>(level), output, coefs, settings, true, amount, region);
+        }
+
+        template<typename T>
+        Error Run(T i, T o)
+        {
+            return Error("Run method not implemented for Clarity");
+        }
+
+        CPUImage<float> coefs;
+    };
+};
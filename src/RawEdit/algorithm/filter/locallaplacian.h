@@ -0,0 +1,476 @@
+#pragma once
+
+#include <cmath>
+#include <vector>
+#include "guided.h"
+
+namespace RawEdit
+{
+    // Coarsest level of the Laplacian pyramids, its size bounds the scale
+    // of the local adaptation
+    constexpr uint32_t LAPLACIAN_MIN_SIZE = 32;
+    // Bounds of the number of intensity levels
+    constexpr uint32_t LAPLACIAN_MAX_LEVELS = 16;
+    // Samples of the remapping curve
+    constexpr uint32_t LAPLACIAN_CURVE_SIZE = 4096;
+
+    // log2 of the luminance, the pyramids work on stops
+    template<typename T>
+    RAWEDIT_INLINE void LogLumaRowImpl(const float* src, float* dst, uint32_t n, uint32_t c)
+    {
+        for (uint32_t x = 0; x < n; ++x)
+            dst[x] = std::log2(std::max(GuideValue(src + x * c, c), 0.f) + 1e-4f);
+    }
+    RAWEDIT_KERNEL(LogLumaRow)
+
+    // Weighted sum of three rows
+    template<typename T>
+    RAWEDIT_INLINE void Blend3RowImpl(const float* a, const float* b, const float* c, float* dst, uint32_t n, float wa, float wb, float wc)
+    {
+        for (uint32_t x = 0; x < n; ++x)
+            dst[x] = wa * a[x] + wb * b[x] + wc * c[x];
+    }
+    RAWEDIT_KERNEL(Blend3Row)
+
+    // [1 4 6 4 1] / 16 of five rows
+    template<typename T>
+    RAWEDIT_INLINE void BinomialColumnImpl(const float* const* rows, float* dst, uint32_t n)
+    {
+        const float* r0 = rows[0];
+        const float* r1 = rows[1];
+        const float* r2 = rows[2];
+        const float* r3 = rows[3];
+        const float* r4 = rows[4];
+        for (uint32_t x = 0; x < n; ++x)
+            dst[x] = (r0[x] + r4[x] + 4.f * (r1[x] + r3[x]) + 6.f * r2[x]) * (1.f / 16.f);
+    }
+    RAWEDIT_KERNEL(BinomialColumn)
+
+    // [1 4 6 4 1] / 16 at every other pixel of a row padded by 2 pixels
+    template<typename T>
+    RAWEDIT_INLINE void BinomialDecimateRowImpl(const float* src, float* dst, uint32_t n)
+    {
+        for (uint32_t x = 0; x < n; ++x)
+        {
+            const float* p = src + 2 * x;
+            dst[x] = (p[0] + p[4] + 4.f * (p[1] + p[3]) + 6.f * p[2]) * (1.f / 16.f);
+        }
+    }
+    RAWEDIT_KERNEL(BinomialDecimateRow)
+
+    // Twice wider row from a coarse row padded by 1 pixel, the binomial
+    // kernel split in its even [1 6 1] / 8 and odd [4 4] / 8 phases
+    template<typename T>
+    RAWEDIT_INLINE void ExpandRowImpl(const float* src, float* dst, uint32_t n)
+    {
+        for (uint32_t x = 0; x + 1 < n; x += 2)
+        {
+            const float* p = src + x / 2;
+            dst[x]     = (p[0] + p[2] + 6.f * p[1]) * (1.f / 8.f);
+            dst[x + 1] = (p[1] + p[2]) * 0.5f;
+        }
+        if (n % 2)
+        {
+            const float* p = src + n / 2;
+            dst[n - 1] = (p[0] + p[2] + 6.f * p[1]) * (1.f / 8.f);
+        }
+    }
+    RAWEDIT_KERNEL(ExpandRow)
+
+    // Remapped intensities around 'gamma': curve(in - gamma) sampled on
+    // [-range, range]
+    template<typename T>
+    RAWEDIT_INLINE void LaplacianRemapRowImpl(const float* src, float* dst, uint32_t n, float gamma, const float* curve, float range)
+    {
+        const float scale = (LAPLACIAN_CURVE_SIZE - 1) / (2.f * range);
+        const float last = LAPLACIAN_CURVE_SIZE - 1.001f;
+        for (uint32_t x = 0; x < n; ++x)
+        {
+            const float t = std::clamp((src[x] - gamma + range) * scale, 0.f, last);
+            const uint32_t i = (uint32_t)t;
+            const float f = t - i;
+            dst[x] = gamma + curve[i] + f * (curve[i + 1] - curve[i]);
+        }
+    }
+    RAWEDIT_KERNEL(LaplacianRemapRow)
+
+    // Adds the Laplacian coefficients (remapped - expanded coarser level)
+    // of the intensity level 'gamma' to the output, weighted by how close
+    // the input Gaussian coefficient is to 'gamma' (linear interpolation
+    // between the levels)
+    template<typename T>
+    RAWEDIT_INLINE void LaplacianAccumulateRowImpl(const float* gauss, const float* remapped, const float* expanded, float* dst,
+                                                   uint32_t n, float gamma, float invStep)
+    {
+        for (uint32_t x = 0; x < n; ++x)
+        {
+            const float w = std::max(0.f, 1.f - std::abs(gauss[x] - gamma) * invStep);
+            dst[x] += w * (remapped[x] - expanded[x]);
+        }
+    }
+    RAWEDIT_KERNEL(LaplacianAccumulateRow)
+
+    // Multiplies the color channels by the gain
+    template<typename T>
+    RAWEDIT_INLINE void GainRowImpl(float* px, const float* gain, uint32_t n, uint32_t c)
+    {
+        const uint32_t f = std::min(c, 3u);
+        for (uint32_t x = 0; x < n; ++x)
+            for (uint32_t k = 0; k < f; ++k)
+                px[x * c + k] *= gain[x];
+    }
+    RAWEDIT_KERNEL(GainRow)
+
+    struct LocalLaplacianSettings
+    {
+        // Extra gain of the differences well below sigma, > 0 enhances the
+        // details, -1 removes them
+        float detail = 0.f;
+        // Slope of the large differences (edges), < 1 compresses the range
+        float beta = 1.f;
+        // Differences below sigma (stops) are details, above are edges
+        float sigma = 1.f;
+        uint32_t levels = 8;
+    };
+
+    // Fast local Laplacian filter (Aubry, Paris et al.) on the log
+    // luminance. The output Laplacian pyramid is the one of the input
+    // remapped around its own value at each pixel; the remapping is only
+    // done for a fixed number of intensity levels, and each coefficient
+    // interpolates the two levels around the input Gaussian coefficient.
+    // The buffers are kept from a run to the next: only the first run
+    // (or a change of size) allocates.
+    class LocalLaplacianCPU
+    {
+    public:
+        // Luminance gain of each pixel of 'src' (single channel, in 'gain')
+        template<typename T>
+        void Compute(const CPUImage<T>* src, const LocalLaplacianSettings& s, FilterBuffer& gain)
+        {
+            static const auto logLuma    = RAWEDIT_SELECT_KERNEL(LogLumaRow, float);
+            static const auto remap      = RAWEDIT_SELECT_KERNEL(LaplacianRemapRow, float);
+            static const auto accumulate = RAWEDIT_SELECT_KERNEL(LaplacianAccumulateRow, float);
+
+            Resize(src->width, src->height);
+            const uint32_t top = gaussian.size() - 1;
+            const uint32_t c = src->channels;
+
+            float lo = INFINITY, hi = -INFINITY;
+            #pragma omp parallel
+            {
+                std::vector<float> row((size_t)src->width * c);
+
+                #pragma omp for reduction(min: lo) reduction(max: hi)
+                for (int64_t y = 0; y < src->height; ++y)
+                {
+                    ConvertSpan(src->GetDataPtr() + src->GetIndex(y, 0), row.data(), row.size(), 0, {});
+                    float* l = gaussian[0].Row(y);
+                    logLuma(row.data(), l, src->width, c);
+                    for (uint32_t x = 0; x < src->width; ++x)
+                    {
+                        lo = std::min(lo, l[x]);
+                        hi = std::max(hi, l[x]);
+                    }
+                }
+            }
+            for (uint32_t l = 0; l < top; ++l)
+                Down(gaussian[l], gaussian[l + 1]);
+
+            const uint32_t k = std::clamp(s.levels, 2u, LAPLACIAN_MAX_LEVELS);
+            const float range = std::max(hi - lo, 1e-3f);
+            const float step = range / (k - 1);
+            BuildCurve(s, range);
+
+            for (uint32_t l = 0; l < top; ++l)
+                std::fill_n(output[l].data.data(), (size_t)output[l].width * output[l].height, 0.f);
+
+            for (uint32_t i = 0; i < k; ++i)
+            {
+                const float gamma = lo + i * step;
+
+                #pragma omp parallel for
+                for (int64_t y = 0; y < src->height; ++y)
+                    remap(gaussian[0].Row(y), remapped[0].Row(y), src->width, gamma, curve.data(), range);
+                for (uint32_t l = 0; l < top; ++l)
+                    Down(remapped[l], remapped[l + 1]);
+
+                for (uint32_t l = 0; l < top; ++l)
+                {
+                    const FilterBuffer& g = gaussian[l];
+                    const FilterBuffer& r = remapped[l];
+                    FilterBuffer& o = output[l];
+                    ForExpandedRows(remapped[l + 1], g.width, g.height, [&](uint32_t y, const float* e) {
+                        accumulate(g.Row(y), r.Row(y), e, o.Row(y), g.width, gamma, 1.f / step);
+                    });
+                }
+            }
+
+            // Collapse. The residual is the input one, compressed around its
+            // mean: the range of the scales above the pyramid is flattened too
+            const size_t residual = (size_t)gaussian[top].width * gaussian[top].height;
+            const float* g = gaussian[top].data.data();
+            float mean = 0.f;
+            for (size_t i = 0; i < residual; ++i)
+                mean += g[i];
+            mean /= residual;
+            for (size_t i = 0; i < residual; ++i)
+                output[top].data[i] = mean + s.beta * (g[i] - mean);
+            for (uint32_t l = top; l-- > 0;)
+            {
+                FilterBuffer& o = output[l];
+                ForExpandedRows(output[l + 1], o.width, o.height, [&](uint32_t y, const float* e) {
+                    float* d = o.Row(y);
+                    for (uint32_t x = 0; x < o.width; ++x)
+                        d[x] += e[x];
+                });
+            }
+
+            gain.Resize(src->width, src->height, 1);
+            #pragma omp parallel for
+            for (int64_t y = 0; y < src->height; ++y)
+            {
+                const float* a = output[0].Row(y);
+                const float* b = gaussian[0].Row(y);
+                float* d = gain.Row(y);
+                for (uint32_t x = 0; x < src->width; ++x)
+                    d[x] = std::exp2(a[x] - b[x]);
+            }
+        }
+
+    private:
+        void Resize(uint32_t w, uint32_t h)
+        {
+            uint32_t levels = 1;
+            for (uint32_t lw = w, lh = h; std::max(lw, lh) > LAPLACIAN_MIN_SIZE && std::min(lw, lh) > 1; ++levels)
+            {
+                lw = (lw + 1) / 2;
+                lh = (lh + 1) / 2;
+            }
+
+            gaussian.resize(levels);
+            remapped.resize(levels);
+            output.resize(levels);
+            for (uint32_t l = 0; l < levels; ++l)
+            {
+                gaussian[l].Resize(w, h, 1);
+                remapped[l].Resize(w, h, 1);
+                output[l].Resize(w, h, 1);
+                w = (w + 1) / 2;
+                h = (h + 1) / 2;
+            }
+        }
+
+        // Remapping of a difference d to the pixel intensity: edges (above
+        // sigma) are scaled by beta, details get an extra detail * d fading
+        // out towards sigma. The curve is smooth around 0 (unlike a power
+        // law) so that a few intensity levels interpolate it well.
+        void BuildCurve(const LocalLaplacianSettings& s, float range)
+        {
+            curve.resize(LAPLACIAN_CURVE_SIZE);
+            const float sigma = std::max(s.sigma, 1e-3f);
+            for (uint32_t i = 0; i < LAPLACIAN_CURVE_SIZE; ++i)
+            {
+                const float d = (2.f * i / (LAPLACIAN_CURVE_SIZE - 1) - 1.f) * range;
+                const float a = std::abs(d);
+                const float edge = a < sigma ? a : sigma + s.beta * (a - sigma);
+                const float v = edge + s.detail * a * std::exp(-0.5f * a * a / (sigma * sigma));
+                curve[i] = d < 0.f ? -v : v;
+            }
+        }
+
+        // 2x binomial downsampling
+        static void Down(const FilterBuffer& src, FilterBuffer& dst)
+        {
+            static const auto column   = RAWEDIT_SELECT_KERNEL(BinomialColumn, float);
+            static const auto decimate = RAWEDIT_SELECT_KERNEL(BinomialDecimateRow, float);
+            const uint32_t w = src.width, h = src.height;
+
+            #pragma omp parallel
+            {
+                std::vector<float> tmp(w + 5);
+
+                #pragma omp for
+                for (int64_t y = 0; y < dst.height; ++y)
+                {
+                    const float* rows[5];
+                    for (int64_t t = 0; t < 5; ++t)
+                        rows[t] = src.Row(std::clamp<int64_t>(2 * y - 2 + t, 0, h - 1));
+                    column(rows, tmp.data() + 2, w);
+                    tmp[0] = tmp[1] = tmp[2];
+                    tmp[w + 2] = tmp[w + 3] = tmp[w + 4] = tmp[w + 1];
+                    decimate(tmp.data(), dst.Row(y), dst.width);
+                }
+            }
+        }
+
+        // Calls f(y, row) with the rows of 'coarse' upsampled to w x h
+        template<typename F>
+        static void ForExpandedRows(const FilterBuffer& coarse, uint32_t w, uint32_t h, F&& f)
+        {
+            static const auto blend  = RAWEDIT_SELECT_KERNEL(Blend3Row, float);
+            static const auto expand = RAWEDIT_SELECT_KERNEL(ExpandRow, float);
+            const uint32_t cw = coarse.width, ch = coarse.height;
+
+            #pragma omp parallel
+            {
+                std::vector<float> tmp(cw + 2), row(w);
+
+                #pragma omp for
+                for (int64_t y = 0; y < h; ++y)
+                {
+                    const uint32_t i = y / 2;
+                    const float* a = coarse.Row(i == 0 ? 0 : i - 1);
+                    const float* b = coarse.Row(i);
+                    const float* c = coarse.Row(std::min(i + 1, ch - 1));
+                    if (y % 2 == 0)
+                        blend(a, b, c, tmp.data() + 1, cw, 1.f / 8.f, 6.f / 8.f, 1.f / 8.f);
+                    else
+                        blend(a, b, c, tmp.data() + 1, cw, 0.f, 0.5f, 0.5f);
+                    tmp[0] = tmp[1];
+                    tmp[cw + 1] = tmp[cw];
+                    expand(tmp.data(), row.data(), w);
+                    f((uint32_t)y, row.data());
+                }
+            }
+        }
+
+        std::vector<FilterBuffer> gaussian, remapped, output;
+        std::vector<float> curve;
+    };
+
+    // Per thread rows of ApplyGainCPU: the pixels and their gains
+    struct GainRowScratch
+    {
+        std::vector<float> row, gain;
+    };
+
+    // Applies a gain map to the colors of 'input', bilinearly upsampled
+    // when it was computed on a smaller copy
+    template<typename T>
+    Error ApplyGainCPU(const CPUImage<T>* input, CPUImage<T>* output, const FilterBuffer& gain, Rect region)
+    {
+        static const auto apply = RAWEDIT_SELECT_KERNEL(GainRow, float);
+        const uint32_t w = input->width, h = input->height, c = input->channels;
+        const float sx = (float)gain.width / w, sy = (float)gain.height / h;
+
+        if (region.Empty())
+        {
+            region = Rect{ 0, 0, w, h };
+            output->Resize(w, h, c);
+        }
+        else if (output->width != w || output->height != h || output->channels != c)
+        {
+            return Error("Filter: partial update of an output of another size");
+        }
+        region = region.Intersect(Rect{ 0, 0, w, h });
+
+        // Horizontal sample positions, shared by all rows
+        const uint32_t gw = gain.width;
+        std::vector<uint32_t> x0(region.width);
+        std::vector<float> fx(region.width);
+        for (uint32_t x = 0; x < region.width; ++x)
+        {
+            const float p = std::clamp((region.x + x + 0.5f) * sx - 0.5f, 0.f, (float)(gw - 1));
+            x0[x] = std::min((uint32_t)p, gw - 1);
+            fx[x] = p - x0[x];
+        }
+
+        ForEachRow<GainRowScratch>(region, [&](GainRowScratch& scratch, uint32_t y, std::span<const T> src, std::span<T> dst) {
+            std::vector<float>& row = scratch.row;
+            std::vector<float>& g = scratch.gain;
+            row.resize(src.size());
+            g.resize(region.width);
+
+            const float p = std::clamp((y + 0.5f) * sy - 0.5f, 0.f, (float)(gain.height - 1));
+            const uint32_t y0 = std::min((uint32_t)p, gain.height - 1);
+            const float fy = p - y0;
+            const float* r0 = gain.Row(y0);
+            const float* r1 = gain.Row(std::min(y0 + 1, gain.height - 1));
+
+            for (uint32_t x = 0; x < region.width; ++x)
+            {
+                const uint32_t a = x0[x], b = std::min(a + 1, gw - 1);
+                const float top    = r0[a] + fx[x] * (r0[b] - r0[a]);
+                const float bottom = r1[a] + fx[x] * (r1[b] - r1[a]);
+                g[x] = top + fy * (bottom - top);
+            }
+
+            ConvertSpan(src.data(), row.data(), row.size(), 0, {});
+            apply(row.data(), g.data(), region.width, c);
+            ConvertSpan(row.data(), dst.data(), row.size(), 0, {});
+        }, input, output);
+        return Ok();
+    }
+
+    // Local tone mapping (shadows / highlights): 'compression' in [0, 1]
+    // flattens the large scale contrast, 'detail' > 0 enhances the local
+    // contrast below 'sigma' stops (< 0 smooths it), without halos.
+    // 'preview' > 0 computes the gains 2^preview times smaller and
+    // upsamples them; the full resolution run (export) costs about
+    // 'levels' pyramids. The whole image is computed for any region, the
+    // region only restricts what is written.
+    class LocalLaplacian : public RegionAlgorithm
+    {
+    public:
+        LocalLaplacian() : RegionAlgorithm("LocalLaplacian")
+        {
+            inputs["detail"]      = 0.f;
+            inputs["compression"] = 0.f;
+            inputs["sigma"]       = 1.f;
+            inputs["levels"]      = 8;
+            inputs["preview"]     = 0;
+
+            for (auto& it : inputs)
+                it.second.multiMask = false;
+        }
+
+        Error Run() override
+        {
+            Error err;
+            DISPATCH_IMAGE_CALL(inputImage, {
+                auto in = inputImage.get();
+                auto out = outputImage.get();
+
+                err = Run(reinterpret_cast<ImagePtr>(in), reinterpret_cast<ImagePtr>(out));
+            });
+            return err;
+        }
+
+    private:
+        template<typename T>
+        Error Run(CPUImage<T>* input, CPUImage<T>* output)
+        {
+            if (input->metadata.cfa.size != 0)
+                return Error("LocalLaplacian: mosaic images must be demosaiced first");
+
+            const float detail = std::clamp(inputs["detail"].AsFloat(), -1.f, 4.f);
+            const float compression = std::clamp(inputs["compression"].AsFloat(), 0.f, 1.f);
+            if (detail == 0.f && compression == 0.f && region.Empty())
+            {
+                output->Resize(input->width, input->height, input->channels);
+                ConvertBuffer(input->GetDataPtr(), output->GetDataPtr(), (size_t)input->width * input->height * input->channels);
+                return Ok();
+            }
+
+            LocalLaplacianSettings s;
+            s.detail = detail;
+            s.beta   = 1.f - compression;
+            s.sigma  = inputs["sigma"].AsFloat();
+            s.levels = std::max(inputs["levels"].AsInt(), 2);
+
+            uint32_t level = PreviewAtLevel(inputs["preview"].AsInt());
+            const CPUImage<T>* src = level == 0 ? input : Downscaled<T>(level);
+            filter.Compute(src, s, gain);
+            return ApplyGainCPU(input, output, gain, region);
+        }
+
+        template<typename T>
+        Error Run(T i, T o)
+        {
+            return Error("Run method not implemented for LocalLaplacian");
+        }
+
+        LocalLaplacianCPU filter;
+        FilterBuffer gain;
+    };
+};
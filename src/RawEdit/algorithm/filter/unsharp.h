@@ -0,0 +1,74 @@
+#pragma once
+
+#include "blur.h"
+
+namespace RawEdit
+{
+    // out = in + amount * (in - blur), where |in - blur| is above the
+    // threshold (noise and flat areas are left alone)
+    template<typename T>
+    RAWEDIT_INLINE void UnsharpRowImpl(const float* in, float* blur, size_t n, float amount, float threshold)
+    {
+        for (size_t i = 0; i < n; ++i)
+        {
+            const float detail = in[i] - blur[i];
+            blur[i] = std::abs(detail) > threshold ? in[i] + amount * detail : in[i];
+        }
+    }
+    RAWEDIT_KERNEL(UnsharpRow)
+
+    class UnsharpMask : public RegionAlgorithm
+    {
+    public:
+        UnsharpMask() : RegionAlgorithm("UnsharpMask")
+        {
+            inputs["sigma"]     = 1.f;
+            inputs["amount"]    = 0.5f;
+            inputs["threshold"] = 0.f;
+
+            for (auto& it : inputs)
+                it.second.multiMask = false;
+        }
+
+        uint32_t Halo() const override { return GaussianPlan(Sigma(GetInputs().at("sigma").AsFloat())).Halo(); }
+
+        Error Run() override
+        {
+            Error err;
+            DISPATCH_IMAGE_CALL(inputImage, {
+                auto in = inputImage.get();
+                auto out = outputImage.get();
+
+                err = Run(reinterpret_cast<ImagePtr>(in), reinterpret_cast<ImagePtr>(out));
+            });
+            return err;
+        }
+
+    private:
+        template<typename T>
+        Error Run(CPUImage<T>* input, CPUImage<T>* output)
+        {
+            static const auto kernel = RAWEDIT_SELECT_KERNEL(UnsharpRow, float);
+            const float sigma     = Sigma(inputs["sigma"].AsFloat());
+            const float amount    = inputs["amount"].AsFloat();
+            const float threshold = inputs["threshold"].AsFloat();
+
+            const GaussianPlan plan(sigma);
+            const uint32_t halo = plan.Halo();
+            return TiledFilterCPU(input, output, halo, [&](FilterScratch& s, const Rect& r) {
+                plan.Apply(s);
+                // The blur is the size of the tile, the input has the halo around it
+                for (uint32_t y = 0; y < r.height; ++y)
+                    kernel(s.input.Row(y + halo) + halo * s.input.channels, s.work[0].Row(y), s.work[0].Stride(), amount, threshold);
+            }, region);
+        }
+
+        template<typename T>
+        Error Run(T i, T o)
+        {
+            return Error("Run method not implemented for UnsharpMask");
+        }
+
+        float Sigma(float sigma) const { return std::max(ToLevel(sigma), 0.1f); }
+    };
+};
@@ -0,0 +1,175 @@
+#pragma once
+
+#include <cmath>
+#include <numbers>
+#include "../base/regionalgorithm.h"
+#include "../base/resample.h"
+
+namespace RawEdit
+{
+    // Mapping of the stored pixels (w x h, edge coordinates) to the
+    // displayed ones for an EXIF orientation. 'size' receives the
+    // displayed size (swapped for the transposing orientations).
+    inline Mat3 OrientationMatrix(uint8_t orientation, float w, float h, std::array<float, 2>& size)
+    {
+        const bool transposed = orientation >= 5 && orientation <= 8;
+        size = transposed ? std::array<float, 2>{ h, w } : std::array<float, 2>{ w, h };
+        switch (orientation)
+        {
+            case 2: return { -1.f, 0.f, w,    0.f,  1.f, 0.f,  0.f, 0.f, 1.f }; // Mirror horizontal
+            case 3: return { -1.f, 0.f, w,    0.f, -1.f, h,    0.f, 0.f, 1.f }; // Rotate 180
+            case 4: return {  1.f, 0.f, 0.f,  0.f, -1.f, h,    0.f, 0.f, 1.f }; // Mirror vertical
+            case 5: return {  0.f, 1.f, 0.f,  1.f,  0.f, 0.f,  0.f, 0.f, 1.f }; // Transpose
+            case 6: return {  0.f, -1.f, h,   1.f,  0.f, 0.f,  0.f, 0.f, 1.f }; // Rotate 90 clockwise
+            case 7: return {  0.f, -1.f, h,  -1.f,  0.f, w,    0.f, 0.f, 1.f }; // Transverse
+            case 8: return {  0.f, 1.f, 0.f, -1.f,  0.f, w,    0.f, 0.f, 1.f }; // Rotate 90 counterclockwise
+            default: return IDENTITY3;
+        }
+    }
+
+    inline Mat3 TranslationMatrix(float x, float y) { return { 1.f, 0.f, x, 0.f, 1.f, y, 0.f, 0.f, 1.f }; }
+    inline Mat3 ScaleMatrix(float x, float y)       { return { x, 0.f, 0.f, 0.f, y, 0.f, 0.f, 0.f, 1.f }; }
+
+    // Parameters of the whole transform, in the order they are applied
+    struct GeometrySettings
+    {
+        uint8_t orientation = 1;
+        bool flipH = false;
+        bool flipV = false;
+        // Keystone amounts in [-1, 1]: relative scaling of the left/right
+        // (horizontal) and top/bottom (vertical) edges
+        float keystoneH = 0.f;
+        float keystoneV = 0.f;
+        // Clockwise, in degrees, around the center
+        float angle = 0.f;
+        // Fractions of the (oriented) frame
+        float cropLeft = 0.f, cropTop = 0.f, cropRight = 1.f, cropBottom = 1.f;
+        float scale = 1.f;
+    };
+
+    // Output size and output to source mapping of the settings for a
+    // w x h source. Everything is composed in one matrix: the pixels are
+    // resampled once.
+    struct GeometryPlan
+    {
+        uint32_t width = 0;
+        uint32_t height = 0;
+        Mat3 toSource = IDENTITY3;
+
+        GeometryPlan(const GeometrySettings& s, uint32_t w, uint32_t h)
+        {
+            std::array<float, 2> size;
+            Mat3 forward = OrientationMatrix(s.orientation, (float)w, (float)h, size);
+            const float fw = size[0], fh = size[1];
+            const float cx = fw * 0.5f, cy = fh * 0.5f;
+
+            if (s.flipH || s.flipV)
+                forward = Multiply(Mat3{ s.flipH ? -1.f : 1.f, 0.f, s.flipH ? fw : 0.f, 0.f, s.flipV ? -1.f : 1.f, s.flipV ? fh : 0.f, 0.f, 0.f, 1.f }, forward);
+
+            if (s.keystoneH != 0.f || s.keystoneV != 0.f)
+            {
+                // Projective term around the center, the center keeps its place and scale
+                const Mat3 keystone = { 1.f, 0.f, 0.f, 0.f, 1.f, 0.f, s.keystoneH / fw, s.keystoneV / fh, 1.f };
+                forward = Multiply(Multiply(TranslationMatrix(cx, cy), Multiply(keystone, TranslationMatrix(-cx, -cy))), forward);
+            }
+
+            if (s.angle != 0.f)
+            {
+                const float a = s.angle * std::numbers::pi_v<float> / 180.f;
+                const Mat3 rotation = { std::cos(a), -std::sin(a), 0.f, std::sin(a), std::cos(a), 0.f, 0.f, 0.f, 1.f };
+                forward = Multiply(Multiply(TranslationMatrix(cx, cy), Multiply(rotation, TranslationMatrix(-cx, -cy))), forward);
+            }
+
+            const float left = std::clamp(s.cropLeft, 0.f, 1.f), right  = std::clamp(s.cropRight,  left, 1.f);
+            const float top  = std::clamp(s.cropTop,  0.f, 1.f), bottom = std::clamp(s.cropBottom, top,  1.f);
+            forward = Multiply(TranslationMatrix(-left * fw, -top * fh), forward);
+            forward = Multiply(ScaleMatrix(s.scale, s.scale), forward);
+
+            width  = std::max<uint32_t>(1, (uint32_t)std::lround((right - left) * fw * s.scale));
+            height = std::max<uint32_t>(1, (uint32_t)std::lround((bottom - top) * fh * s.scale));
+            toSource = Inverse(forward);
+        }
+    };
+
+    // Crop, straightening, orientation, flips, keystone correction and
+    // output scale in one inverse mapped resampling pass. Downscaling by
+    // more than 2 samples a pyramid level of the input (prefiltered,
+    // no aliasing, less to read).
+    class Geometry : public RegionAlgorithm
+    {
+    public:
+        Geometry() : RegionAlgorithm("Geometry")
+        {
+            inputs["method"]      = EnumType({"Nearest", "Bilinear", "Bicubic"}, 1);
+            inputs["orientation"] = EnumType({"Metadata", "Ignore"}, 0);
+            inputs["flip"]        = EnumType({"None", "Horizontal", "Vertical", "Both"}, 0);
+            inputs["keystoneH"]   = 0.f;
+            inputs["keystoneV"]   = 0.f;
+            inputs["angle"]       = 0.f;
+            inputs["cropLeft"]    = 0.f;
+            inputs["cropTop"]     = 0.f;
+            inputs["cropRight"]   = 1.f;
+            inputs["cropBottom"]  = 1.f;
+            inputs["scale"]       = 1.f;
+
+            for (auto& it : inputs)
+                it.second.multiMask = false;
+        }
+
+        Error Run() override
+        {
+            Error err;
+            DISPATCH_IMAGE_CALL(inputImage, {
+                auto in = inputImage.get();
+                auto out = outputImage.get();
+
+                err = Run(reinterpret_cast<ImagePtr>(in), reinterpret_cast<ImagePtr>(out));
+            });
+            return err;
+        }
+
+    private:
+        template<typename T>
+        Error Run(CPUImage<T>* input, CPUImage<T>* output)
+        {
+            if (input->metadata.cfa.size != 0)
+                return Error("Geometry: mosaic images must be demosaiced first");
+
+            const std::string& flip = inputs["flip"].AsEnum().value;
+            GeometrySettings s;
+            s.orientation = inputs["orientation"].AsEnum().value == "Metadata" ? input->metadata.orientation : 1;
+            s.flipH       = flip == "Horizontal" || flip == "Both";
+            s.flipV       = flip == "Vertical" || flip == "Both";
+            s.keystoneH   = std::clamp(inputs["keystoneH"].AsFloat(), -1.f, 1.f);
+            s.keystoneV   = std::clamp(inputs["keystoneV"].AsFloat(), -1.f, 1.f);
+            s.angle       = inputs["angle"].AsFloat();
+            s.cropLeft    = inputs["cropLeft"].AsFloat();
+            s.cropTop     = inputs["cropTop"].AsFloat();
+            s.cropRight   = inputs["cropRight"].AsFloat();
+            s.cropBottom  = inputs["cropBottom"].AsFloat();
+            s.scale       = inputs["scale"].AsFloat();
+            if (!(s.scale > 0.f))
+                return Error("Geometry: scale must be positive");
+
+            const std::string& name = inputs["method"].AsEnum().value;
+            const Interpolation method = name == "Nearest" ? Interpolation::Nearest : name == "Bilinear" ? Interpolation::Bilinear : Interpolation::Bicubic;
+
+            const GeometryPlan plan(s, input->width, input->height);
+            output->metadata.orientation = 1;
+
+            uint32_t level = s.scale < 0.5f ? (uint32_t)std::floor(std::log2(1.f / s.scale)) : 0;
+            if (level == 0 || method == Interpolation::Nearest)
+                return ResampleCPU(input, output, plan.toSource, plan.width, plan.height, method, region);
+
+            const CPUImage<T>* source = Downscaled<T>(level);
+            const Mat3 toLevel = Multiply(ScaleMatrix((float)source->width / input->width, (float)source->height / input->height), plan.toSource);
+            return ResampleCPU(source, output, toLevel, plan.width, plan.height, method, region);
+        }
+
+        template<typename T>
+        Error Run(T i, T o)
+        {
+            return Error("Run method not implemented for Geometry");
+        }
+    };
+};
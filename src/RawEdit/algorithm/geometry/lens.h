@@ -0,0 +1,354 @@
+#pragma once
+
+#include <cmath>
+#include <list>
+#include <memory>
+#include <mutex>
+#include "../base/regionalgorithm.h"
+#include "../base/resample.h"
+
+namespace RawEdit
+{
+    // Distance in pixels between two nodes of the remap tables, the model
+    // is smooth enough to be interpolated in between
+    constexpr uint32_t LENS_TABLE_STEP = 16;
+    // Tables kept by the process wide cache (a few lenses / image sizes)
+    constexpr uint32_t LENS_CACHE_SIZE = 8;
+
+    // Radial lens model, r is the distance to the center relative to the
+    // half diagonal:
+    //   distortion: r_source = r * (1 + k1 r^2 + k2 r^4 + k3 r^6)
+    //   vignetting: the source is divided by 1 + v1 r^2 + v2 r^4 + v3 r^6
+    //   lateral CA: red and blue are scaled by 1 + caRed / 1 + caBlue
+    //               relative to green
+    // 'scale' > 1 zooms in, to hide the borders left by the correction.
+    struct LensModel
+    {
+        float k1 = 0.f, k2 = 0.f, k3 = 0.f;
+        float v1 = 0.f, v2 = 0.f, v3 = 0.f;
+        float caRed = 0.f, caBlue = 0.f;
+        float scale = 1.f;
+
+        bool operator==(const LensModel& other) const = default;
+
+        bool Identity() const { return *this == LensModel{}; }
+    };
+
+    // Source positions (pixel centers) of the red, green and blue samples
+    // and vignetting gain, on a grid of LENS_TABLE_STEP pixels. Planes:
+    // rx, ry, gx, gy, bx, by, gain.
+    struct LensTable
+    {
+        static constexpr uint32_t PLANES = 7;
+
+        LensModel model;
+        uint32_t imageWidth = 0, imageHeight = 0;
+        uint32_t width = 0, height = 0;
+        std::vector<float> planes;
+
+        const float* Plane(uint32_t p, uint32_t y) const { return planes.data() + ((size_t)p * height + y) * width; }
+
+        void Build(const LensModel& m, uint32_t w, uint32_t h)
+        {
+            model = m;
+            imageWidth = w;
+            imageHeight = h;
+            width  = (w - 1) / LENS_TABLE_STEP + 2;
+            height = (h - 1) / LENS_TABLE_STEP + 2;
+            planes.resize((size_t)PLANES * width * height);
+
+            const float cx = w * 0.5f, cy = h * 0.5f;
+            const float norm = 2.f / std::sqrt((float)w * w + (float)h * h);
+            const float zoom = 1.f / std::max(m.scale, 1e-3f);
+
+            #pragma omp parallel for
+            for (uint32_t j = 0; j < height; ++j)
+            {
+                for (uint32_t i = 0; i < width; ++i)
+                {
+                    // Edge coordinates of the node pixel center, relative to the center
+                    const float dx = (i * LENS_TABLE_STEP + 0.5f - cx) * zoom;
+                    const float dy = (j * LENS_TABLE_STEP + 0.5f - cy) * zoom;
+                    const float r2 = (dx * dx + dy * dy) * norm * norm;
+                    const float d = 1.f + r2 * (m.k1 + r2 * (m.k2 + r2 * m.k3));
+
+                    const float sx = dx * d, sy = dy * d;
+                    const float s2 = (sx * sx + sy * sy) * norm * norm;
+                    const float v = 1.f + s2 * (m.v1 + s2 * (m.v2 + s2 * m.v3));
+
+                    const float values[PLANES] = {
+                        cx + sx * (1.f + m.caRed)  - 0.5f, cy + sy * (1.f + m.caRed)  - 0.5f,
+                        cx + sx                    - 0.5f, cy + sy                    - 0.5f,
+                        cx + sx * (1.f + m.caBlue) - 0.5f, cy + sy * (1.f + m.caBlue) - 0.5f,
+                        v > 1e-3f ? 1.f / v : 1.f
+                    };
+                    for (uint32_t p = 0; p < PLANES; ++p)
+                        planes[((size_t)p * height + j) * width + i] = values[p];
+                }
+            }
+        }
+    };
+
+    // Tables shared by every LensCorrection instance of the process: all
+    // the images of a shoot (same lens, same size) use one table
+    inline std::shared_ptr<const LensTable> GetLensTable(const LensModel& m, uint32_t w, uint32_t h)
+    {
+        static std::mutex mutex;
+        static std::list<std::shared_ptr<const LensTable>> tables;
+
+        std::lock_guard lock(mutex);
+        for (auto it = tables.begin(); it != tables.end(); ++it)
+        {
+            if ((*it)->model == m && (*it)->imageWidth == w && (*it)->imageHeight == h)
+            {
+                // Most recently used first
+                tables.splice(tables.begin(), tables, it);
+                return tables.front();
+            }
+        }
+
+        auto table = std::make_shared<LensTable>();
+        table->Build(m, w, h);
+        tables.push_front(table);
+        if (tables.size() > LENS_CACHE_SIZE)
+            tables.pop_back();
+        return table;
+    }
+
+    // Table values of n pixels of an output row from the two table rows
+    // around it: planes are interpolated vertically into 'rows' (one row
+    // of nodes per plane) then horizontally, node interval by interval
+    template<typename T>
+    RAWEDIT_INLINE void LensRowCoordinatesImpl(const float* rows, uint32_t nodes, uint32_t x0, uint32_t n, float* out)
+    {
+        constexpr float inv = 1.f / LENS_TABLE_STEP;
+        for (uint32_t p = 0; p < LensTable::PLANES; ++p)
+        {
+            const float* r = rows + p * nodes;
+            float* o = out + p * n;
+            for (uint32_t i = 0; i < n; ++i)
+            {
+                const uint32_t x = x0 + i;
+                const uint32_t node = x / LENS_TABLE_STEP;
+                const float f = (x - node * LENS_TABLE_STEP) * inv;
+                o[i] = r[node] + f * (r[node + 1] - r[node]);
+            }
+        }
+    }
+    RAWEDIT_KERNEL(LensRowCoordinates)
+
+    // Bilinear sample of each channel at its own position (red, green,
+    // blue; other channels follow green), times the vignetting gain
+    template<uint32_t C>
+    RAWEDIT_INLINE void LensSampleRows(const SampleSource& s, const float* coords, float* dst, uint32_t n)
+    {
+        const uint32_t c = C ? C : s.channels;
+        const float* gain = coords + 6 * n;
+        for (uint32_t i = 0; i < n; ++i)
+        {
+            for (uint32_t k = 0; k < c; ++k)
+            {
+                const uint32_t plane = c >= 3 && k < 3 ? k : 1;
+                const float x = coords[2 * plane * n + i], y = coords[(2 * plane + 1) * n + i];
+                if (s.Outside(x, y))
+                {
+                    dst[i * c + k] = 0.f;
+                    continue;
+                }
+                const float fx0 = std::floor(x), fy0 = std::floor(y);
+                const int32_t x0 = (int32_t)fx0, y0 = (int32_t)fy0;
+                const float fx = x - fx0, fy = y - fy0;
+
+                const bool inside = x0 >= 0 && y0 >= 0 && x0 + 1 < (int32_t)s.width && y0 + 1 < (int32_t)s.height;
+                const float* p00 = inside ? s.data + ((size_t)y0 * s.width + x0) * c : s.At(x0, y0);
+                const float* p01 = inside ? p00 + c : s.At(x0 + 1, y0);
+                const float* p10 = inside ? p00 + (size_t)s.width * c : s.At(x0, y0 + 1);
+                const float* p11 = inside ? p10 + c : s.At(x0 + 1, y0 + 1);
+                const float top    = p00[k] + fx * (p01[k] - p00[k]);
+                const float bottom = p10[k] + fx * (p11[k] - p10[k]);
+                dst[i * c + k] = (top + fy * (bottom - top)) * (k < 3 ? gain[i] : 1.f);
+            }
+        }
+    }
+
+    template<typename T>
+    RAWEDIT_INLINE void LensSampleRowImpl(const SampleSource& s, const float* coords, float* dst, uint32_t n)
+    {
+        __RAWEDIT_SAMPLE_CHANNELS(LensSampleRows, s, coords, dst, n)
+    }
+    RAWEDIT_KERNEL(LensSampleRow)
+
+    // Per thread buffers of LensCPU: the source region of a tile, the
+    // table rows interpolated for an output row, their coordinates and the
+    // sampled pixels
+    struct LensScratch
+    {
+        std::vector<float> source, rows, coords, out;
+    };
+
+    // Applies a table tile by tile: the source region of a tile is found
+    // from the table nodes covering it, converted once and sampled
+    template<typename T>
+    Error LensCPU(const CPUImage<T>* input, CPUImage<T>* output, const LensTable& table, Rect region)
+    {
+        const uint32_t w = input->width, h = input->height, c = input->channels;
+        if (c == 0 || c > 16)
+            return Error("LensCorrection: unsupported channel count");
+
+        if (region.Empty())
+        {
+            region = Rect{ 0, 0, w, h };
+            output->Resize(w, h, c);
+        }
+        else if (output->width != w || output->height != h || output->channels != c)
+        {
+            return Error("LensCorrection: partial update of an output of another size");
+        }
+
+        static const auto coordinates = RAWEDIT_SELECT_KERNEL(LensRowCoordinates, float);
+        static const auto sample      = RAWEDIT_SELECT_KERNEL(LensSampleRow, float);
+        constexpr uint32_t P = LensTable::PLANES;
+
+        ForEachTile<LensScratch>(AlignToTiles(region, RESAMPLE_TILE, Rect{ 0, 0, w, h }), RESAMPLE_TILE, [&](LensScratch& scratch, const Rect& r, ImageView<T> dst) {
+            auto& [source, rows, coords, out] = scratch;
+            coords.resize((size_t)P * RESAMPLE_TILE);
+            out.resize((size_t)RESAMPLE_TILE * c);
+
+            const uint32_t i0 = r.x / LENS_TABLE_STEP, i1 = (r.Right() - 1) / LENS_TABLE_STEP + 1;
+            const uint32_t j0 = r.y / LENS_TABLE_STEP, j1 = (r.Bottom() - 1) / LENS_TABLE_STEP + 1;
+
+            // Source bounds from the position planes of the nodes
+            float x0 = INFINITY, y0 = INFINITY, x1 = -INFINITY, y1 = -INFINITY;
+            for (uint32_t j = j0; j <= j1; ++j)
+            {
+                for (uint32_t p = 0; p < 6; p += 2)
+                {
+                    const float* px = table.Plane(p, j);
+                    const float* py = table.Plane(p + 1, j);
+                    for (uint32_t i = i0; i <= i1; ++i)
+                    {
+                        x0 = std::min(x0, px[i]); x1 = std::max(x1, px[i]);
+                        y0 = std::min(y0, py[i]); y1 = std::max(y1, py[i]);
+                    }
+                }
+            }
+            const int64_t bx0 = std::max<int64_t>(0, (int64_t)std::floor(x0) - 2);
+            const int64_t by0 = std::max<int64_t>(0, (int64_t)std::floor(y0) - 2);
+            const int64_t bx1 = std::min<int64_t>(w, (int64_t)std::ceil(x1) + 3);
+            const int64_t by1 = std::min<int64_t>(h, (int64_t)std::ceil(y1) + 3);
+            if (bx1 <= bx0 || by1 <= by0)
+            {
+                for (uint32_t v = r.y; v < r.Bottom(); ++v)
+                    std::fill_n(dst.At(r.x, v), (size_t)r.width * c, T{});
+                return;
+            }
+
+            const uint32_t bw = bx1 - bx0, bh = by1 - by0;
+            source.resize((size_t)bw * bh * c);
+            for (uint32_t y = 0; y < bh; ++y)
+                ConvertSpan(input->GetDataPtr() + input->GetIndex(by0 + y, bx0), source.data() + (size_t)y * bw * c, (size_t)bw * c, 0, {});
+            const SampleSource s{ source.data(), bw, bh, c, -0.5f - bx0, -0.5f - by0, w - 0.5f - bx0, h - 0.5f - by0 };
+
+            const uint32_t nodes = i1 - i0 + 1;
+            rows.resize((size_t)P * nodes);
+            for (uint32_t v = r.y; v < r.Bottom(); ++v)
+            {
+                const uint32_t j = v / LENS_TABLE_STEP;
+                const float fy = (v - j * LENS_TABLE_STEP) / (float)LENS_TABLE_STEP;
+                for (uint32_t p = 0; p < P; ++p)
+                {
+                    const float* a = table.Plane(p, j) + i0;
+                    const float* b = table.Plane(p, j + 1) + i0;
+                    for (uint32_t i = 0; i < nodes; ++i)
+                        rows[p * nodes + i] = a[i] + fy * (b[i] - a[i]);
+                }
+
+                coordinates(rows.data(), nodes, r.x - i0 * LENS_TABLE_STEP, r.width, coords.data());
+                // Positions are relative to the loaded region
+                for (uint32_t p = 0; p < 6; ++p)
+                {
+                    const float offset = p % 2 == 0 ? (float)bx0 : (float)by0;
+                    float* o = coords.data() + p * r.width;
+                    for (uint32_t i = 0; i < r.width; ++i)
+                        o[i] -= offset;
+                }
+                sample(s, coords.data(), out.data(), r.width);
+                ConvertSpan(out.data(), dst.At(r.x, v), (size_t)r.width * c, 0, {});
+            }
+        }, output);
+        return Ok();
+    }
+
+    // Distortion, vignetting and lateral chromatic aberration correction
+    // (see LensModel) in one pass. Remap and gain tables only depend on
+    // the model and the image size: they are built once and shared.
+    class LensCorrection : public RegionAlgorithm
+    {
+    public:
+        LensCorrection() : RegionAlgorithm("LensCorrection")
+        {
+            inputs["k1"]     = 0.f;
+            inputs["k2"]     = 0.f;
+            inputs["k3"]     = 0.f;
+            inputs["v1"]     = 0.f;
+            inputs["v2"]     = 0.f;
+            inputs["v3"]     = 0.f;
+            inputs["caRed"]  = 0.f;
+            inputs["caBlue"] = 0.f;
+            inputs["scale"]  = 1.f;
+
+            for (auto& it : inputs)
+                it.second.multiMask = false;
+        }
+
+        Error Run() override
+        {
+            Error err;
+            DISPATCH_IMAGE_CALL(inputImage, {
+                auto in = inputImage.get();
+                auto out = outputImage.get();
+
+                err = Run(reinterpret_cast<ImagePtr>(in), reinterpret_cast<ImagePtr>(out));
+            });
+            return err;
+        }
+
+    private:
+        template<typename T>
+        Error Run(CPUImage<T>* input, CPUImage<T>* output)
+        {
+            if (input->metadata.cfa.size != 0)
+                return Error("LensCorrection: mosaic images must be demosaiced first");
+
+            LensModel m;
+            m.k1     = inputs["k1"].AsFloat();
+            m.k2     = inputs["k2"].AsFloat();
+            m.k3     = inputs["k3"].AsFloat();
+            m.v1     = inputs["v1"].AsFloat();
+            m.v2     = inputs["v2"].AsFloat();
+            m.v3     = inputs["v3"].AsFloat();
+            m.caRed  = inputs["caRed"].AsFloat();
+            m.caBlue = inputs["caBlue"].AsFloat();
+            m.scale  = inputs["scale"].AsFloat();
+
+            if (m.Identity() && region.Empty())
+            {
+                output->Resize(input->width, input->height, input->channels);
+                ConvertBuffer(input->GetDataPtr(), output->GetDataPtr(), (size_t)input->width * input->height * input->channels);
+                return Ok();
+            }
+
+            if (table == nullptr || !(table->model == m) || table->imageWidth != input->width || table->imageHeight != input->height)
+                table = GetLensTable(m, input->width, input->height);
+            return LensCPU(input, output, *table, region);
+        }
+
+        template<typename T>
+        Error Run(T i, T o)
+        {
+            return Error("Run method not implemented for LensCorrection");
+        }
+
+        std::shared_ptr<const LensTable> table;
+    };
+};
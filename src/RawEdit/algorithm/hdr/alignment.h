@@ -0,0 +1,244 @@
+#pragma once
+
+#include <array>
+#include <bit>
+#include <cmath>
+#include <vector>
+#include "image/image.h"
+#include "utils/kernel.h"
+
+namespace RawEdit
+{
+    // Levels of the alignment pyramid, the search covers about
+    // +-2^MTB_LEVELS pixels of the grey planes
+    constexpr uint32_t MTB_LEVELS = 6;
+    // Coarsest level size
+    constexpr uint32_t MTB_MIN_SIZE = 32;
+    // Grey values this close to the median are ignored (noise)
+    constexpr uint8_t MTB_TOLERANCE = 4;
+    // Grey values from this one are saturated
+    constexpr uint8_t MTB_SATURATED = 250;
+
+    // 8 bits grey (gamma 2.2, as the threshold bitmaps are meant for) of
+    // linear values, through a table
+    inline uint8_t EncodeGrey(float v)
+    {
+        static const auto table = [] {
+            std::array<uint8_t, 4096> t;
+            for (uint32_t i = 0; i < t.size(); ++i)
+                t[i] = (uint8_t)std::lround(255.f * std::pow(i / 4095.f, 1.f / 2.2f));
+            return t;
+        }();
+        return table[(uint32_t)(std::clamp(v, 0.f, 1.f) * 4095.f + 0.5f)];
+    }
+
+    inline float DecodeGrey(uint8_t g)
+    {
+        return std::pow(g / 255.f, 2.2f);
+    }
+
+    struct GreyPlane
+    {
+        std::vector<uint8_t> data;
+        uint32_t width = 0;
+        uint32_t height = 0;
+
+        const uint8_t* Row(uint32_t y) const { return data.data() + (size_t)y * width; }
+
+        float Saturated() const
+        {
+            size_t count = 0;
+            for (uint8_t v : data)
+                count += v >= MTB_SATURATED;
+            return data.empty() ? 0.f : (float)count / data.size();
+        }
+    };
+
+    // Grey plane of an image: luminance of color images, 2x2 averages of
+    // mosaics (one value per 2x2 block, the 'scale' of the plane is 2)
+    template<typename T>
+    GreyPlane MakeGreyPlane(const CPUImage<T>* img, uint32_t& scale)
+    {
+        const uint32_t c = img->channels;
+        scale = img->metadata.cfa.size != 0 ? 2 : 1;
+
+        GreyPlane g;
+        g.width  = img->width / scale;
+        g.height = img->height / scale;
+        g.data.resize((size_t)g.width * g.height);
+
+        #pragma omp parallel
+        {
+            std::vector<float> r0((size_t)img->width * c), r1((size_t)img->width * c);
+
+            #pragma omp for
+            for (int64_t y = 0; y < g.height; ++y)
+            {
+                uint8_t* dst = g.data.data() + y * g.width;
+                ConvertSpan(img->GetDataPtr() + img->GetIndex(y * scale, 0), r0.data(), r0.size(), 0, {});
+                if (scale == 2)
+                {
+                    ConvertSpan(img->GetDataPtr() + img->GetIndex(y * 2 + 1, 0), r1.data(), r1.size(), 0, {});
+                    for (uint32_t x = 0; x < g.width; ++x)
+                        dst[x] = EncodeGrey(0.25f * (r0[2 * x] + r0[2 * x + 1] + r1[2 * x] + r1[2 * x + 1]));
+                }
+                else
+                {
+                    for (uint32_t x = 0; x < g.width; ++x)
+                    {
+                        const float* px = r0.data() + x * c;
+                        dst[x] = EncodeGrey(c >= 3 ? 0.2126f * px[0] + 0.7152f * px[1] + 0.0722f * px[2] : px[0]);
+                    }
+                }
+            }
+        }
+        return g;
+    }
+
+    inline GreyPlane HalveGreyPlane(const GreyPlane& src)
+    {
+        GreyPlane g;
+        g.width  = std::max(src.width / 2, 1u);
+        g.height = std::max(src.height / 2, 1u);
+        g.data.resize((size_t)g.width * g.height);
+        for (uint32_t y = 0; y < g.height; ++y)
+        {
+            const uint8_t* a = src.Row(std::min(2 * y, src.height - 1));
+            const uint8_t* b = src.Row(std::min(2 * y + 1, src.height - 1));
+            uint8_t* dst = g.data.data() + (size_t)y * g.width;
+            for (uint32_t x = 0; x < g.width; ++x)
+            {
+                const uint32_t x0 = std::min(2 * x, src.width - 1), x1 = std::min(2 * x + 1, src.width - 1);
+                dst[x] = (uint8_t)((a[x0] + a[x1] + b[x0] + b[x1] + 2) / 4);
+            }
+        }
+        return g;
+    }
+
+    // Median threshold bitmap (Ward): pixels above the median of the
+    // plane, and the mask of the pixels far enough from it. Both do not
+    // depend on the exposure, frames of a bracket can be compared.
+    // Another 'percentile' than the median keeps that property; it is
+    // used when a frame is partly saturated. Rows are packed in 64 bits
+    // words, bits past the width are 0.
+    struct ThresholdBitmap
+    {
+        uint32_t width = 0;
+        uint32_t height = 0;
+        uint32_t words = 0;
+        std::vector<uint64_t> bits, mask;
+
+        void Build(const GreyPlane& g, float percentile)
+        {
+            std::array<size_t, 256> histogram{};
+            for (uint8_t v : g.data)
+                ++histogram[v];
+            const size_t rank = (size_t)(std::clamp(percentile, 0.f, 1.f) * g.data.size());
+            uint32_t median = 0;
+            for (size_t count = 0; median < 255 && (count += histogram[median]) < rank;)
+                ++median;
+
+            width  = g.width;
+            height = g.height;
+            words  = (width + 63) / 64;
+            bits.assign((size_t)words * height, 0);
+            mask.assign((size_t)words * height, 0);
+            for (uint32_t y = 0; y < height; ++y)
+            {
+                const uint8_t* row = g.Row(y);
+                for (uint32_t x = 0; x < width; ++x)
+                {
+                    const uint64_t bit = 1ull << (x % 64);
+                    const size_t w = (size_t)y * words + x / 64;
+                    if (row[x] > median)
+                        bits[w] |= bit;
+                    if (std::abs((int32_t)row[x] - (int32_t)median) > MTB_TOLERANCE)
+                        mask[w] |= bit;
+                }
+            }
+        }
+
+        // Number of pixels differing between this bitmap and 'other'
+        // shifted by (dx, dy), this(x, y) against other(x + dx, y + dy), and
+        // reliable in one of them at least (requiring both would ignore the
+        // pixels deciding one pixel shifts in smooth areas)
+        uint64_t Difference(const ThresholdBitmap& other, int32_t dx, int32_t dy) const
+        {
+            const int32_t q = dx >= 0 ? dx / 64 : -((63 - dx) / 64);
+            const uint32_t r = (uint32_t)(dx - q * 64);
+
+            // Word w of a row of 'other' shifted by dx (0 outside)
+            auto shifted = [&](const uint64_t* row, uint32_t w) {
+                const int64_t i = (int64_t)w + q;
+                const uint64_t lo = i >= 0 && i < words ? row[i] : 0;
+                const uint64_t hi = i + 1 >= 0 && i + 1 < words ? row[i + 1] : 0;
+                return r == 0 ? lo : (lo >> r) | (hi << (64 - r));
+            };
+
+            uint64_t count = 0;
+            for (uint32_t y = 0; y < height; ++y)
+            {
+                const int64_t oy = (int64_t)y + dy;
+                if (oy < 0 || oy >= other.height) continue;
+                const uint64_t* b  = bits.data() + (size_t)y * words;
+                const uint64_t* m  = mask.data() + (size_t)y * words;
+                const uint64_t* ob = other.bits.data() + oy * other.words;
+                const uint64_t* om = other.mask.data() + oy * other.words;
+                for (uint32_t w = 0; w < words; ++w)
+                    count += std::popcount((b[w] ^ shifted(ob, w)) & (m[w] | shifted(om, w)));
+            }
+            return count;
+        }
+    };
+
+    // Bitmaps of successive half resolution grey planes
+    struct AlignmentPyramid
+    {
+        std::vector<ThresholdBitmap> levels;
+
+        void Build(GreyPlane g, float percentile = 0.5f)
+        {
+            levels.clear();
+            while (true)
+            {
+                levels.emplace_back().Build(g, percentile);
+                if (levels.size() == MTB_LEVELS || std::min(g.width, g.height) / 2 < MTB_MIN_SIZE)
+                    break;
+                g = HalveGreyPlane(g);
+            }
+        }
+    };
+
+    // Translation (grey plane pixels) of 'frame' relative to 'reference':
+    // frame(x + dx, y + dy) shows what reference(x, y) shows. Coarse to
+    // fine search, +-1 pixel around the doubled shift of each level.
+    inline std::array<int32_t, 2> AlignMTB(const AlignmentPyramid& reference, const AlignmentPyramid& frame)
+    {
+        const uint32_t levels = std::min(reference.levels.size(), frame.levels.size());
+        std::array<int32_t, 2> shift{ 0, 0 };
+        for (uint32_t l = levels; l-- > 0;)
+        {
+            const ThresholdBitmap& a = reference.levels[l];
+            const ThresholdBitmap& b = frame.levels[l];
+            shift = { shift[0] * 2, shift[1] * 2 };
+
+            std::array<int32_t, 2> best = shift;
+            uint64_t bestCount = UINT64_MAX;
+            for (int32_t dy = -1; dy <= 1; ++dy)
+            {
+                for (int32_t dx = -1; dx <= 1; ++dx)
+                {
+                    const uint64_t count = a.Difference(b, shift[0] + dx, shift[1] + dy);
+                    // Ties keep the smallest move
+                    if (count < bestCount || (count == bestCount && dx == 0 && dy == 0))
+                    {
+                        bestCount = count;
+                        best = { shift[0] + dx, shift[1] + dy };
+                    }
+                }
+            }
+            shift = best;
+        }
+        return shift;
+    }
+};
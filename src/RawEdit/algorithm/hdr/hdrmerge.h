@@ -0,0 +1,324 @@
+#pragma once
+
+#include <numeric>
+#include "image/tile.h"
+#include "image/foreach.h"
+#include "../base/algorithm.h"
+#include "alignment.h"
+
+namespace RawEdit
+{
+    // Output tiles of the merge, every frame is read tile by tile
+    constexpr uint32_t HDR_TILE = 256;
+    // Width of the fall off of the weights below the clipping level,
+    // relative to it
+    constexpr float HDR_CLIP_RAMP = 0.1f;
+
+    // Relative exposure of a shot (time * iso / aperture^2), 0 when the
+    // exposure time is unknown
+    inline float ExposureValue(const MetaData& m)
+    {
+        if (!(m.exposureTime > 0.f)) return 0.f;
+        const float iso = m.iso > 0.f ? m.iso : 1.f;
+        const float aperture = m.aperture > 0.f ? m.aperture : 1.f;
+        return m.exposureTime * iso / (aperture * aperture);
+    }
+
+    // Exposure of 'frame' relative to 'reference' from their grey planes
+    // ('shift' in plane pixels): median ratio of the well exposed pixels,
+    // on one pixel every 'step' in both directions
+    inline float EstimateExposure(const GreyPlane& reference, const GreyPlane& frame, std::array<int32_t, 2> shift, uint32_t step)
+    {
+        std::array<float, 256> linear;
+        for (uint32_t i = 0; i < 256; ++i)
+            linear[i] = DecodeGrey(i);
+
+        std::vector<float> ratios;
+        double sumRef = 0.0, sumFrame = 0.0;
+        for (uint32_t y = 0; y < reference.height; y += step)
+        {
+            const int64_t fy = (int64_t)y + shift[1];
+            if (fy < 0 || fy >= frame.height) continue;
+            const uint8_t* a = reference.Row(y);
+            const uint8_t* b = frame.Row(fy);
+            for (uint32_t x = 0; x < reference.width; x += step)
+            {
+                const int64_t fx = (int64_t)x + shift[0];
+                if (fx < 0 || fx >= frame.width) continue;
+                const float va = linear[a[x]], vb = linear[b[fx]];
+                sumRef += va;
+                sumFrame += vb;
+                if (va > 0.02f && va < 0.85f && vb > 0.02f && vb < 0.85f)
+                    ratios.push_back(vb / va);
+            }
+        }
+
+        if (ratios.size() < 64)
+            return sumRef > 0.0 && sumFrame > 0.0 ? (float)(sumFrame / sumRef) : 1.f;
+        std::nth_element(ratios.begin(), ratios.begin() + ratios.size() / 2, ratios.end());
+        return ratios[ratios.size() / 2];
+    }
+
+    // Adds a frame to the weighted sums. Its radiance is value / exposure,
+    // its weight grows with the exposure (less noise) and falls to 0 when
+    // any color channel gets close to clipping.
+    template<typename T>
+    RAWEDIT_INLINE void HDRAccumulateRowImpl(const float* src, float* sum, float* weight, uint32_t n, uint32_t c, float exposure, float clip)
+    {
+        const uint32_t f = std::min(c, 3u);
+        const float scale = 1.f / exposure;
+        const float ramp = 1.f / (clip * HDR_CLIP_RAMP);
+        for (uint32_t x = 0; x < n; ++x)
+        {
+            const float* px = src + x * c;
+            float m = px[0];
+            for (uint32_t k = 1; k < f; ++k)
+                m = std::max(m, px[k]);
+            const float w = exposure * std::clamp((clip - m) * ramp, 0.f, 1.f);
+            for (uint32_t k = 0; k < c; ++k)
+                sum[x * c + k] += w * px[k] * scale;
+            weight[x] += w;
+        }
+    }
+    RAWEDIT_KERNEL(HDRAccumulateRow)
+
+    // Weighted means, pixels clipped in every frame take the radiance of
+    // the darkest one
+    template<typename T>
+    RAWEDIT_INLINE void HDRResolveRowImpl(const float* sum, const float* weight, const float* darkest, float* dst, uint32_t n, uint32_t c, float darkestScale)
+    {
+        for (uint32_t x = 0; x < n; ++x)
+        {
+            const float w = weight[x];
+            for (uint32_t k = 0; k < c; ++k)
+                dst[x * c + k] = w > 0.f ? sum[x * c + k] / w : darkest[x * c + k] * darkestScale;
+        }
+    }
+    RAWEDIT_KERNEL(HDRResolveRow)
+
+    // n pixels of row y of 'img' from column x, shifted by 'shift'. Out of
+    // image pixels are replaced by the closest ones of the same color of
+    // the mosaic ('period' is the CFA size, 1 for color images).
+    template<typename T>
+    void LoadShiftedRow(const CPUImage<T>* img, int64_t y, int64_t x, uint32_t n, std::array<int32_t, 2> shift, uint32_t period, float* dst)
+    {
+        const int64_t w = img->width, h = img->height, p = period;
+        const uint32_t c = img->channels;
+        auto clamp = [p](int64_t v, int64_t size) {
+            if (v < 0)     v += (-v + p - 1) / p * p;
+            if (v >= size) v -= (v - size + p) / p * p;
+            return std::clamp<int64_t>(v, 0, size - 1);
+        };
+
+        const int64_t sy = clamp(y + shift[1], h);
+        const int64_t sx = x + shift[0];
+        const int64_t x0 = std::max<int64_t>(sx, 0), x1 = std::min<int64_t>(sx + n, w);
+        const T* row = img->GetDataPtr() + img->GetIndex(sy, 0);
+        if (x1 > x0)
+            ConvertSpan(row + x0 * c, dst + (x0 - sx) * c, (size_t)(x1 - x0) * c, 0, {});
+        for (int64_t i = 0; i < n; ++i)
+        {
+            if (sx + i >= x0 && sx + i < x1) continue;
+            ConvertSpan(row + clamp(sx + i, w) * c, dst + i * c, c, 0, {});
+        }
+    }
+
+    // Merges an exposure bracket into a float radiance image, in the
+    // units of the reference frame (the middle exposure by default).
+    // Frames are linear images of the same size and layout (demosaiced,
+    // or raw mosaics after RawPreprocess, merged before demosaicing).
+    // Alignment is a translation found on median threshold bitmaps, which
+    // do not depend on the exposure; mosaics are shifted by whole CFA
+    // periods. Relative exposures come from the metadata, or are
+    // estimated from the frames when it is missing. The merge streams
+    // over output tiles: frames stay in their own type and only one tile
+    // row per frame is converted to float at a time.
+    class HDRMerge : public Algorithm
+    {
+    public:
+        HDRMerge() : Algorithm("HDRMerge")
+        {
+            inputs["align"]     = EnumType({"None", "MTB"}, 1);
+            inputs["clip"]      = 0.95f;
+            // Index of the reference frame, -1 for the middle exposure
+            inputs["reference"] = -1;
+
+            for (auto& it : inputs)
+                it.second.multiMask = false;
+        }
+
+        // The frames of the bracket, in any order
+        void BindInputImages(const std::vector<ImagePtr>& images)
+        {
+            frames = images;
+            inputImage = frames.empty() ? nullptr : frames[0];
+        }
+
+        void BindInputImage(ImagePtr img) override { BindInputImages({ img }); }
+
+        // Results of the last run, per frame: translation (pixels) and
+        // exposure relative to the reference
+        const std::vector<std::array<int32_t, 2>>& GetShifts() const { return shifts; }
+        const std::vector<float>& GetExposures() const { return exposures; }
+
+        Error Run() override
+        {
+            if (frames.empty())
+                return Error("HDRMerge: no input frames");
+            for (const ImagePtr& f : frames)
+            {
+                if (f->backend != ImageBackend::CPU || f->type != frames[0]->type)
+                    return Error("HDRMerge: frames must be CPU images of the same type");
+                if (f->width != frames[0]->width || f->height != frames[0]->height || f->channels != frames[0]->channels ||
+                    f->metadata.cfa.size != frames[0]->metadata.cfa.size)
+                    return Error("HDRMerge: frames must have the same size and layout");
+            }
+            if (outputImage == nullptr || outputImage->backend != ImageBackend::CPU || outputImage->type != ImageDataType::FLOAT32)
+                return Error("HDRMerge: the output must be a float CPU image");
+
+            Error err;
+            DISPATCH_IMAGE_CALL(inputImage, {
+                auto in = inputImage.get();
+
+                err = Run(reinterpret_cast<ImagePtr>(in));
+            });
+            return err;
+        }
+
+    private:
+        template<typename T>
+        Error Run(CPUImage<T>*)
+        {
+            const uint32_t n = frames.size();
+            std::vector<const CPUImage<T>*> images(n);
+            for (uint32_t i = 0; i < n; ++i)
+                images[i] = static_cast<const CPUImage<T>*>(frames[i].get());
+            auto output = static_cast<CPUImage<float>*>(outputImage.get());
+
+            uint32_t scale = 1;
+            std::vector<GreyPlane> greys(n);
+            std::vector<double> brightness(n, 0.0);
+            for (uint32_t i = 0; i < n; ++i)
+            {
+                greys[i] = MakeGreyPlane(images[i], scale);
+                for (uint8_t v : greys[i].data)
+                    brightness[i] += v;
+            }
+
+            std::vector<uint32_t> order(n);
+            std::iota(order.begin(), order.end(), 0);
+            std::sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) { return brightness[a] < brightness[b]; });
+            const int32_t index = inputs["reference"].AsInt();
+            const uint32_t ref = index >= 0 && index < (int32_t)n ? index : order[n / 2];
+            const uint32_t refPos = std::find(order.begin(), order.end(), ref) - order.begin();
+
+            // Frames are aligned and compared with their neighbour towards
+            // the reference in the exposure order: the brightest and darkest
+            // frames have little in common with the reference itself
+            auto neighbour = [&](uint32_t k) { return k < refPos ? k + 1 : k - 1; };
+
+            // Both bitmaps of a pair split the pixels at the median of the
+            // ones not saturated in the brighter frame (same rank in both)
+            std::vector<std::array<int32_t, 2>> steps(n, { 0, 0 });
+            if (n > 1 && inputs["align"].AsEnum().value == "MTB")
+            {
+                #pragma omp parallel for schedule(dynamic)
+                for (uint32_t k = 0; k < n; ++k)
+                {
+                    if (k == refPos) continue;
+                    const uint32_t i = order[k], j = order[neighbour(k)];
+                    const float percentile = 0.5f * (1.f - greys[order[std::max(k, neighbour(k))]].Saturated());
+                    AlignmentPyramid a, b;
+                    a.Build(greys[j], percentile);
+                    b.Build(greys[i], percentile);
+                    steps[k] = AlignMTB(a, b);
+                }
+            }
+
+            const bool known = std::all_of(images.begin(), images.end(), [](const CPUImage<T>* img) { return ExposureValue(img->metadata) > 0.f; });
+            std::vector<float> ratios(n, 1.f);
+            for (uint32_t k = 0; k < n; ++k)
+            {
+                if (k == refPos) continue;
+                const uint32_t i = order[k], j = order[neighbour(k)];
+                ratios[k] = known ? ExposureValue(images[i]->metadata) / ExposureValue(images[j]->metadata)
+                                  : std::max(EstimateExposure(greys[j], greys[i], steps[k], 2), 1e-6f);
+            }
+            greys.clear();
+
+            // Composed from the reference outwards
+            const int32_t period = std::max<int32_t>(images[ref]->metadata.cfa.size, 1);
+            std::vector<std::array<int32_t, 2>> grey(n, { 0, 0 });
+            shifts.assign(n, { 0, 0 });
+            exposures.assign(n, 1.f);
+            for (uint32_t d = 1; d < n; ++d)
+            {
+                for (int64_t k : { (int64_t)refPos - d, (int64_t)refPos + d })
+                {
+                    if (k < 0 || k >= n) continue;
+                    const uint32_t i = order[k], j = order[neighbour(k)];
+                    grey[i] = { grey[j][0] + steps[k][0], grey[j][1] + steps[k][1] };
+                    exposures[i] = exposures[j] * ratios[k];
+                    for (uint32_t a = 0; a < 2; ++a)
+                        shifts[i][a] = (int32_t)std::lround((float)grey[i][a] * scale / period) * period;
+                }
+            }
+
+            Merge(images, output, order, images[ref]->metadata);
+            return Ok();
+        }
+
+        template<typename T>
+        Error Run(T i)
+        {
+            return Error("Run method not implemented for HDRMerge");
+        }
+
+        template<typename T>
+        void Merge(const std::vector<const CPUImage<T>*>& images, CPUImage<float>* output, const std::vector<uint32_t>& order, const MetaData& metadata)
+        {
+            static const auto accumulate = RAWEDIT_SELECT_KERNEL(HDRAccumulateRow, float);
+            static const auto resolve    = RAWEDIT_SELECT_KERNEL(HDRResolveRow, float);
+
+            const uint32_t w = images[0]->width, h = images[0]->height, c = images[0]->channels;
+            const uint32_t period = std::max<uint32_t>(images[0]->metadata.cfa.size, 1);
+            const float clip = std::clamp(inputs["clip"].AsFloat(), 0.05f, 1.f);
+            const uint32_t darkest = order.front();
+
+            output->Resize(w, h, c);
+            output->metadata = metadata;
+
+            ForEachTile<MergeScratch>(Rect{ 0, 0, w, h }, HDR_TILE, [&](MergeScratch& scratch, const Rect& r, ImageView<float> out) {
+                auto& [row, dark, sum, weight] = scratch;
+                row.resize((size_t)HDR_TILE * c);
+                dark.resize((size_t)HDR_TILE * c);
+                sum.resize((size_t)HDR_TILE * c);
+                weight.resize(HDR_TILE);
+
+                for (uint32_t y = r.y; y < r.Bottom(); ++y)
+                {
+                    std::fill_n(sum.data(), (size_t)r.width * c, 0.f);
+                    std::fill_n(weight.data(), r.width, 0.f);
+                    for (uint32_t i : order)
+                    {
+                        float* dst = i == darkest ? dark.data() : row.data();
+                        LoadShiftedRow(images[i], y, r.x, r.width, shifts[i], period, dst);
+                        accumulate(dst, sum.data(), weight.data(), r.width, c, exposures[i], clip);
+                    }
+                    resolve(sum.data(), weight.data(), dark.data(), out.At(r.x, y), r.width, c, 1.f / exposures[darkest]);
+                }
+            }, output);
+        }
+
+        // Per thread rows of Merge: the frame being added, the darkest
+        // frame and the weighted sums
+        struct MergeScratch
+        {
+            std::vector<float> row, dark, sum, weight;
+        };
+
+        std::vector<ImagePtr> frames;
+        std::vector<std::array<int32_t, 2>> shifts;
+        std::vector<float> exposures;
+    };
+};
@@ -0,0 +1,446 @@
+#pragma once
+
+#include <cmath>
+#include <vector>
+#include "../base/algorithm.h"
+#include "image/tile.h"
+#include "image/foreach.h"
+
+namespace RawEdit
+{
+    // Tiles are processed independently, with a halo large enough for AHD
+    constexpr uint32_t DEMOSAIC_TILE = 64;
+    constexpr uint32_t DEMOSAIC_HALO = 6;
+
+    // Photosites of each color around each position of a CFA period, as
+    // offsets in a tile buffer (see BilinearGeneric)
+    struct DemosaicNeighbours
+    {
+        int32_t count = 0;
+        int32_t offsets[24];
+    };
+
+    // Per thread working set: every plane covers the tile and its halo
+    struct DemosaicTile
+    {
+        static constexpr uint32_t SIZE = DEMOSAIC_TILE + 2 * DEMOSAIC_HALO;
+        static constexpr uint32_t PLANE = SIZE * SIZE;
+
+        CFAPattern cfa;
+        // Non Bayer patterns only, built once per pattern
+        const std::vector<DemosaicNeighbours>* neighbours = nullptr;
+        // Position of the first buffer pixel in the image (may be negative)
+        int64_t oy = 0;
+        int64_t ox = 0;
+
+        std::vector<float> mosaic = std::vector<float>(PLANE);
+        std::vector<float> rgb    = std::vector<float>(3 * PLANE);
+
+        // AHD only
+        std::vector<float> green  = std::vector<float>(2 * PLANE);
+        std::vector<float> diff   = std::vector<float>(PLANE);
+        std::vector<float> dirRGB = std::vector<float>(6 * PLANE);
+        std::vector<float> lab    = std::vector<float>(6 * PLANE);
+        std::vector<float> homo   = std::vector<float>(2 * PLANE);
+
+        // Bayer bilinear weights, for each color, candidate (center, cross,
+        // diagonal, horizontal, vertical) and row parity, expanded on a row
+        std::vector<float> weights = std::vector<float>(3 * 5 * 2 * SIZE);
+
+        float* Weights(uint32_t c, uint32_t k, uint32_t parity) { return weights.data() + ((c * 5 + k) * 2 + parity) * SIZE; }
+
+        uint8_t Color(int64_t i, int64_t j) const { return cfa.At(oy + i, ox + j); }
+    };
+
+    inline void PrepareBayerWeights(DemosaicTile& tile)
+    {
+        constexpr uint32_t S = DemosaicTile::SIZE;
+        std::fill(tile.weights.begin(), tile.weights.end(), 0.f);
+
+        for (uint32_t p = 0; p < 2; ++p)
+        {
+            for (uint32_t j = 0; j < S; ++j)
+            {
+                const uint8_t here  = tile.Color(p, j);
+                const uint8_t right = tile.Color(p, j + 1);
+                for (uint32_t c = 0; c < 3; ++c)
+                {
+                    uint32_t k;
+                    if (here == c)         k = 0; // center
+                    else if (c == 1)       k = 1; // green at red / blue: cross
+                    else if (here != 1)    k = 2; // red at blue, blue at red: diagonal
+                    else if (right == c)   k = 3; // horizontal neighbours
+                    else                   k = 4; // vertical neighbours
+                    tile.Weights(c, k, p)[j] = 1.f;
+                }
+            }
+        }
+    }
+
+    // Bilinear interpolation of color 'c' from a plane where that color
+    // is only known at its own photosites, for rows in [m, S - m)
+    RAWEDIT_INLINE void InterpolateBayer(DemosaicTile& tile, const float* src, float* dst, uint32_t c, uint32_t m)
+    {
+        constexpr uint32_t S = DemosaicTile::SIZE;
+        for (uint32_t i = m; i < S - m; ++i)
+        {
+            const float* up   = src + (i - 1) * S;
+            const float* row  = src + i * S;
+            const float* down = src + (i + 1) * S;
+            const float* w0 = tile.Weights(c, 0, i & 1);
+            const float* w1 = tile.Weights(c, 1, i & 1);
+            const float* w2 = tile.Weights(c, 2, i & 1);
+            const float* w3 = tile.Weights(c, 3, i & 1);
+            const float* w4 = tile.Weights(c, 4, i & 1);
+            float* out = dst + i * S;
+
+            for (uint32_t j = m; j < S - m; ++j)
+            {
+                const float hor   = 0.5f  * (row[j - 1] + row[j + 1]);
+                const float ver   = 0.5f  * (up[j] + down[j]);
+                const float cross = 0.5f  * (hor + ver);
+                const float diag  = 0.25f * (up[j - 1] + up[j + 1] + down[j - 1] + down[j + 1]);
+                out[j] = w0[j] * row[j] + w1[j] * cross + w2[j] * diag + w3[j] * hor + w4[j] * ver;
+            }
+        }
+    }
+
+    template<typename T>
+    RAWEDIT_INLINE void BilinearBayerImpl(DemosaicTile& tile)
+    {
+        constexpr uint32_t S = DemosaicTile::SIZE;
+        for (uint32_t c = 0; c < 3; ++c)
+        {
+            // Keep only the photosites of color c
+            for (uint32_t i = 0; i < S; ++i)
+            {
+                const float* w = tile.Weights(c, 0, i & 1);
+                for (uint32_t j = 0; j < S; ++j)
+                    tile.diff[i * S + j] = tile.mosaic[i * S + j] * w[j];
+            }
+            InterpolateBayer(tile, tile.diff.data(), tile.rgb.data() + c * DemosaicTile::PLANE, c, 1);
+        }
+    }
+    RAWEDIT_KERNEL(BilinearBayer)
+
+    // Any pattern (X-Trans): for each position of the period and each
+    // color, the closest photosites of that color in the 3x3 neighbourhood
+    // or the 5x5 one when there are none. Fails when a color has none in
+    // the 5x5 either.
+    inline Failable<std::vector<DemosaicNeighbours>> MakeDemosaicNeighbours(const CFAPattern& cfa)
+    {
+        constexpr int32_t S = DemosaicTile::SIZE;
+        const uint32_t ps = cfa.size;
+
+        std::vector<DemosaicNeighbours> table(ps * ps * 3);
+        for (uint32_t py = 0; py < ps; ++py)
+        {
+            for (uint32_t px = 0; px < ps; ++px)
+            {
+                for (uint32_t c = 0; c < 3; ++c)
+                {
+                    DemosaicNeighbours& n = table[(py * ps + px) * 3 + c];
+                    for (int32_t r = 0; r <= 2 && n.count == 0; ++r)
+                        for (int32_t di = -r; di <= r; ++di)
+                            for (int32_t dj = -r; dj <= r; ++dj)
+                                if (std::max(std::abs(di), std::abs(dj)) == r && cfa.At((int64_t)py + di, (int64_t)px + dj) == c)
+                                    n.offsets[n.count++] = di * S + dj;
+                    if (n.count == 0)
+                        return Failed("Demosaic: CFA pattern has no photosite of color {} near ({}, {})", c, py, px);
+                }
+            }
+        }
+        return table;
+    }
+
+    // Average of the neighbours of MakeDemosaicNeighbours
+    template<typename T>
+    RAWEDIT_INLINE void BilinearGenericImpl(DemosaicTile& tile)
+    {
+        constexpr uint32_t S = DemosaicTile::SIZE;
+        const int64_t ps = tile.cfa.size;
+        // Phase of the buffer origin in the period
+        const uint32_t py0 = (uint32_t)(((tile.oy % ps) + ps) % ps);
+        const uint32_t px0 = (uint32_t)(((tile.ox % ps) + ps) % ps);
+        const DemosaicNeighbours* table = tile.neighbours->data();
+
+        for (uint32_t i = 2; i < S - 2; ++i)
+        {
+            const uint32_t py = (py0 + i) % ps;
+            for (uint32_t j = 2; j < S - 2; ++j)
+            {
+                const float* center = tile.mosaic.data() + i * S + j;
+                const DemosaicNeighbours* n = &table[(py * ps + (px0 + j) % ps) * 3];
+                for (uint32_t c = 0; c < 3; ++c)
+                {
+                    float sum = 0.f;
+                    for (int32_t k = 0; k < n[c].count; ++k)
+                        sum += center[n[c].offsets[k]];
+                    tile.rgb[c * DemosaicTile::PLANE + i * S + j] = sum / n[c].count;
+                }
+            }
+        }
+    }
+    RAWEDIT_KERNEL(BilinearGeneric)
+
+    // Adaptive Homogeneity-Directed demosaic (Hirakawa & Parks) for Bayer:
+    // - green is interpolated horizontally and vertically (Hamilton-Adams)
+    // - red and blue are rebuilt for each direction from color differences
+    // - the direction with the most homogeneous neighbourhood, in a cheap
+    //   opponent space, is kept per pixel
+    template<typename T>
+    RAWEDIT_INLINE void AHDBayerImpl(DemosaicTile& tile)
+    {
+        constexpr uint32_t S = DemosaicTile::SIZE;
+        constexpr uint32_t P = DemosaicTile::PLANE;
+        const float* m = tile.mosaic.data();
+        float* gh = tile.green.data();
+        float* gv = tile.green.data() + P;
+
+        for (uint32_t i = 2; i < S - 2; ++i)
+        {
+            const float* isGreen = tile.Weights(1, 0, i & 1);
+            const float* row = m + i * S;
+            const float* up1 = row - S;
+            const float* up2 = row - 2 * S;
+            const float* dn1 = row + S;
+            const float* dn2 = row + 2 * S;
+            for (uint32_t j = 2; j < S - 2; ++j)
+            {
+                const float l = row[j - 1], r = row[j + 1];
+                const float u = up1[j], d = dn1[j];
+                const float h = 0.5f * (l + r) + 0.25f * (2.f * row[j] - row[j - 2] - row[j + 2]);
+                const float v = 0.5f * (u + d) + 0.25f * (2.f * row[j] - up2[j] - dn2[j]);
+                const float hc = std::clamp(h, std::min(l, r), std::max(l, r));
+                const float vc = std::clamp(v, std::min(u, d), std::max(u, d));
+                gh[i * S + j] = isGreen[j] * row[j] + (1.f - isGreen[j]) * hc;
+                gv[i * S + j] = isGreen[j] * row[j] + (1.f - isGreen[j]) * vc;
+            }
+        }
+
+        for (uint32_t dir = 0; dir < 2; ++dir)
+        {
+            const float* g = dir == 0 ? gh : gv;
+            float* out = tile.dirRGB.data() + dir * 3 * P;
+            std::copy(g, g + P, out + P);
+
+            for (uint32_t c = 0; c < 3; c += 2)
+            {
+                for (uint32_t i = 2; i < S - 2; ++i)
+                {
+                    const float* w = tile.Weights(c, 0, i & 1);
+                    for (uint32_t j = 2; j < S - 2; ++j)
+                        tile.diff[i * S + j] = w[j] * (m[i * S + j] - g[i * S + j]);
+                }
+                InterpolateBayer(tile, tile.diff.data(), out + c * P, c, 3);
+                for (uint32_t i = 3; i < S - 3; ++i)
+                    for (uint32_t j = 3; j < S - 3; ++j)
+                        out[c * P + i * S + j] += g[i * S + j];
+            }
+
+            float* lab = tile.lab.data() + dir * 3 * P;
+            for (uint32_t k = 0; k < P; ++k)
+            {
+                const float r = out[k], gg = out[P + k], b = out[2 * P + k];
+                lab[k]         = 0.25f * (r + 2.f * gg + b);
+                lab[P + k]     = r - gg;
+                lab[2 * P + k] = b - gg;
+            }
+        }
+
+        // Homogeneity: neighbours closer than the tolerance of both directions
+        const float* lh = tile.lab.data();
+        const float* lv = tile.lab.data() + 3 * P;
+        float* hh = tile.homo.data();
+        float* hv = tile.homo.data() + P;
+        auto chroma = [P](const float* lab, uint32_t a, uint32_t b) {
+            const float da = lab[P + a] - lab[P + b];
+            const float db = lab[2 * P + a] - lab[2 * P + b];
+            return da * da + db * db;
+        };
+
+        for (uint32_t i = 4; i < S - 4; ++i)
+        {
+            for (uint32_t j = 4; j < S - 4; ++j)
+            {
+                const uint32_t k = i * S + j;
+                const uint32_t nb[4] = { k - 1, k + 1, k - S, k + S };
+
+                const float epsL = std::min(
+                    std::max(std::abs(lh[k] - lh[k - 1]), std::abs(lh[k] - lh[k + 1])),
+                    std::max(std::abs(lv[k] - lv[k - S]), std::abs(lv[k] - lv[k + S])));
+                const float epsC = std::min(
+                    std::max(chroma(lh, k, k - 1), chroma(lh, k, k + 1)),
+                    std::max(chroma(lv, k, k - S), chroma(lv, k, k + S)));
+
+                float sh = 0.f, sv = 0.f;
+                for (uint32_t n = 0; n < 4; ++n)
+                {
+                    sh += (std::abs(lh[k] - lh[nb[n]]) <= epsL && chroma(lh, k, nb[n]) <= epsC) ? 1.f : 0.f;
+                    sv += (std::abs(lv[k] - lv[nb[n]]) <= epsL && chroma(lv, k, nb[n]) <= epsC) ? 1.f : 0.f;
+                }
+                hh[k] = sh;
+                hv[k] = sv;
+            }
+        }
+
+        const float* rh = tile.dirRGB.data();
+        const float* rv = tile.dirRGB.data() + 3 * P;
+        for (uint32_t i = DEMOSAIC_HALO; i < S - DEMOSAIC_HALO; ++i)
+        {
+            for (uint32_t j = DEMOSAIC_HALO; j < S - DEMOSAIC_HALO; ++j)
+            {
+                const uint32_t k = i * S + j;
+                float sh = 0.f, sv = 0.f;
+                for (int32_t di = -1; di <= 1; ++di)
+                {
+                    for (int32_t dj = -1; dj <= 1; ++dj)
+                    {
+                        sh += hh[k + di * (int32_t)S + dj];
+                        sv += hv[k + di * (int32_t)S + dj];
+                    }
+                }
+
+                const float wh = sh > sv ? 1.f : (sh < sv ? 0.f : 0.5f);
+                for (uint32_t c = 0; c < 3; ++c)
+                    tile.rgb[c * P + k] = wh * rh[c * P + k] + (1.f - wh) * rv[c * P + k];
+            }
+        }
+    }
+    RAWEDIT_KERNEL(AHDBayer)
+
+    enum class DemosaicMethod
+    {
+        Bilinear,
+        AHD
+    };
+
+    template<typename T>
+    Error DemosaicCPU(const CPUImage<T>* input, CPUImage<T>* output, DemosaicMethod method)
+    {
+        const CFAPattern cfa = input->metadata.cfa;
+        if (input->channels != 1 || (cfa.size != 2 && cfa.size != 6))
+            return Error("Demosaic: input is not a Bayer / X-Trans mosaic");
+
+        const uint32_t w = input->width;
+        const uint32_t h = input->height;
+        if (w < cfa.size || h < cfa.size)
+            return Error("Demosaic: image too small");
+
+        output->Resize(w, h, 3);
+        output->metadata.cfa = CFAPattern{};
+
+        const bool bayer = cfa.size == 2;
+
+        static const auto bilinearBayer   = RAWEDIT_SELECT_KERNEL(BilinearBayer, T);
+        static const auto bilinearGeneric = RAWEDIT_SELECT_KERNEL(BilinearGeneric, T);
+        static const auto ahdBayer        = RAWEDIT_SELECT_KERNEL(AHDBayer, T);
+        constexpr float maxValue = PixelTraits<T>::integer ? (float)PixelTraits<T>::max : INFINITY;
+
+        std::vector<DemosaicNeighbours> neighbours;
+        if (!bayer)
+        {
+            auto table = MakeDemosaicNeighbours(cfa);
+            if (!table)
+                return table.error();
+            neighbours = std::move(*table);
+        }
+
+        ForEachTile<DemosaicTile>(Rect{ 0, 0, w, h }, DEMOSAIC_TILE, [&](DemosaicTile& tile, const Rect& r, ImageView<T> dst) {
+            constexpr uint32_t S = DemosaicTile::SIZE;
+            tile.cfa = cfa;
+            tile.neighbours = &neighbours;
+            tile.oy = (int64_t)r.y - DEMOSAIC_HALO;
+            tile.ox = (int64_t)r.x - DEMOSAIC_HALO;
+
+            // Out of image photosites are mirrored by whole CFA periods
+            // so that they keep their color
+            auto fold = [&](int64_t v, int64_t size) {
+                while (v < 0) v += cfa.size;
+                while (v >= size) v -= cfa.size;
+                return v;
+            };
+            for (uint32_t i = 0; i < S; ++i)
+            {
+                const int64_t y = fold(tile.oy + i, h);
+                const T* src = input->GetDataPtr() + input->GetIndex(y, 0);
+                for (uint32_t j = 0; j < S; ++j)
+                    tile.mosaic[i * S + j] = static_cast<float>(src[fold(tile.ox + j, w)]);
+            }
+
+            if (bayer)
+            {
+                PrepareBayerWeights(tile);
+                if (method == DemosaicMethod::AHD) ahdBayer(tile);
+                else bilinearBayer(tile);
+            }
+            else
+            {
+                bilinearGeneric(tile);
+            }
+
+            for (uint32_t i = 0; i < r.height; ++i)
+            {
+                T* out = dst.At(r.x, r.y + i);
+                const uint32_t k0 = (i + DEMOSAIC_HALO) * S + DEMOSAIC_HALO;
+                for (uint32_t j = 0; j < r.width; ++j)
+                {
+                    for (uint32_t c = 0; c < 3; ++c)
+                    {
+                        float v = std::clamp(tile.rgb[c * DemosaicTile::PLANE + k0 + j], 0.f, maxValue);
+                        if constexpr (PixelTraits<T>::integer) v = std::round(v);
+                        out[3 * j + c] = static_cast<T>(v);
+                    }
+                }
+            }
+        }, output);
+        return Ok();
+    }
+
+    // Single channel mosaic (see MetaData::cfa) to RGB
+    class Demosaic : public Algorithm
+    {
+    public:
+        Demosaic() : Algorithm("Demosaic")
+        {
+            inputs["method"] = EnumType({"Bilinear", "AHD"}, 1);
+
+            for (auto& it : inputs)
+                it.second.multiMask = false;
+        }
+
+        // Works on UINT16 data as is
+        bool HasFixedPoint() const override { return true; }
+
+        Error Run() override
+        {
+            Error err;
+            DISPATCH_IMAGE_CALL(inputImage, {
+                auto in = inputImage.get();
+                auto out = outputImage.get();
+
+                err = Run(reinterpret_cast<ImagePtr>(in), reinterpret_cast<ImagePtr>(out));
+            });
+            return err;
+        }
+
+    private:
+        template<typename T>
+        Error Run(CPUImage<T>* input, CPUImage<T>* output)
+        {
+            const std::string& method = inputs["method"].AsEnum().value;
+            if (method == "Bilinear")
+                return DemosaicCPU(input, output, DemosaicMethod::Bilinear);
+            if (method == "AHD")
+                return DemosaicCPU(input, output, DemosaicMethod::AHD);
+
+            return Error("Unknown demosaic method");
+        }
+
+        template<typename T>
+        Error Run(T i, T o)
+        {
+            return Error("Run method not implemented for Demosaic");
+        }
+    };
+};
@@ -0,0 +1,293 @@
+#pragma once
+
+#include <cmath>
+#include <vector>
+#include "../base/algorithm.h"
+#include "../base/pointop.h"
+#include "image/foreach.h"
+
+namespace RawEdit
+{
+    // Below this level (normalized) photosites are never considered hot,
+    // noise in the shadows would otherwise be flagged
+    constexpr float HOT_PIXEL_FLOOR = 1.f / 256.f;
+    // Same color neighbours are searched this far, rows are padded by as
+    // much on each side
+    constexpr uint32_t HOT_PIXEL_RADIUS = 2;
+
+    // Rows are normalized, balanced and padded, row pointers are at x = 0.
+    // A hot photosite is brighter than 'ratio' times its brightest same
+    // color neighbour and is replaced by it: the other colors would flag
+    // (and flatten) every bright single color highlight. Values are then
+    // clipped to [0, clip].
+    // Bayer: the same color photosites are 2 apart, 'up' and 'down' are
+    // the rows 2 above and below.
+    template<typename T>
+    RAWEDIT_INLINE void HotPixelRowImpl(const float* up, const float* row, const float* down, float* dst, size_t n, float ratio, float clip)
+    {
+        for (size_t j = 0; j < n; ++j)
+        {
+            const float a = std::max(std::max(up[j - 2], up[j]), std::max(up[j + 2], row[j - 2]));
+            const float b = std::max(std::max(row[j + 2], down[j - 2]), std::max(down[j], down[j + 2]));
+            const float m = std::max(a, b);
+            const float v = row[j];
+            const float fixed = v > ratio * std::max(m, HOT_PIXEL_FLOOR) ? m : v;
+            dst[j] = std::clamp(fixed, 0.f, clip);
+        }
+    }
+    RAWEDIT_KERNEL(HotPixelRow)
+
+    // Same color photosites around each position of a CFA period, within
+    // HOT_PIXEL_RADIUS (X-Trans)
+    struct HotPixelNeighbours
+    {
+        static constexpr uint32_t SIDE = 2 * HOT_PIXEL_RADIUS + 1;
+
+        uint32_t count = 0;
+        int8_t dy[SIDE * SIDE];
+        int8_t dx[SIDE * SIDE];
+    };
+
+    // Indexed by (y % size) * size + x % size
+    inline std::vector<HotPixelNeighbours> MakeHotPixelNeighbours(const CFAPattern& cfa)
+    {
+        const int32_t r = HOT_PIXEL_RADIUS;
+        std::vector<HotPixelNeighbours> table((size_t)cfa.size * cfa.size);
+        for (uint32_t py = 0; py < cfa.size; ++py)
+        {
+            for (uint32_t px = 0; px < cfa.size; ++px)
+            {
+                HotPixelNeighbours& n = table[py * cfa.size + px];
+                for (int32_t dy = -r; dy <= r; ++dy)
+                {
+                    for (int32_t dx = -r; dx <= r; ++dx)
+                    {
+                        if ((dy != 0 || dx != 0) && cfa.At(py + dy, px + dx) == cfa.At(py, px))
+                        {
+                            n.dy[n.count] = dy;
+                            n.dx[n.count] = dx;
+                            ++n.count;
+                        }
+                    }
+                }
+            }
+        }
+        return table;
+    }
+
+    // Any other pattern: 'rows' are the rows y - 2 to y + 2, 'phases' the
+    // neighbours of the CFA row of y
+    template<typename T>
+    RAWEDIT_INLINE void HotPixelCFARowImpl(const float* const* rows, const HotPixelNeighbours* phases, uint32_t period, float* dst, size_t n, float ratio, float clip)
+    {
+        const float* row = rows[HOT_PIXEL_RADIUS];
+        for (size_t j = 0; j < n; ++j)
+        {
+            const HotPixelNeighbours& nb = phases[j % period];
+            const float v = row[j];
+            float fixed = v;
+            if (nb.count != 0)
+            {
+                float m = -INFINITY;
+                for (uint32_t k = 0; k < nb.count; ++k)
+                    m = std::max(m, rows[HOT_PIXEL_RADIUS + nb.dy[k]][(int64_t)j + nb.dx[k]]);
+                fixed = v > ratio * std::max(m, HOT_PIXEL_FLOOR) ? m : v;
+            }
+            dst[j] = std::clamp(fixed, 0.f, clip);
+        }
+    }
+    RAWEDIT_KERNEL(HotPixelCFARow)
+
+    template<typename T>
+    RAWEDIT_INLINE void ClipRowImpl(const float* row, float* dst, size_t n, float clip)
+    {
+        for (size_t j = 0; j < n; ++j)
+            dst[j] = std::clamp(row[j], 0.f, clip);
+    }
+    RAWEDIT_KERNEL(ClipRow)
+
+    // Black / white levels and white balance of a mosaic. Levels are
+    // normalized on [0, 1] and given per CFA color.
+    struct RawPreprocessSettings
+    {
+        __Color black   = { 0.f, 0.f, 0.f };
+        float   white   = 1.f;
+        __Color wbGains = { 1.f, 1.f, 1.f };
+        // 0 disables hot pixel removal
+        float hotPixelRatio = 0.f;
+        bool  clip = true;
+    };
+
+    // Rows y - 2 to y + 2 around the row being processed, per thread.
+    // ForEachRow keeps consecutive rows on a thread: the window rolls and
+    // only loads the row 2 below, except at the start of a chunk.
+    struct RawPreprocessWindow
+    {
+        static constexpr uint32_t ROWS = 2 * HOT_PIXEL_RADIUS + 1;
+
+        std::vector<float> lines, result;
+        std::array<float*, ROWS> rows{};
+        int64_t next = -1;
+    };
+
+    // Single fused pass: every row is read once, balanced in float and
+    // compared to its neighbours while still in cache.
+    template<typename T>
+    Error RawPreprocessCPU(const CPUImage<T>* input, CPUImage<T>* output, const RawPreprocessSettings& s)
+    {
+        const CFAPattern& cfa = input->metadata.cfa;
+        if (input->channels != 1 || cfa.size == 0 || PATTERN_SIZE % cfa.size != 0)
+            return Error("RawPreprocess: input is not a Bayer / X-Trans mosaic");
+
+        const uint32_t w = input->width;
+        const uint32_t h = input->height;
+        if (w < cfa.size || h < cfa.size)
+            return Error("RawPreprocess: image too small");
+
+        output->Resize(w, h, 1);
+
+        // Multipliers are scaled so that the smallest is 1: the channel that
+        // saturates first then reaches 1 exactly, clipping makes every
+        // saturated photosite neutral (no magenta highlights)
+        const float minGain = std::max(std::min({ s.wbGains[0], s.wbGains[1], s.wbGains[2] }), 1e-6f);
+        float gains[3];
+        for (uint32_t c = 0; c < 3; ++c)
+            gains[c] = s.wbGains[c] / minGain / std::max(s.white - s.black[c], 1e-6f);
+
+        // One offset / gain pattern per row of the CFA
+        std::vector<std::array<float, PATTERN_SIZE>> offsets(cfa.size), scales(cfa.size);
+        for (uint32_t r = 0; r < cfa.size; ++r)
+        {
+            for (uint32_t k = 0; k < PATTERN_SIZE; ++k)
+            {
+                const uint8_t c = cfa.At(r, k);
+                offsets[r][k] = s.black[c];
+                scales[r][k]  = gains[c];
+            }
+        }
+
+        static const auto affine   = RAWEDIT_SELECT_KERNEL(AffineRow, float);
+        static const auto hotPixel = RAWEDIT_SELECT_KERNEL(HotPixelRow, float);
+        static const auto hotCFA   = RAWEDIT_SELECT_KERNEL(HotPixelCFARow, float);
+        static const auto clipRow  = RAWEDIT_SELECT_KERNEL(ClipRow, float);
+
+        const float clip = s.clip ? 1.f : INFINITY;
+        const bool removeHot = s.hotPixelRatio > 0.f;
+        const bool bayer = cfa.size == 2;
+        const std::vector<HotPixelNeighbours> neighbours = removeHot && !bayer ? MakeHotPixelNeighbours(cfa) : std::vector<HotPixelNeighbours>();
+        constexpr uint32_t R = HOT_PIXEL_RADIUS;
+        const size_t stride = w + 2 * R;
+
+        // Out of image rows and columns are mirrored by whole CFA periods
+        // (they keep their color). Lines are filled from x = 0.
+        auto load = [&](int64_t y, float* line) {
+            if (y < 0) y += cfa.size;
+            if (y >= h) y -= cfa.size;
+            const uint32_t r = y % cfa.size;
+
+            ConvertSpan(input->GetDataPtr() + input->GetIndex(y, 0), line, w, 0, {});
+            affine(line, line, w, offsets[r].data(), scales[r].data());
+            for (int64_t x = 1; x <= R; ++x)
+            {
+                line[-x] = line[cfa.size - x];
+                line[w - 1 + x] = line[w - 1 + x - cfa.size];
+            }
+        };
+
+        ForEachRow<RawPreprocessWindow>(Rect{ 0, 0, w, h }, [&](RawPreprocessWindow& win, uint32_t y, std::span<T> dst) {
+            auto& rows = win.rows;
+            if (win.lines.empty())
+            {
+                win.lines.resize(RawPreprocessWindow::ROWS * stride);
+                win.result.resize(w);
+                for (uint32_t k = 0; k < RawPreprocessWindow::ROWS; ++k)
+                    rows[k] = win.lines.data() + k * stride + R;
+            }
+
+            if (removeHot)
+            {
+                if (y != win.next)
+                    for (uint32_t k = 0; k < 2 * R; ++k)
+                        load((int64_t)y - R + k, rows[k]);
+                load((int64_t)y + R, rows[2 * R]);
+
+                if (bayer)
+                    hotPixel(rows[0], rows[R], rows[2 * R], win.result.data(), w, s.hotPixelRatio, clip);
+                else
+                    hotCFA(rows.data(), neighbours.data() + (y % cfa.size) * cfa.size, cfa.size, win.result.data(), w, s.hotPixelRatio, clip);
+
+                std::rotate(rows.begin(), rows.begin() + 1, rows.end());
+                win.next = (int64_t)y + 1;
+            }
+            else
+            {
+                load(y, rows[R]);
+                clipRow(rows[R], win.result.data(), w, clip);
+            }
+            ConvertSpan(win.result.data(), dst.data(), w, 0, {});
+        }, output);
+
+        output->metadata.levels.black = { 0.f, 0.f, 0.f };
+        output->metadata.levels.white = 1.f;
+        return Ok();
+    }
+
+    // Sensor level corrections of a mosaic, before demosaic (three times
+    // less data than after). FromMetaData sets the levels of a raw file.
+    class RawPreprocess : public Algorithm
+    {
+    public:
+        RawPreprocess() : Algorithm("RawPreprocess")
+        {
+            inputs["black"]      = __Color{ 0.f, 0.f, 0.f };
+            inputs["white"]      = 1.f;
+            inputs["wb"]         = __Color{ 1.f, 1.f, 1.f };
+            inputs["hotPixels"]  = 0.f;
+            inputs["highlights"] = EnumType({"Clip", "Unclipped"}, 0);
+
+            for (auto& it : inputs)
+                it.second.multiMask = false;
+        }
+
+        void FromMetaData(const MetaData& metadata)
+        {
+            inputs["black"] = metadata.levels.black;
+            inputs["white"] = metadata.levels.white;
+            inputs["wb"]    = metadata.levels.wbGains;
+        }
+
+        // Works on UINT16 data as is
+        bool HasFixedPoint() const override { return true; }
+
+        Error Run() override
+        {
+            Error err;
+            DISPATCH_IMAGE_CALL(inputImage, {
+                auto in = inputImage.get();
+                auto out = outputImage.get();
+
+                err = Run(reinterpret_cast<ImagePtr>(in), reinterpret_cast<ImagePtr>(out));
+            });
+            return err;
+        }
+
+    private:
+        template<typename T>
+        Error Run(CPUImage<T>* input, CPUImage<T>* output)
+        {
+            RawPreprocessSettings s;
+            s.black         = inputs["black"].AsColor();
+            s.white         = inputs["white"].AsFloat();
+            s.wbGains       = inputs["wb"].AsColor();
+            s.hotPixelRatio = inputs["hotPixels"].AsFloat();
+            s.clip          = inputs["highlights"].AsEnum().value == "Clip";
+            return RawPreprocessCPU(input, output, s);
+        }
+
+        template<typename T>
+        Error Run(T i, T o)
+        {
+            return Error("Run method not implemented for RawPreprocess");
+        }
+    };
+};
@@ -0,0 +1,64 @@
+#pragma once
+
+#include "../base/algorithm.h"
+#include "../base/pointop.h"
+
+namespace RawEdit
+{
+    // Subtracts the per channel black level and stretches [black, white]
+    // to the full range. Levels are normalized to [0, 1].
+    class BlackLevel : public Algorithm
+    {
+    public:
+        BlackLevel() : Algorithm("BlackLevel")
+        {
+            inputs["black"] = __Color{ 0.f, 0.f, 0.f };
+            inputs["white"] = 1.f;
+
+            for (auto& it : inputs)
+                it.second.multiMask = false;
+        }
+
+        bool HasFixedPoint() const override { return true; }
+        uint32_t Halo() const override { return 0; }
+
+        Error Run() override
+        {
+            Error err;
+            DISPATCH_IMAGE_CALL(inputImage, {
+                auto in = inputImage.get();
+                auto out = outputImage.get();
+
+                err = Run(reinterpret_cast<ImagePtr>(in), reinterpret_cast<ImagePtr>(out));
+            });
+            return err;
+        }
+
+    private:
+        template<typename T>
+        Error Run(CPUImage<T>* input, CPUImage<T>* output)
+        {
+            const __Color& black = inputs["black"].AsColor();
+            const float white = inputs["white"].AsFloat();
+
+            float offsets[4];
+            float gains[4];
+            for (uint32_t k = 0; k < 4; ++k)
+            {
+                // Alpha (or anything past the third channel) is left untouched
+                offsets[k] = k < 3 ? black[k] : 0.f;
+                gains[k]   = k < 3 ? 1.f / std::max(white - black[k], 1e-6f) : 1.f;
+            }
+
+            if (input->channels > 4)
+                return Error("BlackLevel: too many channels");
+            return AffineCPU(input, output, offsets, gains);
+        }
+
+        template<typename T>
+        Error Run(T i, T o)
+        {
+            return Error("Run method not implemented for BlackLevel");
+        }
+    };
+};
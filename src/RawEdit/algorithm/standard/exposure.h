@@ -0,0 +1,54 @@
+#pragma once
+
+#include <cmath>
+#include "../base/algorithm.h"
+#include "../base/pointop.h"
+
+namespace RawEdit
+{
+    class Exposure : public Algorithm
+    {
+    public:
+        Exposure() : Algorithm("Exposure")
+        {
+            inputs["exposure"] = 0.f;
+
+            for (auto& it : inputs)
+                it.second.multiMask = false;
+        }
+
+        bool HasFixedPoint() const override { return true; }
+        uint32_t Halo() const override { return 0; }
+
+        Error Run() override
+        {
+            Error err;
+            DISPATCH_IMAGE_CALL(inputImage, {
+                auto in = inputImage.get();
+                auto out = outputImage.get();
+
+                err = Run(reinterpret_cast<ImagePtr>(in), reinterpret_cast<ImagePtr>(out));
+            });
+            return err;
+        }
+
+    private:
+        template<typename T>
+        Error Run(CPUImage<T>* input, CPUImage<T>* output)
+        {
+            const float gain = std::exp2(inputs["exposure"].AsFloat());
+            const float offsets[4] = { 0.f, 0.f, 0.f, 0.f };
+            const float gains[4]   = { gain, gain, gain, gain };
+            
+            if (input->channels > 4)
+                return Error("Exposure: too many channels");
+            return AffineCPU(input, output, offsets, gains);
+        }
+
+        template<typename T>
+        Error Run(T i, T o)
+        {
+            return Error("Run method not implemented for Exposure");
+        }
+    };
+};
@@ -1,9 +1,20 @@
 #pragma once
 
 #include "../base/algorithm.h"
+#include "../base/resample.h"
+#include "image/foreach.h"
 
 namespace RawEdit
 {
+    template<typename T>
+    RAWEDIT_INLINE void NearestRowImpl(const T* src, T* dst, const uint32_t* offsets, uint32_t width, uint32_t channels)
+    {
+        for (uint32_t j = 0; j < width; ++j)
+            for (uint32_t k = 0; k < channels; ++k)
+                dst[j * channels + k] = src[offsets[j] + k];
+    }
+    RAWEDIT_KERNEL(NearestRow)
+
     template<typename T>
     Error NearestCPU(const CPUImage<T>* input, CPUImage<T>* output, uint32_t width, uint32_t height)
     {
@@ -11,18 +22,18 @@ namespace RawEdit
         const float wratio = input->width  / (float)width;
         const float hratio = input->height / (float)height;
 
-        #pragma omp parallel for collapse(2)
-        for (uint32_t i = 0; i < height; ++i)
-        {
-            for (uint32_t j = 0; j < width; ++j)
-            {
-                const uint32_t srcX = std::min((uint32_t)(j * wratio), input->width - 1);
-                const uint32_t srcY = std::min((uint32_t)(i * hratio), input->height - 1);
+        // Source columns are the same for every row
+        std::vector<uint32_t> offsets(width);
+        for (uint32_t j = 0; j < width; ++j)
+            offsets[j] = std::min((uint32_t)(j * wratio), input->width - 1) * input->channels;
 
-                for (uint32_t k = 0; k < input->channels; ++k)
-                    output->SetData(i, j, k, input->GetData(srcY, srcX, k));
-            }
-        }
+        static const auto kernel = RAWEDIT_SELECT_KERNEL(NearestRow, T);
+
+        const size_t srcRow = (size_t)input->width * input->channels;
+        ForEachRow([&](uint32_t i, std::span<T> dst) {
+            const uint32_t srcY = std::min((uint32_t)(i * hratio), input->height - 1);
+            kernel(input->GetDataPtr() + srcY * srcRow, dst.data(), offsets.data(), width, input->channels);
+        }, output);
         
         return Ok();
     }
@@ -63,6 +74,14 @@ namespace RawEdit
 
             if (method == "Nearest")
                 return NearestCPU(input, output, tWidth, tHeight);
+            if (tWidth == 0 || tHeight == 0)
+                return Error("Rescale: empty output");
+
+            const Mat3 toSource = { input->width / (float)tWidth, 0.f, 0.f, 0.f, input->height / (float)tHeight, 0.f, 0.f, 0.f, 1.f };
+            if (method == "Bilinear")
+                return ResampleCPU(input, output, toSource, tWidth, tHeight, Interpolation::Bilinear);
+            if (method == "Bicubic")
+                return ResampleCPU(input, output, toSource, tWidth, tHeight, Interpolation::Bicubic);
 
             return Error("Unknown set of parameters for rescale with CPUImage");
         }
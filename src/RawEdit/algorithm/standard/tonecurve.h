@@ -0,0 +1,83 @@
+#pragma once
+
+#include <cmath>
+#include "../base/algorithm.h"
+#include "../base/pointop.h"
+
+namespace RawEdit
+{
+    // Gamma and contrast curve. Integer images are mapped through a
+    // table, rebuilt only when the parameters change.
+    class ToneCurve : public Algorithm
+    {
+    public:
+        ToneCurve() : Algorithm("ToneCurve")
+        {
+            inputs["gamma"]    = 1.f;
+            inputs["contrast"] = 0.f;
+
+            for (auto& it : inputs)
+                it.second.multiMask = false;
+        }
+
+        bool HasFixedPoint() const override { return true; }
+        uint32_t Halo() const override { return 0; }
+
+        Error Run() override
+        {
+            const float g = inputs["gamma"].AsFloat();
+            const float c = inputs["contrast"].AsFloat();
+            if (g != gamma || c != contrast)
+            {
+                gamma = g;
+                contrast = c;
+                lut8.clear();
+                lut16.clear();
+            }
+
+            Error err;
+            DISPATCH_IMAGE_CALL(inputImage, {
+                auto in = inputImage.get();
+                auto out = outputImage.get();
+
+                err = Run(reinterpret_cast<ImagePtr>(in), reinterpret_cast<ImagePtr>(out));
+            });
+            return err;
+        }
+
+    private:
+        template<typename T>
+        Error Run(CPUImage<T>* input, CPUImage<T>* output)
+        {
+            const float invGamma = 1.f / std::max(gamma, 1e-3f);
+            const float k = contrast;
+            auto curve = [=](float v) {
+                v = std::pow(std::max(v, 0.f), invGamma);
+                // Smoothstep blend around mid grey
+                const float s = v * v * (3.f - 2.f * v);
+                return std::clamp(v + k * (s - v), 0.f, 1.f);
+            };
+
+            if constexpr (std::is_same_v<T, uint8_t>)
+                return CurveCPU(input, output, lut8, curve);
+            else if constexpr (std::is_same_v<T, uint16_t>)
+                return CurveCPU(input, output, lut16, curve);
+            else
+            {
+                std::vector<T> unused;
+                return CurveCPU(input, output, unused, curve);
+            }
+        }
+
+        template<typename T>
+        Error Run(T i, T o)
+        {
+            return Error("Run method not implemented for ToneCurve");
+        }
+
+        float gamma    = -1.f;
+        float contrast = 0.f;
+        std::vector<uint8_t>  lut8;
+        std::vector<uint16_t> lut16;
+    };
+};
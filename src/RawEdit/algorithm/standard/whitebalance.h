@@ -0,0 +1,53 @@
+#pragma once
+
+#include "../base/algorithm.h"
+#include "../base/pointop.h"
+
+namespace RawEdit
+{
+    class WhiteBalance : public Algorithm
+    {
+    public:
+        WhiteBalance() : Algorithm("WhiteBalance")
+        {
+            inputs["gains"] = __Color{ 1.f, 1.f, 1.f };
+
+            for (auto& it : inputs)
+                it.second.multiMask = false;
+        }
+
+        bool HasFixedPoint() const override { return true; }
+        uint32_t Halo() const override { return 0; }
+
+        Error Run() override
+        {
+            Error err;
+            DISPATCH_IMAGE_CALL(inputImage, {
+                auto in = inputImage.get();
+                auto out = outputImage.get();
+
+                err = Run(reinterpret_cast<ImagePtr>(in), reinterpret_cast<ImagePtr>(out));
+            });
+            return err;
+        }
+
+    private:
+        template<typename T>
+        Error Run(CPUImage<T>* input, CPUImage<T>* output)
+        {
+            const __Color& wb = inputs["gains"].AsColor();
+            const float offsets[4] = { 0.f, 0.f, 0.f, 0.f };
+            const float gains[4]   = { wb[0], wb[1], wb[2], 1.f };
+
+            if (input->channels != 3 && input->channels != 4)
+                return Error("WhiteBalance: expected a RGB(A) image");
+            return AffineCPU(input, output, offsets, gains);
+        }
+
+        template<typename T>
+        Error Run(T i, T o)
+        {
+            return Error("Run method not implemented for WhiteBalance");
+        }
+    };
+};
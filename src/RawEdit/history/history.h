@@ -0,0 +1,255 @@
+#pragma once
+
+#include <deque>
+#include <vector>
+#include <unordered_map>
+
+#include "utils/rle.h"
+#include "image/mask.h"
+#include "algorithm/base/params.h"
+
+namespace RawEdit
+{
+    // Undo / redo stack for parameter values and mask edits.
+    // - Params are recorded value by value (only the changed mask indices)
+    // - Masks are recorded as rle-compressed xor deltas of the touched tiles
+    // Recorded params and masks must outlive the history.
+    class History
+    {
+    public:
+        static constexpr size_t DEFAULT_BUDGET = 4 * 1024 * 1024;
+
+        History(size_t budget = DEFAULT_BUDGET) : budget(budget) {}
+
+        void BeginParamEdit(Param& param)
+        {
+            auto& snapshot = pendingParams[&param];
+            snapshot.clear();
+            for (const auto& v : param.values)
+                snapshot.push_back(v.value());
+        }
+
+        void EndParamEdit(Param& param)
+        {
+            auto it = pendingParams.find(&param);
+            if (it == pendingParams.end()) return;
+
+            Step step;
+            const auto& before = it->second;
+            for (uint32_t i = 0; i < param.values.size(); ++i)
+            {
+                const AnyParamType& after = param.values[i].value();
+                const AnyParamType old = i < before.size() ? before[i] : AnyParamType(nullptr);
+                if (old != after)
+                    step.params.push_back(ParamChange{ &param, i, old, after });
+            }
+            pendingParams.erase(it);
+
+            if (!step.params.empty())
+                Push(std::move(step));
+        }
+
+        void BeginMaskEdit(Mask& mask)
+        {
+            mask.BeginRecording();
+        }
+
+        void EndMaskEdit(Mask& mask)
+        {
+            Step step;
+            for (const auto& delta : mask.EndRecording())
+                step.masks.push_back(MaskChange{ &mask, delta.tile, RLEEncode(delta.data.data(), delta.data.size()) });
+
+            if (!step.masks.empty())
+                Push(std::move(step));
+        }
+
+        bool CanUndo() const { return cursor > 0; }
+        bool CanRedo() const { return cursor < steps.size(); }
+
+        // Affected mask tiles are flagged as dirty, affected params
+        // become dirty through their cached values.
+        bool Undo()
+        {
+            if (!CanUndo()) return false;
+
+            Apply(steps[--cursor], true);
+            return true;
+        }
+
+        bool Redo()
+        {
+            if (!CanRedo()) return false;
+
+            Apply(steps[cursor++], false);
+            return true;
+        }
+
+        void Clear()
+        {
+            steps.clear();
+            pendingParams.clear();
+            cursor = 0;
+            usage = 0;
+        }
+
+        size_t StepCount() const { return steps.size(); }
+        size_t MemoryUsage() const { return usage; }
+        size_t GetBudget() const { return budget; }
+        void SetBudget(size_t b) { budget = b; Shrink(); }
+
+    private:
+        // Number of oldest steps folded together when the budget is exceeded
+        static constexpr size_t COMPACT_BATCH = 8;
+
+        struct ParamChange
+        {
+            Param* param;
+            uint32_t index;
+            AnyParamType before;
+            AnyParamType after;
+        };
+
+        struct MaskChange
+        {
+            Mask* mask;
+            uint32_t tile;
+            std::vector<uint8_t> rle;
+        };
+
+        struct Step
+        {
+            std::vector<ParamChange> params;
+            std::vector<MaskChange>  masks;
+
+            size_t Size() const
+            {
+                size_t s = sizeof(Step) + params.size() * sizeof(ParamChange);
+                for (const auto& m : masks)
+                    s += sizeof(MaskChange) + m.rle.size();
+                return s;
+            }
+        };
+
+        void Apply(const Step& step, bool undo)
+        {
+            for (const auto& p : step.params)
+            {
+                if (p.index >= p.param->values.size())
+                    p.param->values.resize(p.index + 1);
+                p.param->values[p.index] = undo ? p.before : p.after;
+            }
+
+            for (const auto& m : step.masks)
+            {
+                const Rect r = m.mask->GetTiles().TileRect(m.tile);
+                Mask::TileDelta delta{ m.tile, std::vector<MaskDataType>(r.width * r.height) };
+
+                // Rle stores zeros as runs: decoding into a zeroed buffer gives the xor delta
+                RLEDecode(m.rle.data(), m.rle.size(), delta.data.data(), delta.data.size());
+                m.mask->ApplyDelta(delta);
+            }
+        }
+
+        void Push(Step&& step)
+        {
+            // Recording a new step drops the redo branch
+            while (steps.size() > cursor)
+            {
+                usage -= steps.back().Size();
+                steps.pop_back();
+            }
+
+            usage += step.Size();
+            steps.push_back(std::move(step));
+            cursor = steps.size();
+
+            Shrink();
+        }
+
+        void Shrink()
+        {
+            if (usage <= budget) return;
+
+            Compact();
+
+            // Redo steps go first, they are the least likely to be used
+            while (usage > budget && steps.size() > cursor)
+            {
+                usage -= steps.back().Size();
+                steps.pop_back();
+            }
+
+            // Then the oldest undo steps. The step under the cursor is kept
+            // even over budget.
+            while (usage > budget && cursor > 1)
+            {
+                usage -= steps.front().Size();
+                steps.pop_front();
+                cursor--;
+            }
+        }
+
+        // Folds the oldest steps into a single one: only the oldest 'before'
+        // and newest 'after' of a param value are kept and deltas on the
+        // same tile are xor-ed together. Granularity of old history is lost,
+        // but overlapping edits (brush strokes) shrink a lot.
+        void Compact()
+        {
+            const size_t count = std::min(COMPACT_BATCH, cursor);
+            if (count < 2) return;
+
+            Step merged;
+            std::unordered_map<const Param*, std::unordered_map<uint32_t, size_t>> paramIdx;
+            std::unordered_map<const Mask*,  std::unordered_map<uint32_t, std::vector<uint8_t>>> tiles;
+
+            for (size_t s = 0; s < count; ++s)
+            {
+                for (auto& p : steps[s].params)
+                {
+                    auto it = paramIdx[p.param].find(p.index);
+                    if (it == paramIdx[p.param].end())
+                    {
+                        paramIdx[p.param][p.index] = merged.params.size();
+                        merged.params.push_back(p);
+                    }
+                    else
+                    {
+                        merged.params[it->second].after = p.after;
+                    }
+                }
+
+                for (auto& m : steps[s].masks)
+                {
+                    const Rect r = m.mask->GetTiles().TileRect(m.tile);
+                    auto& buffer = tiles[m.mask][m.tile];
+                    if (buffer.empty())
+                        buffer.resize(r.width * r.height, 0);
+                    RLEDecode(m.rle.data(), m.rle.size(), buffer.data(), buffer.size(), true);
+                }
+            }
+
+            for (auto& [mask, deltas] : tiles)
+                for (auto& [tile, buffer] : deltas)
+                    merged.masks.push_back(MaskChange{ const_cast<Mask*>(mask), tile, RLEEncode(buffer.data(), buffer.size()) });
+
+            for (size_t s = 0; s < count; ++s)
+            {
+                usage -= steps.front().Size();
+                steps.pop_front();
+            }
+
+            usage += merged.Size();
+            steps.push_front(std::move(merged));
+            cursor -= count - 1;
+        }
+
+    private:
+        size_t budget;
+        size_t usage  = 0;
+        size_t cursor = 0;
+
+        std::deque<Step> steps;
+        std::unordered_map<const Param*, std::vector<AnyParamType>> pendingParams;
+    };
+}
@@ -0,0 +1,116 @@
+#pragma once
+
+#include <array>
+#include <cmath>
+#include <string>
+#include <algorithm>
+
+namespace RawEdit
+{
+    // Row major 3x3 matrix
+    using Mat3 = std::array<float, 9>;
+
+    constexpr Mat3 IDENTITY3 = { 1.f, 0.f, 0.f, 0.f, 1.f, 0.f, 0.f, 0.f, 1.f };
+
+    inline Mat3 Multiply(const Mat3& a, const Mat3& b)
+    {
+        Mat3 r{};
+        for (uint32_t i = 0; i < 3; ++i)
+            for (uint32_t j = 0; j < 3; ++j)
+                for (uint32_t k = 0; k < 3; ++k)
+                    r[i * 3 + j] += a[i * 3 + k] * b[k * 3 + j];
+        return r;
+    }
+
+    inline Mat3 Inverse(const Mat3& m)
+    {
+        const float a = m[0], b = m[1], c = m[2];
+        const float d = m[3], e = m[4], f = m[5];
+        const float g = m[6], h = m[7], i = m[8];
+
+        const float A = e * i - f * h, B = f * g - d * i, C = d * h - e * g;
+        const float det = a * A + b * B + c * C;
+        if (std::abs(det) < 1e-12f) return IDENTITY3;
+
+        const float s = 1.f / det;
+        return {
+            A * s, (c * h - b * i) * s, (b * f - c * e) * s,
+            B * s, (a * i - c * g) * s, (c * d - a * f) * s,
+            C * s, (b * g - a * h) * s, (a * e - b * d) * s
+        };
+    }
+
+    enum class TransferFunction
+    {
+        Linear,
+        SRGB,
+        Rec709,
+        Gamma22,
+        Gamma18
+    };
+
+    // Linear light [0, 1] to encoded value
+    inline float EncodeTransfer(TransferFunction t, float v)
+    {
+        v = std::clamp(v, 0.f, 1.f);
+        switch (t)
+        {
+        case TransferFunction::SRGB:    return v <= 0.0031308f ? 12.92f * v : 1.055f * std::pow(v, 1.f / 2.4f) - 0.055f;
+        case TransferFunction::Rec709:  return v < 0.018f ? 4.5f * v : 1.099f * std::pow(v, 0.45f) - 0.099f;
+        case TransferFunction::Gamma22: return std::pow(v, 256.f / 563.f);
+        case TransferFunction::Gamma18: return std::pow(v, 1.f / 1.8f);
+        default:                        return v;
+        }
+    }
+
+    inline float DecodeTransfer(TransferFunction t, float v)
+    {
+        v = std::clamp(v, 0.f, 1.f);
+        switch (t)
+        {
+        case TransferFunction::SRGB:    return v <= 0.04045f ? v / 12.92f : std::pow((v + 0.055f) / 1.055f, 2.4f);
+        case TransferFunction::Rec709:  return v < 0.081f ? v / 4.5f : std::pow((v + 0.099f) / 1.099f, 1.f / 0.45f);
+        case TransferFunction::Gamma22: return std::pow(v, 563.f / 256.f);
+        case TransferFunction::Gamma18: return std::pow(v, 1.8f);
+        default:                        return v;
+        }
+    }
+
+    // RGB spaces with their primaries to XYZ (D65, ProPhoto is Bradford
+    // adapted from D50) and their transfer function
+    struct ColorSpace
+    {
+        const char* name;
+        Mat3 toXYZ;
+        TransferFunction transfer;
+    };
+
+    // Raw images are in camera space, see MetaData::cameraMatrix
+    constexpr const char* CAMERA_SPACE = "Camera";
+
+    inline const std::array<ColorSpace, 6>& ColorSpaces()
+    {
+        static constexpr Mat3 SRGB     = { 0.4124564f, 0.3575761f, 0.1804375f, 0.2126729f, 0.7151522f, 0.0721750f, 0.0193339f, 0.1191920f, 0.9503041f };
+        static constexpr Mat3 ADOBE    = { 0.5767309f, 0.1855540f, 0.1881852f, 0.2973769f, 0.6273491f, 0.0752741f, 0.0270343f, 0.0706872f, 0.9911085f };
+        static constexpr Mat3 PROPHOTO = { 0.7556032f, 0.1127849f, 0.0820818f, 0.2683380f, 0.7151268f, 0.0165353f, 0.0039100f,-0.0129187f, 1.0978387f };
+        static constexpr Mat3 REC2020  = { 0.6369580f, 0.1446169f, 0.1688810f, 0.2627002f, 0.6779981f, 0.0593017f, 0.0000000f, 0.0280727f, 1.0609851f };
+
+        static const std::array<ColorSpace, 6> spaces = {
+            ColorSpace{ "sRGB",             SRGB,     TransferFunction::SRGB    },
+            ColorSpace{ "Linear sRGB",      SRGB,     TransferFunction::Linear  },
+            ColorSpace{ "Adobe RGB",        ADOBE,    TransferFunction::Gamma22 },
+            ColorSpace{ "ProPhoto RGB",     PROPHOTO, TransferFunction::Gamma18 },
+            ColorSpace{ "Rec. 2020",        REC2020,  TransferFunction::Rec709  },
+            ColorSpace{ "Linear Rec. 2020", REC2020,  TransferFunction::Linear  },
+        };
+        return spaces;
+    }
+
+    inline const ColorSpace* FindColorSpace(const std::string& name)
+    {
+        for (const auto& s : ColorSpaces())
+            if (name == s.name)
+                return &s;
+        return nullptr;
+    }
+}
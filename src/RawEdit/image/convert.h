@@ -0,0 +1,222 @@
+#pragma once
+
+#include <limits>
+#include <cstddef>
+#include <cstring>
+#include <algorithm>
+#include <type_traits>
+#include "utils/kernel.h"
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64)
+    #include <immintrin.h>
+    #define RAWEDIT_X86 1
+#else
+    #define RAWEDIT_X86 0
+#endif
+
+namespace RawEdit
+{
+    struct ConvertOptions
+    {
+        // Maps integer types on their full range and floating types
+        // on [0, 1] (eg. uint8 255 <-> float 1.0 <-> uint16 65535)
+        bool normalize = true;
+        // Adds triangular noise before quantizing to uint8 to avoid
+        // banding in smooth gradients
+        bool dither = false;
+    };
+
+    template<typename T>
+    struct PixelTraits
+    {
+        static constexpr bool integer = std::is_integral_v<T>;
+        static constexpr double max = integer ? (double)std::numeric_limits<T>::max() : 1.0;
+    };
+
+    // Cheap integer hash of the element index giving a reproducible
+    // triangular noise in [-1, 1], vectorizes well.
+    RAWEDIT_INLINE float DitherNoise(uint32_t idx)
+    {
+        uint32_t h = idx * 0x9E3779B1u;
+        h ^= h >> 15;
+        h *= 0x85EBCA77u;
+        h ^= h >> 13;
+        const float a = (h & 0xFFFF) * (1.f / 65535.f);
+        const float b = (h >> 16)    * (1.f / 65535.f);
+        return a - b;
+    }
+
+    template<typename Src, typename Dst>
+    RAWEDIT_INLINE void ConvertRowImpl(const Src* src, Dst* dst, size_t n, size_t offset, bool normalize, bool dither)
+    {
+        using SrcT = PixelTraits<Src>;
+        using DstT = PixelTraits<Dst>;
+
+        // 32 bits integers and doubles do not fit in a float mantissa
+        constexpr bool wide = sizeof(Src) >= 4 && sizeof(Dst) >= 4 && (SrcT::integer || DstT::integer || sizeof(Src) == 8 || sizeof(Dst) == 8);
+        using Work = std::conditional_t<wide, double, float>;
+
+        if constexpr (std::is_same_v<Src, Dst>)
+        {
+            for (size_t i = 0; i < n; ++i)
+                dst[i] = src[i];
+        }
+        else if constexpr (SrcT::integer && DstT::integer && sizeof(Dst) > sizeof(Src))
+        {
+            // Widening integers: exact multiplication (257, 65537, 16843009)
+            const Dst mult = normalize ? static_cast<Dst>(DstT::max / SrcT::max) : Dst(1);
+            for (size_t i = 0; i < n; ++i)
+                dst[i] = static_cast<Dst>(src[i]) * mult;
+        }
+        else if constexpr (DstT::integer)
+        {
+            const Work scale = normalize ? static_cast<Work>(DstT::max / SrcT::max) : Work(1);
+            const Work hi = static_cast<Work>(DstT::max);
+            const bool noise = dither && sizeof(Dst) == 1;
+
+            for (size_t i = 0; i < n; ++i)
+            {
+                Work v = static_cast<Work>(src[i]) * scale + Work(0.5);
+                if (noise) v += static_cast<Work>(DitherNoise(offset + i));
+                dst[i] = static_cast<Dst>(std::clamp(v, Work(0), hi));
+            }
+        }
+        else
+        {
+            const Work scale = normalize ? static_cast<Work>(DstT::max / SrcT::max) : Work(1);
+            for (size_t i = 0; i < n; ++i)
+                dst[i] = static_cast<Dst>(static_cast<Work>(src[i]) * scale);
+        }
+    }
+    RAWEDIT_KERNEL(ConvertRow)
+
+    #if RAWEDIT_X86
+        RAWEDIT_TARGET("avx2,f16c") inline void HalfToFloatF16C(const std::float16_t* src, float* dst, size_t n)
+        {
+            size_t i = 0;
+            for (; i + 16 <= n; i += 16)
+            {
+                const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+                const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i + 8));
+                _mm256_storeu_ps(dst + i,     _mm256_cvtph_ps(a));
+                _mm256_storeu_ps(dst + i + 8, _mm256_cvtph_ps(b));
+            }
+            for (; i < n; ++i)
+                dst[i] = static_cast<float>(src[i]);
+        }
+
+        RAWEDIT_TARGET("avx2,f16c") inline void FloatToHalfF16C(const float* src, std::float16_t* dst, size_t n)
+        {
+            size_t i = 0;
+            for (; i + 16 <= n; i += 16)
+            {
+                const __m128i a = _mm256_cvtps_ph(_mm256_loadu_ps(src + i),     _MM_FROUND_TO_NEAREST_INT);
+                const __m128i b = _mm256_cvtps_ph(_mm256_loadu_ps(src + i + 8), _MM_FROUND_TO_NEAREST_INT);
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i),     a);
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i + 8), b);
+            }
+            for (; i < n; ++i)
+                dst[i] = static_cast<std::float16_t>(src[i]);
+        }
+    #endif
+
+    inline bool HasF16C()
+    {
+        return RAWEDIT_X86 && ActiveISA() >= ISA::AVX2;
+    }
+
+    // Converts a span that fits in cache. 'offset' is the position of the
+    // span in the whole buffer (keeps dithering independent of chunking)
+    template<typename Src, typename Dst>
+    void ConvertSpan(const Src* src, Dst* dst, size_t n, size_t offset, const ConvertOptions& opts)
+    {
+        static const auto kernel = RAWEDIT_SELECT_KERNEL(ConvertRow, Src, Dst);
+        constexpr bool srcHalf = std::is_same_v<Src, std::float16_t>;
+        constexpr bool dstHalf = std::is_same_v<Dst, std::float16_t>;
+
+        if constexpr (std::is_same_v<Src, Dst>)
+        {
+            memcpy(dst, src, n * sizeof(Src));
+        }
+        else if constexpr (RAWEDIT_X86 && (srcHalf || dstHalf))
+        {
+            if (!HasF16C())
+                return kernel(src, dst, n, offset, opts.normalize, opts.dither);
+
+            // Half floats go through float: F16C for the half part, regular kernels
+            // for the rest. Both have the same normalized range.
+            if constexpr (srcHalf && std::is_same_v<Dst, float>)
+            {
+                HalfToFloatF16C(src, dst, n);
+            }
+            else if constexpr (dstHalf && std::is_same_v<Src, float>)
+            {
+                FloatToHalfF16C(src, dst, n);
+            }
+            else
+            {
+                constexpr size_t SCRATCH = 2048;
+                float scratch[SCRATCH];
+                for (size_t start = 0; start < n; start += SCRATCH)
+                {
+                    const size_t count = std::min(SCRATCH, n - start);
+                    if constexpr (srcHalf)
+                    {
+                        HalfToFloatF16C(src + start, scratch, count);
+                        ConvertSpan(scratch, dst + start, count, offset + start, opts);
+                    }
+                    else
+                    {
+                        ConvertSpan(src + start, scratch, count, offset + start, opts);
+                        FloatToHalfF16C(scratch, dst + start, count);
+                    }
+                }
+            }
+        }
+        else
+        {
+            kernel(src, dst, n, offset, opts.normalize, opts.dither);
+        }
+    }
+
+    // Feeds 'op(const float* in, float* out, size_t count)' with cache sized 
+    // blocks of 'src' converted to (normalized) float and stores the result
+    // back in the type of 'dst'. Lets kernels compute in float registers
+    // whatever the storage type is (float16 in particular).
+    template<typename T, typename Op>
+    void ProcessAsFloat(const T* src, T* dst, size_t n, Op&& op)
+    {
+        if constexpr (std::is_same_v<T, float>)
+        {
+            op(src, dst, n);
+        }
+        else
+        {
+            // Multiple of 48 so that per channel patterns stay aligned (see pointop.h)
+            constexpr size_t BLOCK = 960;
+            alignas(64) float buffer[BLOCK];
+            for (size_t start = 0; start < n; start += BLOCK)
+            {
+                const size_t count = std::min(BLOCK, n - start);
+                ConvertSpan(src + start, buffer, count, start, {});
+                op(buffer, buffer, count);
+                ConvertSpan(buffer, dst + start, count, start, {});
+            }
+        }
+    }
+
+    // Element-wise conversion of a buffer, split in chunks among threads
+    template<typename Src, typename Dst>
+    void ConvertBuffer(const Src* src, Dst* dst, size_t n, const ConvertOptions& opts = {})
+    {
+        static constexpr size_t CHUNK = 1 << 16;
+
+        const int64_t chunks = (n + CHUNK - 1) / CHUNK;
+        #pragma omp parallel for if(chunks > 4)
+        for (int64_t c = 0; c < chunks; ++c)
+        {
+            const size_t start = c * CHUNK;
+            ConvertSpan(src + start, dst + start, std::min(CHUNK, n - start), start, opts);
+        }
+    }
+}
@@ -1,7 +1,9 @@
 #pragma once
 
 #include "imagebase.h"
+#include "convert.h"
 #include <cstring>
+#include <algorithm>
 
 namespace RawEdit
 {
@@ -31,33 +33,42 @@ namespace RawEdit
         void Resize(uint32_t w, uint32_t h, uint32_t c = 0)
         {
             if (c == 0) c = channels;
+
+            // Stages re-run on the same sizes: keep the (already mapped) buffer
+            if (data == nullptr || (size_t)w * h * c != (size_t)width * height * channels)
+            {
+                delete[] data;
+                data = new T[(size_t)w * h * c];
+            }
+
             width = w;
             height = h;
             channels = c;
-
-            delete[] data;
-            data = new T[w * h * c];
         }
 
-        uint32_t GetIndex(uint32_t i, uint32_t j, uint32_t c = 0) const
+        // 64 bits: images can hold more than 4G values
+        size_t GetIndex(uint32_t i, uint32_t j, uint32_t c = 0) const
         {
-            return c + (j + i * width) * channels;
+            return c + ((size_t)i * width + j) * channels;
         }
 
         template<typename U>
-        void SetData(uint32_t i, U val) { data[i] = val; }
+        void SetData(size_t i, U val) { data[i] = val; }
         template<typename U>
         void SetData(uint32_t i, uint32_t j, U val) { data[GetIndex(i, j, 0)] = val; }
         template<typename U>
         void SetData(uint32_t i, uint32_t j, uint32_t c, U val) { data[GetIndex(i, j, c)] = val; }
         
-        T& GetData(uint32_t i)       { return data[i]; }
-        T  GetData(uint32_t i) const { return data[i]; }
+        T& GetData(size_t i)       { return data[i]; }
+        T  GetData(size_t i) const { return data[i]; }
         T& GetData(uint32_t i, uint32_t j, uint32_t c = 0)       { return data[GetIndex(i, j, c)]; }
         T  GetData(uint32_t i, uint32_t j, uint32_t c = 0) const { return data[GetIndex(i, j, c)]; }
 
         T* GetDataPtr() { return data; }
         const T* GetDataPtr() const { return data; }
+
+        void* RawData() override { return data; }
+        const void* RawData() const override { return data; }
         
         template<typename U>
         void FillData(uint32_t w, uint32_t h, uint32_t c, const U& val)
@@ -65,11 +76,10 @@ namespace RawEdit
             if (data == nullptr || w != width || h != height || c != channels)
             {
                 delete[] data;
-                data = new T[w * h * c];
+                data = new T[(size_t)w * h * c];
             }
 
-            for (uint32_t i = 0; i < w * h * c; ++i)
-                data[i] = val;
+            std::fill_n(data, (size_t)w * h * c, static_cast<T>(val));
 
             width = w;
             height = h;
@@ -84,7 +94,7 @@ namespace RawEdit
             if (w != width || h != height || c != channels)
             {
                 delete[] data;
-                data = new T[w * h * c];
+                data = new T[(size_t)w * h * c];
             }
 
             width = w;
@@ -93,14 +103,14 @@ namespace RawEdit
             
             if (type == newdatatype)
             {
-                memcpy(data, newdata, w * h * c * SizeofType(type));
+                memcpy(data, newdata, (size_t)w * h * c * SizeofType(type));
             }
             else
             {
+                // Values are rescaled to the range of T
                 DISPATCH_DATATYPE(newdatatype,
                     const DataType* typedData = reinterpret_cast<const DataType*>(newdata);
-                    for (size_t i = 0; i < w * h * c; ++i)
-                        data[i] = typedData[i];
+                    ConvertBuffer(typedData, data, (size_t)w * h * c);
                 );
             }
         }
@@ -0,0 +1,212 @@
+#pragma once
+
+#include <span>
+#include <tuple>
+#include "cpuimage.h"
+#include "tile.h"
+
+namespace RawEdit
+{
+    // Parallel iteration over CPUImages. The loops below are the only place
+    // deciding how work is split between threads: kernels get contiguous
+    // spans of interleaved values, which they loop over straight (and which
+    // the compiler vectorizes), and never deal with indices.
+    //
+    // Every image is clipped to the same region: the given ROI (in pixels)
+    // within the bounds of all the images. Images are passed last, const
+    // images give spans of const values.
+    //
+    // Kernels needing scratch buffers name a 'State' type first, as in
+    // ForEachRow<State>(...): every thread default-constructs one and it
+    // is given, first, to each call of fn made on that thread.
+
+    // Values (not pixels) a thread gets at least, below that threads cost
+    // more than they bring
+    constexpr size_t FOREACH_MIN_CHUNK = 1 << 15;
+
+    // Part of an image: rows of 'region' (image coordinates), 'stride'
+    // values apart
+    template<typename T>
+    struct ImageView
+    {
+        T* data = nullptr;
+        size_t stride = 0;
+        uint32_t channels = 0;
+        Rect region;
+
+        std::span<T> Row(uint32_t y) const
+        {
+            return { data + (size_t)(y - region.y) * stride, (size_t)region.width * channels };
+        }
+        T* At(uint32_t x, uint32_t y) const
+        {
+            return data + (size_t)(y - region.y) * stride + (size_t)(x - region.x) * channels;
+        }
+    };
+
+    namespace Detail
+    {
+        template<typename I>
+        struct ElementOf;
+        template<typename T>
+        struct ElementOf<CPUImage<T>> { using Type = T; };
+        template<typename T>
+        struct ElementOf<const CPUImage<T>> { using Type = const T; };
+
+        template<typename I>
+        using ViewOf = ImageView<typename ElementOf<I>::Type>;
+
+        template<typename I>
+        ViewOf<I> MakeView(I* img, const Rect& r)
+        {
+            const size_t stride = (size_t)img->width * img->channels;
+            return { img->GetDataPtr() + (size_t)r.y * stride + (size_t)r.x * img->channels, stride, img->channels, r };
+        }
+
+        template<typename... Is>
+        Rect Clip(Rect roi, Is*... imgs)
+        {
+            ((roi = roi.Intersect(Rect{ 0, 0, imgs->width, imgs->height })), ...);
+            return roi;
+        }
+
+        template<typename I, typename... Is>
+        Rect Bounds(I* first, Is*...)
+        {
+            return Rect{ 0, 0, first->width, first->height };
+        }
+
+        // Tiles of 'roi', aligned on its origin
+        inline Rect TileOf(const Rect& roi, uint32_t tileSize, uint32_t tilesX, uint32_t idx)
+        {
+            const uint32_t x = roi.x + (idx % tilesX) * tileSize;
+            const uint32_t y = roi.y + (idx / tilesX) * tileSize;
+            return Rect{ x, y, std::min(tileSize, roi.Right() - x), std::min(tileSize, roi.Bottom() - y) };
+        }
+
+        inline Rect Grow(const Rect& r, uint32_t halo)
+        {
+            const uint32_t x = r.x > halo ? r.x - halo : 0;
+            const uint32_t y = r.y > halo ? r.y - halo : 0;
+            return Rect{ x, y, r.Right() + halo - x, r.Bottom() + halo - y };
+        }
+
+        // State of the loops without one
+        struct NoState {};
+
+        // fn(state, tile) for the tiles of 'r', handed out dynamically
+        template<typename State, typename Fn>
+        void ForEachTileRect(const Rect& r, uint32_t tileSize, Fn&& fn)
+        {
+            if (r.Empty() || tileSize == 0) return;
+
+            const uint32_t tilesX = (r.width  + tileSize - 1) / tileSize;
+            const uint32_t tilesY = (r.height + tileSize - 1) / tileSize;
+            const uint32_t count = tilesX * tilesY;
+
+            #pragma omp parallel if(count > 1)
+            {
+                State state;
+
+                #pragma omp for schedule(dynamic)
+                for (uint32_t idx = 0; idx < count; ++idx)
+                    fn(state, TileOf(r, tileSize, tilesX, idx));
+            }
+        }
+    }
+
+    // 'r' grown to the whole tiles of a grid aligned on the image origin,
+    // within 'bounds': loops writing whole tiles of a region (TileGrid
+    // tiles) then split it the same way whatever the region.
+    inline Rect AlignToTiles(const Rect& r, uint32_t tileSize, const Rect& bounds)
+    {
+        const Rect clipped = r.Intersect(bounds);
+        if (clipped.Empty() || tileSize == 0) return clipped;
+
+        const uint32_t x = clipped.x / tileSize * tileSize;
+        const uint32_t y = clipped.y / tileSize * tileSize;
+        const uint32_t right  = (clipped.Right()  + tileSize - 1) / tileSize * tileSize;
+        const uint32_t bottom = (clipped.Bottom() + tileSize - 1) / tileSize * tileSize;
+        return Rect{ x, y, right - x, bottom - y }.Intersect(bounds);
+    }
+
+    // fn(state, y, row...) for every row of 'roi', row being the span of
+    // 'roi' in each image. Consecutive rows go to the same thread.
+    template<typename State, typename Fn, typename... Is>
+    void ForEachRow(const Rect& roi, Fn&& fn, Is*... imgs)
+    {
+        const Rect r = Detail::Clip(roi, imgs...);
+        if (r.Empty()) return;
+
+        const auto views = std::make_tuple(Detail::MakeView(imgs, r)...);
+        const size_t rowValues = (size_t)r.width * std::max({ imgs->channels... });
+        const uint32_t rowsPerChunk = (uint32_t)std::max<size_t>(1, FOREACH_MIN_CHUNK / std::max<size_t>(rowValues, 1));
+        const uint32_t chunks = (r.height + rowsPerChunk - 1) / rowsPerChunk;
+
+        #pragma omp parallel if(chunks > 1)
+        {
+            State state;
+
+            #pragma omp for schedule(static)
+            for (uint32_t chunk = 0; chunk < chunks; ++chunk)
+            {
+                const uint32_t y0 = r.y + chunk * rowsPerChunk;
+                const uint32_t y1 = std::min(y0 + rowsPerChunk, r.Bottom());
+                for (uint32_t y = y0; y < y1; ++y)
+                    std::apply([&](const auto&... v) { fn(state, y, v.Row(y)...); }, views);
+            }
+        }
+    }
+
+    // fn(y, row...), without state
+    template<typename Fn, typename... Is>
+    void ForEachRow(const Rect& roi, Fn&& fn, Is*... imgs)
+    {
+        ForEachRow<Detail::NoState>(roi, [&](Detail::NoState&, uint32_t y, auto... rows) { fn(y, rows...); }, imgs...);
+    }
+
+    // Whole images (the size of the first one)
+    template<typename Fn, typename I, typename... Is>
+        requires (!std::is_same_v<std::remove_cvref_t<Fn>, Rect>)
+    void ForEachRow(Fn&& fn, I* img, Is*... imgs)
+    {
+        ForEachRow(Detail::Bounds(img), std::forward<Fn>(fn), img, imgs...);
+    }
+
+    // fn(state, tile, view...) for every 'tileSize' square of 'roi', the
+    // views covering the tile in each image. Tiles are handed out
+    // dynamically: for kernels whose cost varies over the image.
+    template<typename State, typename Fn, typename... Is>
+    void ForEachTile(const Rect& roi, uint32_t tileSize, Fn&& fn, Is*... imgs)
+    {
+        Detail::ForEachTileRect<State>(Detail::Clip(roi, imgs...), tileSize, [&](State& state, const Rect& tile) {
+            fn(state, tile, Detail::MakeView(imgs, tile)...);
+        });
+    }
+
+    // fn(tile, view...), without state
+    template<typename Fn, typename... Is>
+    void ForEachTile(const Rect& roi, uint32_t tileSize, Fn&& fn, Is*... imgs)
+    {
+        ForEachTile<Detail::NoState>(roi, tileSize, [&](Detail::NoState&, const Rect& tile, auto... views) { fn(tile, views...); }, imgs...);
+    }
+
+    // Same with views grown by 'halo' pixels on each side (within the
+    // image bounds, not the ROI): neighbourhood kernels read around 'tile'
+    // and write 'tile' only.
+    template<typename State, typename Fn, typename... Is>
+    void ForEachTileWithHalo(const Rect& roi, uint32_t tileSize, uint32_t halo, Fn&& fn, Is*... imgs)
+    {
+        const Rect bounds = Detail::Clip(Detail::Bounds(imgs...), imgs...);
+        Detail::ForEachTileRect<State>(roi.Intersect(bounds), tileSize, [&](State& state, const Rect& tile) {
+            const Rect grown = Detail::Grow(tile, halo).Intersect(bounds);
+            fn(state, tile, Detail::MakeView(imgs, grown)...);
+        });
+    }
+
+    template<typename Fn, typename... Is>
+    void ForEachTileWithHalo(const Rect& roi, uint32_t tileSize, uint32_t halo, Fn&& fn, Is*... imgs)
+    {
+        ForEachTileWithHalo<Detail::NoState>(roi, tileSize, halo, [&](Detail::NoState&, const Rect& tile, auto... views) { fn(tile, views...); }, imgs...);
+    }
+}
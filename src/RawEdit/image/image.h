@@ -30,4 +30,37 @@ namespace RawEdit
     }
 
     #define DISPATCH_IMAGE_CALL(base, ...) std::visit([&](auto&& __dev) { using ImagePtr = decltype(__dev); __VA_ARGS__;}, ConvertBackend(base))
+
+    // Type erased conversion, covers every pair of DATATYPE_LIST
+    inline void ConvertBuffer(
+        ImageDataType srcType, const void* src, 
+        ImageDataType dstType, void* dst, 
+        size_t n, const ConvertOptions& opts = {}
+    )
+    {
+        DISPATCH_DATATYPE(srcType,
+            using SrcType = DataType;
+            DISPATCH_DATATYPE(dstType,
+                ConvertBuffer(reinterpret_cast<const SrcType*>(src), reinterpret_cast<DataType*>(dst), n, opts);
+            );
+        );
+    }
+
+    // Returns a new cpu image holding the converted data of 'img'
+    inline ImagePtr ConvertImage(const ImagePtr& img, ImageDataType type, const ConvertOptions& opts = {})
+    {
+        if (img->backend != ImageBackend::CPU)
+            return nullptr;
+
+        ImagePtr result;
+        DISPATCH_DATATYPE(type,
+            auto typed = std::make_shared<CPUImage<DataType>>();
+            typed->Resize(img->width, img->height, img->channels);
+            typed->metadata = img->metadata;
+            result = typed;
+        );
+
+        ConvertBuffer(img->type, img->RawData(), type, result->RawData(), (size_t)img->width * img->height * img->channels, opts);
+        return result;
+    }
 }
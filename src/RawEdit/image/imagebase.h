@@ -7,6 +7,8 @@
 #include <cstdint>
 #include <cassert>
 #include <string>
+#include <array>
+#include "colorspace.h"
 
 namespace RawEdit
 {
@@ -118,10 +120,50 @@ namespace RawEdit
 
     #define DISPATCH_DATATYPE(base, ...) std::visit([&](auto&& type) { using DataType = std::remove_cvref_t<decltype(type)>::Type; __VA_ARGS__;}, ConvertDataType(base))
 
+    // Color filter array of a mosaic (single channel) image: color 
+    // (0: red, 1: green, 2: blue) of each photosite of the repeating 
+    // pattern. Size is 2 for Bayer, 6 for X-Trans and 0 if not a mosaic.
+    struct CFAPattern
+    {
+        uint32_t size = 0;
+        std::array<uint8_t, 36> colors{};
+
+        uint8_t At(int64_t i, int64_t j) const
+        {
+            const int64_t s = size;
+            return colors[((i % s + s) % s) * size + ((j % s + s) % s)];
+        }
+    };
+
+    // Sensor levels of a raw image, normalized on the storage range
+    struct RawLevels
+    {
+        std::array<float, 3> black{ 0.f, 0.f, 0.f };
+        float white = 1.f;
+        // As shot white balance multipliers (green is 1)
+        std::array<float, 3> wbGains{ 1.f, 1.f, 1.f };
+    };
+
     struct MetaData
     {
         std::string source = "";
         std::string path   = "";
+        CFAPattern cfa;
+        RawLevels levels;
+
+        // Name of the RGB space of the data (see colorspace.h), camera RGB
+        // of raw images is converted to XYZ by the camera matrix
+        std::string colorSpace = "sRGB";
+        Mat3 cameraMatrix = IDENTITY3;
+
+        // EXIF orientation of the stored pixels (1: as is, 2-8: flips and
+        // rotations to apply for display, see Geometry)
+        uint8_t orientation = 1;
+
+        // Exposure settings of the shot, 0 when unknown
+        float exposureTime = 0.f; // seconds
+        float aperture     = 0.f; // f-number
+        float iso          = 0.f;
     };
 
     struct ImageBase
@@ -134,6 +176,10 @@ namespace RawEdit
         virtual ImageBase* EmptyCopy(bool metadata) const = 0;
         virtual ImageBase* Copy() const = 0;
 
+        // Untyped access to the pixel buffer, interpreted with 'type'
+        virtual void* RawData() = 0;
+        virtual const void* RawData() const = 0;
+
         virtual ~ImageBase() { }
 
         ImageBase(const ImageBase&) = delete;
@@ -1,8 +1,11 @@
-#pragma one
+#pragma once
 
 #include <cmath>
+#include <cstring>
 #include <algorithm>
+#include <unordered_map>
 #include "image.h"
+#include "tile.h"
 
 namespace RawEdit
 {
@@ -12,17 +15,33 @@ namespace RawEdit
     public:
         static constexpr unsigned int MAX_MASK_COUNT = sizeof(MaskDataType) * 8;
 
+        // Xor between the content of a tile before and after an edit.
+        // Applying it twice leaves the tile unchanged, so the same
+        // delta serves for undo and redo.
+        struct TileDelta
+        {
+            uint32_t tile;
+            std::vector<MaskDataType> data;
+        };
+
         Mask()
         { }
 
-        Mask(uint32_t w, uint32_t h, bool on = true) 
+        Mask(uint32_t w, uint32_t h, bool on = true)
         {
             FillData(w, h, 1, on);
             updated = true;
             currentMaskCount = 1;
         }
 
-        uint32_t GetMaskCount() const 
+        template<typename U>
+        void FillData(uint32_t w, uint32_t h, uint32_t c, const U& val)
+        {
+            CPUImage<MaskDataType>::FillData(w, h, c, val);
+            tiles.Reset(w, h);
+        }
+
+        uint32_t GetMaskCount() const
         {
             return currentMaskCount;
         }
@@ -32,32 +51,105 @@ namespace RawEdit
             currentMaskCount ++;
         }
 
+        // Replaces the whole content (eg. with a saved one): 'count' masks
+        // of 'w' x 'h'
+        void Restore(uint32_t w, uint32_t h, uint32_t count, const MaskDataType* content)
+        {
+            FillData(w, h, 1, 0);
+            memcpy(data, content, (size_t)w * h * sizeof(MaskDataType));
+            currentMaskCount = count;
+            updated = true;
+        }
+
         void Circle(MaskDataType mId, uint32_t x, uint32_t y, float radius)
         {
             if (radius < 0) return;
 
-            const uint32_t b1 = std::round(radius);
-            const uint32_t bound = b1 + !(b1 & 1);
+            const int32_t b1 = std::round(radius);
+            const int32_t bound = b1 + !(b1 & 1);
 
-            for (int i = -bound; i <= bound; ++i)
+            for (int32_t i = -bound; i <= bound; ++i)
             {
-                for (int j = -bound; j <= bound; ++j)
+                for (int32_t j = -bound; j <= bound; ++j)
                 {
+                    const int64_t xi = (int64_t)x + j;
+                    const int64_t yi = (int64_t)y + i;
+                    if (xi < 0 || yi < 0 || xi >= width || yi >= height)
+                        continue;
+
                     if ((i * i + j * j) < bound * bound)
-                    {
-                        const uint32_t xi = std::clamp(x + j, 0u, width);
-                        const uint32_t yi = std::clamp(y + i, 0u, height);
                         Set(mId, xi, yi, true);
-                    }
                 }
             }
         }
 
         void Set(MaskDataType mId, uint32_t x, uint32_t y, bool value)
         {
-            SetData(x, y, 1, GetData(x, y, 1) & ~((MaskDataType)1 << mId) | ((MaskDataType)value << mId));
+            const uint32_t tile = tiles.TileIndex(x, y);
+            if (recording && !snapshots.contains(tile))
+                snapshots[tile] = ExtractTile(tile);
+
+            tiles.MarkDirty(tile);
+            SetData(y, x, (GetData(y, x) & ~((MaskDataType)1 << mId)) | ((MaskDataType)value << mId));
+        }
+
+        // Starts tracking edits: the first modification of a tile
+        // keeps a copy of its previous content.
+        void BeginRecording()
+        {
+            recording = true;
+            snapshots.clear();
         }
 
+        // Stops tracking edits and returns what changed since BeginRecording
+        std::vector<TileDelta> EndRecording()
+        {
+            std::vector<TileDelta> deltas;
+            for (auto& [tile, before] : snapshots)
+            {
+                std::vector<MaskDataType> after = ExtractTile(tile);
+                bool changed = false;
+                for (size_t k = 0; k < after.size(); ++k)
+                {
+                    after[k] ^= before[k];
+                    changed = changed || after[k] != 0;
+                }
+
+                if (changed)
+                    deltas.push_back(TileDelta{ tile, std::move(after) });
+            }
+
+            recording = false;
+            snapshots.clear();
+            return deltas;
+        }
+
+        void ApplyDelta(const TileDelta& delta)
+        {
+            const Rect r = tiles.TileRect(delta.tile);
+            for (uint32_t i = 0; i < r.height; ++i)
+            {
+                MaskDataType* row = data + GetIndex(r.y + i, r.x);
+                const MaskDataType* drow = delta.data.data() + i * r.width;
+                for (uint32_t j = 0; j < r.width; ++j)
+                    row[j] ^= drow[j];
+            }
+            tiles.MarkDirty(delta.tile);
+            updated = true;
+        }
+
+        std::vector<MaskDataType> ExtractTile(uint32_t tile) const
+        {
+            const Rect r = tiles.TileRect(tile);
+            std::vector<MaskDataType> content(r.width * r.height);
+            for (uint32_t i = 0; i < r.height; ++i)
+                memcpy(content.data() + i * r.width, data + GetIndex(r.y + i, r.x), r.width * sizeof(MaskDataType));
+            return content;
+        }
+
+        TileGrid& GetTiles() { return tiles; }
+        const TileGrid& GetTiles() const { return tiles; }
+
         bool Updated()
         {
             if (updated)
@@ -74,6 +166,9 @@ namespace RawEdit
     private:
         uint32_t currentMaskCount = 0;
         bool updated = false;
+
+        TileGrid tiles;
+        bool recording = false;
+        std::unordered_map<uint32_t, std::vector<MaskDataType>> snapshots;
     };
 }
-
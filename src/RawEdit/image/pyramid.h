@@ -0,0 +1,123 @@
+#pragma once
+
+#include <vector>
+#include "image.h"
+#include "tile.h"
+#include "foreach.h"
+#include "utils/kernel.h"
+
+namespace RawEdit
+{
+    // 2x2 box average of two source rows, the last column is repeated
+    // for odd widths
+    template<typename T>
+    RAWEDIT_INLINE void Downsample2xRowImpl(const T* r0, const T* r1, T* dst, uint32_t x0, uint32_t x1, uint32_t srcWidth, uint32_t c)
+    {
+        constexpr float round = std::is_integral_v<T> ? 0.5f : 0.f;
+        for (uint32_t x = x0; x < x1; ++x)
+        {
+            const uint32_t a = 2 * x * c;
+            const uint32_t b = std::min(2 * x + 1, srcWidth - 1) * c;
+            for (uint32_t k = 0; k < c; ++k)
+            {
+                const float sum = (float)r0[a + k] + (float)r0[b + k] + (float)r1[a + k] + (float)r1[b + k];
+                dst[x * c + k] = static_cast<T>(sum * 0.25f + round);
+            }
+        }
+    }
+    RAWEDIT_KERNEL(Downsample2xRow)
+
+    // Successive half resolution copies of an image, down to MIN_SIZE.
+    // Level 0 is the image itself (shared, not copied). Levels are
+    // updated by region, so that edits only cost what they touch.
+    class Pyramid
+    {
+    public:
+        static constexpr uint32_t MIN_SIZE = 64;
+
+        void Build(const ImagePtr& base)
+        {
+            levels.clear();
+            levels.push_back(base);
+
+            uint32_t w = base->width, h = base->height;
+            while (std::max(w, h) > MIN_SIZE && std::min(w, h) > 1)
+            {
+                w = (w + 1) / 2;
+                h = (h + 1) / 2;
+
+                ImagePtr level(base->EmptyCopy(true));
+                DISPATCH_DATATYPE(base->type,
+                    static_cast<CPUImage<DataType>*>(level.get())->Resize(w, h, base->channels);
+                );
+                levels.push_back(level);
+            }
+            Update(Rect{ 0, 0, base->width, base->height });
+        }
+
+        bool Matches(const ImagePtr& base) const
+        {
+            return !levels.empty() && levels[0] == base;
+        }
+
+        // Recomputes the levels covering 'region' (level 0 coordinates)
+        void Update(const Rect& region)
+        {
+            Rect r = region;
+            for (uint32_t l = 1; l < levels.size(); ++l)
+            {
+                const ImagePtr& src = levels[l - 1];
+                const ImagePtr& dst = levels[l];
+
+                // Pixels of this level touched by the region
+                r = Rect{ r.x / 2, r.y / 2, (r.Right() + 1) / 2 - r.x / 2, (r.Bottom() + 1) / 2 - r.y / 2 };
+                r = r.Intersect(Rect{ 0, 0, dst->width, dst->height });
+                if (r.Empty()) return;
+
+                DISPATCH_DATATYPE(src->type,
+                    Downsample(static_cast<const CPUImage<DataType>*>(src.get()), static_cast<CPUImage<DataType>*>(dst.get()), r);
+                );
+            }
+        }
+
+        uint32_t LevelCount() const { return levels.size(); }
+        const ImagePtr& Level(uint32_t l) const { return levels[l]; }
+
+        // Smallest level with at least 'pixels' pixels
+        uint32_t LevelFor(size_t pixels) const
+        {
+            uint32_t l = 0;
+            while (l + 1 < levels.size() && (size_t)levels[l + 1]->width * levels[l + 1]->height >= pixels)
+                ++l;
+            return l;
+        }
+
+        // Level 0 region to the (enclosing) region of level 'l'
+        Rect ToLevel(const Rect& r, uint32_t l) const
+        {
+            if (l == 0 || r.Empty()) return r;
+
+            const uint32_t s = 1u << l;
+            const uint32_t x0 = r.x / s, y0 = r.y / s;
+            const uint32_t x1 = (r.Right() + s - 1) / s, y1 = (r.Bottom() + s - 1) / s;
+            return Rect{ x0, y0, x1 - x0, y1 - y0 }.Intersect(Rect{ 0, 0, levels[l]->width, levels[l]->height });
+        }
+
+    private:
+        template<typename T>
+        static void Downsample(const CPUImage<T>* src, CPUImage<T>* dst, const Rect& r)
+        {
+            static const auto kernel = RAWEDIT_SELECT_KERNEL(Downsample2xRow, T);
+            const uint32_t c = src->channels;
+
+            // The kernel addresses whole rows, from column 0
+            ForEachRow(r, [&](uint32_t y, std::span<T> row) {
+                const T* r0 = src->GetDataPtr() + src->GetIndex(2 * y, 0);
+                const T* r1 = src->GetDataPtr() + src->GetIndex(std::min(2 * y + 1, src->height - 1), 0);
+                kernel(r0, r1, row.data() - (size_t)r.x * c, r.x, r.Right(), src->width, c);
+            }, dst);
+        }
+
+        std::vector<ImagePtr> levels;
+    };
+}
@@ -0,0 +1,145 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+namespace RawEdit
+{
+    struct Rect
+    {
+        uint32_t x = 0;
+        uint32_t y = 0;
+        uint32_t width  = 0;
+        uint32_t height = 0;
+
+        bool Empty() const { return width == 0 || height == 0; }
+        uint32_t Right()  const { return x + width;  }
+        uint32_t Bottom() const { return y + height; }
+
+        bool operator==(const Rect& other) const = default;
+
+        Rect Intersect(const Rect& other) const
+        {
+            const uint32_t x0 = std::max(x, other.x);
+            const uint32_t y0 = std::max(y, other.y);
+            const uint32_t x1 = std::min(Right(),  other.Right());
+            const uint32_t y1 = std::min(Bottom(), other.Bottom());
+
+            if (x1 <= x0 || y1 <= y0) return Rect{};
+            return Rect{ x0, y0, x1 - x0, y1 - y0 };
+        }
+
+        Rect Union(const Rect& other) const
+        {
+            if (Empty()) return other;
+            if (other.Empty()) return *this;
+
+            const uint32_t x0 = std::min(x, other.x);
+            const uint32_t y0 = std::min(y, other.y);
+            const uint32_t x1 = std::max(Right(),  other.Right());
+            const uint32_t y1 = std::max(Bottom(), other.Bottom());
+            return Rect{ x0, y0, x1 - x0, y1 - y0 };
+        }
+    };
+
+    // Splits an image in square tiles and keeps track of the ones
+    // that must be recomputed. Flags are bytes (and not std::vector<bool>)
+    // so that different tiles can be flagged from different threads.
+    class TileGrid
+    {
+    public:
+        static constexpr uint32_t DEFAULT_TILE_SIZE = 64;
+
+        TileGrid() {}
+        TileGrid(uint32_t w, uint32_t h, uint32_t ts = DEFAULT_TILE_SIZE)
+        {
+            Reset(w, h, ts);
+        }
+
+        void Reset(uint32_t w, uint32_t h, uint32_t ts = DEFAULT_TILE_SIZE)
+        {
+            width = w;
+            height = h;
+            tileSize = ts;
+            tilesX = (w + ts - 1) / ts;
+            tilesY = (h + ts - 1) / ts;
+            dirty.assign(tilesX * tilesY, 1);
+        }
+
+        bool Matches(uint32_t w, uint32_t h) const { return width == w && height == h; }
+
+        uint32_t TileSize()  const { return tileSize; }
+        uint32_t TilesX()    const { return tilesX; }
+        uint32_t TilesY()    const { return tilesY; }
+        uint32_t TileCount() const { return tilesX * tilesY; }
+
+        uint32_t TileIndex(uint32_t x, uint32_t y) const
+        {
+            return (x / tileSize) + (y / tileSize) * tilesX;
+        }
+
+        Rect TileRect(uint32_t idx) const
+        {
+            const uint32_t x = (idx % tilesX) * tileSize;
+            const uint32_t y = (idx / tilesX) * tileSize;
+            return Rect{ x, y, std::min(tileSize, width - x), std::min(tileSize, height - y) };
+        }
+
+        // Indices of all tiles overlapping the given region
+        std::vector<uint32_t> TilesIn(const Rect& r) const
+        {
+            std::vector<uint32_t> result;
+            const Rect clipped = r.Intersect(Rect{ 0, 0, width, height });
+            if (clipped.Empty()) return result;
+
+            for (uint32_t ty = clipped.y / tileSize; ty <= (clipped.Bottom() - 1) / tileSize; ++ty)
+                for (uint32_t tx = clipped.x / tileSize; tx <= (clipped.Right() - 1) / tileSize; ++tx)
+                    result.push_back(tx + ty * tilesX);
+            return result;
+        }
+
+        void MarkDirty(uint32_t idx) { dirty[idx] = 1; }
+        void MarkDirty(const Rect& r)
+        {
+            for (uint32_t idx : TilesIn(r))
+                dirty[idx] = 1;
+        }
+        void MarkAllDirty() { std::fill(dirty.begin(), dirty.end(), 1); }
+        void MarkClean(uint32_t idx) { dirty[idx] = 0; }
+
+        bool IsDirty(uint32_t idx) const { return dirty[idx] != 0; }
+        bool AnyDirty() const { return std::find(dirty.begin(), dirty.end(), 1) != dirty.end(); }
+
+        // Returns dirty tiles and flags them as clean
+        std::vector<uint32_t> PullDirty()
+        {
+            std::vector<uint32_t> result;
+            for (uint32_t i = 0; i < dirty.size(); ++i)
+            {
+                if (dirty[i])
+                {
+                    result.push_back(i);
+                    dirty[i] = 0;
+                }
+            }
+            return result;
+        }
+
+        Rect DirtyBounds() const
+        {
+            Rect bounds;
+            for (uint32_t i = 0; i < dirty.size(); ++i)
+                if (dirty[i]) bounds = bounds.Union(TileRect(i));
+            return bounds;
+        }
+
+    private:
+        uint32_t width  = 0;
+        uint32_t height = 0;
+        uint32_t tileSize = DEFAULT_TILE_SIZE;
+        uint32_t tilesX = 0;
+        uint32_t tilesY = 0;
+        std::vector<uint8_t> dirty;
+    };
+}
@@ -0,0 +1,368 @@
+#pragma once
+
+#include <list>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <filesystem>
+#include <unordered_map>
+#include "cpuimage.h"
+#include "utils/error.h"
+
+#if defined(_WIN32)
+    #define NOMINMAX
+    #include <windows.h>
+#else
+    #include <fcntl.h>
+    #include <unistd.h>
+    #include <sys/mman.h>
+#endif
+
+namespace RawEdit
+{
+    // Part of a store: 64 bit origin, the size of an image in memory
+    struct StoreRegion
+    {
+        uint64_t x = 0;
+        uint64_t y = 0;
+        uint32_t width  = 0;
+        uint32_t height = 0;
+
+        bool Empty() const { return width == 0 || height == 0; }
+        uint64_t Right()  const { return x + width;  }
+        uint64_t Bottom() const { return y + height; }
+    };
+
+    struct TileStoreOptions
+    {
+        uint32_t tileSize = 512;
+        // Tiles mapped at most (pinned ones excepted)
+        size_t residentBytes = size_t(1) << 30;
+        std::filesystem::path directory = std::filesystem::temp_directory_path();
+    };
+
+    // Image larger than memory, in square tiles of a scratch file (deleted
+    // with the store). Tiles are mapped on demand and unmapped least
+    // recently used first once residentBytes are mapped: what they hold
+    // goes back to the file through the page cache. Each tile is a
+    // contiguous block, rows of tileSize * channels values, so a tile
+    // reads as a small image. Unwritten tiles read as zeros and take no
+    // disk space. Tiles can be acquired from several threads.
+    class TileStore
+    {
+    public:
+        // A mapped tile, pinned (never unmapped) as long as this lives
+        class TileRef
+        {
+        public:
+            TileRef() = default;
+            TileRef(const TileRef&) = delete;
+            TileRef& operator=(const TileRef&) = delete;
+            TileRef(TileRef&& o) noexcept { *this = std::move(o); }
+            TileRef& operator=(TileRef&& o) noexcept
+            {
+                std::swap(store, o.store);
+                std::swap(index, o.index);
+                std::swap(data, o.data);
+                std::swap(region, o.region);
+                return *this;
+            }
+            ~TileRef() { if (store) store->Release(index); }
+
+            uint8_t* Data() const { return data; }
+            // Pixels of the store it covers (clipped on the last row and column)
+            const StoreRegion& Region() const { return region; }
+
+        private:
+            friend class TileStore;
+            TileStore* store = nullptr;
+            uint64_t index = 0;
+            uint8_t* data = nullptr;
+            StoreRegion region;
+        };
+
+        TileStore() = default;
+        TileStore(const TileStore&) = delete;
+        TileStore& operator=(const TileStore&) = delete;
+        ~TileStore() { Close(); }
+
+        Error Create(uint64_t w, uint64_t h, uint32_t c, ImageDataType t, const TileStoreOptions& opts = {})
+        {
+            Close();
+            if (w == 0 || h == 0 || c == 0 || opts.tileSize == 0)
+                return Failed("[Tile Store] - Can not create a {}x{} store with {} channels", w, h, c).error();
+
+            width = w;
+            height = h;
+            channels = c;
+            type = t;
+            options = opts;
+            tilesX = (w + opts.tileSize - 1) / opts.tileSize;
+            tilesY = (h + opts.tileSize - 1) / opts.tileSize;
+            // Mapping offsets must be multiples of the allocation granularity
+            constexpr size_t GRANULARITY = 1 << 16;
+            const size_t bytes = (size_t)opts.tileSize * opts.tileSize * c * SizeofType(t);
+            tileBytes = (bytes + GRANULARITY - 1) / GRANULARITY * GRANULARITY;
+            const uint64_t fileSize = tilesX * tilesY * tileBytes;
+
+        #if defined(_WIN32)
+            const std::filesystem::path path = opts.directory / ("rawedit-" + std::to_string(GetCurrentProcessId()) + "-" + std::to_string((uintptr_t)this) + ".tiles");
+            file = CreateFileW(path.c_str(), GENERIC_READ | GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE, nullptr);
+            if (file == INVALID_HANDLE_VALUE)
+            {
+                file = nullptr;
+                return Failed("[Tile Store] - Can not create a scratch file in '{}'", opts.directory.string()).error();
+            }
+            mapping = CreateFileMappingW(file, nullptr, PAGE_READWRITE, (DWORD)(fileSize >> 32), (DWORD)fileSize, nullptr);
+            if (mapping == nullptr)
+            {
+                Close();
+                return Failed("[Tile Store] - Can not reserve {} bytes of scratch", fileSize).error();
+            }
+        #else
+            std::string path = (opts.directory / "rawedit-XXXXXX").string();
+            fd = mkstemp(path.data());
+            if (fd < 0)
+                return Failed("[Tile Store] - Can not create a scratch file in '{}'", opts.directory.string()).error();
+            // Gone as soon as the store closes, whatever happens
+            unlink(path.c_str());
+            if (ftruncate(fd, (off_t)fileSize) != 0)
+            {
+                Close();
+                return Failed("[Tile Store] - Can not reserve {} bytes of scratch", fileSize).error();
+            }
+        #endif
+            return Ok();
+        }
+
+        void Close()
+        {
+            {
+                std::lock_guard lock(mutex);
+                for (auto& [index, tile] : resident)
+                    Unmap(tile);
+                resident.clear();
+                lru.clear();
+            }
+        #if defined(_WIN32)
+            if (mapping) CloseHandle(mapping);
+            if (file) CloseHandle(file);
+            mapping = nullptr;
+            file = nullptr;
+        #else
+            if (fd >= 0) ::close(fd);
+            fd = -1;
+        #endif
+            width = height = 0;
+        }
+
+        bool Valid() const { return width != 0; }
+        uint64_t Width()  const { return width;  }
+        uint64_t Height() const { return height; }
+        uint32_t Channels() const { return channels; }
+        ImageDataType Type() const { return type; }
+        uint32_t TileSize() const { return options.tileSize; }
+        uint64_t TilesX() const { return tilesX; }
+        uint64_t TilesY() const { return tilesY; }
+        const TileStoreOptions& Options() const { return options; }
+        size_t PixelSize() const { return (size_t)channels * SizeofType(type); }
+
+        // Given to the images read from the store
+        MetaData metadata;
+
+        size_t ResidentBytes() const
+        {
+            std::lock_guard lock(mutex);
+            return resident.size() * tileBytes;
+        }
+
+        Failable<TileRef> Acquire(uint64_t tx, uint64_t ty)
+        {
+            if (tx >= tilesX || ty >= tilesY)
+                return Failed("[Tile Store] - No tile {}, {}", tx, ty);
+
+            TileRef ref;
+            ref.index = ty * tilesX + tx;
+            {
+                std::lock_guard lock(mutex);
+                auto mapped = Map(ref.index);
+                if (!mapped)
+                    return Failed(mapped.error());
+                Tile& tile = **mapped;
+                ++tile.pins;
+                ref.data = tile.data;
+            }
+            ref.store = this;
+            const uint32_t ts = options.tileSize;
+            ref.region = StoreRegion{ tx * ts, ty * ts, (uint32_t)std::min<uint64_t>(ts, width - tx * ts), (uint32_t)std::min<uint64_t>(ts, height - ty * ts) };
+            return ref;
+        }
+
+        // Maps the tiles of 'r' and lets the system read them ahead, without
+        // waiting: a later Acquire finds them in memory
+        void Prefetch(const StoreRegion& r)
+        {
+            ForEachTileOf(r, [&](uint64_t tx, uint64_t ty) {
+                std::lock_guard lock(mutex);
+                auto mapped = Map(ty * tilesX + tx);
+                if (!mapped) return;
+            #if !defined(_WIN32)
+                madvise((*mapped)->data, tileBytes, MADV_WILLNEED);
+            #endif
+            });
+        }
+
+        // 'r' of the store in 'dst' (reused when it has the type of the
+        // store), the parts of 'r' out of the store are left as they are
+        Error Read(const StoreRegion& r, ImagePtr& dst)
+        {
+            if (dst == nullptr || dst->type != type || dst->backend != ImageBackend::CPU)
+            {
+                DISPATCH_DATATYPE(type, dst = std::make_shared<CPUImage<DataType>>(););
+            }
+            DISPATCH_DATATYPE(type,
+                static_cast<CPUImage<DataType>*>(dst.get())->Resize(r.width, r.height, channels);
+            );
+            dst->metadata = metadata;
+            return Copy(r, static_cast<uint8_t*>(dst->RawData()), true);
+        }
+
+        // The whole of 'src' at ('x', 'y'), clipped to the store
+        Error Write(const ImagePtr& src, uint64_t x, uint64_t y)
+        {
+            if (src->type != type || src->channels != channels || src->backend != ImageBackend::CPU)
+                return "[Tile Store] - The image and the store differ";
+            return Copy(StoreRegion{ x, y, src->width, src->height }, static_cast<uint8_t*>(src->RawData()), false);
+        }
+
+    private:
+        struct Tile
+        {
+            uint8_t* data = nullptr;
+            uint32_t pins = 0;
+            std::list<uint64_t>::iterator lru;
+        };
+
+        template<typename Fn>
+        void ForEachTileOf(const StoreRegion& r, Fn&& fn) const
+        {
+            if (r.Empty() || r.x >= width || r.y >= height) return;
+            const uint32_t ts = options.tileSize;
+            const uint64_t x1 = (std::min(r.Right(), width) - 1) / ts, y1 = (std::min(r.Bottom(), height) - 1) / ts;
+            for (uint64_t ty = r.y / ts; ty <= y1; ++ty)
+                for (uint64_t tx = r.x / ts; tx <= x1; ++tx)
+                    fn(tx, ty);
+        }
+
+        // Rows between 'r' of the store and 'image' ('r' sized)
+        Error Copy(const StoreRegion& r, uint8_t* image, bool toImage)
+        {
+            const size_t pixel = PixelSize();
+            const uint32_t ts = options.tileSize;
+            Error err;
+            ForEachTileOf(r, [&](uint64_t tx, uint64_t ty) {
+                if (!err.empty()) return;
+                auto tile = Acquire(tx, ty);
+                if (!tile)
+                {
+                    err = tile.error();
+                    return;
+                }
+                const StoreRegion& t = tile->Region();
+                const uint64_t x0 = std::max(r.x, t.x), x1 = std::min(r.Right(), t.Right());
+                const uint64_t y0 = std::max(r.y, t.y), y1 = std::min(r.Bottom(), t.Bottom());
+                const size_t bytes = (x1 - x0) * pixel;
+                for (uint64_t y = y0; y < y1; ++y)
+                {
+                    uint8_t* inTile = tile->Data() + ((y - t.y) * ts + (x0 - t.x)) * pixel;
+                    uint8_t* inImage = image + ((y - r.y) * r.width + (x0 - r.x)) * pixel;
+                    if (toImage) memcpy(inImage, inTile, bytes);
+                    else memcpy(inTile, inImage, bytes);
+                }
+            });
+            return err;
+        }
+
+        // Under the lock. Most recently used first in 'lru'.
+        Failable<Tile*> Map(uint64_t index)
+        {
+            auto it = resident.find(index);
+            if (it != resident.end())
+            {
+                lru.splice(lru.begin(), lru, it->second.lru);
+                return &it->second;
+            }
+
+            Evict(1);
+            const uint64_t offset = index * tileBytes;
+        #if defined(_WIN32)
+            void* ptr = MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, (DWORD)(offset >> 32), (DWORD)offset, tileBytes);
+            if (ptr == nullptr)
+        #else
+            void* ptr = mmap(nullptr, tileBytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, (off_t)offset);
+            if (ptr == MAP_FAILED)
+        #endif
+                return Failed("[Tile Store] - Can not map tile {}", index);
+
+            lru.push_front(index);
+            Tile& tile = resident[index];
+            tile.data = static_cast<uint8_t*>(ptr);
+            tile.lru = lru.begin();
+            return &tile;
+        }
+
+        // Unmaps unpinned tiles, oldest first, until 'incoming' more fit
+        void Evict(size_t incoming)
+        {
+            const size_t budget = std::max<size_t>(options.residentBytes / tileBytes, 1);
+            for (auto it = lru.end(); it != lru.begin() && resident.size() + incoming > budget;)
+            {
+                --it;
+                auto tile = resident.find(*it);
+                if (tile->second.pins > 0) continue;
+                Unmap(tile->second);
+                resident.erase(tile);
+                it = lru.erase(it);
+            }
+        }
+
+        void Unmap(Tile& tile)
+        {
+        #if defined(_WIN32)
+            UnmapViewOfFile(tile.data);
+        #else
+            munmap(tile.data, tileBytes);
+        #endif
+            tile.data = nullptr;
+        }
+
+        void Release(uint64_t index)
+        {
+            std::lock_guard lock(mutex);
+            auto it = resident.find(index);
+            if (it != resident.end() && it->second.pins > 0)
+                --it->second.pins;
+            Evict(0);
+        }
+
+        uint64_t width = 0;
+        uint64_t height = 0;
+        uint32_t channels = 0;
+        ImageDataType type = ImageDataType::FLOAT32;
+        TileStoreOptions options;
+        uint64_t tilesX = 0;
+        uint64_t tilesY = 0;
+        size_t tileBytes = 0;
+
+    #if defined(_WIN32)
+        HANDLE file = nullptr;
+        HANDLE mapping = nullptr;
+    #else
+        int fd = -1;
+    #endif
+
+        mutable std::mutex mutex;
+        std::unordered_map<uint64_t, Tile> resident;
+        std::list<uint64_t> lru;
+    };
+}
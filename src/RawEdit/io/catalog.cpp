@@ -0,0 +1,298 @@
+#include "catalog.h"
+#include "sidecar.h"
+#include "imageloader.h"
+
+#include <cstring>
+#include <fstream>
+#include <algorithm>
+#include <unordered_map>
+
+namespace RawEdit
+{
+    namespace fs = std::filesystem;
+
+    static constexpr char CATALOG_MAGIC[8] = { 'R', 'E', 'C', 'A', 'T', 'L', 'G', 0 };
+
+    static uint64_t Align8(uint64_t v)
+    {
+        return (v + 7) & ~7ull;
+    }
+
+    // [offset, offset + length) within [0, end), without overflowing
+    static bool Within(uint64_t offset, uint64_t length, uint64_t end)
+    {
+        return offset <= end && length <= end - offset;
+    }
+
+    static std::string Utf8Name(const fs::path& p)
+    {
+        const std::u8string name = p.filename().u8string();
+        return std::string(name.begin(), name.end());
+    }
+
+    static fs::path FromUtf8(std::string_view name)
+    {
+        return fs::path(std::u8string_view(reinterpret_cast<const char8_t*>(name.data()), name.size()));
+    }
+
+    // FNV-1a of a file content
+    static uint64_t HashFile(const fs::path& path)
+    {
+        std::ifstream in(path, std::ios::binary);
+        uint64_t hash = 0xcbf29ce484222325ull;
+        char buffer[4096];
+        while (in.read(buffer, sizeof(buffer)) || in.gcount() > 0)
+        {
+            for (std::streamsize i = 0; i < in.gcount(); ++i)
+                hash = (hash ^ (uint8_t)buffer[i]) * 0x100000001b3ull;
+        }
+        return hash;
+    }
+
+    Error Catalog::Open(const fs::path& dir)
+    {
+        header  = nullptr;
+        entries = nullptr;
+        folder  = dir;
+        if (Error err = file.Open((dir / CATALOG_FILE).string().c_str()); !err.empty())
+            return err;
+
+        // Everything entries and thumbnails point to must be in the file
+        const uint8_t* data = file.Data();
+        const size_t size = file.Size();
+        const auto* h = reinterpret_cast<const CatalogHeader*>(data);
+        const auto* e = reinterpret_cast<const CatalogEntry*>(data + sizeof(CatalogHeader));
+        bool valid = size >= sizeof(CatalogHeader) && std::memcmp(h->magic, CATALOG_MAGIC, 8) == 0 && h->version == CATALOG_VERSION &&
+                     h->fileSize == size && sizeof(CatalogHeader) + (uint64_t)h->count * sizeof(CatalogEntry) <= h->namesOffset &&
+                     Within(h->namesOffset, h->namesSize, h->thumbnailsOffset) && h->thumbnailsOffset <= size;
+        for (uint32_t i = 0; valid && i < h->count; ++i)
+        {
+            valid = (uint64_t)e[i].nameOffset + e[i].nameLength <= h->namesSize &&
+                    (e[i].thumbnailWidth == 0 || (e[i].thumbnailOffset >= h->thumbnailsOffset &&
+                     Within(e[i].thumbnailOffset, (uint64_t)e[i].thumbnailWidth * e[i].thumbnailHeight * 3, size)));
+        }
+        if (!valid)
+        {
+            file.Close();
+            return Failed("[Catalog] - '{}' is not a valid catalog", (dir / CATALOG_FILE).string()).error();
+        }
+
+        header  = h;
+        entries = e;
+        return Ok();
+    }
+
+    std::string_view Catalog::Name(uint32_t id) const
+    {
+        const char* names = reinterpret_cast<const char*>(file.Data() + header->namesOffset);
+        return std::string_view(names + entries[id].nameOffset, entries[id].nameLength);
+    }
+
+    fs::path Catalog::Path(uint32_t id) const
+    {
+        return folder / FromUtf8(Name(id));
+    }
+
+    std::optional<uint32_t> Catalog::Find(std::string_view name) const
+    {
+        uint32_t lo = 0, hi = Size();
+        while (lo < hi)
+        {
+            const uint32_t mid = (lo + hi) / 2;
+            if (Name(mid) < name)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        if (lo < Size() && Name(lo) == name)
+            return lo;
+        return std::nullopt;
+    }
+
+    Error Catalog::Update(const fs::path& dir, std::vector<Error>* skipped)
+    {
+        // Whatever was there, unchanged files are taken from it
+        if (header == nullptr || folder != dir)
+            Open(dir);
+        folder = dir;
+
+        struct Stat
+        {
+            int64_t mtime = 0;
+            uint64_t size = 0;
+        };
+        struct Scanned
+        {
+            std::string name;
+            Stat stat;
+            Stat edit;
+            uint64_t editHash = 0;
+        };
+        std::vector<Scanned> files;
+        std::unordered_map<std::string, Stat> sidecars;
+
+        // One listing, the size and time of each file cost a stat
+        std::error_code ec;
+        for (const auto& e : fs::directory_iterator(dir, ec))
+        {
+            std::error_code fileError;
+            if (!e.is_regular_file(fileError)) continue;
+            std::string name = Utf8Name(e.path());
+            if (name == CATALOG_FILE) continue;
+
+            const bool sidecar = name.ends_with(SIDECAR_EXTENSION);
+            if (!sidecar && !IsImageFile(e.path().string().c_str())) continue;
+            const Stat stat{ e.last_write_time(fileError).time_since_epoch().count(), e.file_size(fileError) };
+            if (sidecar)
+                sidecars.emplace(std::move(name), stat);
+            else
+                files.push_back({ std::move(name), stat });
+        }
+        if (ec)
+            return Failed("[Catalog] - Can not list '{}': {}", dir.string(), ec.message()).error();
+
+        // Unchanged sidecars keep their hash
+        std::sort(files.begin(), files.end(), [](const Scanned& a, const Scanned& b) { return a.name < b.name; });
+        for (auto& f : files)
+        {
+            auto it = sidecars.find(f.name + SIDECAR_EXTENSION);
+            if (it == sidecars.end()) continue;
+
+            f.edit = it->second;
+            const auto id = Find(f.name);
+            if (id && entries[*id].editHash != 0 && entries[*id].editMtime == f.edit.mtime && entries[*id].editSize == f.edit.size)
+                f.editHash = entries[*id].editHash;
+            else
+                f.editHash = HashFile(dir / FromUtf8(it->first));
+        }
+
+        std::vector<CatalogEntry> updated(files.size());
+        std::vector<int64_t> source(files.size(), -1);
+        std::vector<uint32_t> changed;
+        bool dirty = files.size() != Size();
+        for (uint32_t i = 0; i < files.size(); ++i)
+        {
+            const auto id = Find(files[i].name);
+            if (id && entries[*id].mtime == files[i].stat.mtime && entries[*id].fileSize == files[i].stat.size)
+            {
+                updated[i] = entries[*id];
+                source[i] = *id;
+                dirty |= *id != i || updated[i].editHash != files[i].editHash ||
+                         updated[i].editMtime != files[i].edit.mtime || updated[i].editSize != files[i].edit.size;
+            }
+            else
+            {
+                changed.push_back(i);
+            }
+        }
+        dirty |= !changed.empty();
+        if (!dirty)
+            return Ok();
+
+        // Unreadable files keep an empty entry (no size, no thumbnail) and
+        // are tried again once they change
+        std::vector<ImagePtr> thumbnails(files.size());
+        std::vector<Error> errors(files.size());
+
+        #pragma omp parallel for schedule(dynamic)
+        for (int64_t k = 0; k < changed.size(); ++k)
+        {
+            const uint32_t i = changed[k];
+            CatalogEntry& e = updated[i];
+            e = {};
+            e.mtime    = files[i].stat.mtime;
+            e.fileSize = files[i].stat.size;
+
+            const fs::path path = dir / FromUtf8(files[i].name);
+            auto summary = LoadSummary(path.string().c_str(), CATALOG_THUMBNAIL_SIZE);
+            if (!summary)
+            {
+                errors[i] = summary.error();
+                continue;
+            }
+            e.width        = summary->width;
+            e.height       = summary->height;
+            e.orientation  = summary->metadata.orientation;
+            e.raw          = summary->metadata.source == "RAW";
+            e.exposureTime = summary->metadata.exposureTime;
+            e.aperture     = summary->metadata.aperture;
+            e.iso          = summary->metadata.iso;
+            thumbnails[i]  = summary->preview;
+        }
+        if (skipped)
+            for (auto& err : errors)
+                if (!err.empty())
+                    skipped->push_back(std::move(err));
+
+        // Layout
+        CatalogHeader h{};
+        std::memcpy(h.magic, CATALOG_MAGIC, 8);
+        h.version = CATALOG_VERSION;
+        h.count   = files.size();
+        h.namesOffset = Align8(sizeof(CatalogHeader) + files.size() * sizeof(CatalogEntry));
+        std::string names;
+        for (uint32_t i = 0; i < files.size(); ++i)
+        {
+            updated[i].nameOffset = names.size();
+            updated[i].nameLength = files[i].name.size();
+            updated[i].editHash   = files[i].editHash;
+            updated[i].editMtime  = files[i].edit.mtime;
+            updated[i].editSize   = files[i].edit.size;
+            names += files[i].name;
+        }
+        h.namesSize = names.size();
+        h.thumbnailsOffset = Align8(h.namesOffset + h.namesSize);
+
+        uint64_t offset = h.thumbnailsOffset;
+        for (uint32_t i = 0; i < files.size(); ++i)
+        {
+            CatalogEntry& e = updated[i];
+            if (thumbnails[i])
+            {
+                e.thumbnailWidth  = thumbnails[i]->width;
+                e.thumbnailHeight = thumbnails[i]->height;
+            }
+            e.thumbnailOffset = offset;
+            offset = Align8(offset + (uint64_t)e.thumbnailWidth * e.thumbnailHeight * 3);
+        }
+        h.fileSize = offset;
+
+        const fs::path target = dir / CATALOG_FILE;
+        const fs::path temporary = dir / (std::string(CATALOG_FILE) + ".tmp");
+        {
+            std::ofstream out(temporary, std::ios::binary | std::ios::trunc);
+            if (!out)
+                return Failed("[Catalog] - Can not write '{}'", temporary.string()).error();
+
+            auto pad = [&] {
+                static const char zeros[8] = {};
+                out.write(zeros, Align8(out.tellp()) - (uint64_t)out.tellp());
+            };
+            out.write(reinterpret_cast<const char*>(&h), sizeof(h));
+            out.write(reinterpret_cast<const char*>(updated.data()), updated.size() * sizeof(CatalogEntry));
+            pad();
+            out.write(names.data(), names.size());
+            pad();
+            for (uint32_t i = 0; i < files.size(); ++i)
+            {
+                const size_t bytes = (size_t)updated[i].thumbnailWidth * updated[i].thumbnailHeight * 3;
+                const uint8_t* pixels = thumbnails[i] ? static_cast<const uint8_t*>(thumbnails[i]->RawData()) :
+                                        source[i] >= 0 ? Thumbnail(source[i]) : nullptr;
+                if (bytes)
+                    out.write(reinterpret_cast<const char*>(pixels), bytes);
+                pad();
+            }
+            if (!out)
+                return Failed("[Catalog] - Can not write '{}'", temporary.string()).error();
+        }
+
+        // The old mapping goes first (files in use can not be replaced everywhere)
+        header  = nullptr;
+        entries = nullptr;
+        file.Close();
+        fs::rename(temporary, target, ec);
+        if (ec)
+            return Failed("[Catalog] - Can not replace '{}': {}", target.string(), ec.message()).error();
+        return Open(dir);
+    }
+}
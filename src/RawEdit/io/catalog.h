@@ -0,0 +1,92 @@
+#pragma once
+
+#include <vector>
+#include <optional>
+#include <filesystem>
+#include <string_view>
+#include <utils/error.h>
+#include <utils/mappedfile.h>
+
+namespace RawEdit
+{
+    constexpr uint32_t CATALOG_VERSION = 2;
+    // Longest side of the catalog thumbnails
+    constexpr uint32_t CATALOG_THUMBNAIL_SIZE = 256;
+    // Catalog file, in the folder it describes
+    constexpr const char* CATALOG_FILE = ".rawedit-catalog";
+
+    // Catalog file layout (little endian, every part 8 bytes aligned):
+    // header, entries sorted by name, names, then thumbnails (8 bits RGB
+    // rows, stored orientation). Entries are used in place from the
+    // mapping; the entry index is the id of a file.
+    struct CatalogHeader
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t count;
+        uint64_t namesOffset;
+        uint64_t namesSize;
+        uint64_t thumbnailsOffset;
+        uint64_t fileSize;
+    };
+
+    struct CatalogEntry
+    {
+        uint32_t nameOffset;    // in the names block, not null terminated
+        uint16_t nameLength;
+        uint8_t  orientation;
+        uint8_t  raw;
+        int64_t  mtime;         // std::filesystem::file_time_type ticks
+        uint64_t fileSize;
+        uint32_t width;
+        uint32_t height;
+        float    exposureTime;
+        float    aperture;
+        float    iso;
+        uint16_t thumbnailWidth;
+        uint16_t thumbnailHeight;
+        uint64_t thumbnailOffset;
+        uint64_t editHash;      // of the sidecar content, 0 without sidecar
+        int64_t  editMtime;     // of the sidecar, it is hashed again when
+        uint64_t editSize;      // one of them changes
+    };
+    static_assert(sizeof(CatalogHeader) == 48 && sizeof(CatalogEntry) == 80);
+
+    // Memory mapped catalog of the images of a folder. Opening it is a
+    // mapping (no directory walk, no decoding); Update rescans the folder
+    // and only reads the files whose size or modification time changed.
+    class Catalog
+    {
+    public:
+        // Maps the catalog of 'folder', fails when there is none or it is
+        // not valid (Update writes a new one)
+        Error Open(const std::filesystem::path& folder);
+
+        // Rescans 'folder', writes its catalog (atomically, through a
+        // temporary file) when something changed and maps it. Entries of
+        // unchanged files and their thumbnails are copied from the mapped
+        // catalog; new and modified files are summarized in parallel.
+        // Sidecars are only read when their size or time changed.
+        // Unreadable files keep an empty entry (width 0, no thumbnail) and
+        // are reported in 'skipped'.
+        Error Update(const std::filesystem::path& folder, std::vector<Error>* skipped = nullptr);
+
+        uint32_t Size() const { return header ? header->count : 0; }
+        const std::filesystem::path& Folder() const { return folder; }
+
+        const CatalogEntry& Entry(uint32_t id) const { return entries[id]; }
+        std::string_view Name(uint32_t id) const;
+        std::filesystem::path Path(uint32_t id) const;
+        // thumbnailWidth * thumbnailHeight RGB pixels
+        const uint8_t* Thumbnail(uint32_t id) const { return file.Data() + entries[id].thumbnailOffset; }
+
+        // Id of a file name, binary search
+        std::optional<uint32_t> Find(std::string_view name) const;
+
+    private:
+        std::filesystem::path folder;
+        MappedFile file;
+        const CatalogHeader* header = nullptr;
+        const CatalogEntry* entries = nullptr;
+    };
+}
@@ -1,27 +1,369 @@
 #include "imageloader.h"
+#include "pngdecoder.h"
 #include "stb_image.h"
+#include "libraw/libraw.h"
 
-namespace RawEdit 
+#include <cmath>
+#include <memory>
+#include <vector>
+#include <fstream>
+#include <algorithm>
+#include <filesystem>
+
+namespace RawEdit
 {
+    static std::string Extension(const char* path)
+    {
+        std::string ext = std::filesystem::path(path).extension().string();
+        std::transform(ext.begin(), ext.end(), ext.begin(), [](unsigned char c) { return std::tolower(c); });
+        return ext;
+    }
+
+    bool IsRawFile(const char* path)
+    {
+        static const char* extensions[] = {
+            ".3fr", ".arw", ".cr2", ".cr3", ".crw", ".dng", ".erf", ".iiq", ".kdc", ".mef",
+            ".mos", ".mrw", ".nef", ".nrw", ".orf", ".pef", ".raf", ".raw", ".rw2", ".rwl",
+            ".sr2", ".srf", ".srw", ".x3f"
+        };
+
+        const std::string ext = Extension(path);
+        return std::find(std::begin(extensions), std::end(extensions), ext) != std::end(extensions);
+    }
+
+    bool IsImageFile(const char* path)
+    {
+        static const char* extensions[] = {
+            ".jpg", ".jpeg", ".png", ".bmp", ".tga", ".gif", ".psd", ".hdr", ".pic", ".ppm", ".pgm", ".pnm"
+        };
+
+        const std::string ext = Extension(path);
+        return IsRawFile(path) || std::find(std::begin(extensions), std::end(extensions), ext) != std::end(extensions);
+    }
+
+    // Orientation tag (0x0112) of the EXIF block of a JPEG file, 1 when
+    // there is none
+    static uint8_t ReadExifOrientation(const char* path)
+    {
+        std::ifstream file(path, std::ios::binary);
+        std::vector<uint8_t> data(1 << 16);
+        file.read(reinterpret_cast<char*>(data.data()), data.size());
+        data.resize(file.gcount());
+        if (data.size() < 4 || data[0] != 0xFF || data[1] != 0xD8)
+            return 1;
+
+        // Markers up to the APP1 "Exif" one
+        size_t pos = 2;
+        while (pos + 4 <= data.size() && data[pos] == 0xFF)
+        {
+            const uint8_t marker = data[pos + 1];
+            const size_t length = (data[pos + 2] << 8) | data[pos + 3];
+            if (marker == 0xE1 && pos + 10 <= data.size() && std::equal(data.begin() + pos + 4, data.begin() + pos + 10, "Exif\0\0"))
+            {
+                const size_t tiff = pos + 10;
+                if (tiff + 8 > data.size()) return 1;
+                const bool little = data[tiff] == 'I';
+                auto u16 = [&](size_t o) -> uint32_t { return little ? data[o] | (data[o + 1] << 8) : (data[o] << 8) | data[o + 1]; };
+                auto u32 = [&](size_t o) -> uint32_t { return little ? u16(o) | (u16(o + 2) << 16) : (u16(o) << 16) | u16(o + 2); };
+
+                const size_t ifd = tiff + u32(tiff + 4);
+                if (ifd + 2 > data.size()) return 1;
+                const uint32_t count = u16(ifd);
+                for (uint32_t i = 0; i < count && ifd + 2 + i * 12 + 12 <= data.size(); ++i)
+                {
+                    const size_t entry = ifd + 2 + i * 12;
+                    if (u16(entry) == 0x0112)
+                    {
+                        const uint32_t value = u16(entry + 8);
+                        return value >= 1 && value <= 8 ? value : 1;
+                    }
+                }
+                return 1;
+            }
+            // Image data starts, no EXIF block
+            if (marker == 0xDA) break;
+            pos += 2 + length;
+        }
+        return 1;
+    }
+
     Failable<ImagePtr> LoadImage(const char* path)
     {
         int width, height, channels;
         uint8_t* data = stbi_load(path, &width, &height, &channels, 0);
-    
+
         if (data == nullptr)
             return Failed("[Image Loader] - Can not load '{}': {}", path, stbi_failure_reason());
-        
+
         ImagePtr image = std::make_shared<CPUImage<uint8_t>>();
         image->metadata.path   = path;
         image->metadata.source = "PC";
+        image->metadata.orientation = ReadExifOrientation(path);
         image->SetData(width, height, channels, ImageDataType::UINT8, data);
-    
+
         stbi_image_free(data);
         return image;
     }
 
+    // Orientation and exposure settings of an opened raw
+    static void ReadShotInfo(const LibRaw& raw, MetaData& metadata)
+    {
+        // LibRaw flip to EXIF orientation: 3 is 180, 5 is 90 counterclockwise, 6 is 90 clockwise
+        switch (raw.imgdata.sizes.flip)
+        {
+            case 3: metadata.orientation = 3; break;
+            case 5: metadata.orientation = 8; break;
+            case 6: metadata.orientation = 6; break;
+            default: break;
+        }
+
+        const auto& other = raw.imgdata.other;
+        metadata.exposureTime = std::max(other.shutter, 0.f);
+        metadata.aperture     = std::max(other.aperture, 0.f);
+        metadata.iso          = std::max(other.iso_speed, 0.f);
+    }
+
+    // Loads the (undemosaiced) sensor data of the visible area as a
+    // single channel uint16 image, with its CFA pattern
+    Failable<ImagePtr> LoadRaw(const char* path)
+    {
+        // LibRaw is large (several hundreds of kB), keep it off the stack
+        auto raw = std::make_unique<LibRaw>();
+
+        int ret = raw->open_file(path);
+        if (ret != LIBRAW_SUCCESS)
+            return Failed("[Raw Loader] - Can not open '{}': {}", path, libraw_strerror(ret));
+
+        ret = raw->unpack();
+        if (ret != LIBRAW_SUCCESS)
+            return Failed("[Raw Loader] - Can not unpack '{}': {}", path, libraw_strerror(ret));
+
+        const auto& sizes = raw->imgdata.sizes;
+        const auto& idata = raw->imgdata.idata;
+        if (raw->imgdata.rawdata.raw_image == nullptr || idata.filters == 0)
+            return Failed("[Raw Loader] - '{}' is not a Bayer / X-Trans raw", path);
+
+        // Other values are exotic (leaf, 4 colors...) patterns
+        if (idata.filters != 9 && idata.filters < 1000)
+            return Failed("[Raw Loader] - '{}' has an unsupported color filter array", path);
+
+        auto image = std::make_shared<CPUImage<uint16_t>>();
+        image->Resize(sizes.width, sizes.height, 1);
+        image->metadata.path   = path;
+        image->metadata.source = "RAW";
+
+        CFAPattern& cfa = image->metadata.cfa;
+        cfa.size = idata.filters == 9 ? 6 : 2;
+        for (uint32_t i = 0; i < cfa.size; ++i)
+        {
+            for (uint32_t j = 0; j < cfa.size; ++j)
+            {
+                // LibRaw uses 3 for the second green of 4 colors bayer
+                const int c = raw->COLOR(i, j);
+                cfa.colors[i * cfa.size + j] = c == 3 ? 1 : c;
+            }
+        }
+
+        // Per channel black is the sum of the global and channel levels
+        // (the two greens are averaged), LibRaw gives them in raw units
+        const auto& color = raw->imgdata.color;
+        RawLevels& levels = image->metadata.levels;
+        for (uint32_t c = 0; c < 3; ++c)
+        {
+            const float cblack = c == 1 ? 0.5f * (color.cblack[1] + color.cblack[3]) : color.cblack[c];
+            levels.black[c] = (color.black + cblack) / UINT16_MAX;
+        }
+        levels.white = std::max(color.maximum, 1u) / (float)UINT16_MAX;
+
+        // Pre multipliers (daylight) when the camera did not record any
+        const float* mul = color.cam_mul[0] > 0.f && color.cam_mul[1] > 0.f ? color.cam_mul : color.pre_mul;
+        if (mul[1] > 0.f)
+            for (uint32_t c = 0; c < 3; ++c)
+                levels.wbGains[c] = mul[c] > 0.f ? mul[c] / mul[1] : 1.f;
+
+        // LibRaw matrix gives linear sRGB from white balanced camera RGB
+        Mat3 camToSRGB;
+        for (uint32_t i = 0; i < 3; ++i)
+            for (uint32_t j = 0; j < 3; ++j)
+                camToSRGB[i * 3 + j] = color.rgb_cam[i][j];
+        ReadShotInfo(*raw, image->metadata);
+
+        image->metadata.colorSpace   = CAMERA_SPACE;
+        image->metadata.cameraMatrix = Multiply(FindColorSpace("Linear sRGB")->toXYZ, camToSRGB);
+
+        const uint32_t pitch = sizes.raw_pitch / sizeof(uint16_t);
+        const uint16_t* src = raw->imgdata.rawdata.raw_image + sizes.top_margin * pitch + sizes.left_margin;
+        for (uint32_t i = 0; i < sizes.height; ++i)
+            std::copy_n(src + i * pitch, sizes.width, image->GetDataPtr() + image->GetIndex(i, 0));
+
+        return image;
+    }
+
     Failable<ImagePtr> Load(const char* path)
     {
+        if (IsRawFile(path))
+            return LoadRaw(path);
         return LoadImage(path);
     }
+
+    // Box filtered 8 bits RGB copy, longest side at most 'size'
+    static ImagePtr ShrinkPreview(const uint8_t* src, uint32_t width, uint32_t height, uint32_t channels, uint32_t size)
+    {
+        const uint32_t factor = std::max((std::max(width, height) + size - 1) / size, 1u);
+        auto preview = std::make_shared<CPUImage<uint8_t>>();
+        preview->Resize(std::max(width / factor, 1u), std::max(height / factor, 1u), 3);
+
+        for (uint32_t y = 0; y < preview->height; ++y)
+        {
+            for (uint32_t x = 0; x < preview->width; ++x)
+            {
+                uint32_t sum[3] = { 0, 0, 0 }, count = 0;
+                for (uint32_t j = y * factor; j < std::min((y + 1) * factor, height); ++j)
+                {
+                    for (uint32_t i = x * factor; i < std::min((x + 1) * factor, width); ++i, ++count)
+                    {
+                        const uint8_t* px = src + ((size_t)j * width + i) * channels;
+                        for (uint32_t c = 0; c < 3; ++c)
+                            sum[c] += px[channels >= 3 ? c : 0];
+                    }
+                }
+                for (uint32_t c = 0; c < 3; ++c)
+                    preview->SetData(y, x, c, (uint8_t)((sum[c] + count / 2) / count));
+            }
+        }
+        return preview;
+    }
+
+    // Preview of the sensor data when the raw has no usable thumbnail: one
+    // pixel per CFA period (averages of its colors), levels and white
+    // balance applied, sRGB like gamma
+    static ImagePtr RawPreview(const ImagePtr& mosaic, uint32_t size)
+    {
+        const auto* img = static_cast<const CPUImage<uint16_t>*>(mosaic.get());
+        const CFAPattern& cfa = img->metadata.cfa;
+        const RawLevels& levels = img->metadata.levels;
+        const uint32_t w = img->width / cfa.size, h = img->height / cfa.size;
+
+        std::vector<uint8_t> rgb((size_t)w * h * 3);
+        for (uint32_t y = 0; y < h; ++y)
+        {
+            for (uint32_t x = 0; x < w; ++x)
+            {
+                float sum[3] = { 0.f, 0.f, 0.f };
+                uint32_t count[3] = { 0, 0, 0 };
+                for (uint32_t j = 0; j < cfa.size; ++j)
+                {
+                    for (uint32_t i = 0; i < cfa.size; ++i)
+                    {
+                        const uint8_t c = cfa.At(j, i);
+                        sum[c] += img->GetData(y * cfa.size + j, x * cfa.size + i) / (float)UINT16_MAX;
+                        ++count[c];
+                    }
+                }
+                for (uint32_t c = 0; c < 3; ++c)
+                {
+                    const float v = (sum[c] / std::max(count[c], 1u) - levels.black[c]) / std::max(levels.white - levels.black[c], 1e-6f);
+                    rgb[((size_t)y * w + x) * 3 + c] = (uint8_t)std::lround(255.f * std::pow(std::clamp(v * levels.wbGains[c], 0.f, 1.f), 1.f / 2.2f));
+                }
+            }
+        }
+        return ShrinkPreview(rgb.data(), w, h, 3, size);
+    }
+
+    Failable<ImageSummary> LoadSummary(const char* path, uint32_t previewSize)
+    {
+        ImageSummary summary;
+        summary.metadata.path = path;
+
+        if (!IsRawFile(path))
+        {
+            int width, height, channels;
+            uint8_t* data = stbi_load(path, &width, &height, &channels, 3);
+            if (data == nullptr)
+                return Failed("[Image Loader] - Can not load '{}': {}", path, stbi_failure_reason());
+
+            summary.width  = width;
+            summary.height = height;
+            summary.metadata.source = "PC";
+            summary.metadata.orientation = ReadExifOrientation(path);
+            summary.preview = ShrinkPreview(data, width, height, 3, previewSize);
+            stbi_image_free(data);
+            return summary;
+        }
+
+        auto raw = std::make_unique<LibRaw>();
+        int ret = raw->open_file(path);
+        if (ret != LIBRAW_SUCCESS)
+            return Failed("[Raw Loader] - Can not open '{}': {}", path, libraw_strerror(ret));
+
+        summary.width  = raw->imgdata.sizes.width;
+        summary.height = raw->imgdata.sizes.height;
+        summary.metadata.source = "RAW";
+        ReadShotInfo(*raw, summary.metadata);
+
+        // Embedded thumbnail, JPEG or RGB bitmap
+        if (raw->unpack_thumb() == LIBRAW_SUCCESS)
+        {
+            const auto& thumb = raw->imgdata.thumbnail;
+            if (thumb.tformat == LIBRAW_THUMBNAIL_JPEG)
+            {
+                int width, height, channels;
+                uint8_t* data = stbi_load_from_memory(reinterpret_cast<const uint8_t*>(thumb.thumb), thumb.tlength, &width, &height, &channels, 3);
+                if (data != nullptr)
+                {
+                    summary.preview = ShrinkPreview(data, width, height, 3, previewSize);
+                    stbi_image_free(data);
+                    return summary;
+                }
+            }
+            else if (thumb.tformat == LIBRAW_THUMBNAIL_BITMAP && thumb.tcolors == 3 && thumb.tlength >= (size_t)thumb.twidth * thumb.theight * 3)
+            {
+                summary.preview = ShrinkPreview(reinterpret_cast<const uint8_t*>(thumb.thumb), thumb.twidth, thumb.theight, 3, previewSize);
+                return summary;
+            }
+        }
+
+        auto mosaic = LoadRaw(path);
+        if (!mosaic)
+            return Failed(mosaic.error());
+        summary.preview = RawPreview(*mosaic, previewSize);
+        return summary;
+    }
+
+    bool LoadsIntoStore(const char* path, uint64_t minPixels)
+    {
+        if (Extension(path) != ".png")
+            return false;
+        PngDecoder decoder;
+        return decoder.Open(path).empty() && (uint64_t)decoder.Width() * decoder.Height() >= minPixels;
+    }
+
+    Error LoadIntoStore(const char* path, TileStore& store, const TileStoreOptions& options)
+    {
+        PngDecoder decoder;
+        if (Error err = decoder.Open(path); !err.empty())
+            return err;
+
+        const ImageDataType type = decoder.BitDepth() == 8 ? ImageDataType::UINT8 : ImageDataType::UINT16;
+        if (Error err = store.Create(decoder.Width(), decoder.Height(), decoder.Channels(), type, options); !err.empty())
+            return err;
+        store.metadata.path   = path;
+        store.metadata.source = "PC";
+
+        // A band of whole tiles at a time
+        ImagePtr band;
+        DISPATCH_DATATYPE(type, band = std::make_shared<CPUImage<DataType>>(););
+        for (uint32_t y = 0; y < decoder.Height(); y += store.TileSize())
+        {
+            const uint32_t rows = std::min(store.TileSize(), decoder.Height() - y);
+            DISPATCH_DATATYPE(type,
+                static_cast<CPUImage<DataType>*>(band.get())->Resize(decoder.Width(), rows, decoder.Channels());
+            );
+            if (Error err = decoder.ReadRows(rows, band->RawData()); !err.empty())
+                return Failed("[Image Loader] - '{}': {}", path, err).error();
+            if (Error err = store.Write(band, 0, y); !err.empty())
+                return err;
+        }
+        return Ok();
+    }
 }
@@ -1,9 +1,36 @@
 #pragma once
 
 #include <image/image.h>
+#include <image/tilestore.h>
 #include <utils/error.h>
 
 namespace RawEdit
 {
+  bool IsRawFile(const char* path);
+  // Raw files and the formats of LoadImage
+  bool IsImageFile(const char* path);
+
+  // Size and shot settings of a file, with a small 8 bits RGB preview
+  // (longest side at most 'previewSize', stored orientation). Raw files
+  // are not unpacked when they embed a thumbnail.
+  struct ImageSummary
+  {
+      uint32_t width = 0;
+      uint32_t height = 0;
+      MetaData metadata;
+      ImagePtr preview;
+  };
+
+  Failable<ImagePtr> LoadImage(const char* path);
+  Failable<ImagePtr> LoadRaw(const char* path);
   Failable<ImagePtr> Load(const char* path);
+  Failable<ImageSummary> LoadSummary(const char* path, uint32_t previewSize);
+
+  // True for the files LoadIntoStore reads (non interlaced 8 and 16 bits
+  // PNG without palette) of at least 'minPixels' pixels; only the header
+  // is read
+  bool LoadsIntoStore(const char* path, uint64_t minPixels = 0);
+  // Decodes 'path' into 'store', created at its size (UINT8 or UINT16), a
+  // band of tile rows at a time: the image is never whole in memory
+  Error LoadIntoStore(const char* path, TileStore& store, const TileStoreOptions& options = {});
 }
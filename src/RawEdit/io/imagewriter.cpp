@@ -0,0 +1,376 @@
+#include "imagewriter.h"
+#include "jpegencoder.h"
+#include "pngencoder.h"
+#include "utils/concurrency.h"
+
+#include <bit>
+#include <algorithm>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <fstream>
+#include <optional>
+#include <filesystem>
+#include <condition_variable>
+
+namespace RawEdit
+{
+    namespace
+    {
+        // Queue between two stages of the export. Push blocks while it is
+        // full, Pop while it is empty; Close ends the stream (what is queued
+        // is still popped), Abort drops it.
+        template<typename T>
+        class BoundedQueue
+        {
+        public:
+            explicit BoundedQueue(size_t c) : capacity(std::max<size_t>(c, 1)) {}
+
+            bool Push(T item)
+            {
+                std::unique_lock lock(mutex);
+                notFull.wait(lock, [&] { return closed || items.size() < capacity; });
+                if (closed) return false;
+                items.push_back(std::move(item));
+                notEmpty.notify_one();
+                return true;
+            }
+
+            std::optional<T> Pop()
+            {
+                std::unique_lock lock(mutex);
+                notEmpty.wait(lock, [&] { return closed || !items.empty(); });
+                if (items.empty()) return std::nullopt;
+                T item = std::move(items.front());
+                items.pop_front();
+                notFull.notify_one();
+                return item;
+            }
+
+            void Close()
+            {
+                std::lock_guard lock(mutex);
+                closed = true;
+                notEmpty.notify_all();
+                notFull.notify_all();
+            }
+
+            void Abort()
+            {
+                std::lock_guard lock(mutex);
+                closed = true;
+                items.clear();
+                notEmpty.notify_all();
+                notFull.notify_all();
+            }
+
+        private:
+            std::mutex mutex;
+            std::condition_variable notFull, notEmpty;
+            std::deque<T> items;
+            size_t capacity;
+            bool closed = false;
+        };
+
+        struct Strip
+        {
+            uint32_t y = 0;
+            uint32_t rows = 0;
+            std::vector<float> pixels;
+        };
+
+        // Baseline little endian TIFF, uncompressed strips. The IFD and the
+        // strip offsets are known before the first strip: the file is
+        // written front to back, no seek.
+        class TiffEncoder
+        {
+        public:
+            TiffEncoder(uint32_t w, uint32_t h, uint32_t c, uint32_t depth, uint32_t strip, bool d)
+                : width(w), height(h), channels(c), bitDepth(depth == 16 ? 16 : 8), stripRows(strip), dither(d)
+            {
+            }
+
+            // Image data past the 4 GB offsets of baseline TIFF
+            bool TooLarge() const
+            {
+                return (uint64_t)width * height * channels * (bitDepth / 8) + 4096 > UINT32_MAX;
+            }
+
+            std::vector<uint8_t> Header() const
+            {
+                const uint32_t strips = (height + stripRows - 1) / stripRows;
+                const uint32_t stripBytes = stripRows * width * channels * (bitDepth / 8);
+                const bool alpha = channels == 2 || channels == 4;
+                const uint32_t entries = 10 + alpha;
+
+                // Header, IFD, then the arrays too large for their entry
+                const uint32_t ifdEnd = 8 + 2 + entries * 12 + 4;
+                const uint32_t bitsOffset = ifdEnd;
+                const uint32_t offsetsOffset = bitsOffset + (channels > 2 ? channels * 2 : 0);
+                const uint32_t countsOffset = offsetsOffset + (strips > 1 ? strips * 4 : 0);
+                const uint32_t dataOffset = countsOffset + (strips > 1 ? strips * 4 : 0);
+
+                std::vector<uint8_t> out = { 'I', 'I', 42, 0 };
+                auto u16 = [&](uint32_t v) { out.insert(out.end(), { (uint8_t)v, (uint8_t)(v >> 8) }); };
+                auto u32 = [&](uint32_t v) { u16(v & 0xFFFF); u16(v >> 16); };
+                auto entry = [&](uint16_t tag, uint16_t type, uint32_t count, uint32_t value) {
+                    u16(tag); u16(type); u32(count);
+                    if (type == 3 && count == 1) { u16(value); u16(0); }
+                    else u32(value);
+                };
+
+                u32(8);
+                u16(entries);
+                entry(256, 4, 1, width);
+                entry(257, 4, 1, height);
+                if (channels == 2)
+                    entry(258, 3, 2, bitDepth | (bitDepth << 16));
+                else
+                    entry(258, 3, channels, channels == 1 ? bitDepth : bitsOffset);
+                entry(259, 3, 1, 1);
+                entry(262, 3, 1, channels >= 3 ? 2 : 1);
+                entry(273, 4, strips, strips > 1 ? offsetsOffset : dataOffset);
+                entry(277, 3, 1, channels);
+                entry(278, 4, 1, stripRows);
+                entry(279, 4, strips, strips > 1 ? countsOffset : height * width * channels * (bitDepth / 8));
+                entry(284, 3, 1, 1);
+                if (alpha)
+                    entry(338, 3, 1, 2);
+                u32(0);
+
+                if (channels > 2)
+                    for (uint32_t c = 0; c < channels; ++c)
+                        u16(bitDepth);
+                if (strips > 1)
+                {
+                    for (uint32_t s = 0; s < strips; ++s)
+                        u32(dataOffset + s * stripBytes);
+                    for (uint32_t s = 0; s < strips; ++s)
+                        u32(std::min(stripRows, height - s * stripRows) * width * channels * (bitDepth / 8));
+                }
+                return out;
+            }
+
+            void Encode(const float* pixels, uint32_t y, uint32_t rows, std::vector<uint8_t>& out) const
+            {
+                const size_t n = (size_t)rows * width * channels;
+                const size_t offset = (size_t)y * width * channels;
+                out.resize(n * (bitDepth / 8));
+                if (bitDepth == 8)
+                {
+                    ConvertSpan(pixels, out.data(), n, offset, ConvertOptions{ true, dither });
+                }
+                else
+                {
+                    uint16_t* dst = reinterpret_cast<uint16_t*>(out.data());
+                    ConvertSpan(pixels, dst, n, offset, {});
+                    if constexpr (std::endian::native == std::endian::big)
+                        for (size_t i = 0; i < n; ++i)
+                            dst[i] = std::byteswap(dst[i]);
+                }
+            }
+
+            std::vector<uint8_t> Trailer() const { return {}; }
+
+        private:
+            uint32_t width;
+            uint32_t height;
+            uint32_t channels;
+            uint32_t bitDepth;
+            uint32_t stripRows;
+            bool dither;
+        };
+
+        // Computing (a thread), encoding (the calling one) and writing (a
+        // thread). The first error stops the three of them. The threads of
+        // the caller are split between computing and encoding, 'encodeThreads'
+        // of them encode.
+        template<typename Encoder>
+        Error Stream(const char* path, uint32_t width, uint32_t height, uint32_t channels, uint32_t stripRows,
+                     const StripSource& source, Encoder& encoder, uint32_t encodeThreads, const ExportSettings& settings)
+        {
+            std::ofstream file(path, std::ios::binary | std::ios::trunc);
+            if (!file)
+                return Failed("[Image Writer] - Can not open '{}'", path).error();
+
+            BoundedQueue<Strip> strips(settings.queueDepth);
+            BoundedQueue<std::vector<uint8_t>> encoded(settings.queueDepth);
+
+            std::mutex errorMutex;
+            Error error;
+            auto fail = [&](Error err) {
+                {
+                    std::lock_guard lock(errorMutex);
+                    if (error.empty())
+                        error = std::move(err);
+                }
+                strips.Abort();
+                encoded.Abort();
+            };
+
+            const uint32_t threads = Concurrency::ThreadsHere();
+            const uint32_t encoding  = std::clamp(encodeThreads, 1u, std::max(threads, 2u) - 1);
+            const uint32_t computing = std::max(threads - encoding, 1u);
+            std::jthread compute([&] {
+                Concurrency::SetThreadsHere(computing);
+                for (uint32_t y = 0; y < height; y += stripRows)
+                {
+                    Strip strip;
+                    strip.y = y;
+                    strip.rows = std::min(stripRows, height - y);
+                    strip.pixels.resize((size_t)strip.rows * width * channels);
+                    if (Error err = source(strip.y, strip.rows, strip.pixels.data()); !err.empty())
+                        return fail(err);
+                    if (!strips.Push(std::move(strip)))
+                        return;
+                }
+                strips.Close();
+            });
+
+            std::jthread writer([&] {
+                while (auto bytes = encoded.Pop())
+                {
+                    if (!file.write(reinterpret_cast<const char*>(bytes->data()), bytes->size()))
+                        return fail(Failed("[Image Writer] - Can not write '{}'", path).error());
+                }
+            });
+
+            Concurrency::SetThreadsHere(encoding);
+            encoded.Push(encoder.Header());
+            while (auto strip = strips.Pop())
+            {
+                std::vector<uint8_t> bytes;
+                encoder.Encode(strip->pixels.data(), strip->y, strip->rows, bytes);
+                if (!encoded.Push(std::move(bytes)))
+                    break;
+            }
+            encoded.Push(encoder.Trailer());
+            encoded.Close();
+            Concurrency::SetThreadsHere(threads);
+
+            compute.join();
+            writer.join();
+            file.close();
+            if (error.empty() && !file)
+                error = Failed("[Image Writer] - Can not write '{}'", path).error();
+
+            // No truncated file left behind
+            if (!error.empty())
+                std::filesystem::remove(path);
+            return error;
+        }
+    }
+
+    StripSource ImageStripSource(const ImagePtr& image)
+    {
+        return [image](uint32_t y, uint32_t rows, float* dst) -> Error {
+            if (image->backend != ImageBackend::CPU)
+                return "[Image Writer] - Only cpu images can be exported";
+
+            const size_t stride = (size_t)image->width * image->channels;
+            DISPATCH_DATATYPE(image->type,
+                const DataType* src = reinterpret_cast<const DataType*>(image->RawData()) + y * stride;
+                ConvertBuffer(src, dst, rows * stride);
+            );
+            return Ok();
+        };
+    }
+
+    StripSource TileStoreStripSource(TileStore& store)
+    {
+        return [&store, band = ImagePtr()](uint32_t y, uint32_t rows, float* dst) mutable -> Error {
+            if (Error err = store.Read(StoreRegion{ 0, y, (uint32_t)store.Width(), rows }, band); !err.empty())
+                return err;
+            DISPATCH_DATATYPE(band->type,
+                ConvertBuffer(static_cast<const DataType*>(band->RawData()), dst, (size_t)band->width * rows * band->channels);
+            );
+            return Ok();
+        };
+    }
+
+    StripSource PipelineStripSource(Pipeline& pipeline)
+    {
+        return [&pipeline, strip = ImagePtr()](uint32_t y, uint32_t rows, float* dst) mutable -> Error {
+            if (Error err = pipeline.RunRows(y, rows, strip); !err.empty())
+                return err;
+            DISPATCH_DATATYPE(strip->type,
+                ConvertBuffer(static_cast<const DataType*>(strip->RawData()), dst, (size_t)strip->width * rows * strip->channels);
+            );
+            return Ok();
+        };
+    }
+
+    Error Export(const char* path, uint32_t width, uint32_t height, uint32_t channels, const StripSource& source, const ExportSettings& settings)
+    {
+        if (width == 0 || height == 0 || channels == 0 || channels > 4)
+            return Failed("[Image Writer] - Can not export a {}x{} image with {} channels", width, height, channels).error();
+        if (settings.format != ExportFormat::JPEG && settings.bitDepth != 8 && settings.bitDepth != 16)
+            return Failed("[Image Writer] - Unsupported bit depth {}", settings.bitDepth).error();
+
+        const uint32_t threads = Concurrency::ThreadsHere();
+        auto encodeThreads = [&](uint32_t picked) { return settings.encodeThreads ? settings.encodeThreads : std::max(picked, 1u); };
+        switch (settings.format)
+        {
+            case ExportFormat::TIFF:
+            {
+                const uint32_t stripRows = settings.stripRows ? settings.stripRows : 64;
+                TiffEncoder encoder(width, height, channels, settings.bitDepth, stripRows, settings.dither);
+                if (encoder.TooLarge())
+                    return Failed("[Image Writer] - '{}' is too large for a TIFF file", path).error();
+                return Stream(path, width, height, channels, stripRows, source, encoder, encodeThreads(1), settings);
+            }
+            case ExportFormat::PNG:
+            {
+                // Several compression parts per strip keep every encoding core busy
+                const uint32_t encoding = encodeThreads(threads / 2);
+                const uint32_t stripRows = settings.stripRows ? settings.stripRows : 16 * std::max(4u, encoding);
+                PngEncoder encoder(width, height, channels, settings.bitDepth, settings.dither);
+                return Stream(path, width, height, channels, stripRows, source, encoder, encoding, settings);
+            }
+            case ExportFormat::JPEG:
+            {
+                if (width > 65535 || height > 65535)
+                    return Failed("[Image Writer] - '{}' is too large for a JPEG file", path).error();
+                // Strips of whole MCU rows, one per encoding core at least
+                JpegEncoder encoder(width, height, channels, settings.quality);
+                const uint32_t mh = encoder.McuHeight();
+                const uint32_t encoding = encodeThreads(threads / 2);
+                const uint32_t stripRows = settings.stripRows ? (settings.stripRows + mh - 1) / mh * mh : mh * std::max(4u, encoding);
+                return Stream(path, width, height, channels, stripRows, source, encoder, encoding, settings);
+            }
+        }
+        return Failed("[Image Writer] - Unknown export format").error();
+    }
+
+    Error Export(const char* path, const ImagePtr& image, const ExportSettings& settings)
+    {
+        if (image == nullptr)
+            return "[Image Writer] - No image to export";
+        return Export(path, image->width, image->height, image->channels, ImageStripSource(image), settings);
+    }
+
+    Error Export(const char* path, TileStore& store, const ExportSettings& settings)
+    {
+        if (!store.Valid())
+            return "[Image Writer] - No image to export";
+        if (store.Width() > UINT32_MAX || store.Height() > UINT32_MAX)
+            return Failed("[Image Writer] - '{}': {}x{} is too large to export", path, store.Width(), store.Height()).error();
+        return Export(path, (uint32_t)store.Width(), (uint32_t)store.Height(), store.Channels(), TileStoreStripSource(store), settings);
+    }
+
+    Error Export(const char* path, Pipeline& pipeline, const ImagePtr& input, const ExportSettings& settings)
+    {
+        if (input == nullptr)
+            return "[Image Writer] - No image to export";
+        if (Error err = pipeline.BeginRows(input); !err.empty())
+            return err;
+
+        // Stages may change the channels: the first row tells
+        ImagePtr first;
+        Error err = pipeline.RunRows(0, 1, first);
+        if (err.empty())
+            err = Export(path, first->width, pipeline.RowCount(), first->channels, PipelineStripSource(pipeline), settings);
+        pipeline.EndRows();
+        return err;
+    }
+}
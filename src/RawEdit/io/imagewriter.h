@@ -0,0 +1,66 @@
+#pragma once
+
+#include <functional>
+#include <image/image.h>
+#include <image/tilestore.h>
+#include <algorithm/base/pipeline.h>
+#include <utils/error.h>
+
+namespace RawEdit
+{
+    enum class ExportFormat
+    {
+        TIFF,
+        PNG,
+        JPEG
+    };
+
+    struct ExportSettings
+    {
+        ExportFormat format = ExportFormat::TIFF;
+        // 8 or 16 for TIFF and PNG, JPEG is always 8 bits
+        uint32_t bitDepth = 16;
+        // JPEG quality, 1 to 100
+        uint32_t quality = 90;
+        // Dithering when quantizing to 8 bits
+        bool dither = true;
+        // Rows handed from a stage to the next at once (rounded to whole
+        // JPEG MCU rows), 0 picks a size for the format
+        uint32_t stripRows = 0;
+        // Strips waiting between two stages, bounds the memory used
+        uint32_t queueDepth = 3;
+        // Threads of the caller (Concurrency::ThreadsHere) encoding, the
+        // others compute the strips. 0 picks one for TIFF (a conversion),
+        // half of them for PNG and JPEG.
+        uint32_t encodeThreads = 0;
+    };
+
+    // Fills 'dst' with rows [y, y + rows) of the exported image: normalized
+    // float values, channels interleaved. Called from the compute thread
+    // of the export, strip after strip from the top.
+    using StripSource = std::function<Error(uint32_t y, uint32_t rows, float* dst)>;
+
+    // Strips of an image converted on the fly (no float copy of it)
+    StripSource ImageStripSource(const ImagePtr& image);
+    // Strips read from the tiles of a store, a band of tiles mapped at a time
+    StripSource TileStoreStripSource(TileStore& store);
+    // Strips computed by a pipeline (see Pipeline::RunRows), BeginRows
+    // must have been called
+    StripSource PipelineStripSource(Pipeline& pipeline);
+
+    // Streams an image to a file: strips are computed by 'source', encoded
+    // and written by three threads linked by bounded queues, so computing,
+    // encoding and writing overlap and only a few strips are in memory.
+    // Channels: 1 (grey), 2 (grey + alpha), 3 (RGB), 4 (RGBA); JPEG drops
+    // the alpha.
+    Error Export(const char* path, uint32_t width, uint32_t height, uint32_t channels, const StripSource& source, const ExportSettings& settings);
+
+    // Export of an image in memory (eg. the output of a pipeline, in its
+    // working type)
+    Error Export(const char* path, const ImagePtr& image, const ExportSettings& settings);
+    // Export of an image out of core (eg. the output of Pipeline::RunTiled)
+    Error Export(const char* path, TileStore& store, const ExportSettings& settings);
+    // Export of the output of 'pipeline' on 'input', computed strip by
+    // strip as it is written: the output is never whole in memory
+    Error Export(const char* path, Pipeline& pipeline, const ImagePtr& input, const ExportSettings& settings);
+}
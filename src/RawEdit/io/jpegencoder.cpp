@@ -0,0 +1,388 @@
+#include "jpegencoder.h"
+
+#include <bit>
+#include <cmath>
+#include <algorithm>
+
+namespace RawEdit
+{
+    namespace
+    {
+        constexpr uint8_t ZIGZAG[64] = {
+             0,  1,  8, 16,  9,  2,  3, 10, 17, 24, 32, 25, 18, 11,  4,  5,
+            12, 19, 26, 33, 40, 48, 41, 34, 27, 20, 13,  6,  7, 14, 21, 28,
+            35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23, 30, 37, 44, 51,
+            58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63
+        };
+
+        // Annex K tables, natural order
+        constexpr uint8_t LUMINANCE_QUANT[64] = {
+            16, 11, 10, 16,  24,  40,  51,  61,
+            12, 12, 14, 19,  26,  58,  60,  55,
+            14, 13, 16, 24,  40,  57,  69,  56,
+            14, 17, 22, 29,  51,  87,  80,  62,
+            18, 22, 37, 56,  68, 109, 103,  77,
+            24, 35, 55, 64,  81, 104, 113,  92,
+            49, 64, 78, 87, 103, 121, 120, 101,
+            72, 92, 95, 98, 112, 100, 103,  99
+        };
+        constexpr uint8_t CHROMINANCE_QUANT[64] = {
+            17, 18, 24, 47, 99, 99, 99, 99,
+            18, 21, 26, 66, 99, 99, 99, 99,
+            24, 26, 56, 99, 99, 99, 99, 99,
+            47, 66, 99, 99, 99, 99, 99, 99,
+            99, 99, 99, 99, 99, 99, 99, 99,
+            99, 99, 99, 99, 99, 99, 99, 99,
+            99, 99, 99, 99, 99, 99, 99, 99,
+            99, 99, 99, 99, 99, 99, 99, 99
+        };
+
+        constexpr uint8_t DC_LUMINANCE_BITS[16]   = { 0, 1, 5, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0 };
+        constexpr uint8_t DC_CHROMINANCE_BITS[16] = { 0, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0 };
+        constexpr uint8_t DC_VALUES[12] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11 };
+
+        constexpr uint8_t AC_LUMINANCE_BITS[16] = { 0, 2, 1, 3, 3, 2, 4, 3, 5, 5, 4, 4, 0, 0, 1, 0x7d };
+        constexpr uint8_t AC_LUMINANCE_VALUES[162] = {
+            0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12, 0x21, 0x31, 0x41, 0x06, 0x13, 0x51, 0x61, 0x07,
+            0x22, 0x71, 0x14, 0x32, 0x81, 0x91, 0xa1, 0x08, 0x23, 0x42, 0xb1, 0xc1, 0x15, 0x52, 0xd1, 0xf0,
+            0x24, 0x33, 0x62, 0x72, 0x82, 0x09, 0x0a, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x25, 0x26, 0x27, 0x28,
+            0x29, 0x2a, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49,
+            0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69,
+            0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89,
+            0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7,
+            0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3, 0xc4, 0xc5,
+            0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda, 0xe1, 0xe2,
+            0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+            0xf9, 0xfa
+        };
+
+        constexpr uint8_t AC_CHROMINANCE_BITS[16] = { 0, 2, 1, 2, 4, 4, 3, 4, 7, 5, 4, 4, 0, 1, 2, 0x77 };
+        constexpr uint8_t AC_CHROMINANCE_VALUES[162] = {
+            0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21, 0x31, 0x06, 0x12, 0x41, 0x51, 0x07, 0x61, 0x71,
+            0x13, 0x22, 0x32, 0x81, 0x08, 0x14, 0x42, 0x91, 0xa1, 0xb1, 0xc1, 0x09, 0x23, 0x33, 0x52, 0xf0,
+            0x15, 0x62, 0x72, 0xd1, 0x0a, 0x16, 0x24, 0x34, 0xe1, 0x25, 0xf1, 0x17, 0x18, 0x19, 0x1a, 0x26,
+            0x27, 0x28, 0x29, 0x2a, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48,
+            0x49, 0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68,
+            0x69, 0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87,
+            0x88, 0x89, 0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5,
+            0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3,
+            0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda,
+            0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+            0xf9, 0xfa
+        };
+
+        struct HuffmanTable
+        {
+            std::array<uint16_t, 256> code{};
+            std::array<uint8_t, 256> size{};
+
+            HuffmanTable(const uint8_t* bits, const uint8_t* values)
+            {
+                uint32_t c = 0, k = 0;
+                for (uint32_t length = 1; length <= 16; ++length)
+                {
+                    for (uint32_t i = 0; i < bits[length - 1]; ++i, ++k, ++c)
+                    {
+                        code[values[k]] = c;
+                        size[values[k]] = length;
+                    }
+                    c <<= 1;
+                }
+            }
+        };
+
+        const HuffmanTable& Table(uint32_t i)
+        {
+            static const HuffmanTable tables[4] = {
+                { DC_LUMINANCE_BITS, DC_VALUES },
+                { AC_LUMINANCE_BITS, AC_LUMINANCE_VALUES },
+                { DC_CHROMINANCE_BITS, DC_VALUES },
+                { AC_CHROMINANCE_BITS, AC_CHROMINANCE_VALUES }
+            };
+            return tables[i];
+        }
+
+        // Entropy coded bytes, 0xFF are followed by a stuffed 0
+        struct BitWriter
+        {
+            std::vector<uint8_t>& out;
+            uint32_t buffer = 0;
+            uint32_t count = 0;
+
+            void Put(uint32_t bits, uint32_t size)
+            {
+                buffer = (buffer << size) | (bits & ((1u << size) - 1));
+                count += size;
+                while (count >= 8)
+                {
+                    const uint8_t byte = (uint8_t)(buffer >> (count - 8));
+                    out.push_back(byte);
+                    if (byte == 0xFF)
+                        out.push_back(0);
+                    count -= 8;
+                }
+                buffer &= (1u << count) - 1;
+            }
+
+            // Pads the last byte with ones
+            void Flush()
+            {
+                if (count > 0)
+                    Put(0xFF, 8 - count);
+            }
+        };
+
+        uint32_t BitLength(uint32_t v)
+        {
+            return v == 0 ? 0 : 32 - std::countl_zero(v);
+        }
+
+        // Scaled float DCT (Arai, Agui, Nakajima), the scaling is folded
+        // in the quantization divisors
+        void ForwardDCT(float* d)
+        {
+            for (uint32_t pass = 0; pass < 2; ++pass)
+            {
+                // Rows, then columns
+                const uint32_t step = pass == 0 ? 1 : 8, next = pass == 0 ? 8 : 1;
+                for (uint32_t i = 0; i < 8; ++i)
+                {
+                    float* p = d + i * next;
+                    const float tmp0 = p[0 * step] + p[7 * step], tmp7 = p[0 * step] - p[7 * step];
+                    const float tmp1 = p[1 * step] + p[6 * step], tmp6 = p[1 * step] - p[6 * step];
+                    const float tmp2 = p[2 * step] + p[5 * step], tmp5 = p[2 * step] - p[5 * step];
+                    const float tmp3 = p[3 * step] + p[4 * step], tmp4 = p[3 * step] - p[4 * step];
+
+                    float tmp10 = tmp0 + tmp3, tmp13 = tmp0 - tmp3;
+                    float tmp11 = tmp1 + tmp2, tmp12 = tmp1 - tmp2;
+                    p[0 * step] = tmp10 + tmp11;
+                    p[4 * step] = tmp10 - tmp11;
+                    const float z1 = (tmp12 + tmp13) * 0.707106781f;
+                    p[2 * step] = tmp13 + z1;
+                    p[6 * step] = tmp13 - z1;
+
+                    tmp10 = tmp4 + tmp5;
+                    tmp11 = tmp5 + tmp6;
+                    tmp12 = tmp6 + tmp7;
+                    const float z5 = (tmp10 - tmp12) * 0.382683433f;
+                    const float z2 = 0.541196100f * tmp10 + z5;
+                    const float z4 = 1.306562965f * tmp12 + z5;
+                    const float z3 = tmp11 * 0.707106781f;
+                    const float z11 = tmp7 + z3, z13 = tmp7 - z3;
+                    p[5 * step] = z13 + z2;
+                    p[3 * step] = z13 - z2;
+                    p[1 * step] = z11 + z4;
+                    p[7 * step] = z11 - z4;
+                }
+            }
+        }
+
+        void EncodeBlock(BitWriter& writer, float* block, const std::array<float, 64>& divisors, int32_t& previousDC,
+                         const HuffmanTable& dc, const HuffmanTable& ac)
+        {
+            ForwardDCT(block);
+            int32_t q[64];
+            for (uint32_t i = 0; i < 64; ++i)
+                q[i] = (int32_t)std::lround(block[i] / divisors[i]);
+
+            const int32_t diff = std::clamp(q[0] - previousDC, -2047, 2047);
+            previousDC = q[0];
+            const uint32_t dcBits = BitLength(std::abs(diff));
+            writer.Put(dc.code[dcBits], dc.size[dcBits]);
+            if (dcBits)
+                writer.Put(diff < 0 ? diff - 1 : diff, dcBits);
+
+            uint32_t run = 0;
+            for (uint32_t k = 1; k < 64; ++k)
+            {
+                const int32_t v = std::clamp(q[ZIGZAG[k]], -1023, 1023);
+                if (v == 0)
+                {
+                    ++run;
+                    continue;
+                }
+                for (; run > 15; run -= 16)
+                    writer.Put(ac.code[0xF0], ac.size[0xF0]);
+                const uint32_t bits = BitLength(std::abs(v));
+                const uint32_t symbol = (run << 4) | bits;
+                writer.Put(ac.code[symbol], ac.size[symbol]);
+                writer.Put(v < 0 ? v - 1 : v, bits);
+                run = 0;
+            }
+            if (run > 0)
+                writer.Put(ac.code[0x00], ac.size[0x00]);
+        }
+
+        void PutMarker(std::vector<uint8_t>& out, uint8_t marker, uint32_t length)
+        {
+            out.insert(out.end(), { 0xFF, marker, (uint8_t)(length >> 8), (uint8_t)length });
+        }
+    }
+
+    JpegEncoder::JpegEncoder(uint32_t w, uint32_t h, uint32_t c, uint32_t quality)
+        : width(w), height(h), channels(c), components(c >= 3 ? 3 : 1)
+    {
+        static constexpr float AAN_SCALE[8] = { 1.f, 1.387039845f, 1.306562965f, 1.175875602f, 1.f, 0.785694958f, 0.541196100f, 0.275899379f };
+
+        // IJG quality scaling
+        quality = std::clamp(quality, 1u, 100u);
+        const uint32_t scale = quality < 50 ? 5000 / quality : 200 - 2 * quality;
+        for (uint32_t t = 0; t < 2; ++t)
+        {
+            const uint8_t* base = t == 0 ? LUMINANCE_QUANT : CHROMINANCE_QUANT;
+            for (uint32_t i = 0; i < 64; ++i)
+            {
+                const uint32_t natural = ZIGZAG[i];
+                const uint32_t value = std::clamp((base[natural] * scale + 50) / 100, 1u, 255u);
+                quant[t][i] = value;
+                divisors[t][natural] = value * AAN_SCALE[natural / 8] * AAN_SCALE[natural % 8] * 8.f;
+            }
+        }
+    }
+
+    std::vector<uint8_t> JpegEncoder::Header() const
+    {
+        std::vector<uint8_t> out = { 0xFF, 0xD8 };
+
+        PutMarker(out, 0xE0, 16);
+        out.insert(out.end(), { 'J', 'F', 'I', 'F', 0, 1, 1, 0, 0, 1, 0, 1, 0, 0 });
+
+        const uint32_t tables = components == 3 ? 2 : 1;
+        PutMarker(out, 0xDB, 2 + 65 * tables);
+        for (uint32_t t = 0; t < tables; ++t)
+        {
+            out.push_back(t);
+            out.insert(out.end(), quant[t].begin(), quant[t].end());
+        }
+
+        PutMarker(out, 0xC0, 8 + 3 * components);
+        out.insert(out.end(), { 8, (uint8_t)(height >> 8), (uint8_t)height, (uint8_t)(width >> 8), (uint8_t)width, (uint8_t)components });
+        for (uint32_t c = 0; c < components; ++c)
+            out.insert(out.end(), { (uint8_t)(c + 1), (uint8_t)(c == 0 && components == 3 ? 0x22 : 0x11), (uint8_t)(c == 0 ? 0 : 1) });
+
+        struct { uint8_t id; const uint8_t* bits; const uint8_t* values; } huffman[4] = {
+            { 0x00, DC_LUMINANCE_BITS, DC_VALUES },
+            { 0x10, AC_LUMINANCE_BITS, AC_LUMINANCE_VALUES },
+            { 0x01, DC_CHROMINANCE_BITS, DC_VALUES },
+            { 0x11, AC_CHROMINANCE_BITS, AC_CHROMINANCE_VALUES }
+        };
+        for (uint32_t t = 0; t < 2 * tables; ++t)
+        {
+            uint32_t count = 0;
+            for (uint32_t i = 0; i < 16; ++i)
+                count += huffman[t].bits[i];
+            PutMarker(out, 0xC4, 2 + 17 + count);
+            out.push_back(huffman[t].id);
+            out.insert(out.end(), huffman[t].bits, huffman[t].bits + 16);
+            out.insert(out.end(), huffman[t].values, huffman[t].values + count);
+        }
+
+        // One restart interval per MCU row
+        const uint32_t mcus = (width + McuHeight() - 1) / McuHeight();
+        PutMarker(out, 0xDD, 4);
+        out.insert(out.end(), { (uint8_t)(mcus >> 8), (uint8_t)mcus });
+
+        PutMarker(out, 0xDA, 6 + 2 * components);
+        out.push_back(components);
+        for (uint32_t c = 0; c < components; ++c)
+            out.insert(out.end(), { (uint8_t)(c + 1), (uint8_t)(c == 0 ? 0x00 : 0x11) });
+        out.insert(out.end(), { 0, 63, 0 });
+        return out;
+    }
+
+    std::vector<uint8_t> JpegEncoder::Trailer() const
+    {
+        return { 0xFF, 0xD9 };
+    }
+
+    void JpegEncoder::Encode(const float* pixels, uint32_t y, uint32_t rows, std::vector<uint8_t>& out) const
+    {
+        const uint32_t mh = McuHeight();
+        const uint32_t count = (rows + mh - 1) / mh;
+        const uint32_t totalRows = (height + mh - 1) / mh;
+        std::vector<std::vector<uint8_t>> encoded(count);
+
+        #pragma omp parallel for schedule(dynamic)
+        for (int64_t r = 0; r < count; ++r)
+        {
+            const uint32_t available = std::min(mh, rows - (uint32_t)r * mh);
+            EncodeMcuRow(pixels + (size_t)r * mh * width * channels, available, encoded[r]);
+        }
+
+        for (uint32_t r = 0; r < count; ++r)
+        {
+            out.insert(out.end(), encoded[r].begin(), encoded[r].end());
+            const uint32_t mcuRow = y / mh + r;
+            if (mcuRow + 1 < totalRows)
+                out.insert(out.end(), { 0xFF, (uint8_t)(0xD0 + mcuRow % 8) });
+        }
+    }
+
+    void JpegEncoder::EncodeMcuRow(const float* pixels, uint32_t rows, std::vector<uint8_t>& out) const
+    {
+        const uint32_t mh = McuHeight();
+        const uint32_t mcus = (width + mh - 1) / mh;
+        const uint32_t padded = mcus * mh;
+
+        // Planes of the MCU row, edges replicated
+        std::vector<float> y((size_t)mh * padded), cb, cr;
+        if (components == 3)
+        {
+            cb.resize((size_t)mh * padded);
+            cr.resize((size_t)mh * padded);
+        }
+        for (uint32_t j = 0; j < mh; ++j)
+        {
+            const float* row = pixels + (size_t)std::min(j, rows - 1) * width * channels;
+            for (uint32_t i = 0; i < padded; ++i)
+            {
+                const float* px = row + (size_t)std::min(i, width - 1) * channels;
+                const size_t o = (size_t)j * padded + i;
+                if (components == 1)
+                {
+                    y[o] = std::clamp(px[0], 0.f, 1.f) * 255.f - 128.f;
+                    continue;
+                }
+                const float r = std::clamp(px[0], 0.f, 1.f) * 255.f;
+                const float g = std::clamp(px[1], 0.f, 1.f) * 255.f;
+                const float b = std::clamp(px[2], 0.f, 1.f) * 255.f;
+                y[o]  =  0.299f * r + 0.587f * g + 0.114f * b - 128.f;
+                cb[o] = -0.168736f * r - 0.331264f * g + 0.5f * b;
+                cr[o] =  0.5f * r - 0.418688f * g - 0.081312f * b;
+            }
+        }
+
+        BitWriter writer{ out };
+        int32_t dc[3] = { 0, 0, 0 };
+        float block[64];
+        for (uint32_t m = 0; m < mcus; ++m)
+        {
+            // Luminance blocks of the MCU, left to right then top to bottom
+            for (uint32_t by = 0; by < mh; by += 8)
+            {
+                for (uint32_t bx = 0; bx < mh; bx += 8)
+                {
+                    for (uint32_t j = 0; j < 8; ++j)
+                        std::copy_n(y.data() + (size_t)(by + j) * padded + m * mh + bx, 8, block + j * 8);
+                    EncodeBlock(writer, block, divisors[0], dc[0], Table(0), Table(1));
+                }
+            }
+            if (components == 1) continue;
+
+            // Chrominance, 2x2 averages
+            for (uint32_t c = 0; c < 2; ++c)
+            {
+                const float* plane = c == 0 ? cb.data() : cr.data();
+                for (uint32_t j = 0; j < 8; ++j)
+                {
+                    const float* r0 = plane + (size_t)(2 * j) * padded + m * 16;
+                    const float* r1 = r0 + padded;
+                    for (uint32_t i = 0; i < 8; ++i)
+                        block[j * 8 + i] = 0.25f * (r0[2 * i] + r0[2 * i + 1] + r1[2 * i] + r1[2 * i + 1]);
+                }
+                EncodeBlock(writer, block, divisors[1], dc[c + 1], Table(2), Table(3));
+            }
+        }
+        writer.Flush();
+    }
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <vector>
+
+namespace RawEdit
+{
+    // Baseline JPEG encoder: YCbCr 4:2:0 (or greyscale), quality scaled
+    // standard quantization tables and standard Huffman tables. Every MCU
+    // row is a restart interval: rows are entropy coded independently (in
+    // parallel) and joined with RST markers, so a file can be produced
+    // strip by strip.
+    class JpegEncoder
+    {
+    public:
+        // 'channels' of the pixels given to Encode: RGB first (alpha is dropped)
+        // or grey
+        JpegEncoder(uint32_t width, uint32_t height, uint32_t channels, uint32_t quality);
+
+        // Image rows of an MCU row, strips are made of whole MCU rows
+        uint32_t McuHeight() const { return components == 1 ? 8 : 16; }
+
+        // SOI up to the start of the scan
+        std::vector<uint8_t> Header() const;
+
+        // Appends the MCU rows of image rows [y, y + rows) to 'out', 'pixels'
+        // holds these rows as normalized floats. 'y' is a multiple of
+        // McuHeight, 'rows' too except for the last strip.
+        void Encode(const float* pixels, uint32_t y, uint32_t rows, std::vector<uint8_t>& out) const;
+
+        // EOI
+        std::vector<uint8_t> Trailer() const;
+
+    private:
+        void EncodeMcuRow(const float* pixels, uint32_t rows, std::vector<uint8_t>& out) const;
+
+        uint32_t width;
+        uint32_t height;
+        uint32_t channels;
+        uint32_t components;
+        // Luminance and chrominance tables, zigzag order as in DQT
+        std::array<std::array<uint8_t, 64>, 2> quant;
+        // Divisors of the (scaled) AAN DCT output, natural order
+        std::array<std::array<float, 64>, 2> divisors;
+    };
+}
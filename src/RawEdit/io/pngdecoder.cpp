@@ -0,0 +1,416 @@
+#include "pngdecoder.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <string_view>
+
+namespace RawEdit
+{
+    namespace
+    {
+        constexpr uint32_t INFLATE_WINDOW = 32768;
+        // Compressed bytes read from the file at once
+        constexpr uint32_t INFLATE_READ = 1 << 16;
+
+        constexpr uint16_t LENGTH_BASE[29] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+        constexpr uint8_t LENGTH_EXTRA[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+        constexpr uint16_t DISTANCE_BASE[30] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+        constexpr uint8_t DISTANCE_EXTRA[30] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+        // Order of the code length code lengths of dynamic blocks
+        constexpr uint8_t CODE_LENGTH_ORDER[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+
+        uint32_t GetU32(const uint8_t* p)
+        {
+            return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+        }
+
+        // False on over-subscribed codes; incomplete ones are allowed (a
+        // single distance code)
+        template<typename Code>
+        bool Build(Code& h, const uint8_t* lengths, uint32_t n)
+        {
+            h.count.fill(0);
+            for (uint32_t s = 0; s < n; ++s)
+                ++h.count[lengths[s]];
+            int32_t left = 1;
+            for (uint32_t l = 1; l < 16; ++l)
+            {
+                left = 2 * left - h.count[l];
+                if (left < 0)
+                    return false;
+            }
+
+            std::array<uint16_t, 16> offset{};
+            for (uint32_t l = 1; l < 15; ++l)
+                offset[l + 1] = offset[l] + h.count[l];
+            for (uint32_t s = 0; s < n; ++s)
+                if (lengths[s] != 0)
+                    h.symbol[offset[lengths[s]]++] = s;
+            return true;
+        }
+
+        uint8_t Paeth(uint8_t a, uint8_t b, uint8_t c)
+        {
+            const int p = a + b - c;
+            const int pa = std::abs(p - a), pb = std::abs(p - b), pc = std::abs(p - c);
+            return pa <= pb && pa <= pc ? a : pb <= pc ? b : c;
+        }
+
+        // Filtered 'row' back to its values, 'prior' is the row above
+        bool Unfilter(uint8_t filter, uint8_t* row, const uint8_t* prior, size_t n, uint32_t bpp)
+        {
+            switch (filter)
+            {
+                case 0:
+                    return true;
+                case 1:
+                    for (size_t i = bpp; i < n; ++i)
+                        row[i] += row[i - bpp];
+                    return true;
+                case 2:
+                    for (size_t i = 0; i < n; ++i)
+                        row[i] += prior[i];
+                    return true;
+                case 3:
+                    for (size_t i = 0; i < bpp; ++i)
+                        row[i] += prior[i] / 2;
+                    for (size_t i = bpp; i < n; ++i)
+                        row[i] += (row[i - bpp] + prior[i]) / 2;
+                    return true;
+                case 4:
+                    for (size_t i = 0; i < bpp; ++i)
+                        row[i] += prior[i];
+                    for (size_t i = bpp; i < n; ++i)
+                        row[i] += Paeth(row[i - bpp], prior[i], prior[i - bpp]);
+                    return true;
+            }
+            return false;
+        }
+    }
+
+    Error PngDecoder::Open(const char* path)
+    {
+        *this = PngDecoder();
+        file.open(path, std::ios::binary);
+        if (!file)
+            return Failed("[PNG Decoder] - Can not open '{}'", path).error();
+
+        static constexpr uint8_t SIGNATURE[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+        uint8_t header[8];
+        if (!file.read(reinterpret_cast<char*>(header), 8) || std::memcmp(header, SIGNATURE, 8) != 0)
+            return Failed("[PNG Decoder] - '{}' is not a PNG file", path).error();
+
+        // Chunks up to the first IDAT, the ones after IHDR are skipped
+        while (true)
+        {
+            uint8_t chunk[8];
+            if (!file.read(reinterpret_cast<char*>(chunk), 8))
+                return Failed("[PNG Decoder] - '{}' has no image data", path).error();
+            const uint32_t length = GetU32(chunk);
+            const std::string_view type(reinterpret_cast<const char*>(chunk + 4), 4);
+
+            if (type == "IHDR")
+            {
+                uint8_t ihdr[13];
+                if (length != 13 || !file.read(reinterpret_cast<char*>(ihdr), 13) || !file.seekg(4, std::ios::cur))
+                    return Failed("[PNG Decoder] - '{}' has a bad header", path).error();
+                width = GetU32(ihdr);
+                height = GetU32(ihdr + 4);
+                bitDepth = ihdr[8];
+                const uint8_t colorType = ihdr[9];
+                channels = colorType == 0 ? 1 : colorType == 2 ? 3 : colorType == 4 ? 2 : colorType == 6 ? 4 : 0;
+                if (width == 0 || height == 0 || width > INT32_MAX || height > INT32_MAX || ihdr[10] != 0 || ihdr[11] != 0)
+                    return Failed("[PNG Decoder] - '{}' has a bad header", path).error();
+                if (channels == 0 || (bitDepth != 8 && bitDepth != 16) || ihdr[12] != 0)
+                    return Failed("[PNG Decoder] - '{}': palette, low bit depth and interlaced files can not be read by rows", path).error();
+            }
+            else if (type == "IDAT")
+            {
+                if (width == 0)
+                    return Failed("[PNG Decoder] - '{}' has no header", path).error();
+                chunkLeft = length;
+                break;
+            }
+            else if (type == "IEND" || !file.seekg((std::streamoff)length + 4, std::ios::cur))
+            {
+                return Failed("[PNG Decoder] - '{}' has no image data", path).error();
+            }
+        }
+
+        uint8_t cmf, flg;
+        if (!NextByte(cmf) || !NextByte(flg) || (cmf & 0x0F) != 8 || ((cmf << 8) | flg) % 31 != 0 || (flg & 0x20))
+            return Failed("[PNG Decoder] - '{}' has a bad zlib stream", path).error();
+
+        const size_t stride = (size_t)width * channels * (bitDepth / 8);
+        prior.assign(stride, 0);
+        current.resize(stride);
+        window.resize(INFLATE_WINDOW);
+        return Ok();
+    }
+
+    Error PngDecoder::ReadRows(uint32_t rows, void* dst)
+    {
+        if (rows > height - row)
+            return "[PNG Decoder] - Rows past the end of the image";
+
+        const uint32_t bytes = bitDepth / 8;
+        const uint32_t bpp = channels * bytes;
+        const size_t stride = current.size();
+        for (uint32_t y = 0; y < rows; ++y, ++row)
+        {
+            uint8_t filter;
+            if (Error err = Inflate(&filter, 1); !err.empty())
+                return err;
+            if (Error err = Inflate(current.data(), stride); !err.empty())
+                return err;
+            if (!Unfilter(filter, current.data(), prior.data(), stride, bpp))
+                return Failed("[PNG Decoder] - Unknown filter {} on row {}", filter, row).error();
+
+            if (bytes == 1)
+            {
+                std::memcpy(static_cast<uint8_t*>(dst) + y * stride, current.data(), stride);
+            }
+            else
+            {
+                uint16_t* out = static_cast<uint16_t*>(dst) + y * (stride / 2);
+                for (size_t i = 0; i < stride / 2; ++i)
+                    out[i] = (uint16_t)((current[2 * i] << 8) | current[2 * i + 1]);
+            }
+            std::swap(prior, current);
+        }
+        return Ok();
+    }
+
+    bool PngDecoder::NextByte(uint8_t& b)
+    {
+        if (bufferPos == buffer.size())
+        {
+            // Data goes on in the next IDAT chunk (after the CRC of this one)
+            while (chunkLeft == 0)
+            {
+                uint8_t chunk[12];
+                if (!file.read(reinterpret_cast<char*>(chunk), 12) || std::memcmp(chunk + 8, "IDAT", 4) != 0)
+                    return false;
+                chunkLeft = GetU32(chunk + 4);
+            }
+            buffer.resize(std::min(chunkLeft, INFLATE_READ));
+            if (!file.read(reinterpret_cast<char*>(buffer.data()), buffer.size()))
+                return false;
+            chunkLeft -= (uint32_t)buffer.size();
+            bufferPos = 0;
+        }
+        b = buffer[bufferPos++];
+        return true;
+    }
+
+    bool PngDecoder::Bits(uint32_t n, uint32_t& v)
+    {
+        while (bitCount < n)
+        {
+            uint8_t b;
+            if (!NextByte(b))
+                return false;
+            bits |= (uint64_t)b << bitCount;
+            bitCount += 8;
+        }
+        v = (uint32_t)(bits & ((1ull << n) - 1));
+        bits >>= n;
+        bitCount -= n;
+        return true;
+    }
+
+    // Codes are read a bit at a time from their first bit; the codes of a
+    // length follow the last code of the length before, shifted
+    int PngDecoder::Decode(const Huffman& h)
+    {
+        int code = 0, first = 0, index = 0;
+        for (uint32_t l = 1; l < 16; ++l)
+        {
+            uint32_t b;
+            if (!Bits(1, b))
+                return -1;
+            code |= b;
+            const int count = h.count[l];
+            if (code - first < count)
+                return h.symbol[index + code - first];
+            index += count;
+            first = (first + count) << 1;
+            code <<= 1;
+        }
+        return -1;
+    }
+
+    Error PngDecoder::BeginBlock()
+    {
+        uint32_t last, type;
+        if (!Bits(1, last) || !Bits(2, type))
+            return "[PNG Decoder] - Truncated image data";
+        lastBlock = last;
+        inBlock = true;
+        stored = type == 0;
+
+        if (type == 0)
+        {
+            // Stored bytes start on a byte boundary
+            bits >>= bitCount & 7;
+            bitCount -= bitCount & 7;
+            uint32_t length, check;
+            if (!Bits(16, length) || !Bits(16, check) || length != (~check & 0xFFFF))
+                return "[PNG Decoder] - Bad stored block";
+            storedLeft = length;
+            return Ok();
+        }
+        if (type == 1)
+        {
+            uint8_t lengths[288 + 30];
+            std::fill(lengths, lengths + 144, 8);
+            std::fill(lengths + 144, lengths + 256, 9);
+            std::fill(lengths + 256, lengths + 280, 7);
+            std::fill(lengths + 280, lengths + 288, 8);
+            std::fill(lengths + 288, lengths + 318, 5);
+            Build(literals, lengths, 288);
+            Build(distances, lengths + 288, 30);
+            return Ok();
+        }
+        if (type == 2)
+            return BuildDynamic();
+        return "[PNG Decoder] - Bad block type";
+    }
+
+    Error PngDecoder::BuildDynamic()
+    {
+        uint32_t nlen, ndist, ncode;
+        if (!Bits(5, nlen) || !Bits(5, ndist) || !Bits(4, ncode))
+            return "[PNG Decoder] - Truncated image data";
+        nlen += 257;
+        ndist += 1;
+        ncode += 4;
+        if (nlen > 286 || ndist > 30)
+            return "[PNG Decoder] - Bad dynamic block";
+
+        uint8_t lengths[286 + 30] = {};
+        for (uint32_t i = 0; i < ncode; ++i)
+        {
+            uint32_t l;
+            if (!Bits(3, l))
+                return "[PNG Decoder] - Truncated image data";
+            lengths[CODE_LENGTH_ORDER[i]] = (uint8_t)l;
+        }
+        Huffman lengthCode;
+        if (!Build(lengthCode, lengths, 19))
+            return "[PNG Decoder] - Bad dynamic block";
+
+        // Literal and distance lengths, with runs of repeated lengths
+        std::fill(std::begin(lengths), std::end(lengths), 0);
+        for (uint32_t i = 0; i < nlen + ndist;)
+        {
+            const int symbol = Decode(lengthCode);
+            if (symbol < 0)
+                return "[PNG Decoder] - Bad dynamic block";
+            if (symbol < 16)
+            {
+                lengths[i++] = (uint8_t)symbol;
+                continue;
+            }
+
+            uint32_t repeat;
+            uint8_t value = 0;
+            bool read;
+            if (symbol == 16)
+            {
+                if (i == 0)
+                    return "[PNG Decoder] - Bad dynamic block";
+                value = lengths[i - 1];
+                read = Bits(2, repeat);
+                repeat += 3;
+            }
+            else if (symbol == 17)
+            {
+                read = Bits(3, repeat);
+                repeat += 3;
+            }
+            else
+            {
+                read = Bits(7, repeat);
+                repeat += 11;
+            }
+            if (!read || i + repeat > nlen + ndist)
+                return "[PNG Decoder] - Bad dynamic block";
+            std::fill(lengths + i, lengths + i + repeat, value);
+            i += repeat;
+        }
+
+        if (lengths[256] == 0 || !Build(literals, lengths, nlen) || !Build(distances, lengths + nlen, ndist))
+            return "[PNG Decoder] - Bad dynamic block";
+        return Ok();
+    }
+
+    // Decodes up to 'n' more bytes, leaving the block (and a match being
+    // copied) where it stopped for the next call
+    Error PngDecoder::Inflate(uint8_t* dst, size_t n)
+    {
+        auto put = [&](uint8_t b) {
+            window[windowPos++ % INFLATE_WINDOW] = b;
+            *dst++ = b;
+            --n;
+        };
+
+        while (n > 0)
+        {
+            if (copyLeft > 0)
+            {
+                put(window[(windowPos - copyDistance) % INFLATE_WINDOW]);
+                --copyLeft;
+                continue;
+            }
+            if (!inBlock)
+            {
+                if (lastBlock)
+                    return "[PNG Decoder] - Truncated image data";
+                if (Error err = BeginBlock(); !err.empty())
+                    return err;
+                continue;
+            }
+            if (stored)
+            {
+                uint32_t b;
+                if (storedLeft == 0)
+                    inBlock = false;
+                else if (!Bits(8, b))
+                    return "[PNG Decoder] - Truncated image data";
+                else
+                {
+                    put((uint8_t)b);
+                    --storedLeft;
+                }
+                continue;
+            }
+
+            const int symbol = Decode(literals);
+            if (symbol < 0)
+                return "[PNG Decoder] - Bad image data";
+            if (symbol < 256)
+            {
+                put((uint8_t)symbol);
+                continue;
+            }
+            if (symbol == 256)
+            {
+                inBlock = false;
+                continue;
+            }
+
+            const uint32_t s = symbol - 257;
+            uint32_t extra, distanceExtra;
+            const int d = s < 29 && Bits(LENGTH_EXTRA[s], extra) ? Decode(distances) : -1;
+            if (d < 0 || d >= 30 || !Bits(DISTANCE_EXTRA[d], distanceExtra))
+                return "[PNG Decoder] - Bad image data";
+            copyLeft = LENGTH_BASE[s] + extra;
+            copyDistance = DISTANCE_BASE[d] + distanceExtra;
+            if (copyDistance > windowPos)
+                return "[PNG Decoder] - Bad image data";
+        }
+        return Ok();
+    }
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <vector>
+#include <fstream>
+#include <utils/error.h>
+
+namespace RawEdit
+{
+    // PNG decoder read a band of rows at a time: the zlib stream of the
+    // IDAT chunks is inflated as rows are asked for and the rows are
+    // unfiltered on the fly, so only the band asked for is in memory.
+    // Non interlaced 8 and 16 bits grey, grey + alpha, RGB and RGBA files
+    // (no palette, no bit depths below 8); CRCs are not checked.
+    class PngDecoder
+    {
+    public:
+        // Reads the header, up to the first IDAT chunk
+        Error Open(const char* path);
+
+        uint32_t Width()    const { return width; }
+        uint32_t Height()   const { return height; }
+        uint32_t Channels() const { return channels; }
+        uint32_t BitDepth() const { return bitDepth; }
+
+        // The next 'rows' rows, from the top: width * channels samples per
+        // row (uint16_t in native order for 16 bits files)
+        Error ReadRows(uint32_t rows, void* dst);
+
+    private:
+        // Canonical Huffman code: codes of each length, then the symbols
+        // in code order
+        struct Huffman
+        {
+            std::array<uint16_t, 16> count{};
+            std::array<uint16_t, 288> symbol{};
+        };
+
+        Error Inflate(uint8_t* dst, size_t n);
+        Error BeginBlock();
+        Error BuildDynamic();
+        int Decode(const Huffman& h);
+        bool NextByte(uint8_t& b);
+        bool Bits(uint32_t n, uint32_t& v);
+
+        std::ifstream file;
+        uint32_t width = 0;
+        uint32_t height = 0;
+        uint32_t channels = 0;
+        uint32_t bitDepth = 0;
+        uint32_t row = 0;
+        std::vector<uint8_t> prior, current;
+
+        // IDAT bytes left in the chunk being read, then read ahead
+        uint32_t chunkLeft = 0;
+        std::vector<uint8_t> buffer;
+        size_t bufferPos = 0;
+        uint64_t bits = 0;
+        uint32_t bitCount = 0;
+
+        // Deflate state between two reads
+        std::vector<uint8_t> window;
+        size_t windowPos = 0;
+        bool lastBlock = false;
+        bool inBlock = false;
+        bool stored = false;
+        uint32_t storedLeft = 0;
+        uint32_t copyLeft = 0;
+        uint32_t copyDistance = 0;
+        Huffman literals, distances;
+    };
+}
@@ -0,0 +1,353 @@
+#include "pngencoder.h"
+#include "image/image.h"
+
+#include <array>
+#include <bit>
+#include <cstring>
+#include <algorithm>
+
+namespace RawEdit
+{
+    // Rows compressed independently (in parallel), larger than the deflate
+    // window on usual widths so little is lost
+    constexpr uint32_t PNG_PART_ROWS = 16;
+
+    namespace
+    {
+        constexpr uint32_t DEFLATE_WINDOW = 32768;
+        constexpr uint32_t DEFLATE_HASH_BITS = 15;
+        constexpr uint32_t DEFLATE_CHAIN = 16;
+        constexpr uint32_t DEFLATE_MIN_MATCH = 3;
+        constexpr uint32_t DEFLATE_MAX_MATCH = 258;
+
+        constexpr uint16_t LENGTH_BASE[29] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+        constexpr uint8_t LENGTH_EXTRA[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+        constexpr uint16_t DISTANCE_BASE[30] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+        constexpr uint8_t DISTANCE_EXTRA[30] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+
+        uint32_t ReverseBits(uint32_t code, uint32_t size)
+        {
+            uint32_t r = 0;
+            for (uint32_t i = 0; i < size; ++i, code >>= 1)
+                r = (r << 1) | (code & 1);
+            return r;
+        }
+
+        // Fixed Huffman codes (bit reversed, deflate writes from the LSB) and
+        // symbols of the match lengths and distances
+        struct DeflateTables
+        {
+            std::array<uint16_t, 288> literalCode;
+            std::array<uint8_t, 288> literalSize;
+            std::array<uint8_t, 30> distanceCode;
+            std::array<uint8_t, DEFLATE_MAX_MATCH + 1> lengthSymbol;
+            std::array<uint8_t, DEFLATE_WINDOW + 1> distanceSymbol;
+
+            DeflateTables()
+            {
+                for (uint32_t s = 0; s < 288; ++s)
+                {
+                    const auto [code, size] =
+                        s < 144 ? std::pair{ 0x30 + s, 8u } :
+                        s < 256 ? std::pair{ 0x190 + s - 144, 9u } :
+                        s < 280 ? std::pair{ s - 256, 7u } :
+                                  std::pair{ 0xC0 + s - 280, 8u };
+                    literalCode[s] = ReverseBits(code, size);
+                    literalSize[s] = size;
+                }
+                for (uint32_t s = 0; s < 30; ++s)
+                    distanceCode[s] = ReverseBits(s, 5);
+                for (uint32_t l = DEFLATE_MIN_MATCH, s = 0; l <= DEFLATE_MAX_MATCH; ++l)
+                {
+                    while (s + 1 < 29 && LENGTH_BASE[s + 1] <= l) ++s;
+                    lengthSymbol[l] = s;
+                }
+                for (uint32_t d = 1, s = 0; d <= DEFLATE_WINDOW; ++d)
+                {
+                    while (s + 1 < 30 && DISTANCE_BASE[s + 1] <= d) ++s;
+                    distanceSymbol[d] = s;
+                }
+            }
+        };
+
+        struct DeflateWriter
+        {
+            std::vector<uint8_t>& out;
+            uint64_t buffer = 0;
+            uint32_t count = 0;
+
+            void Put(uint32_t bits, uint32_t size)
+            {
+                buffer |= (uint64_t)bits << count;
+                count += size;
+                while (count >= 8)
+                {
+                    out.push_back((uint8_t)buffer);
+                    buffer >>= 8;
+                    count -= 8;
+                }
+            }
+
+            void Align()
+            {
+                if (count > 0)
+                    Put(0, 8 - count);
+            }
+        };
+
+        // One fixed Huffman block (greedy LZ77 on hash chains), followed by
+        // a sync flush so the output ends on a byte and the stream goes on
+        void Deflate(const uint8_t* data, size_t n, std::vector<uint8_t>& out)
+        {
+            static const DeflateTables tables;
+            DeflateWriter writer{ out };
+            auto literal = [&](uint32_t s) { writer.Put(tables.literalCode[s], tables.literalSize[s]); };
+
+            writer.Put(0, 1);
+            writer.Put(1, 2);
+
+            std::vector<int32_t> head(1 << DEFLATE_HASH_BITS, -1), chain(DEFLATE_WINDOW);
+            auto hash = [&](size_t i) {
+                const uint32_t v = data[i] | (data[i + 1] << 8) | (data[i + 2] << 16);
+                return (v * 2654435761u) >> (32 - DEFLATE_HASH_BITS);
+            };
+            auto insert = [&](size_t i) {
+                if (i + DEFLATE_MIN_MATCH > n) return;
+                const uint32_t h = hash(i);
+                chain[i % DEFLATE_WINDOW] = head[h];
+                head[h] = (int32_t)i;
+            };
+
+            for (size_t i = 0; i < n;)
+            {
+                uint32_t best = 0, distance = 0;
+                if (i + DEFLATE_MIN_MATCH <= n)
+                {
+                    const uint32_t limit = (uint32_t)std::min<size_t>(DEFLATE_MAX_MATCH, n - i);
+                    int32_t candidate = head[hash(i)];
+                    for (uint32_t tries = DEFLATE_CHAIN; candidate >= 0 && i - candidate < DEFLATE_WINDOW && tries > 0; --tries)
+                    {
+                        const uint8_t* a = data + candidate;
+                        const uint8_t* b = data + i;
+                        if (a[best] == b[best])
+                        {
+                            uint32_t length = 0;
+                            while (length < limit && a[length] == b[length]) ++length;
+                            if (length > best)
+                            {
+                                best = length;
+                                distance = (uint32_t)(i - candidate);
+                                if (length == limit) break;
+                            }
+                        }
+                        candidate = chain[candidate % DEFLATE_WINDOW];
+                    }
+                }
+
+                if (best >= DEFLATE_MIN_MATCH)
+                {
+                    const uint32_t ls = tables.lengthSymbol[best];
+                    literal(257 + ls);
+                    writer.Put(best - LENGTH_BASE[ls], LENGTH_EXTRA[ls]);
+                    const uint32_t ds = tables.distanceSymbol[distance];
+                    writer.Put(tables.distanceCode[ds], 5);
+                    writer.Put(distance - DISTANCE_BASE[ds], DISTANCE_EXTRA[ds]);
+                    for (size_t end = i + best; i < end; ++i)
+                        insert(i);
+                }
+                else
+                {
+                    literal(data[i]);
+                    insert(i++);
+                }
+            }
+            literal(256);
+
+            writer.Put(0, 3);
+            writer.Align();
+            out.insert(out.end(), { 0x00, 0x00, 0xFF, 0xFF });
+        }
+
+        uint32_t Crc32(const uint8_t* data, size_t n, uint32_t crc = 0)
+        {
+            static const auto table = [] {
+                std::array<uint32_t, 256> t;
+                for (uint32_t i = 0; i < 256; ++i)
+                {
+                    uint32_t c = i;
+                    for (uint32_t k = 0; k < 8; ++k)
+                        c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+                    t[i] = c;
+                }
+                return t;
+            }();
+            crc = ~crc;
+            for (size_t i = 0; i < n; ++i)
+                crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+            return ~crc;
+        }
+
+        uint32_t Adler32(const uint8_t* data, size_t n, uint32_t adler)
+        {
+            uint32_t a = adler & 0xFFFF, b = adler >> 16;
+            while (n > 0)
+            {
+                // Largest run without overflowing b
+                const size_t run = std::min<size_t>(n, 5552);
+                for (size_t i = 0; i < run; ++i)
+                {
+                    a += data[i];
+                    b += a;
+                }
+                a %= 65521;
+                b %= 65521;
+                data += run;
+                n -= run;
+            }
+            return (b << 16) | a;
+        }
+
+        void PutU32(std::vector<uint8_t>& out, uint32_t v)
+        {
+            out.insert(out.end(), { (uint8_t)(v >> 24), (uint8_t)(v >> 16), (uint8_t)(v >> 8), (uint8_t)v });
+        }
+
+        void PutChunk(std::vector<uint8_t>& out, const char* type, const uint8_t* data, size_t n)
+        {
+            PutU32(out, (uint32_t)n);
+            const size_t start = out.size();
+            out.insert(out.end(), type, type + 4);
+            out.insert(out.end(), data, data + n);
+            PutU32(out, Crc32(out.data() + start, n + 4));
+        }
+
+        // Filters a row ('prior' is the unfiltered row above), keeps the
+        // filter of smallest sum of absolute (signed) differences
+        void FilterRow(const uint8_t* row, const uint8_t* prior, size_t n, uint32_t bpp, uint8_t* dst)
+        {
+            auto predict = [&](uint32_t filter, size_t i) -> uint8_t {
+                const uint8_t a = i >= bpp ? row[i - bpp] : 0;
+                const uint8_t b = prior[i];
+                const uint8_t c = i >= bpp ? prior[i - bpp] : 0;
+                switch (filter)
+                {
+                    case 1: return a;
+                    case 2: return b;
+                    case 3: return (uint8_t)((a + b) / 2);
+                    case 4:
+                    {
+                        const int32_t p = a + b - c;
+                        const int32_t pa = std::abs(p - a), pb = std::abs(p - b), pc = std::abs(p - c);
+                        return pa <= pb && pa <= pc ? a : pb <= pc ? b : c;
+                    }
+                    default: return 0;
+                }
+            };
+
+            uint32_t best = 0;
+            uint64_t bestCost = UINT64_MAX;
+            for (uint32_t filter = 0; filter < 5; ++filter)
+            {
+                uint64_t cost = 0;
+                for (size_t i = 0; i < n && cost < bestCost; ++i)
+                    cost += std::abs((int8_t)(uint8_t)(row[i] - predict(filter, i)));
+                if (cost < bestCost)
+                {
+                    bestCost = cost;
+                    best = filter;
+                }
+            }
+
+            dst[0] = best;
+            for (size_t i = 0; i < n; ++i)
+                dst[i + 1] = row[i] - predict(best, i);
+        }
+    }
+
+    PngEncoder::PngEncoder(uint32_t w, uint32_t h, uint32_t c, uint32_t depth, bool d)
+        : width(w), height(h), channels(c), bitDepth(depth == 16 ? 16 : 8), dither(d),
+          previous((size_t)w * c * (depth == 16 ? 2 : 1), 0)
+    {
+    }
+
+    std::vector<uint8_t> PngEncoder::Header() const
+    {
+        static constexpr uint8_t COLOR_TYPES[5] = { 0, 0, 4, 2, 6 };
+
+        std::vector<uint8_t> out = { 0x89, 'P', 'N', 'G', 0x0D, 0x0A, 0x1A, 0x0A };
+        std::vector<uint8_t> ihdr;
+        PutU32(ihdr, width);
+        PutU32(ihdr, height);
+        ihdr.insert(ihdr.end(), { (uint8_t)bitDepth, COLOR_TYPES[channels], 0, 0, 0 });
+        PutChunk(out, "IHDR", ihdr.data(), ihdr.size());
+
+        const uint8_t zlib[2] = { 0x78, 0x01 };
+        PutChunk(out, "IDAT", zlib, 2);
+        return out;
+    }
+
+    void PngEncoder::Encode(const float* pixels, uint32_t y, uint32_t rows, std::vector<uint8_t>& out)
+    {
+        const size_t samples = (size_t)width * channels;
+        const size_t stride = samples * bitDepth / 8;
+        const uint32_t bpp = channels * bitDepth / 8;
+
+        std::vector<uint8_t> raw(rows * stride), filtered(rows * (stride + 1));
+
+        #pragma omp parallel for
+        for (int64_t r = 0; r < rows; ++r)
+        {
+            const float* src = pixels + r * samples;
+            uint8_t* dst = raw.data() + r * stride;
+            const size_t offset = (y + r) * samples;
+            if (bitDepth == 8)
+            {
+                ConvertSpan(src, dst, samples, offset, ConvertOptions{ true, dither });
+            }
+            else
+            {
+                // Big endian samples
+                uint16_t* dst16 = reinterpret_cast<uint16_t*>(dst);
+                ConvertSpan(src, dst16, samples, offset, {});
+                if constexpr (std::endian::native == std::endian::little)
+                    for (size_t i = 0; i < samples; ++i)
+                        dst16[i] = std::byteswap(dst16[i]);
+            }
+        }
+
+        #pragma omp parallel for
+        for (int64_t r = 0; r < rows; ++r)
+        {
+            const uint8_t* prior = r == 0 ? previous.data() : raw.data() + (r - 1) * stride;
+            FilterRow(raw.data() + r * stride, prior, stride, bpp, filtered.data() + r * (stride + 1));
+        }
+        std::copy_n(raw.data() + (rows - 1) * stride, stride, previous.data());
+        adler = Adler32(filtered.data(), filtered.size(), adler);
+
+        const int64_t parts = (rows + PNG_PART_ROWS - 1) / PNG_PART_ROWS;
+        std::vector<std::vector<uint8_t>> compressed(parts);
+
+        #pragma omp parallel for schedule(dynamic)
+        for (int64_t p = 0; p < parts; ++p)
+        {
+            const size_t first = p * PNG_PART_ROWS;
+            const size_t count = std::min<size_t>(PNG_PART_ROWS, rows - first);
+            Deflate(filtered.data() + first * (stride + 1), count * (stride + 1), compressed[p]);
+        }
+
+        for (const auto& part : compressed)
+            PutChunk(out, "IDAT", part.data(), part.size());
+    }
+
+    std::vector<uint8_t> PngEncoder::Trailer() const
+    {
+        // Last (empty, stored) block and the checksum of the stream
+        std::vector<uint8_t> end = { 0x01, 0x00, 0x00, 0xFF, 0xFF };
+        PutU32(end, adler);
+
+        std::vector<uint8_t> out;
+        PutChunk(out, "IDAT", end.data(), end.size());
+        PutChunk(out, "IEND", nullptr, 0);
+        return out;
+    }
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+namespace RawEdit
+{
+    // PNG encoder fed strip by strip: rows are filtered (the filter giving
+    // the smallest sum of absolute differences, as libpng does) and
+    // compressed with fixed Huffman deflate blocks. Each strip is split in
+    // parts compressed in parallel and closed with a sync flush (empty
+    // stored block), so the parts simply follow each other in the single
+    // zlib stream of the file.
+    class PngEncoder
+    {
+    public:
+        // 'channels': 1 grey, 2 grey + alpha, 3 RGB, 4 RGBA; 'bitDepth' 8 or 16
+        PngEncoder(uint32_t width, uint32_t height, uint32_t channels, uint32_t bitDepth, bool dither);
+
+        // Signature, IHDR and the zlib header
+        std::vector<uint8_t> Header() const;
+
+        // Appends IDAT chunks of image rows [y, y + rows), normalized floats
+        // with the channels of the file.
+        // Strips come in order, from the top.
+        void Encode(const float* pixels, uint32_t y, uint32_t rows, std::vector<uint8_t>& out);
+
+        // End of the zlib stream and IEND
+        std::vector<uint8_t> Trailer() const;
+
+    private:
+        uint32_t width;
+        uint32_t height;
+        uint32_t channels;
+        uint32_t bitDepth;
+        bool dither;
+        uint32_t adler = 1;
+        // Last row of the previous strip, unfiltered (Up, Average and Paeth filters)
+        std::vector<uint8_t> previous;
+    };
+}
@@ -0,0 +1,753 @@
+#include "sidecar.h"
+#include "utils/rle.h"
+
+#include <bit>
+#include <map>
+#include <cstring>
+#include <fstream>
+#include <charconv>
+#include <algorithm>
+
+namespace RawEdit
+{
+    namespace fs = std::filesystem;
+
+    namespace
+    {
+        constexpr char SIDECAR_MAGIC[4] = { 'R', 'E', 'S', 'C' };
+        constexpr const char* SIDECAR_TEXT_MAGIC = "rawedit-sidecar";
+        constexpr size_t SIDECAR_HEADER_SIZE = 8;
+        constexpr size_t SIDECAR_CHUNK_HEADER_SIZE = 8;
+        // Smallest encoded algorithm (name length, param count) and param
+        // (name length, type, multi mask, value count): counts read from a
+        // file are checked against the bytes left before allocating
+        constexpr size_t SIDECAR_MIN_ALGORITHM_SIZE = 4;
+        constexpr size_t SIDECAR_MIN_PARAM_SIZE = 6;
+        // Masks are one byte per pixel, their rle data says nothing of
+        // their size
+        constexpr uint64_t SIDECAR_MAX_MASK_PIXELS = 1ull << 30;
+
+        bool MaskSizeValid(const Sidecar::MaskState& mask)
+        {
+            return (uint64_t)mask.width * mask.height <= SIDECAR_MAX_MASK_PIXELS && mask.count <= Mask::MAX_MASK_COUNT;
+        }
+
+        struct ByteWriter
+        {
+            std::vector<uint8_t>& out;
+
+            void U8(uint8_t v)   { out.push_back(v); }
+            void U16(uint16_t v) { out.insert(out.end(), { (uint8_t)v, (uint8_t)(v >> 8) }); }
+            void U32(uint32_t v) { U16(v & 0xFFFF); U16(v >> 16); }
+            void F32(float v)    { U32(std::bit_cast<uint32_t>(v)); }
+            void Str(const std::string& s)
+            {
+                U16(s.size());
+                out.insert(out.end(), s.begin(), s.end());
+            }
+            void Bytes(const void* data, size_t n)
+            {
+                const uint8_t* p = static_cast<const uint8_t*>(data);
+                out.insert(out.end(), p, p + n);
+            }
+
+            // Writes the header of a chunk, its size is set by EndChunk
+            size_t BeginChunk(const char* tag)
+            {
+                Bytes(tag, 4);
+                U32(0);
+                return out.size();
+            }
+            void EndChunk(size_t start)
+            {
+                const uint32_t size = out.size() - start;
+                for (uint32_t i = 0; i < 4; ++i)
+                    out[start - 4 + i] = (uint8_t)(size >> (8 * i));
+            }
+        };
+
+        // Reads past the end set 'ok' to false and return zeros
+        struct ByteReader
+        {
+            const uint8_t* p;
+            const uint8_t* end;
+            bool ok = true;
+
+            bool Has(size_t n)
+            {
+                ok = ok && (size_t)(end - p) >= n;
+                return ok;
+            }
+            uint8_t  U8()  { if (!Has(1)) return 0; return *p++; }
+            uint16_t U16() { if (!Has(2)) return 0; const uint16_t v = p[0] | (p[1] << 8); p += 2; return v; }
+            uint32_t U32() { const uint32_t lo = U16(); return lo | ((uint32_t)U16() << 16); }
+            float    F32() { return std::bit_cast<float>(U32()); }
+            std::string Str()
+            {
+                const uint16_t n = U16();
+                if (!Has(n)) return {};
+                std::string s(reinterpret_cast<const char*>(p), n);
+                p += n;
+                return s;
+            }
+        };
+
+        void EncodeValue(ByteWriter& w, ParamType type, const AnyParamType& v)
+        {
+            w.U8(!std::holds_alternative<std::nullptr_t>(v));
+            if (std::holds_alternative<std::nullptr_t>(v)) return;
+            switch (type)
+            {
+                case ParamType::Int:    w.U32(std::bit_cast<uint32_t>(std::get<int>(v))); break;
+                case ParamType::Float:  w.F32(std::get<float>(v)); break;
+                case ParamType::Color:  for (float c : std::get<__Color>(v)) w.F32(c); break;
+                case ParamType::Enum:   w.Str(std::get<EnumType>(v).value); break;
+                case ParamType::String: w.Str(std::get<std::string>(v)); break;
+                default: break;
+            }
+        }
+
+        AnyParamType DecodeValue(ByteReader& r, ParamType type)
+        {
+            if (r.U8() == 0) return nullptr;
+            switch (type)
+            {
+                case ParamType::Int:    return std::bit_cast<int>(r.U32());
+                case ParamType::Float:  return r.F32();
+                case ParamType::Color:  { __Color c; for (float& v : c) v = r.F32(); return c; }
+                case ParamType::Enum:   { EnumType e; e.value = r.Str(); return e; }
+                case ParamType::String: return r.Str();
+                default: return nullptr;
+            }
+        }
+
+        // Values of a param type must hold the alternative of that type.
+        // Only mask overrides may be null (unset), never the base value.
+        bool ValueMatches(ParamType type, const AnyParamType& v, bool nullable)
+        {
+            if (std::holds_alternative<std::nullptr_t>(v)) return nullable;
+            #define __RAWEDIT_PARAM_X(n, t, ...) if (type == ParamType :: n) return std::holds_alternative<t>(v);
+                PARAM_TYPES_LIST()
+            #undef __RAWEDIT_PARAM_X
+            return false;
+        }
+
+        // Values an enum param of an algorithm can take (none when unset)
+        std::shared_ptr<EnumType::ValueList> PossibleValues(const Param& param)
+        {
+            const AnyParamType v = param.values[0].value();
+            const auto* e = std::get_if<EnumType>(&v);
+            return e ? e->possibleValues : nullptr;
+        }
+
+        void EncodeAlgorithms(ByteWriter& w, const std::vector<Sidecar::AlgorithmState>& algorithms)
+        {
+            const size_t chunk = w.BeginChunk("ALGS");
+            w.U32(algorithms.size());
+            for (const auto& a : algorithms)
+            {
+                w.Str(a.name);
+                w.U16(a.params.size());
+                for (const auto& p : a.params)
+                {
+                    w.Str(p.name);
+                    w.U8((uint8_t)p.type);
+                    w.U8(p.multiMask);
+                    w.U16(p.values.size());
+                    for (const auto& v : p.values)
+                        EncodeValue(w, p.type, v);
+                }
+            }
+            w.EndChunk(chunk);
+        }
+
+        void EncodeMask(ByteWriter& w, const Sidecar::MaskState& mask)
+        {
+            const size_t chunk = w.BeginChunk("MASK");
+            w.U32(mask.width);
+            w.U32(mask.height);
+            w.U32(mask.count);
+            w.Bytes(mask.rle.data(), mask.rle.size());
+            w.EndChunk(chunk);
+        }
+
+        void EncodeHeader(ByteWriter& w)
+        {
+            w.Bytes(SIDECAR_MAGIC, 4);
+            w.U16(SIDECAR_VERSION);
+            w.U16(0);
+        }
+
+        Failable<std::vector<uint8_t>> ReadFile(const fs::path& path)
+        {
+            std::ifstream in(path, std::ios::binary | std::ios::ate);
+            if (!in)
+                return Failed("[Sidecar] - Can not open '{}'", path.string());
+            std::vector<uint8_t> data((size_t)in.tellg());
+            in.seekg(0);
+            if (!in.read(reinterpret_cast<char*>(data.data()), data.size()))
+                return Failed("[Sidecar] - Can not read '{}'", path.string());
+            return data;
+        }
+
+        // Written next to the target then renamed: a sidecar is never
+        // left half written
+        Error WriteFile(const fs::path& path, const std::vector<uint8_t>& a, const std::vector<uint8_t>& b = {})
+        {
+            fs::path temporary = path;
+            temporary += ".tmp";
+            {
+                std::ofstream out(temporary, std::ios::binary | std::ios::trunc);
+                out.write(reinterpret_cast<const char*>(a.data()), a.size());
+                out.write(reinterpret_cast<const char*>(b.data()), b.size());
+                if (!out)
+                    return Failed("[Sidecar] - Can not write '{}'", temporary.string()).error();
+            }
+            std::error_code ec;
+            fs::rename(temporary, path, ec);
+            if (ec)
+                return Failed("[Sidecar] - Can not replace '{}': {}", path.string(), ec.message()).error();
+            return Ok();
+        }
+
+        // Text form helpers
+
+        std::string Quote(const std::string& s)
+        {
+            std::string q = "\"";
+            for (char c : s)
+            {
+                if (c == '"' || c == '\\') q += '\\';
+                if (c == '\n') { q += "\\n"; continue; }
+                q += c;
+            }
+            return q + "\"";
+        }
+
+        std::string Number(float v)
+        {
+            char buffer[32];
+            return std::string(buffer, std::to_chars(buffer, buffer + sizeof(buffer), v).ptr);
+        }
+
+        constexpr char BASE64[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+        std::string Base64Encode(const std::vector<uint8_t>& data)
+        {
+            std::string s;
+            for (size_t i = 0; i < data.size(); i += 3)
+            {
+                const uint32_t n = (data[i] << 16) | (i + 1 < data.size() ? data[i + 1] << 8 : 0) | (i + 2 < data.size() ? data[i + 2] : 0);
+                s += BASE64[(n >> 18) & 63];
+                s += BASE64[(n >> 12) & 63];
+                s += i + 1 < data.size() ? BASE64[(n >> 6) & 63] : '=';
+                s += i + 2 < data.size() ? BASE64[n & 63] : '=';
+            }
+            return s;
+        }
+
+        bool Base64Decode(const std::string& s, std::vector<uint8_t>& out)
+        {
+            uint32_t bits = 0, count = 0;
+            for (char c : s)
+            {
+                if (c == '=') break;
+                const char* pos = std::strchr(BASE64, c);
+                if (pos == nullptr || c == 0) return false;
+                bits = (bits << 6) | (uint32_t)(pos - BASE64);
+                count += 6;
+                if (count >= 8)
+                {
+                    count -= 8;
+                    out.push_back((uint8_t)(bits >> count));
+                }
+            }
+            return true;
+        }
+
+        struct Token
+        {
+            std::string text;
+            bool quoted = false;
+        };
+
+        bool Tokenize(std::string_view line, std::vector<Token>& tokens)
+        {
+            tokens.clear();
+            size_t i = 0;
+            while (i < line.size())
+            {
+                if (std::isspace((unsigned char)line[i])) { ++i; continue; }
+                Token t;
+                if (line[i] == '"')
+                {
+                    t.quoted = true;
+                    for (++i; i < line.size() && line[i] != '"'; ++i)
+                    {
+                        if (line[i] == '\\' && i + 1 < line.size())
+                            t.text += line[++i] == 'n' ? '\n' : line[i];
+                        else
+                            t.text += line[i];
+                    }
+                    if (i++ >= line.size()) return false;
+                }
+                else
+                {
+                    for (; i < line.size() && !std::isspace((unsigned char)line[i]); ++i)
+                        t.text += line[i];
+                }
+                tokens.push_back(std::move(t));
+            }
+            return true;
+        }
+
+        template<typename T>
+        bool ParseNumber(const Token& t, T& v)
+        {
+            const char* end = t.text.data() + t.text.size();
+            auto [ptr, ec] = std::from_chars(t.text.data(), end, v);
+            return !t.quoted && ec == std::errc() && ptr == end;
+        }
+
+        Failable<Sidecar> DecodeBinary(const uint8_t* data, size_t size)
+        {
+            ByteReader header{ data + 4, data + size };
+            const uint16_t version = header.U16();
+            header.U16();
+            if (version > SIDECAR_VERSION)
+                return Failed("[Sidecar] - Version {} is not supported (up to {})", version, SIDECAR_VERSION);
+
+            Sidecar sidecar;
+            ByteReader chunks{ data + SIDECAR_HEADER_SIZE, data + size };
+            while (chunks.ok && chunks.p < chunks.end)
+            {
+                if (!chunks.Has(SIDECAR_CHUNK_HEADER_SIZE)) break;
+                const std::string tag(reinterpret_cast<const char*>(chunks.p), 4);
+                chunks.p += 4;
+                const uint32_t length = chunks.U32();
+                if (!chunks.Has(length)) break;
+                ByteReader r{ chunks.p, chunks.p + length };
+                chunks.p += length;
+
+                if (tag == "ALGS")
+                {
+                    const uint32_t count = r.U32();
+                    if (count > (size_t)(r.end - r.p) / SIDECAR_MIN_ALGORITHM_SIZE)
+                        return Failed("[Sidecar] - {} algorithms do not fit in the 'ALGS' chunk", count);
+                    sidecar.algorithms.resize(count);
+                    for (auto& a : sidecar.algorithms)
+                    {
+                        if (!r.ok) break;
+                        a.name = r.Str();
+                        const uint16_t params = r.U16();
+                        if (params > (size_t)(r.end - r.p) / SIDECAR_MIN_PARAM_SIZE)
+                            return Failed("[Sidecar] - {} params of '{}' do not fit in the 'ALGS' chunk", params, a.name);
+                        a.params.resize(params);
+                        for (auto& p : a.params)
+                        {
+                            p.name = r.Str();
+                            const uint8_t type = r.U8();
+                            if (type >= (uint8_t)ParamType::__UNKNOWN_TYPE)
+                                return Failed("[Sidecar] - Unknown type {} for param '{}' of '{}'", type, p.name, a.name);
+                            p.type = (ParamType)type;
+                            p.multiMask = r.U8();
+                            const uint16_t values = r.U16();
+                            if (values > Mask::MAX_MASK_COUNT)
+                                return Failed("[Sidecar] - Too many values for '{}' of '{}'", p.name, a.name);
+                            p.values.resize(values);
+                            for (auto& v : p.values)
+                                v = DecodeValue(r, p.type);
+                        }
+                    }
+                }
+                else if (tag == "MASK")
+                {
+                    Sidecar::MaskState mask;
+                    mask.width  = r.U32();
+                    mask.height = r.U32();
+                    mask.count  = r.U32();
+                    if (r.ok && !MaskSizeValid(mask))
+                        return Failed("[Sidecar] - Invalid {}x{} mask", mask.width, mask.height);
+                    if (r.ok)
+                        mask.rle.assign(r.p, r.end);
+                    sidecar.mask = std::move(mask);
+                }
+                if (!r.ok)
+                    return Failed("[Sidecar] - Truncated '{}' chunk", tag);
+            }
+            if (!chunks.ok)
+                return Failed("[Sidecar] - Truncated sidecar");
+            return sidecar;
+        }
+
+        Failable<Sidecar> DecodeText(std::string_view text)
+        {
+            Sidecar sidecar;
+            std::vector<Token> t;
+            uint32_t lineNumber = 0;
+            for (size_t start = 0; start < text.size();)
+            {
+                size_t end = text.find('\n', start);
+                if (end == std::string_view::npos) end = text.size();
+                const std::string_view line = text.substr(start, end - start);
+                start = end + 1;
+                ++lineNumber;
+
+                if (!Tokenize(line, t))
+                    return Failed("[Sidecar] - Line {}: unterminated string", lineNumber);
+                if (t.empty() || t[0].text.starts_with('#')) continue;
+
+                const std::string& keyword = t[0].text;
+                if (keyword == SIDECAR_TEXT_MAGIC)
+                {
+                    uint32_t version = 0;
+                    if (t.size() != 2 || !ParseNumber(t[1], version) || version > SIDECAR_VERSION)
+                        return Failed("[Sidecar] - Line {}: unsupported version", lineNumber);
+                }
+                else if (keyword == "algorithm" && t.size() == 2)
+                {
+                    sidecar.algorithms.push_back({ t[1].text, {} });
+                }
+                else if (keyword == "param" && t.size() >= 4 && !sidecar.algorithms.empty())
+                {
+                    Sidecar::ParamState p;
+                    p.name = t[1].text;
+                    for (uint32_t k = 0; k < (uint32_t)ParamType::__UNKNOWN_TYPE; ++k)
+                        if (ParamTypeToString((ParamType)k) == t[2].text)
+                            p.type = (ParamType)k;
+                    if (p.type == ParamType::__UNKNOWN_TYPE)
+                        return Failed("[Sidecar] - Line {}: unknown type '{}'", lineNumber, t[2].text);
+                    if (t[3].text != "single" && t[3].text != "multi")
+                        return Failed("[Sidecar] - Line {}: expected 'single' or 'multi'", lineNumber);
+                    p.multiMask = t[3].text == "multi";
+
+                    for (size_t k = 4; k < t.size();)
+                    {
+                        if (!t[k].quoted && t[k].text == "null")
+                        {
+                            p.values.push_back(nullptr);
+                            ++k;
+                            continue;
+                        }
+
+                        bool ok = true;
+                        switch (p.type)
+                        {
+                            case ParamType::Int:   { int v;   ok = ParseNumber(t[k++], v); p.values.push_back(v); break; }
+                            case ParamType::Float: { float v; ok = ParseNumber(t[k++], v); p.values.push_back(v); break; }
+                            case ParamType::Color:
+                            {
+                                __Color c;
+                                for (float& v : c)
+                                    ok = ok && k < t.size() && ParseNumber(t[k++], v);
+                                p.values.push_back(c);
+                                break;
+                            }
+                            case ParamType::Enum:   { EnumType e; e.value = t[k].text; ok = t[k++].quoted; p.values.push_back(e); break; }
+                            case ParamType::String: { ok = t[k].quoted; p.values.push_back(t[k++].text); break; }
+                            default: ok = false;
+                        }
+                        if (!ok)
+                            return Failed("[Sidecar] - Line {}: invalid {} value for '{}'", lineNumber, t[2].text, p.name);
+                    }
+                    if (p.values.size() > Mask::MAX_MASK_COUNT)
+                        return Failed("[Sidecar] - Line {}: too many values for '{}'", lineNumber, p.name);
+                    sidecar.algorithms.back().params.push_back(std::move(p));
+                }
+                else if (keyword == "mask" && t.size() == 5)
+                {
+                    Sidecar::MaskState mask;
+                    if (!ParseNumber(t[1], mask.width) || !ParseNumber(t[2], mask.height) || !ParseNumber(t[3], mask.count) ||
+                        !MaskSizeValid(mask) || !Base64Decode(t[4].text, mask.rle))
+                        return Failed("[Sidecar] - Line {}: invalid mask", lineNumber);
+                    sidecar.mask = std::move(mask);
+                }
+                else
+                {
+                    return Failed("[Sidecar] - Line {}: unexpected '{}'", lineNumber, keyword);
+                }
+            }
+            return sidecar;
+        }
+
+        // Mask chunk of an existing sidecar (binary: copied as is)
+        Failable<std::vector<uint8_t>> ExtractMaskChunk(const std::vector<uint8_t>& data)
+        {
+            if (data.size() >= SIDECAR_HEADER_SIZE && std::memcmp(data.data(), SIDECAR_MAGIC, 4) == 0)
+            {
+                size_t p = SIDECAR_HEADER_SIZE;
+                while (p + SIDECAR_CHUNK_HEADER_SIZE <= data.size())
+                {
+                    const uint32_t length = data[p + 4] | (data[p + 5] << 8) | (data[p + 6] << 16) | ((uint32_t)data[p + 7] << 24);
+                    const size_t next = p + SIDECAR_CHUNK_HEADER_SIZE + length;
+                    if (next > data.size())
+                        return Failed("[Sidecar] - Truncated sidecar");
+                    if (std::memcmp(data.data() + p, "MASK", 4) == 0)
+                        return std::vector<uint8_t>(data.begin() + p, data.begin() + next);
+                    p = next;
+                }
+                return std::vector<uint8_t>();
+            }
+
+            auto sidecar = Sidecar::Decode(data.data(), data.size());
+            if (!sidecar)
+                return Failed(sidecar.error());
+            std::vector<uint8_t> chunk;
+            if (sidecar->mask)
+            {
+                ByteWriter w{ chunk };
+                EncodeMask(w, *sidecar->mask);
+            }
+            return chunk;
+        }
+    }
+
+    Sidecar Sidecar::Capture(const Pipeline& pipeline, const Mask* mask)
+    {
+        Sidecar sidecar;
+        for (size_t i = 0; i < pipeline.StageCount(); ++i)
+        {
+            const Algorithm& algo = pipeline[i];
+            AlgorithmState& a = sidecar.algorithms.emplace_back();
+            a.name = algo.GetName();
+            for (const auto& [name, param] : algo.GetInputs())
+            {
+                if (param.type == ParamType::__UNKNOWN_TYPE) continue;
+                ParamState& p = a.params.emplace_back();
+                p.name = name;
+                p.type = param.type;
+                p.multiMask = param.multiMask;
+                for (const auto& v : param.values)
+                    p.values.push_back(v.value());
+            }
+        }
+
+        if (mask != nullptr && mask->width != 0)
+        {
+            MaskState m;
+            m.width  = mask->width;
+            m.height = mask->height;
+            m.count  = mask->GetMaskCount();
+            m.rle    = RLEEncode(mask->GetDataPtr(), (size_t)m.width * m.height);
+            sidecar.mask = std::move(m);
+        }
+        return sidecar;
+    }
+
+    Error Sidecar::Apply(Pipeline& pipeline, Mask* target) const
+    {
+        // Validation first, nothing is set on errors
+        std::vector<Algorithm*> stages(algorithms.size(), nullptr);
+        std::map<std::string, uint32_t> occurrences;
+        for (size_t i = 0; i < algorithms.size(); ++i)
+        {
+            const AlgorithmState& a = algorithms[i];
+            uint32_t skip = occurrences[a.name]++;
+            for (size_t s = 0; s < pipeline.StageCount() && stages[i] == nullptr; ++s)
+                if (pipeline[s].GetName() == a.name && skip-- == 0)
+                    stages[i] = &pipeline[s];
+            if (stages[i] == nullptr)
+                return Failed("[Sidecar] - No '{}' stage in the pipeline", a.name).error();
+
+            auto& inputs = stages[i]->GetInputs();
+            for (const ParamState& p : a.params)
+            {
+                auto it = inputs.find(p.name);
+                if (it == inputs.end())
+                    return Failed("[Sidecar] - No parameter named '{}' in '{}'", p.name, a.name).error();
+                const Param& param = it->second;
+                if (param.type != p.type)
+                    return Failed("[Sidecar] - Type mismatch for parameter '{}' in '{}'. Expected '{}', given '{}'", p.name, a.name, ParamTypeToString(param.type), ParamTypeToString(p.type)).error();
+                if (param.multiMask != p.multiMask || p.values.empty() || (!p.multiMask && p.values.size() != 1))
+                    return Failed("[Sidecar] - Mask mismatch for parameter '{}' in '{}'.", p.name, a.name).error();
+
+                for (size_t k = 0; k < p.values.size(); ++k)
+                {
+                    const AnyParamType& v = p.values[k];
+                    if (!ValueMatches(p.type, v, k > 0))
+                        return Failed("[Sidecar] - Invalid value for parameter '{}' in '{}'", p.name, a.name).error();
+                    if (p.type != ParamType::Enum || std::holds_alternative<std::nullptr_t>(v)) continue;
+
+                    const auto possible = PossibleValues(param);
+                    const std::string& value = std::get<EnumType>(v).value;
+                    if (possible && std::find(possible->begin(), possible->end(), value) == possible->end())
+                        return Failed("[Sidecar] - '{}' is not a value of '{}' in '{}'", value, p.name, a.name).error();
+                }
+            }
+        }
+
+        std::vector<MaskDataType> maskData;
+        if (mask && target != nullptr)
+        {
+            if (!MaskSizeValid(*mask))
+                return Failed("[Sidecar] - Invalid {}x{} mask", mask->width, mask->height).error();
+            maskData.resize((size_t)mask->width * mask->height);
+            if (!RLEDecode(mask->rle.data(), mask->rle.size(), maskData.data(), maskData.size()))
+                return Error("[Sidecar] - Corrupted mask");
+        }
+
+        for (size_t i = 0; i < algorithms.size(); ++i)
+        {
+            auto& inputs = stages[i]->GetInputs();
+            for (const ParamState& p : algorithms[i].params)
+            {
+                Param& param = inputs[p.name];
+                // Enums keep the list of values of the algorithm
+                const auto possible = p.type == ParamType::Enum ? PossibleValues(param) : nullptr;
+
+                // Extra mask values are cleared (not dropped) so that they
+                // still count as changes
+                if (param.values.size() < p.values.size())
+                    param.values.resize(p.values.size(), Cached<AnyParamType>(nullptr));
+                for (size_t k = 0; k < param.values.size(); ++k)
+                {
+                    AnyParamType v = k < p.values.size() ? p.values[k] : AnyParamType(nullptr);
+                    if (auto* e = std::get_if<EnumType>(&v))
+                        e->possibleValues = possible;
+                    param.values[k] = v;
+                }
+            }
+        }
+
+        if (mask && target != nullptr)
+        {
+            // Nearest neighbour to the current mask size (masks follow the
+            // display resolution)
+            const uint32_t w = target->width ? target->width : mask->width;
+            const uint32_t h = target->height ? target->height : mask->height;
+            if (w != mask->width || h != mask->height)
+            {
+                std::vector<MaskDataType> resized((size_t)w * h);
+                for (uint32_t y = 0; y < h; ++y)
+                {
+                    const uint32_t sy = std::min<uint32_t>((uint64_t)y * mask->height / h, mask->height - 1);
+                    for (uint32_t x = 0; x < w; ++x)
+                        resized[(size_t)y * w + x] = maskData[(size_t)sy * mask->width + std::min<uint32_t>((uint64_t)x * mask->width / w, mask->width - 1)];
+                }
+                maskData = std::move(resized);
+            }
+            target->Restore(w, h, mask->count, maskData.data());
+        }
+        return Ok();
+    }
+
+    std::vector<uint8_t> Sidecar::Encode() const
+    {
+        std::vector<uint8_t> out;
+        ByteWriter w{ out };
+        EncodeHeader(w);
+        EncodeAlgorithms(w, algorithms);
+        if (mask)
+            EncodeMask(w, *mask);
+        return out;
+    }
+
+    // rawedit-sidecar 1
+    // algorithm "Exposure"
+    // param "exposure" Float multi 0.5 null 1.25
+    // param "method" Enum single "Bicubic"
+    // mask <width> <height> <count> <base64 of the rle data>
+    std::string Sidecar::EncodeText() const
+    {
+        std::string s = std::string(SIDECAR_TEXT_MAGIC) + " " + std::to_string(SIDECAR_VERSION) + "\n";
+        for (const auto& a : algorithms)
+        {
+            s += "algorithm " + Quote(a.name) + "\n";
+            for (const auto& p : a.params)
+            {
+                s += "param " + Quote(p.name) + " " + ParamTypeToString(p.type) + (p.multiMask ? " multi" : " single");
+                for (const auto& v : p.values)
+                {
+                    s += " ";
+                    if (std::holds_alternative<std::nullptr_t>(v)) { s += "null"; continue; }
+                    switch (p.type)
+                    {
+                        case ParamType::Int:    s += std::to_string(std::get<int>(v)); break;
+                        case ParamType::Float:  s += Number(std::get<float>(v)); break;
+                        case ParamType::Color:  { const auto& c = std::get<__Color>(v); s += Number(c[0]) + " " + Number(c[1]) + " " + Number(c[2]); break; }
+                        case ParamType::Enum:   s += Quote(std::get<EnumType>(v).value); break;
+                        case ParamType::String: s += Quote(std::get<std::string>(v)); break;
+                        default: break;
+                    }
+                }
+                s += "\n";
+            }
+        }
+        if (mask)
+            s += "mask " + std::to_string(mask->width) + " " + std::to_string(mask->height) + " " + std::to_string(mask->count) + " " + Base64Encode(mask->rle) + "\n";
+        return s;
+    }
+
+    Failable<Sidecar> Sidecar::Decode(const uint8_t* data, size_t size)
+    {
+        if (size >= SIDECAR_HEADER_SIZE && std::memcmp(data, SIDECAR_MAGIC, 4) == 0)
+            return DecodeBinary(data, size);
+
+        const std::string_view text(reinterpret_cast<const char*>(data), size);
+        if (!text.starts_with(SIDECAR_TEXT_MAGIC))
+            return Failed("[Sidecar] - Not a sidecar");
+        return DecodeText(text);
+    }
+
+    Failable<Sidecar> Sidecar::Load(const fs::path& path)
+    {
+        auto data = ReadFile(path);
+        if (!data)
+            return Failed(data.error());
+        auto sidecar = Decode(data->data(), data->size());
+        if (!sidecar)
+            return Failed("{} ('{}')", sidecar.error(), path.string());
+        return sidecar;
+    }
+
+    Error Sidecar::Save(const fs::path& path, bool text) const
+    {
+        if (!text)
+            return WriteFile(path, Encode());
+        const std::string s = EncodeText();
+        return WriteFile(path, std::vector<uint8_t>(s.begin(), s.end()));
+    }
+
+    Error SyncSidecars(const Sidecar& preset, const std::vector<fs::path>& images, std::vector<Error>* failures)
+    {
+        std::vector<uint8_t> head;
+        ByteWriter w{ head };
+        EncodeHeader(w);
+        EncodeAlgorithms(w, preset.algorithms);
+
+        std::vector<Error> errors(images.size());
+
+        #pragma omp parallel for schedule(dynamic)
+        for (int64_t i = 0; i < images.size(); ++i)
+        {
+            const fs::path path = SidecarPath(images[i]);
+            std::vector<uint8_t> maskChunk;
+            std::error_code ec;
+            if (fs::exists(path, ec))
+            {
+                // Never replace a sidecar that can not be read (its mask would be lost)
+                auto data = ReadFile(path);
+                auto chunk = data ? ExtractMaskChunk(*data) : Failed(data.error());
+                if (!chunk)
+                {
+                    errors[i] = Failed("{} ('{}')", chunk.error(), path.string()).error();
+                    continue;
+                }
+                maskChunk = std::move(*chunk);
+            }
+            errors[i] = WriteFile(path, head, maskChunk);
+        }
+
+        size_t failed = 0;
+        for (auto& err : errors)
+        {
+            if (err.empty()) continue;
+            ++failed;
+            if (failures)
+                failures->push_back(std::move(err));
+        }
+        if (failed)
+            return Failed("[Sidecar] - {} of {} sidecars could not be written", failed, images.size()).error();
+        return Ok();
+    }
+}
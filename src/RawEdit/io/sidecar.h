@@ -0,0 +1,89 @@
+#pragma once
+
+#include <vector>
+#include <optional>
+#include <filesystem>
+#include <utils/error.h>
+#include <image/mask.h>
+#include <algorithm/base/pipeline.h>
+
+namespace RawEdit
+{
+    constexpr uint16_t SIDECAR_VERSION = 1;
+    // Edit sidecar of an image: the image file name followed by this extension
+    constexpr const char* SIDECAR_EXTENSION = ".rawedit";
+
+    // Edits of an image: the inputs of the algorithms of a pipeline (every
+    // mask value of multi mask params) and the mask, rle compressed.
+    //
+    // Binary form (little endian): "RESC", version (u16), 0 (u16), then
+    // chunks { tag (4 chars), size (u32), payload }. "ALGS" holds the
+    // algorithms, "MASK" the mask; unknown chunks are skipped. Presets are
+    // synced to images by splicing chunks, without parsing them.
+    // Text form: "rawedit-sidecar <version>" then one line per algorithm,
+    // param and mask, see EncodeText.
+    //
+    // A decoded sidecar is validated once against a pipeline when applied
+    // (names, ParamType, multi mask, enum values) and can be applied to any
+    // number of pipelines.
+    class Sidecar
+    {
+    public:
+        struct ParamState
+        {
+            std::string name;
+            ParamType type = ParamType::__UNKNOWN_TYPE;
+            bool multiMask = false;
+            // One per mask index, nullptr where unset
+            std::vector<AnyParamType> values;
+        };
+
+        struct AlgorithmState
+        {
+            std::string name;
+            std::vector<ParamState> params;
+        };
+
+        struct MaskState
+        {
+            uint32_t width = 0;
+            uint32_t height = 0;
+            uint32_t count = 0;
+            std::vector<uint8_t> rle;
+        };
+
+        std::vector<AlgorithmState> algorithms;
+        std::optional<MaskState> mask;
+
+        // Inputs of the stages of 'pipeline' (and 'mask' when given)
+        static Sidecar Capture(const Pipeline& pipeline, const Mask* mask = nullptr);
+
+        // Sets the inputs of 'pipeline'. Stages are matched by name (the
+        // n-th stage of a name in the sidecar to the n-th one in the
+        // pipeline), params by name; inputs the sidecar does not have are
+        // left as they are. Everything is checked before anything is set.
+        // The mask is resampled when its size differs from 'mask'.
+        Error Apply(Pipeline& pipeline, Mask* mask = nullptr) const;
+
+        std::vector<uint8_t> Encode() const;
+        std::string EncodeText() const;
+        // Either form
+        static Failable<Sidecar> Decode(const uint8_t* data, size_t size);
+
+        static Failable<Sidecar> Load(const std::filesystem::path& path);
+        Error Save(const std::filesystem::path& path, bool text = false) const;
+    };
+
+    inline std::filesystem::path SidecarPath(const std::filesystem::path& image)
+    {
+        std::filesystem::path p = image;
+        p += SIDECAR_EXTENSION;
+        return p;
+    }
+
+    // Writes the algorithms of 'preset' in the sidecars of 'images',
+    // keeping their masks. The preset is encoded once, existing sidecars
+    // are only scanned for their mask chunk: the cost is the I/O. Failures
+    // are reported per image.
+    Error SyncSidecars(const Sidecar& preset, const std::vector<std::filesystem::path>& images, std::vector<Error>* failures = nullptr);
+}
@@ -0,0 +1,227 @@
+#pragma once
+
+#include <array>
+#include <cmath>
+#include <vector>
+#include <limits>
+#include "image/image.h"
+#include "image/tile.h"
+#include "image/pyramid.h"
+
+namespace RawEdit
+{
+    constexpr uint32_t HISTOGRAM_BINS = 256;
+    constexpr uint32_t STATS_MAX_CHANNELS = 4;
+
+    // Values are normalized ([0, 1] on the range of integer types).
+    // Clipped values are <= 0 or >= 1, they still fall in the first
+    // and last bins.
+    struct ChannelStats
+    {
+        std::array<uint32_t, HISTOGRAM_BINS> histogram{};
+        float min = std::numeric_limits<float>::infinity();
+        float max = -std::numeric_limits<float>::infinity();
+        uint64_t clippedLow  = 0;
+        uint64_t clippedHigh = 0;
+
+        void Add(const ChannelStats& other, int32_t sign = 1)
+        {
+            for (uint32_t b = 0; b < HISTOGRAM_BINS; ++b)
+                histogram[b] += sign * other.histogram[b];
+            clippedLow  += sign * (int64_t)other.clippedLow;
+            clippedHigh += sign * (int64_t)other.clippedHigh;
+            if (sign > 0)
+            {
+                min = std::min(min, other.min);
+                max = std::max(max, other.max);
+            }
+        }
+
+        // Value below which 'p' (in [0, 1]) of the samples are, from the
+        // histogram (bin resolution)
+        float Percentile(double p) const
+        {
+            uint64_t total = 0;
+            for (uint32_t b = 0; b < HISTOGRAM_BINS; ++b)
+                total += histogram[b];
+            if (total == 0) return 0.f;
+
+            const uint64_t target = (uint64_t)std::ceil(p * total);
+            uint64_t count = 0;
+            for (uint32_t b = 0; b < HISTOGRAM_BINS; ++b)
+            {
+                count += histogram[b];
+                if (count >= target)
+                    return (b + 0.5f) / HISTOGRAM_BINS;
+            }
+            return 1.f;
+        }
+    };
+
+    struct ImageStats
+    {
+        uint32_t channels = 0;
+        uint64_t pixels   = 0;
+        // Pyramid level the stats were computed on
+        uint32_t level    = 0;
+        std::array<ChannelStats, STATS_MAX_CHANNELS> channel;
+        // Rec. 709 luminance of the first three channels
+        ChannelStats luminance;
+    };
+
+    template<typename T>
+    RAWEDIT_INLINE void AccumulateRowImpl(const float* px, size_t count, uint32_t c, ChannelStats* channel, ChannelStats& luminance)
+    {
+        auto add = [](ChannelStats& s, float v) {
+            const int32_t bin = std::clamp((int32_t)(v * HISTOGRAM_BINS), 0, (int32_t)HISTOGRAM_BINS - 1);
+            s.histogram[bin]++;
+            s.clippedLow  += v <= 0.f;
+            s.clippedHigh += v >= 1.f;
+            s.min = std::min(s.min, v);
+            s.max = std::max(s.max, v);
+        };
+
+        for (size_t i = 0; i < count; ++i)
+        {
+            for (uint32_t k = 0; k < c; ++k)
+                add(channel[k], px[i * c + k]);
+            if (c >= 3)
+                add(luminance, 0.2126f * px[i * c] + 0.7152f * px[i * c + 1] + 0.0722f * px[i * c + 2]);
+        }
+    }
+    RAWEDIT_KERNEL(AccumulateRow)
+
+    // Histograms, extrema and clipping counts of an image, computed on a
+    // pyramid level. Each tile of the level owns its partial stats (no
+    // shared counters between threads), totals are merged from them.
+    // After an edit only the tiles covering the changed region are
+    // recomputed and swapped in the totals.
+    class Statistics
+    {
+    public:
+        // Level picked by default: the smallest with at least that many pixels
+        static constexpr size_t DEFAULT_TARGET_PIXELS = 512 * 512;
+
+        void SetTargetPixels(size_t pixels) { targetPixels = pixels; tiles.clear(); }
+
+        // Region changed in level 0 coordinates
+        void Invalidate(const Rect& region)
+        {
+            if (!tiles.empty())
+                grid.MarkDirty(LevelRegion(region));
+        }
+
+        void InvalidateAll() { tiles.clear(); }
+
+        // Brings the stats up to date with the pyramid (the pyramid itself
+        // must have been updated first)
+        const ImageStats& Update(const Pyramid& pyramid)
+        {
+            const uint32_t level = pyramid.LevelFor(targetPixels);
+            const ImagePtr& img = pyramid.Level(level);
+            if (tiles.empty() || level != stats.level || !grid.Matches(img->width, img->height) || std::min(img->channels, STATS_MAX_CHANNELS) != stats.channels)
+            {
+                stats = ImageStats{};
+                stats.level = level;
+                stats.channels = std::min(img->channels, STATS_MAX_CHANNELS);
+                stats.pixels = (uint64_t)img->width * img->height;
+
+                grid.Reset(img->width, img->height);
+                tiles.assign(grid.TileCount(), ImageStats{});
+            }
+            scale = 1u << level;
+
+            const std::vector<uint32_t> dirty = grid.PullDirty();
+            if (dirty.empty()) return stats;
+
+            // Removes the old partial stats, recomputes and adds the new ones
+            for (uint32_t t : dirty)
+                Merge(tiles[t], -1);
+
+            DISPATCH_DATATYPE(img->type,
+                Compute(static_cast<const CPUImage<DataType>*>(img.get()), dirty);
+            );
+
+            for (uint32_t t : dirty)
+                Merge(tiles[t], 1);
+
+            // Extrema can not be subtracted, they are gathered from the tiles
+            for (uint32_t k = 0; k < stats.channels; ++k)
+                GatherExtrema(stats.channel[k], [&](const ImageStats& s) -> const ChannelStats& { return s.channel[k]; });
+            GatherExtrema(stats.luminance, [](const ImageStats& s) -> const ChannelStats& { return s.luminance; });
+            return stats;
+        }
+
+        const ImageStats& Get() const { return stats; }
+
+    private:
+        Rect LevelRegion(const Rect& r) const
+        {
+            const uint32_t x0 = r.x / scale, y0 = r.y / scale;
+            const uint32_t x1 = (r.Right() + scale - 1) / scale, y1 = (r.Bottom() + scale - 1) / scale;
+            return Rect{ x0, y0, x1 - x0, y1 - y0 };
+        }
+
+        void Merge(const ImageStats& tile, int32_t sign)
+        {
+            for (uint32_t k = 0; k < stats.channels; ++k)
+                stats.channel[k].Add(tile.channel[k], sign);
+            stats.luminance.Add(tile.luminance, sign);
+        }
+
+        template<typename Get>
+        void GatherExtrema(ChannelStats& total, Get&& get)
+        {
+            total.min = std::numeric_limits<float>::infinity();
+            total.max = -std::numeric_limits<float>::infinity();
+            for (const auto& t : tiles)
+            {
+                total.min = std::min(total.min, get(t).min);
+                total.max = std::max(total.max, get(t).max);
+            }
+        }
+
+        template<typename T>
+        void Compute(const CPUImage<T>* img, const std::vector<uint32_t>& dirty)
+        {
+            static const auto kernel = RAWEDIT_SELECT_KERNEL(AccumulateRow, float);
+            const uint32_t c = stats.channels;
+            const uint32_t stride = img->channels;
+
+            #pragma omp parallel
+            {
+                std::vector<float> row(grid.TileSize() * stride);
+                std::vector<float> packed(grid.TileSize() * c);
+
+                #pragma omp for schedule(dynamic)
+                for (int64_t i = 0; i < (int64_t)dirty.size(); ++i)
+                {
+                    const Rect r = grid.TileRect(dirty[i]);
+                    ImageStats& s = tiles[dirty[i]];
+                    s = ImageStats{};
+
+                    for (uint32_t y = r.y; y < r.Bottom(); ++y)
+                    {
+                        ConvertSpan(img->GetDataPtr() + img->GetIndex(y, r.x), row.data(), (size_t)r.width * stride, 0, {});
+                        const float* px = row.data();
+                        if (stride != c)
+                        {
+                            for (uint32_t x = 0; x < r.width; ++x)
+                                for (uint32_t k = 0; k < c; ++k)
+                                    packed[x * c + k] = row[x * stride + k];
+                            px = packed.data();
+                        }
+                        kernel(px, r.width, c, s.channel.data(), s.luminance);
+                    }
+                }
+            }
+        }
+
+        size_t targetPixels = DEFAULT_TARGET_PIXELS;
+        uint32_t scale = 1;
+
+        ImageStats stats;
+        TileGrid grid;
+        std::vector<ImageStats> tiles;
+    };
+}
@@ -25,7 +25,7 @@ namespace RawEdit
         }
 
         T& value()       { return _value; };
-        T  value() const { return _value; };
+        const T& value() const { return _value; };
     private:
         T _value;
         mutable T _oldValue;
@@ -0,0 +1,194 @@
+#pragma once
+
+#include <mutex>
+#include <thread>
+#include <algorithm>
+#include <condition_variable>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+namespace RawEdit
+{
+    // How the cores are shared between images processed side by side
+    // (loaders, batch exports...) and the kernels of a single image
+    enum class ConcurrencyPolicy
+    {
+        // An image is edited: its kernels get most of the cores, images
+        // load in the background on one core each
+        Interactive,
+        // Throughput over many images: a lane per couple of cores
+        Batch,
+        // Half of the cores for each
+        Balanced
+    };
+
+    enum class Lane
+    {
+        // Rendering of the edited image, a single lane
+        Interactive,
+        // Loading, exporting... one image per lane
+        Batch
+    };
+
+    struct ConcurrencyBudget
+    {
+        uint32_t interactiveThreads = 1;
+        // Images processed at once and the kernel threads of each of them
+        uint32_t batchLanes = 1;
+        uint32_t batchThreads = 1;
+    };
+
+    // The split of the cores for the whole process. Work runs in lanes: a
+    // thread takes one (ConcurrencyLease) for the time of a job, waiting
+    // while every lane of its kind is taken, and its OpenMP regions are
+    // sized to the lane. Teams are never nested (a ForEachRow within a
+    // ForEachTile runs on the tile thread), so the threads of all the lanes
+    // never add up to more than the cores.
+    class Concurrency
+    {
+    public:
+        static Concurrency& Instance()
+        {
+            static Concurrency instance;
+            return instance;
+        }
+
+        static ConcurrencyBudget MakeBudget(ConcurrencyPolicy policy, uint32_t cores)
+        {
+            cores = std::max(cores, 1u);
+            ConcurrencyBudget b;
+            switch (policy)
+            {
+                case ConcurrencyPolicy::Interactive:
+                    b.batchLanes = std::clamp(cores / 4, 1u, 4u);
+                    b.batchThreads = 1;
+                    b.interactiveThreads = std::max(cores - b.batchLanes, 1u);
+                    break;
+                case ConcurrencyPolicy::Batch:
+                    b.interactiveThreads = 1;
+                    b.batchThreads = cores >= 8 ? 2 : 1;
+                    b.batchLanes = std::max((cores - 1) / b.batchThreads, 1u);
+                    break;
+                case ConcurrencyPolicy::Balanced:
+                    b.interactiveThreads = std::max(cores / 2, 1u);
+                    b.batchThreads = std::max(cores / 16, 1u);
+                    b.batchLanes = std::max((cores - b.interactiveThreads) / b.batchThreads, 1u);
+                    break;
+            }
+            return b;
+        }
+
+        // 0 cores: the hardware ones
+        void SetPolicy(ConcurrencyPolicy policy, uint32_t cores = 0)
+        {
+            SetBudget(MakeBudget(policy, cores ? cores : HardwareCores()));
+        }
+
+        // Leases already taken keep their threads
+        void SetBudget(const ConcurrencyBudget& b)
+        {
+            {
+                std::lock_guard lock(mutex);
+                budget = b;
+            }
+            freed.notify_all();
+        }
+
+        ConcurrencyBudget Budget() const
+        {
+            std::lock_guard lock(mutex);
+            return budget;
+        }
+
+        // Kernel threads of the calling thread: its lease, all the cores
+        // without one
+        static uint32_t ThreadsHere()
+        {
+#ifdef _OPENMP
+            return (uint32_t)omp_get_max_threads();
+#else
+            return 1;
+#endif
+        }
+
+        // For the threads a job starts: OpenMP settings are per thread and
+        // new threads do not inherit them
+        static void SetThreadsHere(uint32_t threads)
+        {
+#ifdef _OPENMP
+            omp_set_num_threads((int)std::max(threads, 1u));
+            omp_set_max_active_levels(1);
+#endif
+        }
+
+        static uint32_t HardwareCores()
+        {
+            return std::max(std::thread::hardware_concurrency(), 1u);
+        }
+
+    private:
+        friend class ConcurrencyLease;
+
+        Concurrency() : budget(MakeBudget(ConcurrencyPolicy::Interactive, HardwareCores()))
+        {
+#ifdef _OPENMP
+            omp_set_max_active_levels(1);
+#endif
+        }
+
+        // Waits for a free lane, returns its threads
+        uint32_t Enter(Lane lane)
+        {
+            std::unique_lock lock(mutex);
+            const size_t i = static_cast<size_t>(lane);
+            freed.wait(lock, [&] { return active[i] < Lanes(lane); });
+            ++active[i];
+            return lane == Lane::Interactive ? budget.interactiveThreads : budget.batchThreads;
+        }
+
+        void Leave(Lane lane)
+        {
+            {
+                std::lock_guard lock(mutex);
+                --active[static_cast<size_t>(lane)];
+            }
+            freed.notify_all();
+        }
+
+        uint32_t Lanes(Lane lane) const
+        {
+            return lane == Lane::Interactive ? 1 : budget.batchLanes;
+        }
+
+        mutable std::mutex mutex;
+        std::condition_variable freed;
+        ConcurrencyBudget budget;
+        uint32_t active[2] = {};
+    };
+
+    // A lane for the calling thread, as long as it lives
+    class ConcurrencyLease
+    {
+    public:
+        explicit ConcurrencyLease(Lane l) : lane(l), previous(Concurrency::ThreadsHere())
+        {
+            threads = Concurrency::Instance().Enter(lane);
+            Concurrency::SetThreadsHere(threads);
+        }
+        ~ConcurrencyLease()
+        {
+            Concurrency::SetThreadsHere(previous);
+            Concurrency::Instance().Leave(lane);
+        }
+        ConcurrencyLease(const ConcurrencyLease&) = delete;
+        ConcurrencyLease& operator=(const ConcurrencyLease&) = delete;
+
+        uint32_t Threads() const { return threads; }
+
+    private:
+        Lane lane;
+        uint32_t threads = 1;
+        uint32_t previous;
+    };
+}
@@ -0,0 +1,97 @@
+#pragma once
+
+#include <cstdlib>
+#include <cstdint>
+#include <string>
+#include <algorithm>
+
+namespace RawEdit
+{
+    // Instruction sets kernels are compiled for, from the least to the 
+    // most capable one. Second argument is the attribute applied to the 
+    // kernel variants.
+    #if defined(__GNUC__) || defined(__clang__)
+        #define RAWEDIT_TARGET(str) __attribute__((target(str)))
+        #define RAWEDIT_INLINE inline __attribute__((always_inline))
+    #else
+        #define RAWEDIT_TARGET(str)
+        #define RAWEDIT_INLINE __forceinline
+    #endif
+    #define RAWEDIT_NO_TARGET
+
+    // The list takes the X macro as argument so it can be expanded from 
+    // within other macros (see kernel.h)
+    #define __RAWEDIT_ISA_LIST_APPLY(X, ...) \
+        X(Scalar, RAWEDIT_NO_TARGET, __VA_ARGS__) \
+        X(SSE4  , RAWEDIT_TARGET("sse4.2,popcnt"), __VA_ARGS__) \
+        X(AVX2  , RAWEDIT_TARGET("avx2,fma,f16c,bmi2"), __VA_ARGS__) \
+        X(AVX512, RAWEDIT_TARGET("avx512f,avx512bw,avx512vl,avx512dq,avx2,fma,f16c,bmi2"), __VA_ARGS__)
+
+    #define ISA_LIST(...) __RAWEDIT_ISA_LIST_APPLY(__RAWEDIT_ISA_X, __VA_ARGS__)
+
+    enum class ISA
+    {
+        #define __RAWEDIT_ISA_X(name, ...) name,
+            ISA_LIST()
+        #undef __RAWEDIT_ISA_X
+        __COUNT
+    };
+
+    constexpr size_t ISACount = static_cast<size_t>(ISA::__COUNT);
+
+    inline const char* ISAToString(ISA isa)
+    {
+        switch (isa)
+        {
+            #define __RAWEDIT_ISA_X(name, ...) case ISA :: name : return #name;
+                ISA_LIST()
+            #undef __RAWEDIT_ISA_X
+            default:
+                return "Unknown";
+        }
+    }
+
+    inline ISA StringToISA(std::string str, ISA fallback)
+    {
+        std::transform(str.begin(), str.end(), str.begin(), [](unsigned char c) { return std::tolower(c); });
+
+        #define __RAWEDIT_ISA_X(name, ...) { std::string n = #name; std::transform(n.begin(), n.end(), n.begin(), [](unsigned char c) { return std::tolower(c); }); if (n == str) return ISA :: name; }
+            ISA_LIST()
+        #undef __RAWEDIT_ISA_X
+        return fallback;
+    }
+
+    // Best instruction set supported by the cpu (and os)
+    inline ISA DetectISA()
+    {
+        #if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+            __builtin_cpu_init();
+            if (__builtin_cpu_supports("avx512f")  && __builtin_cpu_supports("avx512bw") && 
+                __builtin_cpu_supports("avx512vl") && __builtin_cpu_supports("avx512dq") && 
+                __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") && __builtin_cpu_supports("f16c"))
+                return ISA::AVX512;
+            if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") && 
+                __builtin_cpu_supports("f16c") && __builtin_cpu_supports("bmi2"))
+                return ISA::AVX2;
+            if (__builtin_cpu_supports("sse4.2") && __builtin_cpu_supports("popcnt"))
+                return ISA::SSE4;
+        #endif
+        return ISA::Scalar;
+    }
+
+    // Instruction set used by kernels. Computed once, it can be lowered 
+    // (but not raised above what the cpu supports) with the RAWEDIT_ISA 
+    // environment variable, eg: RAWEDIT_ISA=sse4
+    inline ISA ActiveISA()
+    {
+        static const ISA isa = []() {
+            const ISA detected = DetectISA();
+            const char* forced = std::getenv("RAWEDIT_ISA");
+            if (forced == nullptr)
+                return detected;
+
+            return std::min(detected, StringToISA(forced, detected));
+        }();
+        return isa;
+    }
+}
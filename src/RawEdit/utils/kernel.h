@@ -0,0 +1,35 @@
+#pragma once
+
+#include <array>
+#include "isa.h"
+
+namespace RawEdit
+{
+    // Multiversioned kernels
+    // - The kernel body is written once, as a template function named 
+    //   `<name>Impl` and marked RAWEDIT_INLINE
+    // - RAWEDIT_KERNEL(name) declares one `<name>_<ISA>` wrapper per 
+    //   instruction set. The body is inlined in each of them, hence compiled
+    //   (and auto-vectorized) for that instruction set
+    // - RAWEDIT_SELECT_KERNEL(name, types...) returns the wrapper matching
+    //   ActiveISA() for the given template arguments
+    // Kernels should work on rows / spans: OpenMP regions must stay outside 
+    // of them, as outlined parallel regions do not inherit the target. 
+    #define RAWEDIT_KERNEL(name) \
+        __RAWEDIT_ISA_LIST_APPLY(__RAWEDIT_KERNEL_VARIANT, name)
+
+    #define __RAWEDIT_KERNEL_VARIANT(isa, attr, name) \
+        template<typename... Ts, typename... Args> \
+        attr void name ## _ ## isa (Args... args) { name ## Impl<Ts...>(args...); }
+
+    #define RAWEDIT_SELECT_KERNEL(name, ...) \
+        ::RawEdit::SelectKernel<decltype(&name ## Impl<__VA_ARGS__>)>({ __RAWEDIT_ISA_LIST_APPLY(__RAWEDIT_KERNEL_ADDRESS, name, __VA_ARGS__) })
+
+    #define __RAWEDIT_KERNEL_ADDRESS(isa, attr, name, ...) &name ## _ ## isa <__VA_ARGS__>,
+
+    template<typename Fn>
+    inline Fn SelectKernel(const std::array<Fn, ISACount>& variants)
+    {
+        return variants[static_cast<size_t>(ActiveISA())];
+    }
+}
@@ -0,0 +1,99 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <utility>
+#include "error.h"
+
+#if defined(_WIN32)
+    #define NOMINMAX
+    #include <windows.h>
+#else
+    #include <fcntl.h>
+    #include <unistd.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+#endif
+
+namespace RawEdit
+{
+    // File mapped in memory, read only. Pages are loaded on first access,
+    // opening a large file costs nothing but the mapping itself.
+    class MappedFile
+    {
+    public:
+        MappedFile() = default;
+        MappedFile(const MappedFile&) = delete;
+        MappedFile& operator=(const MappedFile&) = delete;
+        MappedFile(MappedFile&& o) noexcept { *this = std::move(o); }
+        MappedFile& operator=(MappedFile&& o) noexcept
+        {
+            std::swap(data, o.data);
+            std::swap(size, o.size);
+            return *this;
+        }
+        ~MappedFile() { Close(); }
+
+        Error Open(const char* path)
+        {
+            Close();
+        #if defined(_WIN32)
+            HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+            if (file == INVALID_HANDLE_VALUE)
+                return Failed("[Mapped File] - Can not open '{}'", path).error();
+            LARGE_INTEGER length;
+            GetFileSizeEx(file, &length);
+            size = (size_t)length.QuadPart;
+            HANDLE mapping = size ? CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr) : nullptr;
+            CloseHandle(file);
+            if (size && mapping == nullptr)
+                return Failed("[Mapped File] - Can not map '{}'", path).error();
+            if (mapping)
+            {
+                data = static_cast<const uint8_t*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+                CloseHandle(mapping);
+            }
+        #else
+            const int fd = ::open(path, O_RDONLY);
+            if (fd < 0)
+                return Failed("[Mapped File] - Can not open '{}'", path).error();
+            struct stat st;
+            fstat(fd, &st);
+            size = (size_t)st.st_size;
+            if (size)
+            {
+                void* ptr = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+                data = ptr == MAP_FAILED ? nullptr : static_cast<const uint8_t*>(ptr);
+            }
+            ::close(fd);
+        #endif
+            if (size && data == nullptr)
+            {
+                size = 0;
+                return Failed("[Mapped File] - Can not map '{}'", path).error();
+            }
+            return Ok();
+        }
+
+        void Close()
+        {
+            if (data)
+            {
+            #if defined(_WIN32)
+                UnmapViewOfFile(data);
+            #else
+                munmap(const_cast<uint8_t*>(data), size);
+            #endif
+            }
+            data = nullptr;
+            size = 0;
+        }
+
+        const uint8_t* Data() const { return data; }
+        size_t Size() const { return size; }
+
+    private:
+        const uint8_t* data = nullptr;
+        size_t size = 0;
+    };
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+namespace RawEdit
+{
+    // Run length encoding tailored for sparse buffers (mask deltas, masks):
+    // the stream is a sequence of (zero run, literal run, literals...)
+    // where both runs are stored on two bytes.
+    inline std::vector<uint8_t> RLEEncode(const uint8_t* data, size_t size)
+    {
+        std::vector<uint8_t> out;
+        auto push16 = [&](uint16_t v) { out.push_back(v & 0xFF); out.push_back(v >> 8); };
+
+        size_t i = 0;
+        while (i < size)
+        {
+            uint16_t zeros = 0;
+            while (i < size && data[i] == 0 && zeros < UINT16_MAX) { ++zeros; ++i; }
+
+            const size_t start = i;
+            uint16_t literals = 0;
+            // A single zero in between literals is cheaper to keep as literal
+            while (i < size && literals < UINT16_MAX &&
+                   (data[i] != 0 || (i + 1 < size && data[i + 1] != 0)))
+            { 
+                ++literals; ++i; 
+            }
+
+            push16(zeros);
+            push16(literals);
+            out.insert(out.end(), data + start, data + start + literals);
+        }
+        return out;
+    }
+
+    // Decodes into 'data' which must hold 'size' bytes. When 'xorInto'
+    // is set, decoded bytes are xor-ed into the destination instead of 
+    // overwriting it (zero runs are then left untouched). 
+    inline bool RLEDecode(const uint8_t* rle, size_t rleSize, uint8_t* data, size_t size, bool xorInto = false)
+    {
+        size_t r = 0;
+        size_t i = 0;
+        while (r + 4 <= rleSize)
+        {
+            const uint16_t zeros    = rle[r] | (rle[r + 1] << 8);
+            const uint16_t literals = rle[r + 2] | (rle[r + 3] << 8);
+            r += 4;
+
+            if (i + zeros + literals > size || r + literals > rleSize)
+                return false;
+
+            if (!xorInto)
+                for (uint16_t k = 0; k < zeros; ++k) data[i + k] = 0;
+            i += zeros;
+
+            for (uint16_t k = 0; k < literals; ++k)
+                data[i + k] = xorInto ? (data[i + k] ^ rle[r + k]) : rle[r + k];
+            i += literals;
+            r += literals;
+        }
+        return r == rleSize;
+    }
+}
@@ -0,0 +1,146 @@
+#pragma once
+
+#include <map>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <optional>
+#include <algorithm>
+#include <functional>
+#include <stop_token>
+#include <condition_variable>
+#include "concurrency.h"
+
+namespace RawEdit
+{
+    // Runs jobs on its own threads. Jobs are keyed (an image for instance)
+    // and a job supersedes the older ones of its key: a queued one is
+    // dropped without running, a running one is asked to stop through its
+    // stop_token, which the job checks at its own boundaries (tiles...).
+    // At most one job of a key runs at a time, so the state of a key can
+    // be used by its jobs without locking. Keys are served in the order
+    // they were submitted. Jobs run in a lane of 'lane' (see Concurrency).
+    class JobScheduler
+    {
+    public:
+        using Job = std::function<void(std::stop_token)>;
+
+        explicit JobScheduler(uint32_t threads = 1, Lane l = Lane::Interactive) : lane(l)
+        {
+            for (uint32_t i = 0; i < std::max(threads, 1u); ++i)
+                workers.emplace_back([this](std::stop_token stop) { Work(stop); });
+        }
+        JobScheduler(const JobScheduler&) = delete;
+        JobScheduler& operator=(const JobScheduler&) = delete;
+
+        // Running jobs are asked to stop, queued ones are dropped
+        ~JobScheduler()
+        {
+            {
+                std::lock_guard lock(mutex);
+                for (auto& [key, slot] : slots)
+                    if (slot.running) slot.running->request_stop();
+                slots.clear();
+                order.clear();
+            }
+            for (auto& w : workers)
+                w.request_stop();
+            wake.notify_all();
+        }
+
+        void Submit(const std::string& key, Job job)
+        {
+            {
+                std::lock_guard lock(mutex);
+                Slot& slot = slots[key];
+                if (slot.running)
+                    slot.running->request_stop();
+                if (!slot.queued)
+                    order.push_back(key);
+                slot.queued = std::move(job);
+            }
+            wake.notify_one();
+        }
+
+        // Drops the queued job of 'key' and stops the running one
+        void Cancel(const std::string& key)
+        {
+            std::lock_guard lock(mutex);
+            auto it = slots.find(key);
+            if (it == slots.end()) return;
+
+            if (it->second.running)
+                it->second.running->request_stop();
+            it->second.queued = nullptr;
+            std::erase(order, key);
+            if (!it->second.running)
+                slots.erase(it);
+        }
+
+        // Queued or running
+        bool Busy(const std::string& key) const
+        {
+            std::lock_guard lock(mutex);
+            return slots.contains(key);
+        }
+
+    private:
+        struct Slot
+        {
+            Job queued;
+            std::optional<std::stop_source> running;
+        };
+
+        void Work(std::stop_token stop)
+        {
+            std::unique_lock lock(mutex);
+            while (!stop.stop_requested())
+            {
+                // First key with a queued job and none running
+                auto next = order.end();
+                wake.wait(lock, stop, [&] {
+                    next = std::find_if(order.begin(), order.end(), [&](const std::string& k) {
+                        return !slots[k].running;
+                    });
+                    return next != order.end();
+                });
+                if (stop.stop_requested())
+                    return;
+
+                const std::string key = *next;
+                order.erase(next);
+                Slot& slot = slots[key];
+                Job job = std::move(slot.queued);
+                slot.queued = nullptr;
+                slot.running.emplace();
+                const std::stop_token token = slot.running->get_token();
+
+                lock.unlock();
+                {
+                    ConcurrencyLease lease(lane);
+                    job(token);
+                }
+                lock.lock();
+
+                // The slot may have been dropped with the scheduler
+                auto it = slots.find(key);
+                if (it == slots.end()) continue;
+                it->second.running.reset();
+                if (it->second.queued)
+                    wake.notify_one();
+                else
+                    slots.erase(it);
+            }
+        }
+
+        mutable std::mutex mutex;
+        std::condition_variable_any wake;
+        std::map<std::string, Slot> slots;
+        // Keys with a queued job
+        std::deque<std::string> order;
+        Lane lane;
+        std::vector<std::jthread> workers;
+    };
+}